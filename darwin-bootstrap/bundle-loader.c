@@ -4,6 +4,8 @@
 #include "darwin/mach-decls.h"
 #include "darwin/xxpc.h"
 #include "substitute-internal.h"
+#include "filter-snapshot.h"
+#include "cbit/htab.h"
 #include <dlfcn.h>
 #include <mach/mach.h>
 #include <mach/mach_time.h>
@@ -14,6 +16,10 @@
 #include <syslog.h>
 #include <pthread.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <dispatch/dispatch.h>
 extern char ***_NSGetArgv(void);
 
 static struct {
@@ -29,6 +35,18 @@ static struct {
     typeof(objc_getClass) *objc_getClass;
 } objc_funcs;
 
+/* Tweaks are loaded inside a hook transaction, so all their
+ * substitute_hook_functions calls are committed at once, along with the hook
+ * manifests of every image loaded since it began. */
+static struct {
+    bool initialized;
+    typeof(substitute_hook_begin) *substitute_hook_begin;
+    typeof(substitute_hook_commit) *substitute_hook_commit;
+    typeof(substitute_apply_hook_manifests) *substitute_apply_hook_manifests;
+    typeof(substitute_set_defer_memory_writes) *substitute_set_defer_memory_writes;
+    uint32_t first_new_image;
+} substitute_funcs;
+
 static xxpc_connection_t substituted_conn;
 
 static pthread_mutex_t hello_reply_mtx = PTHREAD_MUTEX_INITIALIZER;
@@ -38,6 +56,55 @@ static bool hello_reply_ready;
 
 #define GET(funcs, handle, name) (funcs)->name = dlsym(handle, #name)
 
+/* With SUBSTITUTE_LAUNCH_TRACE=1 in the environment, log how long each step
+ * of loading tweaks took in this process: one line per dylib, and a summary
+ * at the end.  Times are mach_absolute_time ticks. */
+static struct {
+    bool enabled;
+    uint64_t start, conn_created, hello_sent, reply_received, end;
+    uint64_t filter_time, dylib_time, commit_time;
+    uint32_t nfilters, ndylibs;
+} launch_trace;
+
+static uint64_t trace_now() {
+    return launch_trace.enabled ? mach_absolute_time() : 0;
+}
+
+static double trace_ms(uint64_t ticks) {
+    static mach_timebase_info_data_t tb;
+    if (!tb.denom)
+        mach_timebase_info(&tb);
+    return (double) ticks * tb.numer / tb.denom / 1e6;
+}
+
+/* filter evaluation time, not counting the dlopens it did */
+static void trace_filter_done(uint64_t start, uint64_t dylib_time_before) {
+    if (!launch_trace.enabled)
+        return;
+    uint64_t dylib_time = launch_trace.dylib_time - dylib_time_before;
+    launch_trace.filter_time += mach_absolute_time() - start - dylib_time;
+    launch_trace.nfilters++;
+}
+
+static void trace_summary(const char *argv0, bool from_snapshot) {
+    if (!launch_trace.enabled)
+        return;
+    launch_trace.end = mach_absolute_time();
+    uint64_t start = launch_trace.start;
+#define SINCE_START(field) \
+    (launch_trace.field ? trace_ms(launch_trace.field - start) : 0.0)
+    ib_log("launch-trace: %s: %s; connection %.3f, hello sent %.3f, "
+           "reply %.3f ms; %u filters in %.3f ms; %u dylibs in %.3f ms; "
+           "commit %.3f ms; total %.3f ms",
+           argv0, from_snapshot ? "snapshot" : "substituted",
+           SINCE_START(conn_created), SINCE_START(hello_sent),
+           SINCE_START(reply_received),
+           launch_trace.nfilters, trace_ms(launch_trace.filter_time),
+           launch_trace.ndylibs, trace_ms(launch_trace.dylib_time),
+           trace_ms(launch_trace.commit_time), SINCE_START(end));
+#undef SINCE_START
+}
+
 static void *dlopen_noload(const char *path) {
     void *h = dlopen(path, RTLD_LAZY | RTLD_NOLOAD);
     if (!h)
@@ -86,10 +153,136 @@ static bool objc_has_class(const char *name) {
     return !!objc_funcs.objc_getClass(name);
 }
 
+/* Tweaks' filters tend to name the same few bundles and classes, so each name
+ * is only looked up once while going through the filters.  A miss is only
+ * good until the next tweak is loaded, since that might have brought the
+ * bundle or class in with it. */
+struct probe_name {
+    const char *name;
+    size_t len;
+    size_t hash;
+};
+#define probe_name_hash(k) ((k)->hash)
+#define probe_name_eq(k1, k2) ((k1)->hash == (k2)->hash && \
+                               (k1)->len == (k2)->len && \
+                               !memcmp((k1)->name, (k2)->name, (k1)->len))
+#define probe_name_null(k) (!(k)->name)
+DECL_STATIC_HTAB_KEY(probe_name, struct probe_name, probe_name_hash,
+                     probe_name_eq, probe_name_null, 0);
+struct probe_result {
+    bool present;
+    uint32_t dylib_generation;
+};
+DECL_HTAB(probe_results, probe_name, struct probe_result);
+static HTAB_STORAGE(probe_results) bundle_probes =
+    HTAB_STORAGE_INIT_STATIC(&bundle_probes, probe_results);
+static HTAB_STORAGE(probe_results) class_probes =
+    HTAB_STORAGE_INIT_STATIC(&class_probes, probe_results);
+/* bumped by use_dylib */
+static uint32_t dylib_generation;
+
+static bool probe_cached(struct htab_probe_results *ht, const char *name,
+                         bool (*test)(const char *)) {
+    struct probe_name key = {.name = name, .hash = 2166136261};
+    const char *p;
+    for (p = name; *p; p++)
+        key.hash = (key.hash ^ (uint8_t) *p) * 16777619;
+    key.len = p - name;
+    bool new;
+    struct probe_result *r = htab_setp_probe_results(ht, &key, &new);
+    if (new || (!r->present && r->dylib_generation != dylib_generation)) {
+        r->present = test(name);
+        r->dylib_generation = dylib_generation;
+    }
+    return r->present;
+}
+
+static bool cf_has_bundle_cached(const char *name) {
+    return probe_cached(&bundle_probes.h, name, cf_has_bundle);
+}
+
+static bool objc_has_class_cached(const char *name) {
+    return probe_cached(&class_probes.h, name, objc_has_class);
+}
+
+/* the names point into the hello reply or the snapshot */
+static void reset_probes() {
+    htab_free_storage_probe_results(&bundle_probes.h);
+    HTAB_STORAGE_INIT(&bundle_probes, probe_results);
+    htab_free_storage_probe_results(&class_probes.h);
+    HTAB_STORAGE_INIT(&class_probes, probe_results);
+}
+
+static void begin_hook_transaction() {
+    if (substitute_funcs.initialized)
+        return;
+    substitute_funcs.initialized = true;
+    substitute_funcs.first_new_image = _dyld_image_count();
+    void *handle = dlopen("/usr/lib/libsubstitute.0.dylib", RTLD_LAZY);
+    if (!handle)
+        return;
+    GET(&substitute_funcs, handle, substitute_hook_begin);
+    GET(&substitute_funcs, handle, substitute_hook_commit);
+    /* optional */
+    GET(&substitute_funcs, handle, substitute_apply_hook_manifests);
+    /* SubHookMemory calls from the tweaks' constructors can be committed
+     * with their hooks too, but only if asked, since the patches don't show
+     * up until then */
+    const char *defer = getenv("SUBSTITUTE_DEFER_HOOK_MEMORY");
+    if (defer && !strcmp(defer, "1"))
+        GET(&substitute_funcs, handle, substitute_set_defer_memory_writes);
+    if (!substitute_funcs.substitute_hook_begin ||
+        !substitute_funcs.substitute_hook_commit) {
+        substitute_funcs.substitute_hook_begin = NULL;
+        return;
+    }
+    if (substitute_funcs.substitute_set_defer_memory_writes)
+        substitute_funcs.substitute_set_defer_memory_writes(true);
+    substitute_funcs.substitute_hook_begin();
+}
+
+static void end_hook_transaction() {
+    if (!substitute_funcs.substitute_hook_begin)
+        return;
+    uint64_t start = trace_now();
+    if (substitute_funcs.substitute_apply_hook_manifests) {
+        uint32_t first = substitute_funcs.first_new_image;
+        uint32_t count = _dyld_image_count();
+        const void *headers[count > first ? count - first : 1];
+        size_t nheaders = 0;
+        for (uint32_t i = first; i < count; i++) {
+            const struct mach_header *mh = _dyld_get_image_header(i);
+            if (mh)
+                headers[nheaders++] = mh;
+        }
+        int ret = substitute_funcs.substitute_apply_hook_manifests(
+            headers, nheaders, 0);
+        if (ret)
+            ib_log("substitute_apply_hook_manifests failed: %d", ret);
+    }
+    int ret = substitute_funcs.substitute_hook_commit();
+    if (substitute_funcs.substitute_set_defer_memory_writes)
+        substitute_funcs.substitute_set_defer_memory_writes(false);
+    if (launch_trace.enabled)
+        launch_trace.commit_time += mach_absolute_time() - start;
+    if (ret)
+        ib_log("substitute_hook_commit failed: %d", ret);
+    substitute_funcs.substitute_hook_begin = NULL;
+}
+
 static void use_dylib(const char *name) {
     if (IB_VERBOSE)
         ib_log("loading dylib %s", name);
+    uint64_t start = trace_now();
+    begin_hook_transaction();
     dlopen(name, RTLD_LAZY);
+    dylib_generation++;
+    if (launch_trace.enabled) {
+        uint64_t time = mach_absolute_time() - start;
+        launch_trace.dylib_time += time;
+        launch_trace.ndylibs++;
+        ib_log("launch-trace: dlopen %s: %.3f ms", name, trace_ms(time));
+    }
 }
 
 enum bundle_test_result {
@@ -123,14 +316,14 @@ static enum bundle_test_result do_bundle_test_type(
 static bool check_bundle_with_info(xxpc_object_t info) {
     bool any = xxpc_dictionary_get_bool(info, "any");
     enum bundle_test_result btr =
-        do_bundle_test_type(info, "bundles", cf_has_bundle);
+        do_bundle_test_type(info, "bundles", cf_has_bundle_cached);
     if (btr == BUNDLE_TEST_RESULT_INVALID)
         return false;
     if (!any && btr == BUNDLE_TEST_RESULT_FAIL)
         goto no_load;
     if (any && btr == BUNDLE_TEST_RESULT_PASS)
         goto do_load;
-    btr = do_bundle_test_type(info, "classes", objc_has_class);
+    btr = do_bundle_test_type(info, "classes", objc_has_class_cached);
     if (btr == BUNDLE_TEST_RESULT_INVALID)
         return false;
     if (btr == BUNDLE_TEST_RESULT_FAIL)
@@ -148,6 +341,169 @@ do_load:;
     return true;
 }
 
+struct snapshot {
+    const struct filter_snapshot_header *hdr;
+    const struct filter_snapshot_entry *entries;
+    const uint32_t *refs;
+    const char *strings;
+};
+
+static bool snapshot_list_ok(const struct snapshot *snap,
+                             struct filter_snapshot_list list) {
+    if (list.start > snap->hdr->nrefs ||
+        list.count > snap->hdr->nrefs - list.start)
+        return false;
+    for (uint32_t i = 0; i < list.count; i++) {
+        if (snap->refs[list.start + i] >= snap->hdr->strings_size)
+            return false;
+    }
+    return true;
+}
+
+static bool snapshot_ok(struct snapshot *snap, const void *buf, size_t size,
+                        const struct stat *dir_st) {
+    const struct filter_snapshot_header *hdr = buf;
+    if (size < sizeof(*hdr) ||
+        __atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) !=
+            FILTER_SNAPSHOT_MAGIC ||
+        hdr->version != FILTER_SNAPSHOT_VERSION)
+        return false;
+    if (hdr->dir_mtime_sec != dir_st->st_mtimespec.tv_sec ||
+        hdr->dir_mtime_nsec != dir_st->st_mtimespec.tv_nsec) {
+        if (IB_VERBOSE)
+            ib_log("filter snapshot is stale");
+        return false;
+    }
+    if (hdr->nentries > size / sizeof(struct filter_snapshot_entry) ||
+        hdr->nrefs > size / sizeof(uint32_t) ||
+        hdr->strings_size > size ||
+        filter_snapshot_size(hdr->nentries, hdr->nrefs,
+                             hdr->strings_size) > size)
+        return false;
+    snap->hdr = hdr;
+    snap->entries = (void *) (hdr + 1);
+    snap->refs = (void *) (snap->entries + hdr->nentries);
+    snap->strings = (void *) (snap->refs + hdr->nrefs);
+    if (hdr->strings_size && snap->strings[hdr->strings_size - 1])
+        return false;
+    for (uint32_t i = 0; i < hdr->nentries; i++) {
+        const struct filter_snapshot_entry *e = &snap->entries[i];
+        if (e->dylib >= hdr->strings_size ||
+            !snapshot_list_ok(snap, e->executables) ||
+            !snapshot_list_ok(snap, e->bundles) ||
+            !snapshot_list_ok(snap, e->classes))
+            return false;
+    }
+    return true;
+}
+
+static enum bundle_test_result do_snapshot_test_type(
+    const struct snapshot *snap, struct filter_snapshot_list list,
+    bool (*test)(const char *)) {
+    if (list.count == 0)
+        return BUNDLE_TEST_RESULT_EMPTY;
+    for (uint32_t i = 0; i < list.count; i++) {
+        if (test(snap->strings + snap->refs[list.start + i]))
+            return BUNDLE_TEST_RESULT_PASS;
+    }
+    return BUNDLE_TEST_RESULT_FAIL;
+}
+
+static const char *g_argv0;
+
+static bool is_argv0(const char *name) {
+    return !strcmp(name, g_argv0);
+}
+
+/* the same as substituted's evaluateFilter followed by
+ * check_bundle_with_info */
+static void check_snapshot_entry(const struct snapshot *snap,
+                                 const struct filter_snapshot_entry *e) {
+    bool any = e->flags & FILTER_SNAPSHOT_ANY;
+    if (e->flags & FILTER_SNAPSHOT_HAS_EXECUTABLES) {
+        if (do_snapshot_test_type(snap, e->executables, is_argv0) !=
+            BUNDLE_TEST_RESULT_PASS) {
+            if (any)
+                goto do_load;
+            return;
+        }
+    }
+    enum bundle_test_result btr =
+        do_snapshot_test_type(snap, e->bundles, cf_has_bundle_cached);
+    if (!any && btr == BUNDLE_TEST_RESULT_FAIL)
+        return;
+    if (any && btr == BUNDLE_TEST_RESULT_PASS)
+        goto do_load;
+    btr = do_snapshot_test_type(snap, e->classes, objc_has_class_cached);
+    if (btr == BUNDLE_TEST_RESULT_FAIL)
+        return;
+do_load:
+    use_dylib(snap->strings + e->dylib);
+}
+
+/* Load bundles according to substituted's snapshot, if there's a valid one
+ * that's up to date; otherwise we have to ask it. */
+static bool load_from_snapshot(const char *argv0) {
+    struct stat dir_st;
+    if (stat(FILTER_SNAPSHOT_DIR, &dir_st))
+        return false;
+    int fd = shm_open(FILTER_SNAPSHOT_SHM_NAME, O_RDONLY);
+    if (fd == -1)
+        return false;
+    struct stat st;
+    void *buf = MAP_FAILED;
+    if (!fstat(fd, &st) && st.st_size > 0)
+        buf = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED)
+        return false;
+    struct snapshot snap;
+    bool ok = snapshot_ok(&snap, buf, (size_t) st.st_size, &dir_st);
+    if (ok) {
+        g_argv0 = argv0;
+        for (uint32_t i = 0; i < snap.hdr->nentries; i++) {
+            uint64_t start = trace_now();
+            uint64_t dylib_time = launch_trace.dylib_time;
+            check_snapshot_entry(&snap, &snap.entries[i]);
+            trace_filter_done(start, dylib_time);
+        }
+        end_hook_transaction();
+        reset_probes();
+    }
+    munmap(buf, (size_t) st.st_size);
+    return ok;
+}
+
+/* SpringBoard loads hundreds of images while it launches, so rather than one
+ * message each, substituted gets them in batches: a batch is a run of adds or
+ * of removes (so the order of an unload and a reload is kept), sent a short
+ * while after its first image or at the end of the initial burst. */
+#define ADD_REMOVE_FLUSH_DELAY_NS (50 * NSEC_PER_MSEC)
+static pthread_mutex_t add_remove_mtx = PTHREAD_MUTEX_INITIALIZER;
+static xxpc_object_t add_remove_pending;
+static bool add_remove_pending_is_add;
+static bool add_remove_flush_scheduled;
+
+static void flush_added_removed_locked() {
+    if (!add_remove_pending)
+        return;
+    xxpc_object_t message = xxpc_dictionary_create(NULL, NULL, 0);
+    xxpc_dictionary_set_string(message, "type", "add-remove");
+    xxpc_dictionary_set_bool(message, "is-add", add_remove_pending_is_add);
+    xxpc_dictionary_set_value(message, "id-dylibs", add_remove_pending);
+    xxpc_connection_send_message(substituted_conn, message);
+    xxpc_release(message);
+    xxpc_release(add_remove_pending);
+    add_remove_pending = NULL;
+}
+
+static void flush_added_removed(UNUSED void *ctx) {
+    pthread_mutex_lock(&add_remove_mtx);
+    add_remove_flush_scheduled = false;
+    flush_added_removed_locked();
+    pthread_mutex_unlock(&add_remove_mtx);
+}
+
 static void notify_added_removed(const struct mach_header *mh32, bool is_add) {
     char id_dylib_buf[32];
     const char *id_dylib;
@@ -167,13 +523,25 @@ static void notify_added_removed(const struct mach_header *mh32, bool is_add) {
     sprintf(id_dylib_buf, "unknown.%p", mh32);
     id_dylib = id_dylib_buf;
 
-ok:;
-    xxpc_object_t message = xxpc_dictionary_create(NULL, NULL, 0);
-    xxpc_dictionary_set_string(message, "type", "add-remove");
-    xxpc_dictionary_set_bool(message, "is-add", is_add);
-    xxpc_dictionary_set_string(message, "id-dylib", id_dylib);
-    xxpc_connection_send_message(substituted_conn, message);
-    xxpc_release(message);
+ok:
+    pthread_mutex_lock(&add_remove_mtx);
+    if (add_remove_pending && add_remove_pending_is_add != is_add)
+        flush_added_removed_locked();
+    if (!add_remove_pending) {
+        add_remove_pending = xxpc_array_create(NULL, 0);
+        add_remove_pending_is_add = is_add;
+    }
+    /* copies the string, which might be about to be unmapped */
+    xxpc_array_set_string(add_remove_pending, XXPC_ARRAY_APPEND, id_dylib);
+    if (!add_remove_flush_scheduled) {
+        add_remove_flush_scheduled = true;
+        dispatch_after_f(dispatch_time(DISPATCH_TIME_NOW,
+                                       ADD_REMOVE_FLUSH_DELAY_NS),
+                         dispatch_get_global_queue(
+                             DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
+                         NULL, flush_added_removed);
+    }
+    pthread_mutex_unlock(&add_remove_mtx);
 }
 
 static void add_image_cb(const struct mach_header *mh, intptr_t vmaddr_slide) {
@@ -201,16 +569,28 @@ static bool handle_hello_reply(xxpc_object_t dict) {
             if (mh32)
                 notify_added_removed(mh32, true);
         }
+        pthread_mutex_lock(&add_remove_mtx);
+        flush_added_removed_locked();
+        pthread_mutex_unlock(&add_remove_mtx);
     }
     xxpc_object_t bundles = xxpc_dictionary_get_value(dict, "bundles");
     if (!bundles || xxpc_get_type(bundles) != XXPC_TYPE_ARRAY)
         return false;
+    bool ok = true;
     for (size_t i = 0, count = xxpc_array_get_count(bundles);
          i < count; i++) {
-        if (!check_bundle_with_info(xxpc_array_get_value(bundles, i)))
-            return false;
+        uint64_t start = trace_now();
+        uint64_t dylib_time = launch_trace.dylib_time;
+        bool info_ok = check_bundle_with_info(xxpc_array_get_value(bundles, i));
+        trace_filter_done(start, dylib_time);
+        if (!info_ok) {
+            ok = false;
+            break;
+        }
     }
-    return true;
+    end_hook_transaction();
+    reset_probes();
+    return ok;
 }
 
 static void signal_hello_reply(xxpc_object_t object) {
@@ -246,6 +626,21 @@ static void handle_xxpc_object(xxpc_object_t object, bool is_reply) {
 /* this is DYLD_INSERT_LIBRARIES'd, not injected. */
 __attribute__((constructor))
 static void init() {
+    const char *trace_env = getenv("SUBSTITUTE_LAUNCH_TRACE");
+    launch_trace.enabled = trace_env && !strcmp(trace_env, "1");
+    launch_trace.start = trace_now();
+
+    const char *argv0 = (*_NSGetArgv())[0];
+    if (!argv0)
+        argv0 = "???";
+
+    const char *sb_exe =
+        "/System/Library/CoreServices/SpringBoard.app/SpringBoard";
+    if (strcmp(argv0, sb_exe) && load_from_snapshot(argv0)) {
+        trace_summary(argv0, true);
+        return;
+    }
+
     xxpc_connection_t conn = xxpc_connection_create_mach_service(
         "com.ex.substituted", NULL, 0);
     /* it's not supposed to return null, but just in case */
@@ -255,16 +650,13 @@ static void init() {
     }
 
     substituted_conn = conn;
+    launch_trace.conn_created = trace_now();
 
     xxpc_connection_set_event_handler(conn, ^(xxpc_object_t object) {
         handle_xxpc_object(object, false);
     });
     xxpc_connection_resume(conn);
 
-    const char *argv0 = (*_NSGetArgv())[0];
-    if (!argv0)
-        argv0 = "???";
-
     xxpc_object_t message = xxpc_dictionary_create(NULL, NULL, 0);
     xxpc_dictionary_set_string(message, "type", "hello");
     xxpc_dictionary_set_int64(message, "proto-version", 1);
@@ -274,6 +666,7 @@ static void init() {
         handle_xxpc_object(reply, true);
     });
     xxpc_release(message);
+    launch_trace.hello_sent = trace_now();
 
     /* Timing out *always* means a bug (or the user manually unloaded
      * substituted).  Therefore, a high timeout is actually a good thing,
@@ -302,6 +695,7 @@ static void init() {
         }
     }
     pthread_mutex_unlock(&hello_reply_mtx);
+    launch_trace.reply_received = trace_now();
 
     if (hello_reply == NULL) {
         /* thread notified us of XPC error */
@@ -317,7 +711,9 @@ static void init() {
     }
     xxpc_release(hello_reply);
 
+    trace_summary(argv0, false);
     return;
 bad:
     ib_log("giving up on loading bundles for this process...");
+    trace_summary(argv0, false);
 }
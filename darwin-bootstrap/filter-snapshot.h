@@ -0,0 +1,62 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+/* The filters from the plists in FILTER_SNAPSHOT_DIR, compiled by substituted
+ * into a shared memory object so bundle-loader can check them itself instead
+ * of blocking on a round trip to substituted at launch.
+ *
+ * Only what comes out the same for every process but SpringBoard is in here:
+ * SafeMode filters and ones whose CoreFoundationVersion excludes this system
+ * are left out, and SpringBoard always asks substituted, since its filtering
+ * depends on the safe mode state (and substituted wants to hear from it
+ * anyway).  The snapshot counts as stale unless the directory's mtime matches
+ * the one recorded here.
+ *
+ * Layout: the header, then nentries entries, then nrefs uint32 string
+ * offsets, which the entries' lists index, then strings_size bytes of
+ * NUL-terminated strings. */
+
+#define FILTER_SNAPSHOT_SHM_NAME "com.ex.substituted.filters"
+#define FILTER_SNAPSHOT_DIR "/Library/Substitute/DynamicLibraries"
+#define FILTER_SNAPSHOT_MAGIC 0x53424653
+#define FILTER_SNAPSHOT_VERSION 1
+
+struct filter_snapshot_header {
+    /* stored last, so a snapshot that's still being written doesn't match */
+    uint32_t magic;
+    uint32_t version;
+    int64_t dir_mtime_sec;
+    int64_t dir_mtime_nsec;
+    uint32_t nentries;
+    uint32_t nrefs;
+    uint32_t strings_size;
+    uint32_t reserved;
+};
+
+struct filter_snapshot_list {
+    uint32_t start;
+    uint32_t count;
+};
+
+enum {
+    /* Mode = Any */
+    FILTER_SNAPSHOT_ANY = 1,
+    /* there's an Executables list (possibly empty) */
+    FILTER_SNAPSHOT_HAS_EXECUTABLES = 2,
+};
+
+struct filter_snapshot_entry {
+    uint32_t dylib;
+    uint32_t flags;
+    struct filter_snapshot_list executables;
+    struct filter_snapshot_list bundles;
+    struct filter_snapshot_list classes;
+};
+
+static inline size_t filter_snapshot_size(uint32_t nentries, uint32_t nrefs,
+                                          uint32_t strings_size) {
+    return sizeof(struct filter_snapshot_header) +
+           nentries * sizeof(struct filter_snapshot_entry) +
+           nrefs * sizeof(uint32_t) + strings_size;
+}
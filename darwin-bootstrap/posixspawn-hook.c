@@ -28,6 +28,7 @@
 #include <mach-o/fat.h>
 #include <spawn.h>
 #include <sys/wait.h>
+#include <signal.h>
 #include <syslog.h>
 #include <malloc/malloc.h>
 #include <errno.h>
@@ -127,11 +128,21 @@ static int (*old_xpc_pipe_try_receive)(mach_port_t, xxpc_object_t *,
                                        mach_port_t *, void *, size_t, int);
 
 static bool g_is_launchd;
-static pthread_mutex_t g_state_lock = PTHREAD_MUTEX_INITIALIZER;
-/* covering... */
+/* launchd spawns and reaps on several threads at once, so the pids of the
+ * xpcproxy children are split across shards, each with its own lock; the
+ * fates, which are only touched when one of those is reaped or SpringBoard
+ * asks, get a lock of their own. */
+#define PID_SHARDS 16
+static struct pid_shard {
+    pthread_mutex_t lock;
+    HTAB_STORAGE(pid_str) map;
+} g_pid_to_bundleid[PID_SHARDS];
+static pthread_mutex_t g_fate_lock = PTHREAD_MUTEX_INITIALIZER;
 static xxpc_object_t g_bundleid_to_fate;
-static HTAB_STORAGE(pid_str) g_pid_to_bundleid =
-    HTAB_STORAGE_INIT_STATIC(&g_pid_to_bundleid, pid_str);
+
+static struct pid_shard *pid_shard(pid_t pid) {
+    return &g_pid_to_bundleid[(uint32_t) pid % PID_SHARDS];
+}
 
 static bool advance(char **strp, const char *template) {
     size_t len = strlen(template);
@@ -142,13 +153,26 @@ static bool advance(char **strp, const char *template) {
     return false;
 }
 
-static bool spawn_unrestrict(pid_t pid, bool should_resume, bool is_exec) {
+struct unrestrict_req {
+    pid_t pid;
+    bool should_resume;
+    bool is_exec;
+};
+
+static bool spawn_unrestrict_batch(const struct unrestrict_req *reqs,
+                                   size_t nreqs) {
     const char *prog = "/Library/Substitute/Helpers/unrestrict";
-    char pid_s[32];
-    sprintf(pid_s, "%ld", (long) pid);
-    const char *should_resume_s = should_resume ? "1" : "0";
-    const char *is_exec_s = is_exec ? "1" : "0";
-    const char *argv[] = {prog, pid_s, should_resume_s, is_exec_s, NULL};
+    char pid_s[nreqs][32];
+    const char *argv[1 + 3 * nreqs + 1];
+    const char **argp = argv;
+    *argp++ = prog;
+    for (size_t i = 0; i < nreqs; i++) {
+        sprintf(pid_s[i], "%ld", (long) reqs[i].pid);
+        *argp++ = pid_s[i];
+        *argp++ = reqs[i].should_resume ? "1" : "0";
+        *argp++ = reqs[i].is_exec ? "1" : "0";
+    }
+    *argp = NULL;
     pid_t prog_pid;
     char *env[] = {"_MSSafeMode=1", NULL};
     if (old_posix_spawn(&prog_pid, prog, NULL, NULL, (char **) argv, env)) {
@@ -156,8 +180,9 @@ static bool spawn_unrestrict(pid_t pid, bool should_resume, bool is_exec) {
         return false;
     }
     if (IB_VERBOSE)
-        ib_log("unrestrict pid: %d; should_resume=%d is_exec=%d",
-               prog_pid, should_resume, is_exec);
+        ib_log("unrestrict pid: %d; %zu processes, first should_resume=%d "
+               "is_exec=%d", prog_pid, nreqs, reqs[0].should_resume,
+               reqs[0].is_exec);
     int xstat;
     /* reap intermediate to avoid zombie - if it doesn't work, not a big deal */
     if (waitpid(prog_pid, &xstat, 0) == -1)
@@ -167,7 +192,78 @@ static bool spawn_unrestrict(pid_t pid, bool should_resume, bool is_exec) {
     return true;
 }
 
-static bool looks_restricted(const char *filename) {
+static bool spawn_unrestrict(pid_t pid, bool should_resume, bool is_exec) {
+    struct unrestrict_req req = {pid, should_resume, is_exec};
+    return spawn_unrestrict_batch(&req, 1);
+}
+
+/* A child that isn't replacing us doesn't need to be unrestricted before
+ * posix_spawn returns: it stays suspended until unrestrict resumes it.  So
+ * rather than having launchd wait for unrestrict to start every time, the
+ * pids go to a worker thread, which sends whatever has queued up to one
+ * unrestrict. */
+#define UNRESTRICT_QUEUE_MAX 64
+static pthread_mutex_t g_unrestrict_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_unrestrict_cond = PTHREAD_COND_INITIALIZER;
+static struct unrestrict_req g_unrestrict_queue[UNRESTRICT_QUEUE_MAX];
+static size_t g_unrestrict_count;
+static pthread_once_t g_unrestrict_once = PTHREAD_ONCE_INIT;
+static bool g_unrestrict_worker_ok;
+
+static void *unrestrict_worker(UNUSED void *arg) {
+    struct unrestrict_req reqs[UNRESTRICT_QUEUE_MAX];
+    while (1) {
+        pthread_mutex_lock(&g_unrestrict_lock);
+        while (!g_unrestrict_count)
+            pthread_cond_wait(&g_unrestrict_cond, &g_unrestrict_lock);
+        size_t nreqs = g_unrestrict_count;
+        memcpy(reqs, g_unrestrict_queue, nreqs * sizeof(*reqs));
+        g_unrestrict_count = 0;
+        pthread_mutex_unlock(&g_unrestrict_lock);
+        if (!spawn_unrestrict_batch(reqs, nreqs)) {
+            /* don't leave them suspended forever */
+            for (size_t i = 0; i < nreqs; i++) {
+                if (reqs[i].should_resume)
+                    kill(reqs[i].pid, SIGCONT);
+            }
+        }
+    }
+    return NULL;
+}
+
+static void start_unrestrict_worker() {
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    g_unrestrict_worker_ok =
+        !pthread_create(&thread, &attr, unrestrict_worker, NULL);
+    pthread_attr_destroy(&attr);
+    if (!g_unrestrict_worker_ok)
+        ib_log("posixspawn-hook: couldn't start unrestrict worker");
+}
+
+static void queue_unrestrict(pid_t pid, bool should_resume) {
+    pthread_once(&g_unrestrict_once, start_unrestrict_worker);
+    if (g_unrestrict_worker_ok) {
+        pthread_mutex_lock(&g_unrestrict_lock);
+        bool queued = g_unrestrict_count < UNRESTRICT_QUEUE_MAX;
+        if (queued) {
+            g_unrestrict_queue[g_unrestrict_count++] =
+                (struct unrestrict_req) {pid, should_resume, false};
+            pthread_cond_signal(&g_unrestrict_cond);
+        }
+        pthread_mutex_unlock(&g_unrestrict_lock);
+        if (queued)
+            return;
+    }
+    spawn_unrestrict(pid, should_resume, false);
+}
+
+/* *cacheable is set if the answer came from the file's contents rather than an
+ * I/O error. */
+static bool looks_restricted_uncached(const char *filename, bool *cacheable) {
+    *cacheable = false;
     int fd = open(filename, O_RDONLY);
     if (fd == -1) {
         ib_log("open '%s': %s", filename, strerror(errno));
@@ -235,20 +331,84 @@ static bool looks_restricted(const char *filename) {
     /* overestimation is fine here */
     const char sectname[] = "__restrict";
     ret = !!memmem(cmds_buf, sizeofcmds, sectname, sizeof(sectname));
+    *cacheable = true;
     free(cmds_buf);
 end:
     close(fd);
     return ret;
 }
 
+/* launchd spawns the same few hundred binaries over and over, so remember
+ * the answer for each file, as identified by a stat.  A replaced or modified
+ * binary gets a different inode, mtime or size; if not, it's at worst a
+ * spurious or missed unrestrict, same as the overestimating memmem. */
+#define RESTRICT_CACHE_SIZE 256
+struct restrict_cache_entry {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+    bool valid;
+    bool restricted;
+};
+static struct restrict_cache_entry g_restrict_cache[RESTRICT_CACHE_SIZE];
+static pthread_mutex_t g_restrict_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct restrict_cache_entry *restrict_cache_slot(const struct stat *st) {
+    uint64_t h = (uint64_t) st->st_ino * 0x9e3779b97f4a7c15 ^ st->st_dev;
+    return &g_restrict_cache[(h >> 32) % RESTRICT_CACHE_SIZE];
+}
+
+static bool restrict_cache_matches(const struct restrict_cache_entry *e,
+                                   const struct stat *st) {
+    return e->valid && e->dev == st->st_dev && e->ino == st->st_ino &&
+           e->mtime.tv_sec == st->st_mtimespec.tv_sec &&
+           e->mtime.tv_nsec == st->st_mtimespec.tv_nsec &&
+           e->size == st->st_size;
+}
+
+static bool looks_restricted(const char *filename) {
+    struct stat st;
+    if (stat(filename, &st)) {
+        bool cacheable;
+        return looks_restricted_uncached(filename, &cacheable);
+    }
+    struct restrict_cache_entry *e = restrict_cache_slot(&st);
+    pthread_mutex_lock(&g_restrict_cache_lock);
+    if (restrict_cache_matches(e, &st)) {
+        bool ret = e->restricted;
+        pthread_mutex_unlock(&g_restrict_cache_lock);
+        return ret;
+    }
+    pthread_mutex_unlock(&g_restrict_cache_lock);
+
+    bool cacheable;
+    bool ret = looks_restricted_uncached(filename, &cacheable);
+    if (cacheable) {
+        pthread_mutex_lock(&g_restrict_cache_lock);
+        *e = (struct restrict_cache_entry) {
+            .dev = st.st_dev,
+            .ino = st.st_ino,
+            .mtime = st.st_mtimespec,
+            .size = st.st_size,
+            .valid = true,
+            .restricted = ret,
+        };
+        pthread_mutex_unlock(&g_restrict_cache_lock);
+    }
+    return ret;
+}
+
 static int hook_posix_spawn_generic(__typeof__(posix_spawn) *old,
                                     pid_t *restrict pidp, const char *restrict path,
                                     const posix_spawn_file_actions_t *file_actions,
                                     const posix_spawnattr_t *restrict attrp,
                                     char *const argv[restrict],
                                     char *const envp[restrict]) {
-    char *new = NULL;
-    char **new_envp = NULL;
+    char *new = NULL, *new_to_free = NULL;
+    char **new_envp = NULL, **new_envp_to_free = NULL;
+    /* enough for launchd's spawns, which are most of them */
+    char *envp_buf[64];
     char *const *envp_to_use = envp;
     char *const *my_envp = envp ? envp : *_NSGetEnviron();
     posix_spawnattr_t my_attr = NULL;
@@ -268,21 +428,25 @@ static int hook_posix_spawn_generic(__typeof__(posix_spawn) *old,
     }
 
 
-    static const char bl_dylib[] =
-        "/Library/Substitute/Helpers/bundle-loader.dylib";
-    static const char psh_dylib[] =
-        "/Library/Substitute/Helpers/posixspawn-hook.dylib";
+#define BL_DYLIB "/Library/Substitute/Helpers/bundle-loader.dylib"
+#define PSH_DYLIB "/Library/Substitute/Helpers/posixspawn-hook.dylib"
+    static const char bl_dylib[] = BL_DYLIB;
+    static const char psh_dylib[] = PSH_DYLIB;
+    /* what we set when there was no DYLD_INSERT_LIBRARIES already */
+    static const char bl_insert[] = "DYLD_INSERT_LIBRARIES=" BL_DYLIB;
+    static const char psh_insert[] = "DYLD_INSERT_LIBRARIES=" PSH_DYLIB;
 
     const char *bundleid = NULL;
 
     /* which dylib should we add, if any? */
-    const char *dylib_to_add;
+    const char *dylib_to_add, *insert_to_add;
     if (g_is_launchd) {
         if (strcmp(path, "/usr/libexec/xpcproxy"))
             goto skip;
         if (argv[0] && argv[1])
             bundleid = argv[1];
         dylib_to_add = psh_dylib;
+        insert_to_add = psh_insert;
     } else {
         /* - substituted obviously doesn't want to have bundle_loader run in it
          *   and try to contact substituted.  I have _MSSafeMode=1 in the plist
@@ -313,6 +477,7 @@ static int hook_posix_spawn_generic(__typeof__(posix_spawn) *old,
             !strcmp(xbasename(argv[0] ?: ""), "sshd"))
             goto skip;
         dylib_to_add = bl_dylib;
+        insert_to_add = bl_insert;
     }
 
     if (access(dylib_to_add, R_OK)) {
@@ -322,17 +487,6 @@ static int hook_posix_spawn_generic(__typeof__(posix_spawn) *old,
         goto skip;
     }
 
-    if (attrp) {
-        posix_spawnattr_t attr = *attrp;
-        size_t size = malloc_size(attr);
-        my_attr = malloc(size);
-        if (!my_attr)
-            goto crap;
-        memcpy(my_attr, attr, size);
-    } else {
-        if (posix_spawnattr_init(&my_attr))
-            goto crap;
-    }
     /* This mirrors Substrate's logic with safe mode.  I don't really
      * understand the point of the difference between its 'safe' (which removes
      * Substrate from DYLD_INSERT_LIBRARIES) and 'quit' (which just skips
@@ -358,9 +512,17 @@ static int hook_posix_spawn_generic(__typeof__(posix_spawn) *old,
             orig_dyld_insert = env;
         }
     }
-    new = malloc(sizeof("DYLD_INSERT_LIBRARIES=") - 1 +
-                 sizeof(psh_dylib) /* not - 1, because : */ +
-                 strlen(orig_dyld_insert) + 1);
+    if (!*orig_dyld_insert) {
+        /* the usual case */
+        if (!safe_mode)
+            new = (char *) insert_to_add;
+        goto have_new;
+    }
+    new = new_to_free = malloc(sizeof("DYLD_INSERT_LIBRARIES=") - 1 +
+                               sizeof(psh_dylib) /* not - 1, because : */ +
+                               strlen(orig_dyld_insert) + 1);
+    if (!new)
+        goto crap;
     char *newp_orig = stpcpy(new, "DYLD_INSERT_LIBRARIES=");
     char *newp = newp_orig;
     const char *p = orig_dyld_insert;
@@ -389,14 +551,19 @@ static int hook_posix_spawn_generic(__typeof__(posix_spawn) *old,
             *newp++ = ':';
         newp = stpcpy(newp, dylib_to_add);
     }
-    if (IB_VERBOSE)
-        ib_log("using %s", new);
     /* no libraries? then just get rid of it */
-    if (newp == newp_orig) {
-        free(new);
+    if (newp == newp_orig)
         new = NULL;
+have_new:
+    if (IB_VERBOSE)
+        ib_log("using %s", new ?: "(nothing)");
+    if (env_count + 2 <= sizeof(envp_buf) / sizeof(*envp_buf)) {
+        new_envp = envp_buf;
+    } else {
+        new_envp = new_envp_to_free = malloc(sizeof(char *) * (env_count + 2));
+        if (!new_envp)
+            goto crap;
     }
-    new_envp = malloc(sizeof(char *) * (env_count + 2));
     envp_to_use = new_envp;
     char **outp = new_envp;
     for (size_t idx = 0; idx < env_count; idx++) {
@@ -420,6 +587,18 @@ static int hook_posix_spawn_generic(__typeof__(posix_spawn) *old,
     /* TODO skip this if Substrate is doing it anyway */
     bool was_suspended;
     if (need_unrestrict) {
+        /* only copied when the flags have to change */
+        if (attrp) {
+            posix_spawnattr_t attr = *attrp;
+            size_t size = malloc_size(attr);
+            my_attr = malloc(size);
+            if (!my_attr)
+                goto crap;
+            memcpy(my_attr, attr, size);
+        } else {
+            if (posix_spawnattr_init(&my_attr))
+                goto crap;
+        }
         was_suspended = flags & POSIX_SPAWN_START_SUSPENDED;
         flags |= POSIX_SPAWN_START_SUSPENDED;
         if (posix_spawnattr_setflags(&my_attr, flags))
@@ -442,7 +621,8 @@ static int hook_posix_spawn_generic(__typeof__(posix_spawn) *old,
         ib_log("non-launchd, calling jailbreakd on ourselves");
         calljailbreakd(getpid());
     }
-    int ret = old(pidp, path, file_actions, &my_attr, argv, envp_to_use);
+    int ret = old(pidp, path, file_actions, my_attr ? &my_attr : attrp, argv,
+                  envp_to_use);
     if (IB_VERBOSE)
         ib_log("ret=%d pid=%ld", ret, (long) *pidp);
 
@@ -452,16 +632,18 @@ static int hook_posix_spawn_generic(__typeof__(posix_spawn) *old,
      * unrestrict it ourself. */
     pid_t pid = *pidp;
     if (need_unrestrict)
-        spawn_unrestrict(pid, !was_suspended, false);
+        queue_unrestrict(pid, !was_suspended);
 
     if (bundleid) {
-        pthread_mutex_lock(&g_state_lock);
+        struct pid_shard *shard = pid_shard(pid);
+        char *bundleid_copy = strdup(bundleid);
+        pthread_mutex_lock(&shard->lock);
         bool new_entry;
-        char **old_bundleid = htab_setp_pid_str(&g_pid_to_bundleid.h, &pid, &new_entry);
+        char **old_bundleid = htab_setp_pid_str(&shard->map.h, &pid, &new_entry);
         if (!new_entry)
             free(*old_bundleid);
-        *old_bundleid = strdup(bundleid);
-        pthread_mutex_unlock(&g_state_lock);
+        *old_bundleid = bundleid_copy;
+        pthread_mutex_unlock(&shard->lock);
     }
 
     //calljailbreakd(pid);
@@ -472,8 +654,8 @@ crap:
 skip:
     ret = old(pidp, path, file_actions, attrp, argv, envp);
 cleanup:
-    free(new_envp);
-    free(new);
+    free(new_envp_to_free);
+    free(new_to_free);
     free(my_attr);
     return ret;
 }
@@ -499,21 +681,25 @@ static int hook_posix_spawnp(pid_t *restrict pid, const char *restrict path,
 static void after_wait_generic(pid_t pid, int stat) {
     if (pid == -1)
         return;
-    pthread_mutex_lock(&g_state_lock);
+    struct pid_shard *shard = pid_shard(pid);
+    pthread_mutex_lock(&shard->lock);
     struct htab_bucket_pid_str *bucket =
-        htab_getbucket_pid_str(&g_pid_to_bundleid.h, &pid);
+        htab_getbucket_pid_str(&shard->map.h, &pid);
     if (!bucket) {
+        pthread_mutex_unlock(&shard->lock);
         /* probably spawned some other way / not a task */
         if (IB_VERBOSE)
             ib_log("reaped unknown pid %d", pid);
-        goto end;
+        return;
     }
     char *bundleid = bucket->value;
+    htab_removeat_pid_str(&shard->map.h, bucket);
+    pthread_mutex_unlock(&shard->lock);
+
+    pthread_mutex_lock(&g_fate_lock);
     xxpc_dictionary_set_int64(g_bundleid_to_fate, bundleid, stat);
+    pthread_mutex_unlock(&g_fate_lock);
     free(bundleid);
-    htab_removeat_pid_str(&g_pid_to_bundleid.h, bucket);
-end:
-    pthread_mutex_unlock(&g_state_lock);
 }
 
 static pid_t hook_wait4(pid_t pid, int *stat_loc, int options,
@@ -540,6 +726,17 @@ static int hook_xpc_pipe_try_receive(mach_port_t port_set, xxpc_object_t *reques
     if (!request || /* just to be sure */
         xxpc_get_type(request) != XXPC_TYPE_DICTIONARY)
         return res;
+    /* This sees every request launchd gets, so reject what can't be ours
+     * before doing any dictionary lookups: only root (substituted) may send
+     * hook-operations, and the sender's euid comes straight from the
+     * message's audit trailer.  Most of launchd's traffic is from apps and
+     * daemons running as mobile or some other user. */
+    audit_token_t at;
+    xxpc_dictionary_get_audit_token(request, &at);
+    uid_t euid;
+    audit_token_to_au32(at, NULL, &euid, NULL, NULL, NULL, NULL, NULL, NULL);
+    if (euid != 0)
+        return res;
     /* is it for us? - usage of "in"/"out" is to satisfy the public vproc API */
     xxpc_object_t in = xxpc_dictionary_get_value(request, "in");
     if (!in || xxpc_get_type(in) != XXPC_TYPE_DICTIONARY)
@@ -548,17 +745,6 @@ static int hook_xpc_pipe_try_receive(mach_port_t port_set, xxpc_object_t *reques
         "com.ex.substitute.hook-operation");
     if (!name)
         return res;
-    /* is it from someone untrustworthy? */
-    audit_token_t at;
-    xxpc_dictionary_get_audit_token(request, &at);
-    uid_t euid;
-    pid_t pid;
-    audit_token_to_au32(at, NULL, &euid, NULL, NULL, NULL, &pid, NULL, NULL);
-    if (euid != 0) {
-        ib_log("Attempt to perform hook-operation by pid %d with euid %d",
-               euid, pid);
-        return res;
-    }
     xxpc_object_t reply = NULL;
     if (!strcmp(name, "bundleid-to-fate")) {
         const char *bundleid = xxpc_dictionary_get_string(in, "bundleid");
@@ -566,7 +752,7 @@ static int hook_xpc_pipe_try_receive(mach_port_t port_set, xxpc_object_t *reques
             goto invalid;
         reply = xxpc_dictionary_create_reply(request);
         xxpc_object_t out = xxpc_dictionary_create(NULL, NULL, 0);
-        pthread_mutex_lock(&g_state_lock);
+        pthread_mutex_lock(&g_fate_lock);
         xxpc_object_t fate = xxpc_dictionary_get_value(g_bundleid_to_fate,
                                                        bundleid);
         if (fate) {
@@ -580,7 +766,7 @@ static int hook_xpc_pipe_try_receive(mach_port_t port_set, xxpc_object_t *reques
             if (IB_VERBOSE)
                 ib_log("your (%s) fate is unavailable", bundleid);
         }
-        pthread_mutex_unlock(&g_state_lock);
+        pthread_mutex_unlock(&g_fate_lock);
         xxpc_dictionary_set_value(reply, "out", out);
         xxpc_release(out);
     } else {
@@ -663,6 +849,10 @@ static void init() {
      * disk...)
      */
     g_bundleid_to_fate = xxpc_dictionary_create(NULL, NULL, 0);
+    for (int i = 0; i < PID_SHARDS; i++) {
+        pthread_mutex_init(&g_pid_to_bundleid[i].lock, NULL);
+        HTAB_STORAGE_INIT(&g_pid_to_bundleid[i].map, pid_str);
+    }
 
     const char *image0 = _dyld_get_image_name(0);
     g_is_launchd = !!strstr(image0, "launchd");
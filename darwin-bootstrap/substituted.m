@@ -1,10 +1,12 @@
 #include "darwin/xxpc.h"
 #include "substitute.h"
+#include "filter-snapshot.h"
 #import <Foundation/Foundation.h>
 #import <CoreFoundation/CoreFoundation.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <mach/vm_param.h>
+#include <pthread.h>
 
 void *vproc_swap_complex(void *vp, int key, xxpc_object_t inval,
                          __strong xxpc_object_t *outval);
@@ -24,6 +26,33 @@ static enum {
 static NSSet *g_springboard_loaded_dylibs;
 static NSSet *g_springboard_last_loaded_dylibs;
 
+/* The state file is a table of strings, used straight from the mapping:
+ * the header, 'count' uint32 offsets into the strings, then 'strings_size'
+ * bytes of NUL-terminated strings. */
+#define STATE_MAGIC 0x53425354
+#define STATE_VERSION 1
+struct state_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint32_t strings_size;
+};
+
+/* g_springboard_last_loaded_dylibs as of when substituted started, until a
+ * new SpringBoard replaces it */
+static struct {
+    const struct state_header *hdr;
+    size_t size;
+    const uint32_t *offsets;
+    const char *strings;
+} g_loaded_state;
+
+static void unmap_loaded_state() {
+    if (g_loaded_state.hdr)
+        munmap((void *) g_loaded_state.hdr, g_loaded_state.size);
+    g_loaded_state.hdr = NULL;
+}
+
 static bool load_state() {
     int fd = shm_open("com.ex.substituted.state", O_RDONLY);
     if (fd == -1)
@@ -31,71 +60,108 @@ static bool load_state() {
     struct stat st;
     if (fstat(fd, &st)) {
         NSLog(@"fstat error");
+        close(fd);
         return false;
     }
     size_t size = (size_t) st.st_size;
     /* note: can't have concurrent modification */
-    void *buf = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    void *buf = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)
+                     : MAP_FAILED;
+    close(fd);
     if (buf == MAP_FAILED) {
         NSLog(@"mmap error");
         return false;
     }
-    NSData *nsd = [NSData dataWithBytesNoCopy:buf length:size];
-    NSError *err = nil;
-    id result = [NSPropertyListSerialization propertyListWithData:nsd
-                                             options:NSPropertyListImmutable
-                                             format:NULL error:&err];
-    if (err)
-        NSLog(@"propertyListWithData: %@", err);
-    if (!result)
-        return false;
-    if (![result isKindOfClass:[NSSet class]]) {
-        NSLog(@"loaded data is not NSSet - newer version?");
-        return false;
+    const struct state_header *hdr = buf;
+    if (size < sizeof(*hdr) || hdr->magic != STATE_MAGIC ||
+        hdr->version != STATE_VERSION) {
+        NSLog(@"loaded state has the wrong format - other version?");
+        goto bad;
     }
-    for (id str in result) {
-        if (![str isKindOfClass:[NSString class]]) {
-            NSLog(@"loaded data member is not NSString");
-            return false;
+    size_t rest = size - sizeof(*hdr);
+    if (hdr->count > rest / sizeof(uint32_t) ||
+        hdr->strings_size > rest - hdr->count * sizeof(uint32_t) ||
+        (hdr->count && (!hdr->strings_size ||
+                        ((const char *) (hdr + 1))[hdr->count * sizeof(uint32_t)
+                                                   + hdr->strings_size - 1]))) {
+        NSLog(@"loaded state is truncated");
+        goto bad;
+    }
+    const uint32_t *offsets = (const void *) (hdr + 1);
+    for (uint32_t i = 0; i < hdr->count; i++) {
+        if (offsets[i] >= hdr->strings_size) {
+            NSLog(@"loaded state has a bad offset");
+            goto bad;
         }
     }
-    g_springboard_last_loaded_dylibs = result;
-    munmap(buf, size);
-    close(fd);
+    g_loaded_state.hdr = hdr;
+    g_loaded_state.size = size;
+    g_loaded_state.offsets = offsets;
+    g_loaded_state.strings = (const char *) (offsets + hdr->count);
     return true;
+bad:
+    munmap(buf, size);
+    return false;
 }
 
 static bool save_state() {
-    NSError *err = nil;
-    NSData *data = [NSPropertyListSerialization
-                    dataWithPropertyList:g_springboard_last_loaded_dylibs
-                    format:NSPropertyListBinaryFormat_v1_0 options:0
-                    error:&err];
-    if (err)
-        NSLog(@"dataWithPropertyList: %@", err);
-    if (!data)
+    NSSet *set = g_springboard_last_loaded_dylibs;
+    /* no SpringBoard since we started: keep the state that was saved */
+    if (!set)
+        return false;
+    NSMutableArray *utf8 = [NSMutableArray arrayWithCapacity:[set count]];
+    size_t strings_size = 0;
+    for (NSString *dylib in set) {
+        NSData *data = [dylib dataUsingEncoding:NSUTF8StringEncoding];
+        if (!data)
+            continue;
+        [utf8 addObject:data];
+        strings_size += [data length] + 1;
+    }
+    uint32_t count = (uint32_t) [utf8 count];
+    size_t used = sizeof(struct state_header) + count * sizeof(uint32_t) +
+                  strings_size;
+    if (strings_size > UINT32_MAX) {
+        NSLog(@"state too big");
         return false;
+    }
+
     int fd = shm_open("com.ex.substituted.state", O_RDWR | O_CREAT | O_TRUNC,
                       0644);
     if (fd == -1) {
         NSLog(@"shm_open error (write)");
         return false;
     }
-    size_t size = ([data length] + PAGE_MASK) & ~PAGE_MASK;
+    size_t size = (used + PAGE_MASK) & ~PAGE_MASK;
     if (ftruncate(fd, size)) {
         NSLog(@"ftruncate error (%zu)", size);
+        close(fd);
         return false;
     }
 
     void *buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
     if (buf == MAP_FAILED) {
         NSLog(@"mmap error (write)");
         return false;
     }
 
-    memcpy(buf, [data bytes], [data length]);
+    struct state_header *hdr = buf;
+    uint32_t *offsets = (void *) (hdr + 1);
+    char *strings = (char *) (offsets + count);
+    uint32_t off = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        NSData *data = utf8[i];
+        offsets[i] = off;
+        memcpy(strings + off, [data bytes], [data length]);
+        off += [data length];
+        strings[off++] = '\0';
+    }
+    hdr->version = STATE_VERSION;
+    hdr->count = count;
+    hdr->strings_size = (uint32_t) strings_size;
+    hdr->magic = STATE_MAGIC;
     munmap(buf, size);
-    close(fd);
     return true;
 }
 
@@ -122,6 +188,18 @@ static void install_deadlock_warning() {
     }
 }
 
+/* Every process that looks up private symbols in the shared cache would
+ * otherwise read them out of the cache file itself. */
+static void build_shared_cache_sym_index() {
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND,
+                                             0), ^{
+        int ret = substitute_build_shared_cache_sym_index();
+        if (ret && ret != SUBSTITUTE_ERR_NOT_SUPPORTED) {
+            NSLog(@"substitute_build_shared_cache_sym_index failed: %d", ret);
+        }
+    });
+}
+
 static double id_to_double(id o) {
     if ([o isKindOfClass:[NSString class]]) {
         NSScanner *scan = [NSScanner scannerWithString:o];
@@ -136,44 +214,136 @@ static double id_to_double(id o) {
     }
 }
 
+/* The parsed filters, which are only reread when something in the directory
+ * changes, rather than on every hello.  They're replaced as a whole (on the
+ * main queue) and never modified, so hellos on other queues just need to grab
+ * the current array under the lock. */
+static NSArray *g_filters;
+static pthread_mutex_t g_filters_lock = PTHREAD_MUTEX_INITIALIZER;
+/* main queue only */
+static NSMutableArray *g_filter_watchers;
+static bool g_filters_reload_pending;
+
+static void reload_filters();
+
+static NSArray *current_filters() {
+    pthread_mutex_lock(&g_filters_lock);
+    NSArray *filters = g_filters;
+    pthread_mutex_unlock(&g_filters_lock);
+    return filters;
+}
+
+/* installing a package changes several files at once */
+static void filters_changed() {
+    if (g_filters_reload_pending)
+        return;
+    g_filters_reload_pending = true;
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, 100 * NSEC_PER_MSEC),
+                   dispatch_get_main_queue(), ^{
+        g_filters_reload_pending = false;
+        reload_filters();
+    });
+}
+
+static void watch_path(NSString *path) {
+    int fd = open([path fileSystemRepresentation], O_EVTONLY);
+    if (fd == -1)
+        return;
+    dispatch_source_t source = dispatch_source_create(
+        DISPATCH_SOURCE_TYPE_VNODE, (uintptr_t) fd,
+        DISPATCH_VNODE_WRITE | DISPATCH_VNODE_EXTEND | DISPATCH_VNODE_DELETE |
+        DISPATCH_VNODE_RENAME | DISPATCH_VNODE_REVOKE,
+        dispatch_get_main_queue());
+    if (!source) {
+        close(fd);
+        return;
+    }
+    dispatch_source_set_event_handler(source, ^{
+        filters_changed();
+    });
+    dispatch_source_set_cancel_handler(source, ^{
+        close(fd);
+    });
+    dispatch_resume(source);
+    [g_filter_watchers addObject:source];
+}
+
+static void reload_filters() {
+    for (dispatch_source_t source in g_filter_watchers)
+        dispatch_source_cancel(source);
+    g_filter_watchers = [NSMutableArray array];
+    /* the directory is watched before reading it, and the plists after, so
+     * new files can't be missed; a plist changing in between is caught by
+     * the mtime check below if it was replaced, which is how packages
+     * install them */
+    watch_path(@FILTER_SNAPSHOT_DIR);
+    struct timespec mtime;
+    NSMutableArray *plists = [NSMutableArray array];
+    NSArray *filters = load_filters(&mtime, plists);
+    pthread_mutex_lock(&g_filters_lock);
+    g_filters = filters;
+    pthread_mutex_unlock(&g_filters_lock);
+    publish_filter_snapshot(filters, mtime);
+    for (NSString *plist in plists)
+        watch_path(plist);
+    struct stat st;
+    if (!stat(FILTER_SNAPSHOT_DIR, &st) &&
+        (st.st_mtimespec.tv_sec != mtime.tv_sec ||
+         st.st_mtimespec.tv_nsec != mtime.tv_nsec))
+        filters_changed();
+}
+
 static xxpc_object_t nsstring_to_xpc(NSString *in) {
     return xxpc_string_create([in cStringUsingEncoding:NSUTF8StringEncoding]);
 }
 
-@interface PeerHandler : NSObject {
-    xxpc_object_t _connection;
-    NSString *_argv0;
-    bool _is_springboard;
-    NSMutableSet *_loaded_dylibs;
+/* A plist's filter, checked and with everything that doesn't depend on the
+ * process worked out */
+@interface BundleFilter : NSObject {
+@public
+    NSString *_dylib_path;
+    /* no Filter key, so it's loaded everywhere (even in safe mode) */
+    bool _unfiltered;
+    bool _for_safe_mode;
+    bool _any;
+    bool _cfv_ok;
+    NSArray *_executables;
+    NSArray *_bundles;
+    NSArray *_classes;
 }
-
 @end
 
-enum convert_filters_ret TEST;
+@implementation BundleFilter
 
-@implementation PeerHandler
-
-enum convert_filters_ret {
-    PROVISIONAL_PASS,
-    FAIL,
-    INVALID
-};
+static bool is_string_array(id array) {
+    if (![array isKindOfClass:[NSArray class]])
+        return false;
+    for (id name in array) {
+        if (![name isKindOfClass:[NSString class]])
+            return false;
+    }
+    return true;
+}
 
-- (enum convert_filters_ret)
-    convertFiltersForBundleInfo:(NSDictionary *)plist_dict
-    toXPCReply:(xxpc_object_t)out_info {
+/* nil if the plist is invalid */
++ (instancetype)filterForDylib:(NSString *)dylib_path
+                plist:(NSDictionary *)plist_dict {
+    BundleFilter *f = [[BundleFilter alloc] init];
+    f->_dylib_path = dylib_path;
 
     for (NSString *key in [plist_dict allKeys]) {
         if (!([key isEqualToString:@"Filter"]))
-            return INVALID;
+            return nil;
     }
 
     NSDictionary *filter = [plist_dict objectForKey:@"Filter"];
-    if (!filter)
-        return PROVISIONAL_PASS;
+    if (!filter) {
+        f->_unfiltered = true;
+        return f;
+    }
 
     if (![filter isKindOfClass:[NSDictionary class]])
-        return INVALID;
+        return nil;
 
     for (NSString *key in [filter allKeys]) {
         if (!([key isEqualToString:@"CoreFoundationVersion"] ||
@@ -182,104 +352,255 @@ enum convert_filters_ret {
               [key isEqualToString:@"Executables"] ||
               [key isEqualToString:@"Mode"] ||
               [key isEqualToString:@"SafeMode"])) {
-            return INVALID;
+            return nil;
         }
     }
 
-    bool for_safe_mode = false;
     NSNumber *safe_mode_num = [filter objectForKey:@"SafeMode"];
     if (safe_mode_num) {
          if ([safe_mode_num isEqual:[NSNumber numberWithBool:true]])
-            for_safe_mode = true;
+            f->_for_safe_mode = true;
          else if (![safe_mode_num isEqual:[NSNumber numberWithBool:false]])
-            return INVALID;
-    }
-    /* in REALLY_SAFE mode, nothing gets loaded */
-    if (for_safe_mode) {
-        if (!_is_springboard || g_springboard_needs_safe != NEEDS_SAFE)
-            return FAIL;
-    } else {
-        if (_is_springboard && g_springboard_needs_safe != NO_SAFE)
-            return FAIL;
+            return nil;
     }
 
-    bool any = false;
     NSString *mode_str = [filter objectForKey:@"Mode"];
     if (mode_str) {
-        any = [mode_str isEqual:@"Any"];
-        if (!any && ![mode_str isEqual:@"All"])
-            return INVALID;
+        f->_any = [mode_str isEqual:@"Any"];
+        if (!f->_any && ![mode_str isEqual:@"All"])
+            return nil;
     }
 
-    xxpc_dictionary_set_bool(out_info, "any", any);
-
-    /* First do the two we can test here. */
-
+    f->_cfv_ok = true;
     NSArray *cfv = [filter objectForKey:@"CoreFoundationVersion"];
     if (cfv) {
         if (![cfv isKindOfClass:[NSArray class]] ||
             [cfv count] == 0 ||
             [cfv count] > 2)
-            return INVALID;
+            return nil;
         double version = kCFCoreFoundationVersionNumber;
         double minimum = id_to_double([cfv objectAtIndex:0]);
         if (minimum != minimum)
-            return INVALID;
+            return nil;
         if (version < minimum)
-            return FAIL;
-        id supremum_o = [cfv objectAtIndex:1];
-        if (supremum_o) {
-            double supremum = id_to_double(supremum_o);
+            f->_cfv_ok = false;
+        if ([cfv count] > 1) {
+            double supremum = id_to_double([cfv objectAtIndex:1]);
             if (supremum != supremum)
-                return INVALID;
+                return nil;
             if (version >= supremum)
-                return FAIL;
+                f->_cfv_ok = false;
         }
     }
 
-    NSArray *executables = [filter objectForKey:@"Executables"];
-    if (executables) {
-        if (![executables isKindOfClass:[NSArray class]])
-            return INVALID;
-        for (NSString *name in executables) {
-            if (![name isKindOfClass:[NSString class]])
-                return INVALID;
-            if ([name isEqualToString:_argv0])
-                goto ok;
+    f->_executables = [filter objectForKey:@"Executables"];
+    f->_bundles = [filter objectForKey:@"Bundles"];
+    f->_classes = [filter objectForKey:@"Classes"];
+    if ((f->_executables && !is_string_array(f->_executables)) ||
+        (f->_bundles && !is_string_array(f->_bundles)) ||
+        (f->_classes && !is_string_array(f->_classes)))
+        return nil;
+
+    return f;
+}
+@end
+
+/* Read every plist in FILTER_SNAPSHOT_DIR, adding their paths to plists.
+ * The directory's mtime is taken first, so if it changes while we're
+ * reading, it won't match. */
+static NSArray *load_filters(struct timespec *dir_mtime,
+                             NSMutableArray *plists) {
+    NSString *base = @FILTER_SNAPSHOT_DIR;
+    struct stat st;
+    if (stat(FILTER_SNAPSHOT_DIR, &st))
+        memset(&st, 0, sizeof(st));
+    *dir_mtime = st.st_mtimespec;
+
+    NSMutableArray *filters = [NSMutableArray array];
+    NSError *err;
+    NSArray *list = [[NSFileManager defaultManager]
+                     contentsOfDirectoryAtPath:base
+                     error:&err];
+
+    for (NSString *dylib in list) {
+        if (![[dylib pathExtension] isEqualToString:@"dylib"])
+            continue;
+        NSString *plist = [[dylib stringByDeletingPathExtension]
+                           stringByAppendingPathExtension:@"plist"];
+        NSString *full_plist = [base stringByAppendingPathComponent:plist];
+        [plists addObject:full_plist];
+        NSDictionary *plist_dict = [NSDictionary dictionaryWithContentsOfFile:
+                                    full_plist];
+        if (!plist_dict) {
+            NSLog(@"missing, unreadable, or invalid plist '%@' for dylib '%@'; unlike Substrate, we require plists",
+                  full_plist, dylib);
+            continue;
+        }
+
+        NSString *dylib_path = [base stringByAppendingPathComponent:dylib];
+        BundleFilter *f = [BundleFilter filterForDylib:dylib_path
+                                        plist:plist_dict];
+        if (!f) {
+            NSLog(@"bad data in plist '%@' for dylib '%@'", full_plist, dylib);
+            continue;
+        }
+        [filters addObject:f];
+    }
+    return filters;
+}
+
+struct snapshot_builder {
+    NSMutableData *entries, *refs, *strings;
+};
+
+static uint32_t snapshot_add_string(struct snapshot_builder *sb,
+                                    NSString *str) {
+    uint32_t off = (uint32_t) [sb->strings length];
+    const char *c = [str cStringUsingEncoding:NSUTF8StringEncoding];
+    [sb->strings appendBytes:c length:strlen(c) + 1];
+    return off;
+}
+
+static struct filter_snapshot_list snapshot_add_list(
+    struct snapshot_builder *sb, NSArray *strs) {
+    struct filter_snapshot_list list = {
+        (uint32_t) ([sb->refs length] / sizeof(uint32_t)),
+        (uint32_t) [strs count]
+    };
+    for (NSString *str in strs) {
+        uint32_t off = snapshot_add_string(sb, str);
+        [sb->refs appendBytes:&off length:sizeof(off)];
+    }
+    return list;
+}
+
+/* Write the filters out for bundle-loader; see filter-snapshot.h.  The old
+ * object is unlinked rather than rewritten, so anyone who has it mapped
+ * keeps a consistent copy. */
+static bool publish_filter_snapshot(NSArray *filters, struct timespec mtime) {
+    struct snapshot_builder sb = {
+        [NSMutableData data], [NSMutableData data], [NSMutableData data]
+    };
+    for (BundleFilter *f in filters) {
+        if (f->_for_safe_mode || !(f->_unfiltered || f->_cfv_ok))
+            continue;
+        struct filter_snapshot_entry e = {0};
+        e.dylib = snapshot_add_string(&sb, f->_dylib_path);
+        if (f->_any)
+            e.flags |= FILTER_SNAPSHOT_ANY;
+        if (f->_executables)
+            e.flags |= FILTER_SNAPSHOT_HAS_EXECUTABLES;
+        e.executables = snapshot_add_list(&sb, f->_executables);
+        e.bundles = snapshot_add_list(&sb, f->_bundles);
+        e.classes = snapshot_add_list(&sb, f->_classes);
+        [sb.entries appendBytes:&e length:sizeof(e)];
+    }
+
+    struct filter_snapshot_header hdr = {
+        .magic = 0,
+        .version = FILTER_SNAPSHOT_VERSION,
+        .dir_mtime_sec = mtime.tv_sec,
+        .dir_mtime_nsec = mtime.tv_nsec,
+        .nentries = (uint32_t) ([sb.entries length] /
+                                sizeof(struct filter_snapshot_entry)),
+        .nrefs = (uint32_t) ([sb.refs length] / sizeof(uint32_t)),
+        .strings_size = (uint32_t) [sb.strings length],
+    };
+    size_t size = filter_snapshot_size(hdr.nentries, hdr.nrefs,
+                                       hdr.strings_size);
+
+    shm_unlink(FILTER_SNAPSHOT_SHM_NAME);
+    int fd = shm_open(FILTER_SNAPSHOT_SHM_NAME, O_RDWR | O_CREAT | O_EXCL,
+                      0644);
+    if (fd == -1) {
+        NSLog(@"shm_open error (filter snapshot)");
+        return false;
+    }
+    size_t map_size = (size + PAGE_MASK) & ~PAGE_MASK;
+    if (ftruncate(fd, map_size)) {
+        NSLog(@"ftruncate error (%zu)", map_size);
+        close(fd);
+        return false;
+    }
+    void *buf = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                     0);
+    close(fd);
+    if (buf == MAP_FAILED) {
+        NSLog(@"mmap error (filter snapshot)");
+        return false;
+    }
+    char *p = buf;
+    memcpy(p, &hdr, sizeof(hdr));
+    p += sizeof(hdr);
+    memcpy(p, [sb.entries bytes], [sb.entries length]);
+    p += [sb.entries length];
+    memcpy(p, [sb.refs bytes], [sb.refs length]);
+    p += [sb.refs length];
+    memcpy(p, [sb.strings bytes], [sb.strings length]);
+    __atomic_store_n(&((struct filter_snapshot_header *) buf)->magic,
+                     FILTER_SNAPSHOT_MAGIC, __ATOMIC_RELEASE);
+    munmap(buf, map_size);
+    return true;
+}
+
+@interface PeerHandler : NSObject {
+    xxpc_object_t _connection;
+    NSString *_argv0;
+    bool _is_springboard;
+    NSMutableSet *_loaded_dylibs;
+}
+
+@end
+
+@implementation PeerHandler
+
+- (bool)evaluateFilter:(BundleFilter *)f toXPCReply:(xxpc_object_t)out_info {
+    if (f->_unfiltered)
+        return true;
+
+    /* in REALLY_SAFE mode, nothing gets loaded */
+    if (f->_for_safe_mode) {
+        if (!_is_springboard || g_springboard_needs_safe != NEEDS_SAFE)
+            return false;
+    } else {
+        if (_is_springboard && g_springboard_needs_safe != NO_SAFE)
+            return false;
+    }
+
+    xxpc_dictionary_set_bool(out_info, "any", f->_any);
+
+    /* First do the two we can test here. */
+
+    if (!f->_cfv_ok)
+        return false;
+
+    if (f->_executables) {
+        if (![f->_executables containsObject:_argv0]) {
+            /* (with Any, without adding other conditions) */
+            return f->_any;
         }
-        if (any)
-            return PROVISIONAL_PASS; /* without adding other conditions */
-        else
-            return FAIL;
-    ok:;
     }
 
     /* Convert the rest to tests for bundle-loader. */
 
     struct {
-        __unsafe_unretained NSString *key;
+        __unsafe_unretained NSArray *things;
         const char *okey;
     } types[2] = {
-        {@"Classes", "classes"},
-        {@"Bundles", "bundles"},
+        {f->_classes, "classes"},
+        {f->_bundles, "bundles"},
     };
 
     for (int i = 0; i < 2; i++) {
-        NSArray *things = [filter objectForKey:types[i].key];
-        if (things) {
-            if (![things isKindOfClass:[NSArray class]])
-                return INVALID;
+        if (types[i].things) {
             xxpc_object_t out_things = xxpc_array_create(NULL, 0);
-            for (NSString *name in things) {
-                if (![name isKindOfClass:[NSString class]])
-                    return INVALID;
+            for (NSString *name in types[i].things)
                 xxpc_array_append_value(out_things, nsstring_to_xpc(name));
-            }
             xxpc_dictionary_set_value(out_info, types[i].okey, out_things);
         }
     }
 
-    return PROVISIONAL_PASS;
+    return true;
 }
 
 - (void)updateSpringBoardNeedsSafeThen:(void (^)())then {
@@ -287,6 +608,7 @@ enum convert_filters_ret {
     xxpc_dictionary_set_string(inn, "com.ex.substitute.hook-operation",
                                "bundleid-to-fate");
     xxpc_dictionary_set_string(inn, "bundleid", "com.apple.SpringBoard");
+    bool was_safe = g_springboard_needs_safe != NO_SAFE;
 
     dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
                    ^{
@@ -316,7 +638,7 @@ enum convert_filters_ret {
 
 
         if (crashed) {
-            if (g_springboard_needs_safe) {
+            if (was_safe) {
                 NSLog(@"SpringBoard crashed while in safe mode; using Really Safe Mode (no UI) next time :(");
                 to_set = REALLY_SAFE;
             } else {
@@ -363,13 +685,17 @@ enum convert_filters_ret {
     _is_springboard = [_argv0 isEqualToString:sb_exe];
 
     if (_is_springboard) {
-        g_springboard_last_loaded_dylibs = g_springboard_loaded_dylibs;
-        g_springboard_loaded_dylibs = _loaded_dylibs = [NSMutableSet set];
-        save_state();
-
-        [self updateSpringBoardNeedsSafeThen:^{
-            [self handleMessageHelloRest:request];
-        }];
+        /* SpringBoard's state is only touched on the main queue */
+        dispatch_async(dispatch_get_main_queue(), ^{
+            g_springboard_last_loaded_dylibs = g_springboard_loaded_dylibs;
+            unmap_loaded_state();
+            g_springboard_loaded_dylibs = _loaded_dylibs = [NSMutableSet set];
+            save_state();
+
+            [self updateSpringBoardNeedsSafeThen:^{
+                [self handleMessageHelloRest:request];
+            }];
+        });
     } else {
         [self handleMessageHelloRest:request];
     }
@@ -384,39 +710,12 @@ bad:
 
     xxpc_object_t bundles = xxpc_array_create(NULL, 0);
 
-    NSError *err;
-    NSString *base = @"/Library/Substitute/DynamicLibraries";
-    NSArray *list = [[NSFileManager defaultManager]
-                     contentsOfDirectoryAtPath:base
-                     error:&err];
-
-    for (NSString *dylib in list) {
-        if (![[dylib pathExtension] isEqualToString:@"dylib"])
-            continue;
-        NSString *plist = [[dylib stringByDeletingPathExtension]
-                           stringByAppendingPathExtension:@"plist"];
-        NSString *full_plist = [base stringByAppendingPathComponent:plist];
-        NSDictionary *plist_dict = [NSDictionary dictionaryWithContentsOfFile:
-                                    full_plist];
-        if (!plist_dict) {
-            NSLog(@"missing, unreadable, or invalid plist '%@' for dylib '%@'; unlike Substrate, we require plists",
-                  full_plist, dylib);
-            continue;
-        }
-
+    for (BundleFilter *f in current_filters()) {
         xxpc_object_t info = xxpc_dictionary_create(NULL, NULL, 0);
-
-        enum convert_filters_ret ret =
-            [self convertFiltersForBundleInfo:plist_dict toXPCReply:info];
-        if (ret == FAIL) {
+        if (![self evaluateFilter:f toXPCReply:info])
             continue;
-        } else if (ret == INVALID) {
-            NSLog(@"bad data in plist '%@' for dylib '%@'", full_plist, dylib);
-            continue;
-        }
-
-        NSString *dylib_path = [base stringByAppendingPathComponent:dylib];
-        xxpc_dictionary_set_value(info, "dylib", nsstring_to_xpc(dylib_path));
+        xxpc_dictionary_set_value(info, "dylib",
+                                  nsstring_to_xpc(f->_dylib_path));
         xxpc_array_append_value(bundles, info);
     }
 
@@ -430,33 +729,65 @@ bad:
 - (void)handleMessageAddRemove:(NS_VALID_UNTIL_END_OF_SCOPE
                                 xxpc_object_t)request {
     bool is_add = xxpc_dictionary_get_bool(request, "is-add");
-    const char *id_dylib = xxpc_dictionary_get_string(request, "id-dylib");
-    if (!id_dylib || !_loaded_dylibs)
+    if (!_is_springboard)
         return [self handleBadMessage:request];
-    NSString *id_dylib_s = [NSString stringWithCString:id_dylib
-                                     encoding:NSUTF8StringEncoding];
-    if (is_add)
-        [_loaded_dylibs addObject:id_dylib_s];
-    else
-        [_loaded_dylibs removeObject:id_dylib_s];
+    /* bundle-loader sends a batch of images; just one is the old format */
+    NSMutableArray *ids = [NSMutableArray array];
+    xxpc_object_t id_dylibs = xxpc_dictionary_get_value(request, "id-dylibs");
+    if (id_dylibs) {
+        if (xxpc_get_type(id_dylibs) != XXPC_TYPE_ARRAY)
+            return [self handleBadMessage:request];
+        for (size_t i = 0, count = xxpc_array_get_count(id_dylibs);
+             i < count; i++) {
+            const char *id_dylib = xxpc_array_get_string(id_dylibs, i);
+            if (!id_dylib)
+                return [self handleBadMessage:request];
+            [ids addObject:[NSString stringWithCString:id_dylib
+                                     encoding:NSUTF8StringEncoding]];
+        }
+    } else {
+        const char *id_dylib = xxpc_dictionary_get_string(request, "id-dylib");
+        if (!id_dylib)
+            return [self handleBadMessage:request];
+        [ids addObject:[NSString stringWithCString:id_dylib
+                                 encoding:NSUTF8StringEncoding]];
+    }
+    /* after the hello's block, which sets _loaded_dylibs */
+    dispatch_async(dispatch_get_main_queue(), ^{
+        if (is_add)
+            [_loaded_dylibs addObjectsFromArray:ids];
+        else
+            for (NSString *id_dylib in ids)
+                [_loaded_dylibs removeObject:id_dylib];
+    });
 }
 
 - (void)handleMessageSBFatalLoadedDylibs:(xxpc_object_t)request {
     /* This should probably be secured somehow... */
     NSLog(@"handleMessageSBFatalLoadedDylibs");
-    NSSet *set = g_springboard_last_loaded_dylibs;
-    xxpc_object_t reply = xxpc_dictionary_create_reply(request);
-    if (set) {
-        xxpc_object_t dylibs = xxpc_array_create(NULL, 0);
-        xxpc_dictionary_set_value(reply, "dylibs", dylibs);
-        for (NSString *dylib in set) {
-            xxpc_array_set_string(dylibs, XXPC_ARRAY_APPEND,
-                                  [dylib cStringUsingEncoding:
-                                         NSUTF8StringEncoding]);
+    dispatch_async(dispatch_get_main_queue(), ^{
+        NSSet *set = g_springboard_last_loaded_dylibs;
+        xxpc_object_t reply = xxpc_dictionary_create_reply(request);
+        if (set) {
+            xxpc_object_t dylibs = xxpc_array_create(NULL, 0);
+            xxpc_dictionary_set_value(reply, "dylibs", dylibs);
+            for (NSString *dylib in set) {
+                xxpc_array_set_string(dylibs, XXPC_ARRAY_APPEND,
+                                      [dylib cStringUsingEncoding:
+                                             NSUTF8StringEncoding]);
 
+            }
+        } else if (g_loaded_state.hdr) {
+            xxpc_object_t dylibs = xxpc_array_create(NULL, 0);
+            xxpc_dictionary_set_value(reply, "dylibs", dylibs);
+            for (uint32_t i = 0; i < g_loaded_state.hdr->count; i++) {
+                xxpc_array_set_string(dylibs, XXPC_ARRAY_APPEND,
+                                      g_loaded_state.strings +
+                                      g_loaded_state.offsets[i]);
+            }
         }
-    }
-    xxpc_connection_send_message(_connection, reply);
+        xxpc_connection_send_message(_connection, reply);
+    });
 }
 
 - (void)handleBadMessage:(xxpc_object_t)request {
@@ -482,6 +813,12 @@ bad:
 
 - (instancetype)initWithConnection:(xxpc_object_t)connection {
     _connection = connection;
+    /* Each connection's messages are handled in order, but different
+     * connections don't wait for each other (or for SpringBoard's launchd
+     * query); only SpringBoard's state is serialized, on the main queue. */
+    xxpc_connection_set_target_queue(connection,
+        dispatch_queue_create("com.ex.substituted.peer",
+                              DISPATCH_QUEUE_SERIAL));
     xxpc_connection_set_event_handler(connection, ^(xxpc_object_t event) {
         xxpc_type_t ty = xxpc_get_type(event);
         if (ty == XXPC_TYPE_DICTIONARY) {
@@ -506,6 +843,8 @@ int main() {
     NSLog(@"hello from substituted");
     install_deadlock_warning();
     load_state();
+    reload_filters();
+    build_shared_cache_sym_index();
     xxpc_connection_t listener = xxpc_connection_create_mach_service(
         "com.ex.substituted", dispatch_get_main_queue(),
         XXPC_CONNECTION_MACH_SERVICE_LISTENER);
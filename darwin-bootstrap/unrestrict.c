@@ -9,6 +9,9 @@
  * replace the current process, and (b) if they're not, launchd/xpcproxy (into
  * which posixspawn-hook is injected) still can't task_for_pid the child
  * process itself, because they don't have the right entitlements.
+ *
+ * Usage: unrestrict <pid> <should_resume> <is_exec> [<pid> ...]; launchd
+ * queues up the processes it spawns and sends them in batches.
 */
 
 #define IB_LOG_NAME "unrestrict"
@@ -28,7 +31,8 @@
 #define PROC_PIDFDVNODEINFO_SIZE 176
 int proc_pidfdinfo(int, int, int, void *, int);
 
-static bool unrestrict_macho_header(void *header, size_t size) {
+/* Returns whether there was anything to rename; if !modify, just check. */
+static bool unrestrict_macho_header(void *header, size_t size, bool modify) {
     struct mach_header *mh = header;
     if (mh->magic != MH_MAGIC && mh->magic != MH_MAGIC_64) {
         ib_log("bad mach-o magic");
@@ -64,6 +68,8 @@ static bool unrestrict_macho_header(void *header, size_t size) {
                 section_y *sect = (void *) (sc + 1);
                 for (uint32_t i = 0; i < sc->nsects; i++, sect++) {
                     if (!strncmp(sect->sectname, "__restrict", 16)) {
+                        if (!modify)
+                            return true;
                         strcpy(sect->sectname, "\xf0\x9f\x92\xa9");
                         did_modify = true;
                     }
@@ -113,6 +119,24 @@ setback:;
     size_t toread = 0x4000;
     if (segm_size < toread)
         toread = segm_size;
+
+    /* Nearly always there's nothing to change, so first look at the header
+     * through a shared mapping of it rather than copying it over. */
+    mach_vm_address_t view = 0;
+    vm_prot_t cur, max;
+    kr = mach_vm_remap(mach_task_self(), &view, toread, 0, VM_FLAGS_ANYWHERE,
+                       task, segm_addr, FALSE, &cur, &max, VM_INHERIT_NONE);
+    if (!kr) {
+        bool checked = cur & VM_PROT_READ;
+        bool need = checked &&
+                    unrestrict_macho_header((void *) view, toread, false);
+        mach_vm_deallocate(mach_task_self(), view, toread);
+        if (checked && !need)
+            return;
+    } else {
+        ib_log("mach_vm_remap(view of %lx): %x", (long) segm_addr, kr);
+    }
+
     if ((kr = vm_allocate(mach_task_self(), &header_addr, toread,
                           VM_FLAGS_ANYWHERE))) {
         ib_log("vm_allocate(%zx): %x", toread, kr);
@@ -123,67 +147,36 @@ setback:;
                                 &actual);
     if (kr || actual != toread) {
         ib_log("mach_vm_read_overwrite: %x", kr);
-        return;
+        goto out;
     }
 
-    bool did_modify = unrestrict_macho_header((void *) header_addr, toread);
+    bool did_modify = unrestrict_macho_header((void *) header_addr, toread,
+                                              true);
 
     if (did_modify) {
         if ((kr = vm_protect(mach_task_self(), header_addr, toread,
                              FALSE, info.protection))) {
             ib_log("vm_protect(%lx=>%d): %x",
                    (long) header_addr, info.protection, kr);
-            return;
+            goto out;
         }
-        vm_prot_t cur, max;
         if ((kr = mach_vm_remap(task, &segm_addr, toread, 0,
                                 VM_FLAGS_OVERWRITE,
                                 mach_task_self(), header_addr, FALSE,
                                 &cur, &max, info.inheritance))) {
             ib_log("mach_vm_remap(%lx=>%lx size=%zx): %x",
                    (long) header_addr, (long) segm_addr, toread, kr);
-            return;
+            goto out;
         }
     }
+out:
+    vm_deallocate(mach_task_self(), header_addr, toread);
 }
 
 
 
-int main(int argc, char **argv) {
-    if (argc != 4) {
-        ib_log("wrong number of args");
-        return 1;
-    }
-
-    const char *pids = argv[1];
-    char *end;
-    long pid = strtol(pids, &end, 10);
-    if (!pids[0] || *end) {
-        ib_log("pid not an integer");
-        return 1;
-    }
-
-    const char *should_resume = argv[2];
-    if (strcmp(should_resume, "0") && strcmp(should_resume, "1")) {
-        ib_log("should_resume not 0 or 1");
-        return 1;
-    }
-
-    const char *is_exec = argv[3];
-    if (strcmp(is_exec, "0") && strcmp(is_exec, "1")) {
-        ib_log("is_exec not 0 or 1");
-        return 1;
-    }
-
-    /* double fork to avoid zombies */
-    int ret = fork();
-    if (ret == -1) {
-        ib_log("fork: %s", strerror(errno));
-        return 1;
-    } else if (ret) {
-        return 0;
-    }
-
+static int unrestrict_pid(long pid, const char *should_resume,
+                          const char *is_exec) {
     if (IB_VERBOSE) {
         ib_log("unrestricting %ld (sr=%s, ie=%s)", pid,
                should_resume, is_exec);
@@ -246,6 +239,7 @@ int main(int argc, char **argv) {
         ib_log("note: ready after %d retries", retries);
 
     unrestrict(task);
+    mach_port_deallocate(mach_task_self(), task);
 
     rv = 0;
 fail:
@@ -258,3 +252,47 @@ fail:
 
     return rv;
 }
+
+int main(int argc, char **argv) {
+    if (argc < 4 || (argc - 1) % 3) {
+        ib_log("wrong number of args");
+        return 1;
+    }
+
+    for (int i = 1; i < argc; i += 3) {
+        const char *pids = argv[i];
+        char *end;
+        strtol(pids, &end, 10);
+        if (!pids[0] || *end) {
+            ib_log("pid not an integer");
+            return 1;
+        }
+
+        const char *should_resume = argv[i + 1];
+        if (strcmp(should_resume, "0") && strcmp(should_resume, "1")) {
+            ib_log("should_resume not 0 or 1");
+            return 1;
+        }
+
+        const char *is_exec = argv[i + 2];
+        if (strcmp(is_exec, "0") && strcmp(is_exec, "1")) {
+            ib_log("is_exec not 0 or 1");
+            return 1;
+        }
+    }
+
+    /* double fork to avoid zombies */
+    int ret = fork();
+    if (ret == -1) {
+        ib_log("fork: %s", strerror(errno));
+        return 1;
+    } else if (ret) {
+        return 0;
+    }
+
+    int rv = 0;
+    for (int i = 1; i < argc; i += 3)
+        rv |= unrestrict_pid(strtol(argv[i], NULL, 10), argv[i + 1],
+                             argv[i + 2]);
+    return rv;
+}
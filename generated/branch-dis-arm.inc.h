@@ -0,0 +1,407 @@
+/* Generated code; do not edit!
+   generated by script/gen-branch-dis.py from generic-dis-arm.inc.h
+   (the same decoder, except that anything which can't lead to
+    P(branch), P(pcrel), P(ret), P(bad), P(thumb_it)
+    is folded into P(unidentified))
+*/
+
+    switch ((op >> 20) & 0x1f) {
+    case 0: {
+        switch ((op >> 25) & 0x7) {
+        case 1: {
+            if ((op & 0xf3f0000) == 0x20f0000) {
+                insn_adrlabel_label_unk_Rd_1_ADR:;
+                struct bitslice label = {.nruns = 2, .runs = (struct bitslice_run[]) {{0,0,12}, {22,12,2}}};
+                struct bitslice Rd = {.nruns = 1, .runs = (struct bitslice_run[]) {{12,0,4}}};
+                return P(adrlabel_label_unk_Rd_1_ADR)(ctx, label, Rd); /* 0x020f0000 | 0xf0c0ffff */
+            } else {
+                return P(unidentified)(ctx);
+            }
+        }
+        case 4: {
+            insn_GPR_Rn_reglist_regs_S_16_STMDA:;
+            struct bitslice regs = {.nruns = 1, .runs = (struct bitslice_run[]) {{0,0,16}}};
+            struct bitslice Rn = {.nruns = 1, .runs = (struct bitslice_run[]) {{16,0,4}}};
+            return P(GPR_Rn_reglist_regs_S_16_STMDA)(ctx, regs, Rn); /* 0x08000000 | 0xf1efffff */
+        }
+        case 5: {
+            insn_br_target_target_pred_p_B_1_Bcc:;
+            struct bitslice target = {.nruns = 1, .runs = (struct bitslice_run[]) {{0,0,24}}};
+            struct bitslice p = {.nruns = 1, .runs = (struct bitslice_run[]) {{28,0,4}}};
+            return P(br_target_target_pred_p_B_1_Bcc)(ctx, target, p); /* 0x0a000000 | 0xf0ffffff */
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 1: {
+        switch ((op >> 26) & 0x3) {
+        case 2: {
+            switch ((op >> 25) & 0x1) {
+            case 0: {
+                insn_GPR_Rn_reglist_regs_16_LDMDA:;
+                struct bitslice regs = {.nruns = 1, .runs = (struct bitslice_run[]) {{0,0,16}}};
+                struct bitslice Rn = {.nruns = 1, .runs = (struct bitslice_run[]) {{16,0,4}}};
+                return P(GPR_Rn_reglist_regs_16_LDMDA)(ctx, regs, Rn); /* 0x08100000 | 0xf1efffff */
+            }
+            case 1:
+                goto insn_br_target_target_pred_p_B_1_Bcc; /* 0x0a000000 | 0xf0ffffff */
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 2:
+    case 10: {
+        switch ((op >> 25) & 0x7) {
+        case 4:
+            goto insn_GPR_Rn_reglist_regs_S_16_STMDA; /* 0x08000000 | 0xf1efffff */
+        case 5:
+            goto insn_br_target_target_pred_p_B_1_Bcc; /* 0x0a000000 | 0xf0ffffff */
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 3:
+    case 11: {
+        switch ((op >> 26) & 0x3) {
+        case 2: {
+            switch ((op >> 25) & 0x1) {
+            case 0:
+                goto insn_GPR_Rn_reglist_regs_16_LDMDA; /* 0x08100000 | 0xf1efffff */
+            case 1:
+                goto insn_br_target_target_pred_p_B_1_Bcc; /* 0x0a000000 | 0xf0ffffff */
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 4: {
+        switch ((op >> 25) & 0x7) {
+        case 1: {
+            if ((op & 0xf3f0000) == 0x20f0000) {
+                goto insn_adrlabel_label_unk_Rd_1_ADR; /* 0x020f0000 | 0xf0c0ffff */
+            } else {
+                return P(unidentified)(ctx);
+            }
+        }
+        case 4:
+            goto insn_GPR_Rn_reglist_regs_S_16_STMDA; /* 0x08000000 | 0xf1efffff */
+        case 5:
+            goto insn_br_target_target_pred_p_B_1_Bcc; /* 0x0a000000 | 0xf0ffffff */
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 5: {
+        switch ((op >> 25) & 0x7) {
+        case 4:
+            goto insn_GPR_Rn_reglist_regs_16_LDMDA; /* 0x08100000 | 0xf1efffff */
+        case 5:
+            goto insn_br_target_target_pred_p_B_1_Bcc; /* 0x0a000000 | 0xf0ffffff */
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 6:
+    case 14: {
+        switch ((op >> 25) & 0x7) {
+        case 4:
+            goto insn_GPR_Rn_reglist_regs_S_16_STMDA; /* 0x08000000 | 0xf1efffff */
+        case 5:
+            goto insn_br_target_target_pred_p_B_1_Bcc; /* 0x0a000000 | 0xf0ffffff */
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 7:
+    case 15: {
+        switch ((op >> 26) & 0x3) {
+        case 2: {
+            switch ((op >> 25) & 0x1) {
+            case 0:
+                goto insn_GPR_Rn_reglist_regs_16_LDMDA; /* 0x08100000 | 0xf1efffff */
+            case 1:
+                goto insn_br_target_target_pred_p_B_1_Bcc; /* 0x0a000000 | 0xf0ffffff */
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 8: {
+        switch ((op >> 25) & 0x7) {
+        case 1: {
+            switch ((op >> 16) & 0xf) {
+            case 15:
+                goto insn_adrlabel_label_unk_Rd_1_ADR; /* 0x020f0000 | 0xf0c0ffff */
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        case 4:
+            goto insn_GPR_Rn_reglist_regs_S_16_STMDA; /* 0x08000000 | 0xf1efffff */
+        case 5:
+            goto insn_br_target_target_pred_p_B_1_Bcc; /* 0x0a000000 | 0xf0ffffff */
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 9: {
+        switch ((op >> 25) & 0x7) {
+        case 4:
+            goto insn_GPR_Rn_reglist_regs_16_LDMDA; /* 0x08100000 | 0xf1efffff */
+        case 5:
+            goto insn_br_target_target_pred_p_B_1_Bcc; /* 0x0a000000 | 0xf0ffffff */
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 12: {
+        switch ((op >> 25) & 0x7) {
+        case 1: {
+            if ((op & 0xf3f0000) == 0x20f0000) {
+                goto insn_adrlabel_label_unk_Rd_1_ADR; /* 0x020f0000 | 0xf0c0ffff */
+            } else {
+                return P(unidentified)(ctx);
+            }
+        }
+        case 4:
+            goto insn_GPR_Rn_reglist_regs_S_16_STMDA; /* 0x08000000 | 0xf1efffff */
+        case 5:
+            goto insn_br_target_target_pred_p_B_1_Bcc; /* 0x0a000000 | 0xf0ffffff */
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 13: {
+        switch ((op >> 26) & 0x3) {
+        case 2: {
+            switch ((op >> 25) & 0x1) {
+            case 0:
+                goto insn_GPR_Rn_reglist_regs_16_LDMDA; /* 0x08100000 | 0xf1efffff */
+            case 1:
+                goto insn_br_target_target_pred_p_B_1_Bcc; /* 0x0a000000 | 0xf0ffffff */
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 16: {
+        switch ((op >> 25) & 0x7) {
+        case 4:
+            goto insn_GPR_Rn_reglist_regs_S_16_STMDA; /* 0x08000000 | 0xf1efffff */
+        case 5: {
+            insn_bl_target_func_2_BL:;
+            struct bitslice func = {.nruns = 1, .runs = (struct bitslice_run[]) {{0,0,24}}};
+            return P(bl_target_func_2_BL)(ctx, func); /* 0x0b000000 | 0xf0ffffff */
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 17:
+    case 21: {
+        switch ((op >> 26) & 0x3) {
+        case 2: {
+            switch ((op >> 25) & 0x1) {
+            case 0:
+                goto insn_GPR_Rn_reglist_regs_16_LDMDA; /* 0x08100000 | 0xf1efffff */
+            case 1:
+                goto insn_bl_target_func_2_BL; /* 0x0b000000 | 0xf0ffffff */
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 18: {
+        switch ((op >> 26) & 0x3) {
+        case 0: {
+            switch ((op >> 5) & 0x7) {
+            case 0: {
+                if ((op & 0xffffff0) == 0x12fff10) {
+                    struct bitslice dst = {.nruns = 1, .runs = (struct bitslice_run[]) {{0,0,4}}};
+                    return P(GPR_dst_B_2_BX)(ctx, dst); /* 0x012fff10 | 0xf000000f */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        case 2: {
+            switch ((op >> 25) & 0x1) {
+            case 0:
+                goto insn_GPR_Rn_reglist_regs_S_16_STMDA; /* 0x08000000 | 0xf1efffff */
+            case 1:
+                goto insn_bl_target_func_2_BL; /* 0x0b000000 | 0xf0ffffff */
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 19:
+    case 23: {
+        switch ((op >> 26) & 0x3) {
+        case 2: {
+            switch ((op >> 25) & 0x1) {
+            case 0:
+                goto insn_GPR_Rn_reglist_regs_16_LDMDA; /* 0x08100000 | 0xf1efffff */
+            case 1:
+                goto insn_bl_target_func_2_BL; /* 0x0b000000 | 0xf0ffffff */
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 20: {
+        switch ((op >> 25) & 0x7) {
+        case 4:
+            goto insn_GPR_Rn_reglist_regs_S_16_STMDA; /* 0x08000000 | 0xf1efffff */
+        case 5:
+            goto insn_bl_target_func_2_BL; /* 0x0b000000 | 0xf0ffffff */
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 22: {
+        switch ((op >> 26) & 0x3) {
+        case 2: {
+            switch ((op >> 25) & 0x1) {
+            case 0:
+                goto insn_GPR_Rn_reglist_regs_S_16_STMDA; /* 0x08000000 | 0xf1efffff */
+            case 1:
+                goto insn_bl_target_func_2_BL; /* 0x0b000000 | 0xf0ffffff */
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 24: {
+        switch ((op >> 26) & 0x3) {
+        case 2: {
+            switch ((op >> 25) & 0x1) {
+            case 0:
+                goto insn_GPR_Rn_reglist_regs_S_16_STMDA; /* 0x08000000 | 0xf1efffff */
+            case 1:
+                goto insn_bl_target_func_2_BL; /* 0x0b000000 | 0xf0ffffff */
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 25:
+    case 29: {
+        switch ((op >> 26) & 0x3) {
+        case 2: {
+            switch ((op >> 25) & 0x1) {
+            case 0:
+                goto insn_GPR_Rn_reglist_regs_16_LDMDA; /* 0x08100000 | 0xf1efffff */
+            case 1:
+                goto insn_bl_target_func_2_BL; /* 0x0b000000 | 0xf0ffffff */
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 26: {
+        switch ((op >> 25) & 0x7) {
+        case 4:
+            goto insn_GPR_Rn_reglist_regs_S_16_STMDA; /* 0x08000000 | 0xf1efffff */
+        case 5:
+            goto insn_bl_target_func_2_BL; /* 0x0b000000 | 0xf0ffffff */
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 27: {
+        switch ((op >> 25) & 0x7) {
+        case 4:
+            goto insn_GPR_Rn_reglist_regs_16_LDMDA; /* 0x08100000 | 0xf1efffff */
+        case 5:
+            goto insn_bl_target_func_2_BL; /* 0x0b000000 | 0xf0ffffff */
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 28: {
+        switch ((op >> 26) & 0x3) {
+        case 2: {
+            switch ((op >> 25) & 0x1) {
+            case 0:
+                goto insn_GPR_Rn_reglist_regs_S_16_STMDA; /* 0x08000000 | 0xf1efffff */
+            case 1:
+                goto insn_bl_target_func_2_BL; /* 0x0b000000 | 0xf0ffffff */
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 30: {
+        switch ((op >> 26) & 0x3) {
+        case 2: {
+            switch ((op >> 25) & 0x1) {
+            case 0:
+                goto insn_GPR_Rn_reglist_regs_S_16_STMDA; /* 0x08000000 | 0xf1efffff */
+            case 1:
+                goto insn_bl_target_func_2_BL; /* 0x0b000000 | 0xf0ffffff */
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 31: {
+        switch ((op >> 26) & 0x3) {
+        case 2: {
+            switch ((op >> 25) & 0x1) {
+            case 0:
+                goto insn_GPR_Rn_reglist_regs_16_LDMDA; /* 0x08100000 | 0xf1efffff */
+            case 1:
+                goto insn_bl_target_func_2_BL; /* 0x0b000000 | 0xf0ffffff */
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    default:
+        return P(unidentified)(ctx);
+    }
@@ -0,0 +1,135 @@
+/* Generated code; do not edit!
+   generated by script/gen-branch-dis.py from generic-dis-thumb.inc.h
+   (the same decoder, except that anything which can't lead to
+    P(branch), P(pcrel), P(ret), P(bad), P(thumb_it)
+    is folded into P(unidentified))
+*/
+
+    switch ((op >> 9) & 0x1f) {
+    case 3: {
+        switch ((op >> 7) & 0x3) {
+        case 0:
+        case 1: {
+            switch ((op >> 15) & 0x1) {
+            case 0: {
+                if ((op & 0xffffff00) == 0x4600) {
+                    struct bitslice Rd = {.nruns = 2, .runs = (struct bitslice_run[]) {{0,0,3}, {7,3,1}}};
+                    struct bitslice Rm = {.nruns = 1, .runs = (struct bitslice_run[]) {{3,0,4}}};
+                    return P(GPR_Rm_unk_Rd_1_tMOVr)(ctx, Rd, Rm); /* 0x00004600 | 0x000000ff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        case 2: {
+            switch ((op >> 15) & 0x1) {
+            case 0: {
+                if ((op & 0xffffff87) == 0x4700) {
+                    struct bitslice Rm = {.nruns = 1, .runs = (struct bitslice_run[]) {{3,0,4}}};
+                    return P(GPR_Rm_B_1_tBX)(ctx, Rm); /* 0x00004700 | 0x00000078 */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 4:
+    case 5:
+    case 6:
+    case 7: {
+        switch ((op >> 15) & 0x1) {
+        case 0: {
+            if ((op & 0xfffff800) == 0x4800) {
+                struct bitslice addr = {.nruns = 1, .runs = (struct bitslice_run[]) {{0,0,8}}};
+                struct bitslice Rt = {.nruns = 1, .runs = (struct bitslice_run[]) {{8,0,3}}};
+                return P(t_addrmode_pc_addr_unk_Rt_1_tLDRpci)(ctx, addr, Rt); /* 0x00004800 | 0x000007ff */
+            } else {
+                return P(unidentified)(ctx);
+            }
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 8:
+    case 9:
+    case 10:
+    case 11:
+    case 12:
+    case 13:
+    case 14:
+    case 15: {
+        if ((op & 0xfffff000) == 0xd000) {
+            struct bitslice target = {.nruns = 1, .runs = (struct bitslice_run[]) {{0,0,8}}};
+            struct bitslice p = {.nruns = 1, .runs = (struct bitslice_run[]) {{8,0,4}}};
+            return P(t_bcctarget_target_pred_p_B_1_tBcc)(ctx, target, p); /* 0x0000d000 | 0x00000fff */
+        } else {
+            return P(unidentified)(ctx);
+        }
+    }
+    case 16:
+    case 17:
+    case 18:
+    case 19: {
+        switch ((op >> 14) & 0x1) {
+        case 0: {
+            if ((op & 0xfffff800) == 0xa000) {
+                struct bitslice addr = {.nruns = 1, .runs = (struct bitslice_run[]) {{0,0,8}}};
+                struct bitslice Rd = {.nruns = 1, .runs = (struct bitslice_run[]) {{8,0,3}}};
+                return P(t_adrlabel_addr_unk_Rd_1_tADR)(ctx, addr, Rd); /* 0x0000a000 | 0x000007ff */
+            } else {
+                return P(unidentified)(ctx);
+            }
+        }
+        case 1: {
+            if ((op & 0xfffff800) == 0xe000) {
+                struct bitslice target = {.nruns = 1, .runs = (struct bitslice_run[]) {{0,0,11}}};
+                return P(t_brtarget_target_B_1_tB)(ctx, target); /* 0x0000e000 | 0x000007ff */
+            } else {
+                return P(unidentified)(ctx);
+            }
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 24:
+    case 25:
+    case 28:
+    case 29: {
+        if ((op & 0xfffff500) == 0xb100) {
+            struct bitslice target = {.nruns = 2, .runs = (struct bitslice_run[]) {{3,0,5}, {9,5,1}}};
+            return P(t_cbtarget_target_B_2_tCBNZ)(ctx, target); /* 0x0000b100 | 0x00000aff */
+        } else {
+            return P(unidentified)(ctx);
+        }
+    }
+    case 30: {
+        if ((op & 0xfffffe00) == 0xbc00) {
+            struct bitslice regs = {.nruns = 2, .runs = (struct bitslice_run[]) {{0,0,8}, {8,15,1}}};
+            return P(reglist_regs_1_tPOP)(ctx, regs); /* 0x0000bc00 | 0x000001ff */
+        } else {
+            return P(unidentified)(ctx);
+        }
+    }
+    case 31: {
+        if ((op & 0xffffff00) == 0xbf00) {
+            struct bitslice mask = {.nruns = 1, .runs = (struct bitslice_run[]) {{0,0,4}}};
+            struct bitslice cc = {.nruns = 1, .runs = (struct bitslice_run[]) {{4,0,4}}};
+            return P(it_pred_cc_it_mask_mask_1_t2IT)(ctx, mask, cc); /* 0x0000bf00 | 0x000000ff */
+        } else {
+            return P(unidentified)(ctx);
+        }
+    }
+    default:
+        return P(unidentified)(ctx);
+    }
@@ -0,0 +1,2117 @@
+/* Generated code; do not edit!
+   generated by script/gen-branch-dis.py from generic-dis-thumb2.inc.h
+   (the same decoder, except that anything which can't lead to
+    P(branch), P(pcrel), P(ret), P(bad), P(thumb_it)
+    is folded into P(unidentified))
+*/
+
+    switch ((op >> 20) & 0x1f) {
+    case 0: {
+        switch ((op >> 26) & 0x3) {
+        case 0:
+        case 1: {
+            switch ((op >> 14) & 0x3) {
+            case 0:
+            case 1: {
+                if ((op & 0xfb5f8000) == 0xf20f0000) {
+                    insn_t2adrlabel_addr_unk_Rd_1_t2ADR:;
+                    struct bitslice addr = {.nruns = 5, .runs = (struct bitslice_run[]) {{0,0,8}, {12,8,3}, {21,12,1}, {23,12,1}, {26,11,1}}};
+                    struct bitslice Rd = {.nruns = 1, .runs = (struct bitslice_run[]) {{8,0,4}}};
+                    return P(t2adrlabel_addr_unk_Rd_1_t2ADR)(ctx, addr, Rd); /* 0xf20f0000 | 0x04007fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 2: {
+                switch ((op >> 12) & 0x1) {
+                case 0: {
+                    if ((op & 0xf800d000) == 0xf0008000) {
+                        insn_brtarget_target_pred_p_B_1_t2Bcc:;
+                        struct bitslice target = {.nruns = 5, .runs = (struct bitslice_run[]) {{0,1,11}, {11,19,1}, {13,18,1}, {16,12,6}, {26,20,1}}};
+                        struct bitslice p = {.nruns = 1, .runs = (struct bitslice_run[]) {{22,0,4}}};
+                        return P(brtarget_target_pred_p_B_1_t2Bcc)(ctx, target, p); /* 0xf0008000 | 0x07ff2fff */
+                    } else {
+                        return P(unidentified)(ctx);
+                    }
+                }
+                case 1: {
+                    if ((op & 0xf800d000) == 0xf0009000) {
+                        insn_uncondbrtarget_target_B_1_t2B:;
+                        struct bitslice target = {.nruns = 5, .runs = (struct bitslice_run[]) {{0,0,11}, {11,21,1}, {13,22,1}, {16,11,10}, {26,23,1}}};
+                        return P(uncondbrtarget_target_B_1_t2B)(ctx, target); /* 0xf0009000 | 0x07ff2fff */
+                    } else {
+                        return P(unidentified)(ctx);
+                    }
+                }
+                default:
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 3: {
+                switch ((op >> 12) & 0x1) {
+                case 0: {
+                    if ((op & 0xf800d001) == 0xf000c000) {
+                        insn_t_blxtarget_func_1_tBLXi:;
+                        struct bitslice func = {.nruns = 5, .runs = (struct bitslice_run[]) {{1,1,10}, {11,21,1}, {13,22,1}, {16,11,10}, {26,23,1}}};
+                        return P(t_blxtarget_func_1_tBLXi)(ctx, func); /* 0xf000c000 | 0x07ff2ffe */
+                    } else {
+                        return P(unidentified)(ctx);
+                    }
+                }
+                case 1: {
+                    if ((op & 0xf800d000) == 0xf000d000) {
+                        insn_t_bltarget_func_1_tBL:;
+                        struct bitslice func = {.nruns = 5, .runs = (struct bitslice_run[]) {{0,0,11}, {11,21,1}, {13,22,1}, {16,11,10}, {26,23,1}}};
+                        return P(t_bltarget_func_1_tBL)(ctx, func); /* 0xf000d000 | 0x07ff2fff */
+                    } else {
+                        return P(unidentified)(ctx);
+                    }
+                }
+                default:
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 1: {
+        switch ((op >> 26) & 0x3) {
+        case 0:
+        case 1: {
+            switch ((op >> 12) & 0x7) {
+            case 0:
+            case 2: {
+                if ((op & 0xf800d000) == 0xf0008000) {
+                    goto insn_brtarget_target_pred_p_B_1_t2Bcc; /* 0xf0008000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 1:
+            case 3: {
+                if ((op & 0xf800d000) == 0xf0009000) {
+                    goto insn_uncondbrtarget_target_B_1_t2B; /* 0xf0009000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 4:
+            case 6: {
+                if ((op & 0xf800d001) == 0xf000c000) {
+                    goto insn_t_blxtarget_func_1_tBLXi; /* 0xf000c000 | 0x07ff2ffe */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 5:
+            case 7: {
+                if ((op & 0xf800d000) == 0xf000d000) {
+                    goto insn_t_bltarget_func_1_tBL; /* 0xf000d000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        case 2: {
+            switch ((op >> 8) & 0x7) {
+            case 0: {
+                if ((op & 0xfed00fc0) == 0xf8100000) {
+                    return P(unidentified)(ctx);
+                } else {
+                    if ((op & 0xfe5f0000) == 0xf81f0000) {
+                        insn_t2ldrlabel_addr_unk_Rt_5_t2LDRBpci:;
+                        struct bitslice addr = {.nruns = 2, .runs = (struct bitslice_run[]) {{0,0,12}, {23,12,1}}};
+                        struct bitslice Rt = {.nruns = 1, .runs = (struct bitslice_run[]) {{12,0,4}}};
+                        return P(t2ldrlabel_addr_unk_Rt_5_t2LDRBpci)(ctx, addr, Rt); /* 0xf81f0000 | 0x0120f8ff */
+                    } else {
+                        return P(unidentified)(ctx);
+                    }
+                }
+            }
+            case 1:
+            case 3: {
+                switch ((op >> 11) & 0x1) {
+                case 0: {
+                    if ((op & 0xfe5f0000) == 0xf81f0000) {
+                        goto insn_t2ldrlabel_addr_unk_Rt_5_t2LDRBpci; /* 0xf81f0000 | 0x01a0ffff */
+                    } else {
+                        return P(unidentified)(ctx);
+                    }
+                }
+                default:
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 2: {
+                if ((op & 0xfe5f0000) == 0xf81f0000) {
+                    goto insn_t2ldrlabel_addr_unk_Rt_5_t2LDRBpci; /* 0xf81f0000 | 0x01a0ffff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 4: {
+                switch ((op >> 11) & 0x1) {
+                case 0: {
+                    if ((op & 0xfe5f0000) == 0xf81f0000) {
+                        goto insn_t2ldrlabel_addr_unk_Rt_5_t2LDRBpci; /* 0xf81f0000 | 0x01a0ffff */
+                    } else {
+                        return P(unidentified)(ctx);
+                    }
+                }
+                default:
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 5:
+            case 7: {
+                switch ((op >> 11) & 0x1) {
+                case 0: {
+                    if ((op & 0xfe5f0000) == 0xf81f0000) {
+                        goto insn_t2ldrlabel_addr_unk_Rt_5_t2LDRBpci; /* 0xf81f0000 | 0x01a0ffff */
+                    } else {
+                        return P(unidentified)(ctx);
+                    }
+                }
+                default:
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 6: {
+                switch ((op >> 11) & 0x1) {
+                case 0: {
+                    if ((op & 0xfe5f0000) == 0xf81f0000) {
+                        goto insn_t2ldrlabel_addr_unk_Rt_5_t2LDRBpci; /* 0xf81f0000 | 0x01a0ffff */
+                    } else {
+                        return P(unidentified)(ctx);
+                    }
+                }
+                default:
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 2: {
+        switch ((op >> 26) & 0x3) {
+        case 0:
+        case 1: {
+            switch ((op >> 12) & 0xf) {
+            case 0:
+            case 1:
+            case 2:
+            case 3:
+            case 4:
+            case 5:
+            case 6:
+            case 7: {
+                if ((op & 0xfb5f8000) == 0xf20f0000) {
+                    goto insn_t2adrlabel_addr_unk_Rd_1_t2ADR; /* 0xf22f0000 | 0x04007fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 8:
+            case 10: {
+                if ((op & 0xf800d000) == 0xf0008000) {
+                    goto insn_brtarget_target_pred_p_B_1_t2Bcc; /* 0xf0008000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 9:
+            case 11: {
+                if ((op & 0xf800d000) == 0xf0009000) {
+                    goto insn_uncondbrtarget_target_B_1_t2B; /* 0xf0009000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 12:
+            case 14: {
+                if ((op & 0xf800d001) == 0xf000c000) {
+                    goto insn_t_blxtarget_func_1_tBLXi; /* 0xf000c000 | 0x07ff2ffe */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 13:
+            case 15: {
+                if ((op & 0xf800d000) == 0xf000d000) {
+                    goto insn_t_bltarget_func_1_tBL; /* 0xf000d000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 3: {
+        switch ((op >> 26) & 0x3) {
+        case 0:
+        case 1: {
+            switch ((op >> 12) & 0x7) {
+            case 0:
+            case 2: {
+                if ((op & 0xf800d000) == 0xf0008000) {
+                    goto insn_brtarget_target_pred_p_B_1_t2Bcc; /* 0xf0008000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 1:
+            case 3: {
+                if ((op & 0xf800d000) == 0xf0009000) {
+                    goto insn_uncondbrtarget_target_B_1_t2B; /* 0xf0009000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 4:
+            case 6: {
+                if ((op & 0xf800d001) == 0xf000c000) {
+                    goto insn_t_blxtarget_func_1_tBLXi; /* 0xf000c000 | 0x07ff2ffe */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 5:
+            case 7: {
+                if ((op & 0xf800d000) == 0xf000d000) {
+                    goto insn_t_bltarget_func_1_tBL; /* 0xf000d000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        case 2: {
+            switch ((op >> 8) & 0x7) {
+            case 0: {
+                if ((op & 0xfed00fc0) == 0xf8100000) {
+                    return P(unidentified)(ctx);
+                } else {
+                    if ((op & 0xfe5f0000) == 0xf81f0000) {
+                        goto insn_t2ldrlabel_addr_unk_Rt_5_t2LDRBpci; /* 0xf81f0000 | 0x0120f8ff */
+                    } else {
+                        return P(unidentified)(ctx);
+                    }
+                }
+            }
+            case 1:
+            case 3: {
+                switch ((op >> 11) & 0x1) {
+                case 0: {
+                    if ((op & 0xfe5f0000) == 0xf81f0000) {
+                        goto insn_t2ldrlabel_addr_unk_Rt_5_t2LDRBpci; /* 0xf81f0000 | 0x01a0ffff */
+                    } else {
+                        return P(unidentified)(ctx);
+                    }
+                }
+                default:
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 2: {
+                if ((op & 0xfe5f0000) == 0xf81f0000) {
+                    goto insn_t2ldrlabel_addr_unk_Rt_5_t2LDRBpci; /* 0xf81f0000 | 0x01a0ffff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 4: {
+                switch ((op >> 11) & 0x1) {
+                case 0: {
+                    if ((op & 0xfe5f0000) == 0xf81f0000) {
+                        goto insn_t2ldrlabel_addr_unk_Rt_5_t2LDRBpci; /* 0xf81f0000 | 0x01a0ffff */
+                    } else {
+                        return P(unidentified)(ctx);
+                    }
+                }
+                default:
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 5:
+            case 7: {
+                switch ((op >> 11) & 0x1) {
+                case 0: {
+                    if ((op & 0xfe5f0000) == 0xf81f0000) {
+                        goto insn_t2ldrlabel_addr_unk_Rt_5_t2LDRBpci; /* 0xf81f0000 | 0x01a0ffff */
+                    } else {
+                        return P(unidentified)(ctx);
+                    }
+                }
+                default:
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 6: {
+                switch ((op >> 11) & 0x1) {
+                case 0: {
+                    if ((op & 0xfe5f0000) == 0xf81f0000) {
+                        goto insn_t2ldrlabel_addr_unk_Rt_5_t2LDRBpci; /* 0xf81f0000 | 0x01a0ffff */
+                    } else {
+                        return P(unidentified)(ctx);
+                    }
+                }
+                default:
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 4: {
+        switch ((op >> 25) & 0xf) {
+        case 8:
+        case 10: {
+            switch ((op >> 12) & 0xf) {
+            case 8:
+            case 10: {
+                if ((op & 0xf800d000) == 0xf0008000) {
+                    goto insn_brtarget_target_pred_p_B_1_t2Bcc; /* 0xf0008000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 9:
+            case 11: {
+                if ((op & 0xf800d000) == 0xf0009000) {
+                    goto insn_uncondbrtarget_target_B_1_t2B; /* 0xf0009000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 12:
+            case 14: {
+                if ((op & 0xf800d001) == 0xf000c000) {
+                    goto insn_t_blxtarget_func_1_tBLXi; /* 0xf000c000 | 0x07ff2ffe */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 13:
+            case 15: {
+                if ((op & 0xf800d000) == 0xf000d000) {
+                    goto insn_t_bltarget_func_1_tBL; /* 0xf000d000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        case 9:
+        case 11: {
+            switch ((op >> 12) & 0xf) {
+            case 8:
+            case 10: {
+                if ((op & 0xf800d000) == 0xf0008000) {
+                    goto insn_brtarget_target_pred_p_B_1_t2Bcc; /* 0xf0008000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 9:
+            case 11: {
+                if ((op & 0xf800d000) == 0xf0009000) {
+                    goto insn_uncondbrtarget_target_B_1_t2B; /* 0xf0009000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 12:
+            case 14: {
+                if ((op & 0xf800d001) == 0xf000c000) {
+                    goto insn_t_blxtarget_func_1_tBLXi; /* 0xf000c000 | 0x07ff2ffe */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 13:
+            case 15: {
+                if ((op & 0xf800d000) == 0xf000d000) {
+                    goto insn_t_bltarget_func_1_tBL; /* 0xf000d000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 5: {
+        switch ((op >> 26) & 0x7) {
+        case 4:
+        case 5: {
+            switch ((op >> 12) & 0xf) {
+            case 8:
+            case 10: {
+                if ((op & 0xf800d000) == 0xf0008000) {
+                    goto insn_brtarget_target_pred_p_B_1_t2Bcc; /* 0xf0008000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 9:
+            case 11: {
+                if ((op & 0xf800d000) == 0xf0009000) {
+                    goto insn_uncondbrtarget_target_B_1_t2B; /* 0xf0009000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 12:
+            case 14: {
+                if ((op & 0xf800d001) == 0xf000c000) {
+                    goto insn_t_blxtarget_func_1_tBLXi; /* 0xf000c000 | 0x07ff2ffe */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 13:
+            case 15: {
+                if ((op & 0xf800d000) == 0xf000d000) {
+                    goto insn_t_bltarget_func_1_tBL; /* 0xf000d000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        case 6: {
+            switch ((op >> 8) & 0x7) {
+            case 0: {
+                if ((op & 0xfff00fc0) == 0xf8500000) {
+                    return P(unidentified)(ctx);
+                } else {
+                    if ((op & 0xff7f0000) == 0xf85f0000) {
+                        goto insn_t2ldrlabel_addr_unk_Rt_5_t2LDRBpci; /* 0xf85f0000 | 0x0000f8ff */
+                    } else {
+                        return P(unidentified)(ctx);
+                    }
+                }
+            }
+            case 1:
+            case 3: {
+                switch ((op >> 11) & 0x1) {
+                case 0: {
+                    if ((op & 0xff7f0000) == 0xf85f0000) {
+                        goto insn_t2ldrlabel_addr_unk_Rt_5_t2LDRBpci; /* 0xf85f0000 | 0x0080ffff */
+                    } else {
+                        return P(unidentified)(ctx);
+                    }
+                }
+                default:
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 2: {
+                if ((op & 0xff7f0000) == 0xf85f0000) {
+                    goto insn_t2ldrlabel_addr_unk_Rt_5_t2LDRBpci; /* 0xf85f0000 | 0x0080ffff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 4: {
+                switch ((op >> 11) & 0x1) {
+                case 0: {
+                    if ((op & 0xff7f0000) == 0xf85f0000) {
+                        goto insn_t2ldrlabel_addr_unk_Rt_5_t2LDRBpci; /* 0xf85f0000 | 0x0080ffff */
+                    } else {
+                        return P(unidentified)(ctx);
+                    }
+                }
+                default:
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 5:
+            case 7: {
+                switch ((op >> 11) & 0x1) {
+                case 0: {
+                    if ((op & 0xff7f0000) == 0xf85f0000) {
+                        goto insn_t2ldrlabel_addr_unk_Rt_5_t2LDRBpci; /* 0xf85f0000 | 0x0080ffff */
+                    } else {
+                        return P(unidentified)(ctx);
+                    }
+                }
+                default:
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 6: {
+                switch ((op >> 11) & 0x1) {
+                case 0: {
+                    if ((op & 0xff7f0000) == 0xf85f0000) {
+                        goto insn_t2ldrlabel_addr_unk_Rt_5_t2LDRBpci; /* 0xf85f0000 | 0x0080ffff */
+                    } else {
+                        return P(unidentified)(ctx);
+                    }
+                }
+                default:
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 6:
+    case 14: {
+        switch ((op >> 27) & 0x1) {
+        case 0: {
+            switch ((op >> 12) & 0x7) {
+            case 0:
+            case 2: {
+                if ((op & 0xf800d000) == 0xf0008000) {
+                    goto insn_brtarget_target_pred_p_B_1_t2Bcc; /* 0xf0008000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 1:
+            case 3: {
+                if ((op & 0xf800d000) == 0xf0009000) {
+                    goto insn_uncondbrtarget_target_B_1_t2B; /* 0xf0009000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 4:
+            case 6: {
+                if ((op & 0xf800d001) == 0xf000c000) {
+                    goto insn_t_blxtarget_func_1_tBLXi; /* 0xf000c000 | 0x07ff2ffe */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 5:
+            case 7: {
+                if ((op & 0xf800d000) == 0xf000d000) {
+                    goto insn_t_bltarget_func_1_tBL; /* 0xf000d000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 7: {
+        switch ((op >> 27) & 0x1) {
+        case 0: {
+            switch ((op >> 12) & 0x7) {
+            case 0:
+            case 2: {
+                if ((op & 0xf800d000) == 0xf0008000) {
+                    goto insn_brtarget_target_pred_p_B_1_t2Bcc; /* 0xf0008000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 1:
+            case 3: {
+                if ((op & 0xf800d000) == 0xf0009000) {
+                    goto insn_uncondbrtarget_target_B_1_t2B; /* 0xf0009000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 4:
+            case 6: {
+                if ((op & 0xf800d001) == 0xf000c000) {
+                    goto insn_t_blxtarget_func_1_tBLXi; /* 0xf000c000 | 0x07ff2ffe */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 5:
+            case 7: {
+                if ((op & 0xf800d000) == 0xf000d000) {
+                    goto insn_t_bltarget_func_1_tBL; /* 0xf000d000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 8: {
+        switch ((op >> 27) & 0x1) {
+        case 0: {
+            switch ((op >> 12) & 0xf) {
+            case 0:
+            case 1:
+            case 2:
+            case 3:
+            case 4:
+            case 5:
+            case 6:
+            case 7: {
+                if ((op & 0xfb5f8000) == 0xf20f0000) {
+                    goto insn_t2adrlabel_addr_unk_Rd_1_t2ADR; /* 0xf28f0000 | 0x04007fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 8:
+            case 10: {
+                if ((op & 0xf800d000) == 0xf0008000) {
+                    goto insn_brtarget_target_pred_p_B_1_t2Bcc; /* 0xf0008000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 9:
+            case 11: {
+                if ((op & 0xf800d000) == 0xf0009000) {
+                    goto insn_uncondbrtarget_target_B_1_t2B; /* 0xf0009000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 12:
+            case 14: {
+                if ((op & 0xf800d001) == 0xf000c000) {
+                    goto insn_t_blxtarget_func_1_tBLXi; /* 0xf000c000 | 0x07ff2ffe */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 13:
+            case 15: {
+                if ((op & 0xf800d000) == 0xf000d000) {
+                    goto insn_t_bltarget_func_1_tBL; /* 0xf000d000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 9: {
+        switch ((op >> 26) & 0x3) {
+        case 0:
+        case 1: {
+            switch ((op >> 12) & 0x7) {
+            case 0:
+            case 2: {
+                if ((op & 0xf800d000) == 0xf0008000) {
+                    goto insn_brtarget_target_pred_p_B_1_t2Bcc; /* 0xf0008000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 1:
+            case 3: {
+                if ((op & 0xf800d000) == 0xf0009000) {
+                    goto insn_uncondbrtarget_target_B_1_t2B; /* 0xf0009000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 4:
+            case 6: {
+                if ((op & 0xf800d001) == 0xf000c000) {
+                    goto insn_t_blxtarget_func_1_tBLXi; /* 0xf000c000 | 0x07ff2ffe */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 5:
+            case 7: {
+                if ((op & 0xf800d000) == 0xf000d000) {
+                    goto insn_t_bltarget_func_1_tBL; /* 0xf000d000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        case 2: {
+            switch ((op >> 28) & 0x1) {
+            case 0: {
+                if ((op & 0xffd00000) == 0xe8900000) {
+                    insn_GPR_Rn_reglist_regs_4_t2LDMDB:;
+                    struct bitslice regs = {.nruns = 1, .runs = (struct bitslice_run[]) {{0,0,16}}};
+                    struct bitslice Rn = {.nruns = 1, .runs = (struct bitslice_run[]) {{16,0,4}}};
+                    return P(GPR_Rn_reglist_regs_4_t2LDMDB)(ctx, regs, Rn); /* 0xe8900000 | 0x002fffff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 1: {
+                switch ((op >> 16) & 0xf) {
+                case 15: {
+                    if ((op & 0xfe5f0000) == 0xf81f0000) {
+                        goto insn_t2ldrlabel_addr_unk_Rt_5_t2LDRBpci; /* 0xf81f0000 | 0x01a0ffff */
+                    } else {
+                        return P(unidentified)(ctx);
+                    }
+                }
+                default:
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 10: {
+        switch ((op >> 27) & 0x1) {
+        case 0: {
+            switch ((op >> 12) & 0xf) {
+            case 0:
+            case 1:
+            case 2:
+            case 3:
+            case 4:
+            case 5:
+            case 6:
+            case 7: {
+                if ((op & 0xfb5f8000) == 0xf20f0000) {
+                    goto insn_t2adrlabel_addr_unk_Rd_1_t2ADR; /* 0xf2af0000 | 0x04007fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 8:
+            case 10: {
+                if ((op & 0xf800d000) == 0xf0008000) {
+                    goto insn_brtarget_target_pred_p_B_1_t2Bcc; /* 0xf0008000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 9:
+            case 11: {
+                if ((op & 0xf800d000) == 0xf0009000) {
+                    goto insn_uncondbrtarget_target_B_1_t2B; /* 0xf0009000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 12:
+            case 14: {
+                if ((op & 0xf800d001) == 0xf000c000) {
+                    goto insn_t_blxtarget_func_1_tBLXi; /* 0xf000c000 | 0x07ff2ffe */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 13:
+            case 15: {
+                if ((op & 0xf800d000) == 0xf000d000) {
+                    goto insn_t_bltarget_func_1_tBL; /* 0xf000d000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 11: {
+        switch ((op >> 26) & 0x3) {
+        case 0:
+        case 1: {
+            switch ((op >> 12) & 0x7) {
+            case 0:
+            case 2: {
+                if ((op & 0xf800d000) == 0xf0008000) {
+                    goto insn_brtarget_target_pred_p_B_1_t2Bcc; /* 0xf0008000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 1:
+            case 3: {
+                if ((op & 0xf800d000) == 0xf0009000) {
+                    goto insn_uncondbrtarget_target_B_1_t2B; /* 0xf0009000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 4:
+            case 6: {
+                if ((op & 0xf800d001) == 0xf000c000) {
+                    goto insn_t_blxtarget_func_1_tBLXi; /* 0xf000c000 | 0x07ff2ffe */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 5:
+            case 7: {
+                if ((op & 0xf800d000) == 0xf000d000) {
+                    goto insn_t_bltarget_func_1_tBL; /* 0xf000d000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        case 2: {
+            switch ((op >> 28) & 0x1) {
+            case 0: {
+                if ((op & 0xffd00000) == 0xe8900000) {
+                    goto insn_GPR_Rn_reglist_regs_4_t2LDMDB; /* 0xe8900000 | 0x002fffff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 1: {
+                switch ((op >> 16) & 0xf) {
+                case 15: {
+                    if ((op & 0xfe5f0000) == 0xf81f0000) {
+                        goto insn_t2ldrlabel_addr_unk_Rt_5_t2LDRBpci; /* 0xf81f0000 | 0x01a0ffff */
+                    } else {
+                        return P(unidentified)(ctx);
+                    }
+                }
+                default:
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 12: {
+        switch ((op >> 26) & 0x7) {
+        case 4:
+        case 5: {
+            switch ((op >> 12) & 0xf) {
+            case 8:
+            case 10: {
+                if ((op & 0xf800d000) == 0xf0008000) {
+                    goto insn_brtarget_target_pred_p_B_1_t2Bcc; /* 0xf0008000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 9:
+            case 11: {
+                if ((op & 0xf800d000) == 0xf0009000) {
+                    goto insn_uncondbrtarget_target_B_1_t2B; /* 0xf0009000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 12:
+            case 14: {
+                if ((op & 0xf800d001) == 0xf000c000) {
+                    goto insn_t_blxtarget_func_1_tBLXi; /* 0xf000c000 | 0x07ff2ffe */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 13:
+            case 15: {
+                if ((op & 0xf800d000) == 0xf000d000) {
+                    goto insn_t_bltarget_func_1_tBL; /* 0xf000d000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 13: {
+        switch ((op >> 26) & 0x7) {
+        case 2: {
+            switch ((op >> 4) & 0xf) {
+            case 0:
+            case 1: {
+                if ((op & 0xfff0ffe0) == 0xe8d0f000) {
+                    struct bitslice Rm = {.nruns = 1, .runs = (struct bitslice_run[]) {{0,0,4}}};
+                    return P(unk_Rm_B_2_t2TBB)(ctx, Rm); /* 0xe8d0f000 | 0x000f001f */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        case 4:
+        case 5: {
+            switch ((op >> 12) & 0x7) {
+            case 0:
+            case 2: {
+                if ((op & 0xf800d000) == 0xf0008000) {
+                    goto insn_brtarget_target_pred_p_B_1_t2Bcc; /* 0xf0008000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 1:
+            case 3: {
+                if ((op & 0xf800d000) == 0xf0009000) {
+                    goto insn_uncondbrtarget_target_B_1_t2B; /* 0xf0009000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 4:
+            case 6: {
+                if ((op & 0xf800d001) == 0xf000c000) {
+                    goto insn_t_blxtarget_func_1_tBLXi; /* 0xf000c000 | 0x07ff2ffe */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 5:
+            case 7: {
+                if ((op & 0xf800d000) == 0xf000d000) {
+                    goto insn_t_bltarget_func_1_tBL; /* 0xf000d000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        case 6: {
+            switch ((op >> 16) & 0xf) {
+            case 15: {
+                if ((op & 0xff7f0000) == 0xf85f0000) {
+                    goto insn_t2ldrlabel_addr_unk_Rt_5_t2LDRBpci; /* 0xf85f0000 | 0x0080ffff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 15: {
+        switch ((op >> 25) & 0x7) {
+        case 0:
+        case 1:
+        case 2:
+        case 3: {
+            switch ((op >> 12) & 0x7) {
+            case 0:
+            case 2: {
+                if ((op & 0xf800d000) == 0xf0008000) {
+                    goto insn_brtarget_target_pred_p_B_1_t2Bcc; /* 0xf0008000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 1:
+            case 3: {
+                if ((op & 0xf800d000) == 0xf0009000) {
+                    goto insn_uncondbrtarget_target_B_1_t2B; /* 0xf0009000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 4:
+            case 6: {
+                if ((op & 0xf800d001) == 0xf000c000) {
+                    goto insn_t_blxtarget_func_1_tBLXi; /* 0xf000c000 | 0x07ff2ffe */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 5:
+            case 7: {
+                if ((op & 0xf800d000) == 0xf000d000) {
+                    goto insn_t_bltarget_func_1_tBL; /* 0xf000d000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 16: {
+        switch ((op >> 27) & 0x1) {
+        case 0: {
+            switch ((op >> 12) & 0xf) {
+            case 8:
+            case 10: {
+                if ((op & 0xf800d000) == 0xf0008000) {
+                    goto insn_brtarget_target_pred_p_B_1_t2Bcc; /* 0xf0008000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 9:
+            case 11: {
+                if ((op & 0xf800d000) == 0xf0009000) {
+                    goto insn_uncondbrtarget_target_B_1_t2B; /* 0xf0009000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 12:
+            case 14: {
+                if ((op & 0xf800d001) == 0xf000c000) {
+                    goto insn_t_blxtarget_func_1_tBLXi; /* 0xf000c000 | 0x07ff2ffe */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 13:
+            case 15: {
+                if ((op & 0xf800d000) == 0xf000d000) {
+                    goto insn_t_bltarget_func_1_tBL; /* 0xf000d000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 17: {
+        switch ((op >> 26) & 0x7) {
+        case 2: {
+            switch ((op >> 25) & 0x1) {
+            case 0: {
+                if ((op & 0xffd00000) == 0xe9100000) {
+                    goto insn_GPR_Rn_reglist_regs_4_t2LDMDB; /* 0xe9100000 | 0x002fffff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        case 4:
+        case 5: {
+            switch ((op >> 12) & 0xf) {
+            case 8:
+            case 10: {
+                if ((op & 0xf800d000) == 0xf0008000) {
+                    goto insn_brtarget_target_pred_p_B_1_t2Bcc; /* 0xf0008000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 9:
+            case 11: {
+                if ((op & 0xf800d000) == 0xf0009000) {
+                    goto insn_uncondbrtarget_target_B_1_t2B; /* 0xf0009000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 12:
+            case 14: {
+                if ((op & 0xf800d001) == 0xf000c000) {
+                    goto insn_t_blxtarget_func_1_tBLXi; /* 0xf000c000 | 0x07ff2ffe */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 13:
+            case 15: {
+                if ((op & 0xf800d000) == 0xf000d000) {
+                    goto insn_t_bltarget_func_1_tBL; /* 0xf000d000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        case 6: {
+            switch ((op >> 8) & 0x7) {
+            case 0: {
+                if ((op & 0xfed00fc0) == 0xf8100000) {
+                    return P(unidentified)(ctx);
+                } else {
+                    if ((op & 0xfe5f0000) == 0xf81f0000) {
+                        goto insn_t2ldrlabel_addr_unk_Rt_5_t2LDRBpci; /* 0xf81f0000 | 0x0120f8ff */
+                    } else {
+                        return P(unidentified)(ctx);
+                    }
+                }
+            }
+            case 1:
+            case 3: {
+                switch ((op >> 11) & 0x1) {
+                case 0: {
+                    if ((op & 0xfe5f0000) == 0xf81f0000) {
+                        goto insn_t2ldrlabel_addr_unk_Rt_5_t2LDRBpci; /* 0xf81f0000 | 0x01a0ffff */
+                    } else {
+                        return P(unidentified)(ctx);
+                    }
+                }
+                default:
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 2: {
+                if ((op & 0xfe5f0000) == 0xf81f0000) {
+                    goto insn_t2ldrlabel_addr_unk_Rt_5_t2LDRBpci; /* 0xf81f0000 | 0x01a0ffff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 4: {
+                switch ((op >> 11) & 0x1) {
+                case 0: {
+                    if ((op & 0xfe5f0000) == 0xf81f0000) {
+                        goto insn_t2ldrlabel_addr_unk_Rt_5_t2LDRBpci; /* 0xf81f0000 | 0x01a0ffff */
+                    } else {
+                        return P(unidentified)(ctx);
+                    }
+                }
+                default:
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 5:
+            case 7: {
+                switch ((op >> 11) & 0x1) {
+                case 0: {
+                    if ((op & 0xfe5f0000) == 0xf81f0000) {
+                        goto insn_t2ldrlabel_addr_unk_Rt_5_t2LDRBpci; /* 0xf81f0000 | 0x01a0ffff */
+                    } else {
+                        return P(unidentified)(ctx);
+                    }
+                }
+                default:
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 6: {
+                switch ((op >> 11) & 0x1) {
+                case 0: {
+                    if ((op & 0xfe5f0000) == 0xf81f0000) {
+                        goto insn_t2ldrlabel_addr_unk_Rt_5_t2LDRBpci; /* 0xf81f0000 | 0x01a0ffff */
+                    } else {
+                        return P(unidentified)(ctx);
+                    }
+                }
+                default:
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 18: {
+        switch ((op >> 12) & 0xf) {
+        case 8:
+        case 10: {
+            switch ((op >> 27) & 0x1) {
+            case 0: {
+                if ((op & 0xf800d000) == 0xf0008000) {
+                    goto insn_brtarget_target_pred_p_B_1_t2Bcc; /* 0xf0008000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        case 9:
+        case 11: {
+            switch ((op >> 27) & 0x1) {
+            case 0: {
+                if ((op & 0xf800d000) == 0xf0009000) {
+                    goto insn_uncondbrtarget_target_B_1_t2B; /* 0xf0009000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        case 12:
+        case 14: {
+            switch ((op >> 27) & 0x1) {
+            case 0: {
+                if ((op & 0xf800d001) == 0xf000c000) {
+                    goto insn_t_blxtarget_func_1_tBLXi; /* 0xf000c000 | 0x07ff2ffe */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        case 13:
+        case 15: {
+            switch ((op >> 27) & 0x1) {
+            case 0: {
+                if ((op & 0xf800d000) == 0xf000d000) {
+                    goto insn_t_bltarget_func_1_tBL; /* 0xf000d000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 19: {
+        switch ((op >> 26) & 0x7) {
+        case 2: {
+            if ((op & 0xffd00000) == 0xe9100000) {
+                goto insn_GPR_Rn_reglist_regs_4_t2LDMDB; /* 0xe9100000 | 0x002fffff */
+            } else {
+                return P(unidentified)(ctx);
+            }
+        }
+        case 4:
+        case 5: {
+            switch ((op >> 12) & 0x7) {
+            case 0:
+            case 2: {
+                if ((op & 0xf800d000) == 0xf0008000) {
+                    goto insn_brtarget_target_pred_p_B_1_t2Bcc; /* 0xf0008000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 1:
+            case 3: {
+                if ((op & 0xf800d000) == 0xf0009000) {
+                    goto insn_uncondbrtarget_target_B_1_t2B; /* 0xf0009000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 4:
+            case 6: {
+                if ((op & 0xf800d001) == 0xf000c000) {
+                    goto insn_t_blxtarget_func_1_tBLXi; /* 0xf000c000 | 0x07ff2ffe */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 5:
+            case 7: {
+                if ((op & 0xf800d000) == 0xf000d000) {
+                    goto insn_t_bltarget_func_1_tBL; /* 0xf000d000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        case 6: {
+            switch ((op >> 8) & 0x7) {
+            case 0: {
+                if ((op & 0xfed00fc0) == 0xf8100000) {
+                    return P(unidentified)(ctx);
+                } else {
+                    if ((op & 0xfe5f0000) == 0xf81f0000) {
+                        goto insn_t2ldrlabel_addr_unk_Rt_5_t2LDRBpci; /* 0xf81f0000 | 0x0120f8ff */
+                    } else {
+                        return P(unidentified)(ctx);
+                    }
+                }
+            }
+            case 1:
+            case 3: {
+                switch ((op >> 11) & 0x1) {
+                case 0: {
+                    if ((op & 0xfe5f0000) == 0xf81f0000) {
+                        goto insn_t2ldrlabel_addr_unk_Rt_5_t2LDRBpci; /* 0xf81f0000 | 0x01a0ffff */
+                    } else {
+                        return P(unidentified)(ctx);
+                    }
+                }
+                default:
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 2: {
+                if ((op & 0xfe5f0000) == 0xf81f0000) {
+                    goto insn_t2ldrlabel_addr_unk_Rt_5_t2LDRBpci; /* 0xf81f0000 | 0x01a0ffff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 4: {
+                switch ((op >> 11) & 0x1) {
+                case 0: {
+                    if ((op & 0xfe5f0000) == 0xf81f0000) {
+                        goto insn_t2ldrlabel_addr_unk_Rt_5_t2LDRBpci; /* 0xf81f0000 | 0x01a0ffff */
+                    } else {
+                        return P(unidentified)(ctx);
+                    }
+                }
+                default:
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 5:
+            case 7: {
+                switch ((op >> 11) & 0x1) {
+                case 0: {
+                    if ((op & 0xfe5f0000) == 0xf81f0000) {
+                        goto insn_t2ldrlabel_addr_unk_Rt_5_t2LDRBpci; /* 0xf81f0000 | 0x01a0ffff */
+                    } else {
+                        return P(unidentified)(ctx);
+                    }
+                }
+                default:
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 6: {
+                switch ((op >> 11) & 0x1) {
+                case 0: {
+                    if ((op & 0xfe5f0000) == 0xf81f0000) {
+                        goto insn_t2ldrlabel_addr_unk_Rt_5_t2LDRBpci; /* 0xf81f0000 | 0x01a0ffff */
+                    } else {
+                        return P(unidentified)(ctx);
+                    }
+                }
+                default:
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 20: {
+        switch ((op >> 27) & 0x1) {
+        case 0: {
+            switch ((op >> 12) & 0x7) {
+            case 0:
+            case 2: {
+                if ((op & 0xf800d000) == 0xf0008000) {
+                    goto insn_brtarget_target_pred_p_B_1_t2Bcc; /* 0xf0008000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 1:
+            case 3: {
+                if ((op & 0xf800d000) == 0xf0009000) {
+                    goto insn_uncondbrtarget_target_B_1_t2B; /* 0xf0009000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 4:
+            case 6: {
+                if ((op & 0xf800d001) == 0xf000c000) {
+                    goto insn_t_blxtarget_func_1_tBLXi; /* 0xf000c000 | 0x07ff2ffe */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 5:
+            case 7: {
+                if ((op & 0xf800d000) == 0xf000d000) {
+                    goto insn_t_bltarget_func_1_tBL; /* 0xf000d000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 21:
+    case 29: {
+        switch ((op >> 27) & 0x1) {
+        case 0: {
+            switch ((op >> 12) & 0x7) {
+            case 0:
+            case 2: {
+                if ((op & 0xf800d000) == 0xf0008000) {
+                    goto insn_brtarget_target_pred_p_B_1_t2Bcc; /* 0xf0008000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 1:
+            case 3: {
+                if ((op & 0xf800d000) == 0xf0009000) {
+                    goto insn_uncondbrtarget_target_B_1_t2B; /* 0xf0009000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 4:
+            case 6: {
+                if ((op & 0xf800d001) == 0xf000c000) {
+                    goto insn_t_blxtarget_func_1_tBLXi; /* 0xf000c000 | 0x07ff2ffe */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 5:
+            case 7: {
+                if ((op & 0xf800d000) == 0xf000d000) {
+                    goto insn_t_bltarget_func_1_tBL; /* 0xf000d000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 22:
+    case 30: {
+        switch ((op >> 12) & 0x7) {
+        case 0:
+        case 2: {
+            switch ((op >> 26) & 0x3) {
+            case 0:
+            case 1: {
+                if ((op & 0xf800d000) == 0xf0008000) {
+                    goto insn_brtarget_target_pred_p_B_1_t2Bcc; /* 0xf0008000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        case 1:
+        case 3: {
+            switch ((op >> 26) & 0x3) {
+            case 0:
+            case 1: {
+                if ((op & 0xf800d000) == 0xf0009000) {
+                    goto insn_uncondbrtarget_target_B_1_t2B; /* 0xf0009000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        case 4:
+        case 6: {
+            switch ((op >> 26) & 0x3) {
+            case 0:
+            case 1: {
+                if ((op & 0xf800d001) == 0xf000c000) {
+                    goto insn_t_blxtarget_func_1_tBLXi; /* 0xf000c000 | 0x07ff2ffe */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        case 5:
+        case 7: {
+            switch ((op >> 26) & 0x3) {
+            case 0:
+            case 1: {
+                if ((op & 0xf800d000) == 0xf000d000) {
+                    goto insn_t_bltarget_func_1_tBL; /* 0xf000d000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 23:
+    case 31: {
+        switch ((op >> 12) & 0x7) {
+        case 0:
+        case 2: {
+            switch ((op >> 26) & 0x3) {
+            case 0:
+            case 1: {
+                if ((op & 0xf800d000) == 0xf0008000) {
+                    goto insn_brtarget_target_pred_p_B_1_t2Bcc; /* 0xf0008000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        case 1:
+        case 3: {
+            switch ((op >> 26) & 0x3) {
+            case 0:
+            case 1: {
+                if ((op & 0xf800d000) == 0xf0009000) {
+                    goto insn_uncondbrtarget_target_B_1_t2B; /* 0xf0009000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        case 4:
+        case 6: {
+            switch ((op >> 26) & 0x3) {
+            case 0:
+            case 1: {
+                if ((op & 0xf800d001) == 0xf000c000) {
+                    goto insn_t_blxtarget_func_1_tBLXi; /* 0xf000c000 | 0x07ff2ffe */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        case 5:
+        case 7: {
+            switch ((op >> 26) & 0x3) {
+            case 0:
+            case 1: {
+                if ((op & 0xf800d000) == 0xf000d000) {
+                    goto insn_t_bltarget_func_1_tBL; /* 0xf000d000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 24: {
+        switch ((op >> 12) & 0x7) {
+        case 0:
+        case 2: {
+            switch ((op >> 27) & 0x1f) {
+            case 30: {
+                if ((op & 0xf800d000) == 0xf0008000) {
+                    goto insn_brtarget_target_pred_p_B_1_t2Bcc; /* 0xf0008000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        case 1:
+        case 3: {
+            switch ((op >> 27) & 0x1f) {
+            case 30: {
+                if ((op & 0xf800d000) == 0xf0009000) {
+                    goto insn_uncondbrtarget_target_B_1_t2B; /* 0xf0009000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        case 4:
+        case 6: {
+            switch ((op >> 27) & 0x1f) {
+            case 30: {
+                if ((op & 0xf800d001) == 0xf000c000) {
+                    goto insn_t_blxtarget_func_1_tBLXi; /* 0xf000c000 | 0x07ff2ffe */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        case 5:
+        case 7: {
+            switch ((op >> 27) & 0x1f) {
+            case 30: {
+                if ((op & 0xf800d000) == 0xf000d000) {
+                    goto insn_t_bltarget_func_1_tBL; /* 0xf000d000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 25: {
+        switch ((op >> 27) & 0x1) {
+        case 0: {
+            switch ((op >> 12) & 0x7) {
+            case 0:
+            case 2: {
+                if ((op & 0xf800d000) == 0xf0008000) {
+                    goto insn_brtarget_target_pred_p_B_1_t2Bcc; /* 0xf0008000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 1:
+            case 3: {
+                if ((op & 0xf800d000) == 0xf0009000) {
+                    goto insn_uncondbrtarget_target_B_1_t2B; /* 0xf0009000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 4:
+            case 6: {
+                if ((op & 0xf800d001) == 0xf000c000) {
+                    goto insn_t_blxtarget_func_1_tBLXi; /* 0xf000c000 | 0x07ff2ffe */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 5:
+            case 7: {
+                if ((op & 0xf800d000) == 0xf000d000) {
+                    goto insn_t_bltarget_func_1_tBL; /* 0xf000d000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        case 1: {
+            switch ((op >> 26) & 0x1) {
+            case 0: {
+                switch ((op >> 16) & 0xf) {
+                case 15: {
+                    if ((op & 0xfe5f0000) == 0xf81f0000) {
+                        goto insn_t2ldrlabel_addr_unk_Rt_5_t2LDRBpci; /* 0xf81f0000 | 0x01a0ffff */
+                    } else {
+                        return P(unidentified)(ctx);
+                    }
+                }
+                default:
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 26: {
+        switch ((op >> 12) & 0x7) {
+        case 0:
+        case 2: {
+            switch ((op >> 27) & 0x1) {
+            case 0: {
+                if ((op & 0xf800d000) == 0xf0008000) {
+                    goto insn_brtarget_target_pred_p_B_1_t2Bcc; /* 0xf0008000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        case 1:
+        case 3: {
+            switch ((op >> 27) & 0x1) {
+            case 0: {
+                if ((op & 0xf800d000) == 0xf0009000) {
+                    goto insn_uncondbrtarget_target_B_1_t2B; /* 0xf0009000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        case 4:
+        case 6: {
+            switch ((op >> 27) & 0x1) {
+            case 0: {
+                if ((op & 0xf800d001) == 0xf000c000) {
+                    goto insn_t_blxtarget_func_1_tBLXi; /* 0xf000c000 | 0x07ff2ffe */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        case 5:
+        case 7: {
+            switch ((op >> 27) & 0x1) {
+            case 0: {
+                if ((op & 0xf800d000) == 0xf000d000) {
+                    goto insn_t_bltarget_func_1_tBL; /* 0xf000d000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 27: {
+        switch ((op >> 27) & 0x1) {
+        case 0: {
+            switch ((op >> 12) & 0x7) {
+            case 0:
+            case 2: {
+                if ((op & 0xf800d000) == 0xf0008000) {
+                    goto insn_brtarget_target_pred_p_B_1_t2Bcc; /* 0xf0008000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 1:
+            case 3: {
+                if ((op & 0xf800d000) == 0xf0009000) {
+                    goto insn_uncondbrtarget_target_B_1_t2B; /* 0xf0009000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 4:
+            case 6: {
+                if ((op & 0xf800d001) == 0xf000c000) {
+                    goto insn_t_blxtarget_func_1_tBLXi; /* 0xf000c000 | 0x07ff2ffe */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            case 5:
+            case 7: {
+                if ((op & 0xf800d000) == 0xf000d000) {
+                    goto insn_t_bltarget_func_1_tBL; /* 0xf000d000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        case 1: {
+            switch ((op >> 26) & 0x1) {
+            case 0: {
+                switch ((op >> 16) & 0xf) {
+                case 15: {
+                    if ((op & 0xfe5f0000) == 0xf81f0000) {
+                        goto insn_t2ldrlabel_addr_unk_Rt_5_t2LDRBpci; /* 0xf81f0000 | 0x01a0ffff */
+                    } else {
+                        return P(unidentified)(ctx);
+                    }
+                }
+                default:
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    case 28: {
+        switch ((op >> 10) & 0x1f) {
+        case 0:
+        case 1:
+        case 8:
+        case 9:
+        case 11: {
+            switch ((op >> 26) & 0x3) {
+            case 0:
+            case 1: {
+                if ((op & 0xf800d000) == 0xf0008000) {
+                    goto insn_brtarget_target_pred_p_B_1_t2Bcc; /* 0xf0008000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        case 2:
+        case 10: {
+            switch ((op >> 26) & 0x3) {
+            case 0:
+            case 1: {
+                if ((op & 0xf800d000) == 0xf0008000) {
+                    goto insn_brtarget_target_pred_p_B_1_t2Bcc; /* 0xf0008000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        case 3: {
+            switch ((op >> 27) & 0x1) {
+            case 0: {
+                if ((op & 0xfff0ffff) == 0xf3c08f00) {
+                    return P(unidentified)(ctx);
+                } else {
+                    if ((op & 0xf800d000) == 0xf0008000) {
+                        goto insn_brtarget_target_pred_p_B_1_t2Bcc; /* 0xf1c08c00 | 0x060f03ff */
+                    } else {
+                        return P(unidentified)(ctx);
+                    }
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        case 4:
+        case 5:
+        case 7:
+        case 12:
+        case 13:
+        case 15: {
+            switch ((op >> 26) & 0x3) {
+            case 0:
+            case 1: {
+                if ((op & 0xf800d000) == 0xf0009000) {
+                    goto insn_uncondbrtarget_target_B_1_t2B; /* 0xf0009000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        case 6:
+        case 14: {
+            switch ((op >> 26) & 0x3) {
+            case 0:
+            case 1: {
+                if ((op & 0xf800d000) == 0xf0009000) {
+                    goto insn_uncondbrtarget_target_B_1_t2B; /* 0xf0009000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        case 16:
+        case 17:
+        case 19:
+        case 24:
+        case 25:
+        case 27: {
+            switch ((op >> 26) & 0x3) {
+            case 0:
+            case 1: {
+                if ((op & 0xf800d001) == 0xf000c000) {
+                    goto insn_t_blxtarget_func_1_tBLXi; /* 0xf000c000 | 0x07ff2ffe */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        case 18:
+        case 26: {
+            switch ((op >> 26) & 0x3) {
+            case 0:
+            case 1: {
+                if ((op & 0xf800d001) == 0xf000c000) {
+                    goto insn_t_blxtarget_func_1_tBLXi; /* 0xf000c000 | 0x07ff2ffe */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        case 20:
+        case 21:
+        case 23:
+        case 28:
+        case 29:
+        case 31: {
+            switch ((op >> 26) & 0x3) {
+            case 0:
+            case 1: {
+                if ((op & 0xf800d000) == 0xf000d000) {
+                    goto insn_t_bltarget_func_1_tBL; /* 0xf000d000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        case 22:
+        case 30: {
+            switch ((op >> 26) & 0x3) {
+            case 0:
+            case 1: {
+                if ((op & 0xf800d000) == 0xf000d000) {
+                    goto insn_t_bltarget_func_1_tBL; /* 0xf000d000 | 0x07ff2fff */
+                } else {
+                    return P(unidentified)(ctx);
+                }
+            }
+            default:
+                return P(unidentified)(ctx);
+            }
+        }
+        default:
+            return P(unidentified)(ctx);
+        }
+    }
+    default:
+        return P(unidentified)(ctx);
+    }
@@ -218,7 +218,11 @@ static INLINE void P(bl_target_func_2_BL)(tdis_ctx ctx, struct bitslice func) {
 static INLINE void P(dis_arm)(tdis_ctx ctx) {
     uint32_t op = ctx->base.op = unaligned_r32(ctx->base.ptr);
     ctx->base.op_size = ctx->base.newop_size = 4;
+#if DIS_BRANCHES_ONLY
+    #include "../generated/branch-dis-arm.inc.h"
+#else
     #include "../generated/generic-dis-arm.inc.h"
+#endif
     __builtin_abort();
 }
 #define GENERATED_HEADER "../generated/generic-dis-arm.inc.h"
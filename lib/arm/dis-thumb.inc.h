@@ -87,7 +87,11 @@ static INLINE void P(GPR_func_1_tBLXr)(tdis_ctx ctx, UNUSED struct bitslice func
 
 static INLINE void P(thumb_do_it)(tdis_ctx ctx) {
     uint16_t op = ctx->base.op = unaligned_r16(ctx->base.ptr);
+#if DIS_BRANCHES_ONLY
+    #include "../generated/branch-dis-thumb.inc.h"
+#else
     #include "../generated/generic-dis-thumb.inc.h"
+#endif
     __builtin_abort();
 }
 
@@ -191,7 +191,11 @@ static INLINE void P(rGPR_func_1_t2BXJ)(tdis_ctx ctx, UNUSED struct bitslice fun
 
 static INLINE void P(thumb2_do_it)(tdis_ctx ctx) {
     uint32_t op = ctx->base.op;
+#if DIS_BRANCHES_ONLY
+    #include "../generated/branch-dis-thumb2.inc.h"
+#else
     #include "../generated/generic-dis-thumb2.inc.h"
+#endif
     __builtin_abort();
 }
 
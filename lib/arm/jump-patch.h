@@ -3,6 +3,8 @@
 #include "arm/assemble.h"
 #define MAX_JUMP_PATCH_SIZE 8
 #define MAX_EXTENDED_PATCH_SIZE (MAX_JUMP_PATCH_SIZE+14)
+/* LDR PC can reach anywhere */
+#define JUMP_PATCH_REACH 0
 
 static inline int jump_patch_size(uint_tptr pc,
                                   UNUSED uint_tptr dpc,
@@ -17,3 +19,37 @@ static inline void make_jump_patch(void **codep, uint_tptr pc,
     struct assemble_ctx actx = {codep, (void*)pc, arch.pc_low_bit, 0xe};
     LDR_PC(actx, dpc);
 }
+
+/* The usual patch already jumps through a literal; at a 4-byte aligned pc
+ * it's at offset 4. */
+#define RETARGETABLE_JUMP_SIZE 8
+#define RETARGETABLE_JUMP_LITERAL 4
+static inline void make_retargetable_jump(void **codep, uint_tptr pc,
+                                          uint_tptr dpc,
+                                          struct arch_dis_ctx arch) {
+    make_jump_patch(codep, pc, dpc, arch);
+}
+
+/* A probe stub: count a call in *counter, then jump through a pointer-sized
+ * literal like make_retargetable_jump.  Used in place of an intro trampoline.
+ * It's always ARM code; the LDR PC at the end switches back to Thumb if the
+ * target is.  There aren't enough free registers at function entry for
+ * LDREXD/STREXD, so r0-r3 are saved on the stack around the loop. */
+#define PROBE_STUB_SIZE 48
+#define PROBE_STUB_LITERAL 44
+static inline void make_probe_stub(void **codep, UNUSED uint_tptr pc,
+                                   uint64_t *counter,
+                                   UNUSED struct arch_dis_ctx arch) {
+    op32(codep, 0xe92d000f); /* push {r0-r3} */
+    op32(codep, 0xe59f001c); /* ldr r0, counter */
+    op32(codep, 0xe1b02f9f); /* 1: ldrexd r2, r3, [r0] */
+    op32(codep, 0xe2922001); /* adds r2, r2, #1 */
+    op32(codep, 0xe2a33000); /* adc r3, r3, #0 */
+    op32(codep, 0xe1a01f92); /* strexd r1, r2, r3, [r0] */
+    op32(codep, 0xe3510000); /* cmp r1, #0 */
+    op32(codep, 0x1afffff9); /* bne 1b */
+    op32(codep, 0xe8bd000f); /* pop {r0-r3} */
+    op32(codep, 0xe59ff000); /* ldr pc, literal */
+    op32(codep, (uint32_t) (uintptr_t) counter);
+    op32(codep, 0);
+}
@@ -2,6 +2,8 @@
 #define MIN_INSN_SIZE 4
 #define TD_MAX_REWRITTEN_SIZE (7 * 2 * 4) /* also conservative */
 #define ARCH_MAX_CODE_ALIGNMENT 4
+/* so a linear sweep through a whole section can't get out of sync */
+#define ARCH_FIXED_WIDTH_INSNS
 
 struct arch_pcrel_info {
     unsigned reg;
@@ -21,10 +23,15 @@ struct arch_dis_ctx {
      * use Rt2/Rs or could read their Rd, so the third doesn't count), we won't
      * run out even with the dumbest possible thing. */
     uint32_t regs_possibly_written;
+    /* For transform_dis only - how much smaller the rewritten instructions
+     * came out than the always-works MOV sequences, thanks to the target
+     * being within range of a shorter form.  Reported in the stats. */
+    uint32_t bytes_saved;
 };
 
 static inline void arch_dis_ctx_init(struct arch_dis_ctx *ctx) {
     ctx->regs_possibly_written = 0;
+    ctx->bytes_saved = 0;
 }
 
 static inline int arm64_get_unwritten_temp_reg(struct arch_dis_ctx *ctx) {
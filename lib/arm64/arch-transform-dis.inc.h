@@ -1,18 +1,48 @@
 #include "arm64/assemble.h"
 
+/* The rewritten instruction runs at ctx->pc_trampoline rather than its
+ * original pc; if the target is still within range of a short form from
+ * there (the arena's pages often end up near the code being hooked), use
+ * that, and fall back to a MOV sequence otherwise. */
+
 static NOINLINE UNUSED
 void transform_dis_pcrel(struct transform_dis_ctx *ctx, uint_tptr dpc,
                          struct arch_pcrel_info info) {
     ctx->write_newop_here = NULL;
     void **codep = ctx->rewritten_ptr_ptr;
-    if (info.load_mode >= PLM_U32_SIMD) {
-        int temp = arm64_get_unwritten_temp_reg(&ctx->arch);
-        MOVi64(codep, 0, dpc);
-        LDRxi(codep, temp, 0, 0, true, info.load_mode);
+    void *start = *codep;
+    uint_tptr pc = ctx->pc_trampoline;
+    int64_t diff = (int64_t) (dpc - pc);
+    bool simd = info.load_mode >= PLM_U32_SIMD;
+    int mov_size = size_of_MOVi64(dpc);
+    int conservative = mov_size + (info.load_mode != PLM_ADR ? 4 : 0);
+    if (info.load_mode == PLM_ADR) {
+        /* ADRP, plus an ADD unless the target is page aligned */
+        int adrp_size = (dpc & 0xfff) ? 8 : 4;
+        if (fits_signed(diff, 21))
+            ADR(codep, info.reg, pc, dpc);
+        else if (ADRP_in_range(pc, dpc) && adrp_size <= mov_size)
+            ADRP_ADD(codep, info.reg, pc, dpc);
+        else
+            MOVi64(codep, info.reg, dpc);
+    } else if (fits_signed(diff, 21) && !(diff & 3)) {
+        /* same literal load, new imm19 */
+        op32(codep, (ctx->base.op & ~(0x7ffff << 5)) |
+                    (uint32_t) (diff >> 2 & 0x7ffff) << 5);
     } else {
-        MOVi64(codep, info.reg, dpc);
-        LDRxi(codep, info.reg, info.reg, 0, true, info.load_mode);
+        int reg = simd ? arm64_get_unwritten_temp_reg(&ctx->arch) : info.reg;
+        uint32_t lo = dpc & 0xfff;
+        if (ADRP_in_range(pc, dpc) &&
+            !(lo & (size_of_load(info.load_mode) - 1))) {
+            ADRP(codep, reg, pc, dpc);
+            LDRxi(codep, info.reg, reg, lo, true, info.load_mode);
+        } else {
+            MOVi64(codep, reg, dpc);
+            LDRxi(codep, info.reg, reg, 0, true, info.load_mode);
+        }
     }
+    ctx->arch.bytes_saved += conservative - (int) ((char *) *codep -
+                                                   (char *) start);
 }
 
 static NOINLINE UNUSED
@@ -25,21 +55,54 @@ void transform_dis_branch(struct transform_dis_ctx *ctx, uint_tptr dpc, int cc)
 #endif
     transform_dis_branch_top(ctx, dpc, cc);
     ctx->write_newop_here = NULL;
+    void **codep = ctx->rewritten_ptr_ptr;
+    void *start = *codep;
+    uint_tptr pc = ctx->pc_trampoline;
+    int64_t diff = (int64_t) (dpc - pc);
+    bool link = cc & CC_CALL;
     int mov_br_size = size_of_MOVi64(dpc) + 4;
+    int conservative = (cc & CC_CONDITIONAL ? 4 : 0) + mov_br_size;
 
-    void **codep = ctx->rewritten_ptr_ptr;
+    if ((cc & CC_ARMCC) == CC_ARMCC && fits_signed(diff, 21)) {
+        Bccrel(codep, cc & 0xf, (int) diff);
+        goto done;
+    }
+    if ((cc & CC_XBXZ) == CC_XBXZ &&
+        fits_signed(diff, (ctx->base.op >> 25 & 1) ? 16 : 21)) {
+        /* TBZ has imm14, CBZ imm19; just retarget it */
+        ctx->base.modify = true;
+        ctx->base.newval[0] = ctx->base.pc + (uint_tptr) diff;
+        ctx->base.newval[1] = 0; /* don't invert */
+        ctx->write_newop_here = *codep; *codep += 4;
+        goto done;
+    }
+
+    /* otherwise, skip over an unconditional jump if the condition fails */
+    uint_tptr tail_pc = pc + (cc & CC_CONDITIONAL ? 4 : 0);
+    bool near_tail = fits_signed((int64_t) (dpc - tail_pc), 28);
+    int tail_size = near_tail ? 4 : mov_br_size;
     if ((cc & CC_ARMCC) == CC_ARMCC) {
         int icc = (cc & 0xf) ^ 1;
-        Bccrel(codep, icc, 4 + mov_br_size);
+        Bccrel(codep, icc, 4 + tail_size);
     } else if ((cc & CC_XBXZ) == CC_XBXZ) {
         ctx->base.modify = true;
-        ctx->base.newval[0] = ctx->base.pc + 4 + mov_br_size;
+        ctx->base.newval[0] = ctx->base.pc + 4 + tail_size;
         ctx->base.newval[1] = 1; /* do invert */
         ctx->write_newop_here = *codep; *codep += 4;
     }
-    int reg = arm64_get_unwritten_temp_reg(&ctx->arch);
-    MOVi64(codep, reg, dpc);
-    BR(codep, reg, /*link*/ cc & CC_CALL);
+    if (near_tail) {
+        if (link)
+            BLrel(codep, (int) (dpc - tail_pc));
+        else
+            Brel(codep, (int) (dpc - tail_pc));
+    } else {
+        int reg = arm64_get_unwritten_temp_reg(&ctx->arch);
+        MOVi64(codep, reg, dpc);
+        BR(codep, reg, link);
+    }
+done:
+    ctx->arch.bytes_saved += conservative - (int) ((char *) *codep -
+                                                   (char *) start);
 }
 
 static void transform_dis_pre_dis(UNUSED struct transform_dis_ctx *ctx) {}
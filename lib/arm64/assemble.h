@@ -1,6 +1,12 @@
 #pragma once
 #include "dis.h"
 
+/* Does diff fit in a signed field of 'bits' bits? */
+static inline bool fits_signed(int64_t diff, int bits) {
+    return diff >= -((int64_t) 1 << (bits - 1)) &&
+           diff < ((int64_t) 1 << (bits - 1));
+}
+
 static inline int size_of_MOVi64(uint64_t val) {
     int num_nybbles = val == 0 ? 1 : ((64 - __builtin_clzll(val) + 15) / 16);
     return 4 * num_nybbles;
@@ -35,21 +41,51 @@ static inline void LDRxi(void **codep, int Rt, int Rn, uint32_t off,
         case PLM_U128_SIMD: size = 0; opc = 3; simd = true; break;
         default: __builtin_abort();
     }
-    if (simd) {
-        off /= 1 << (size | (opc & 1) << 2);
-    } else {
-        off /= 1 << size;
+    /* log2 of the access size; a 128-bit SIMD access has size 0, but opc 3 */
+    int scale = size;
+    if (simd)
+        scale += (opc & 2) << 1;
+    else
         opc = sign ? (regsize_64 ? 2 : 3) : 1;
-    }
+    substitute_assert(!(off & ((1u << scale) - 1)));
+    off >>= scale;
     op32(codep, 0x39000000 | Rt | Rn << 5 | off << 10 | opc << 22 | simd << 26 |
                 size << 30);
 }
 
-static inline void ADRP_ADD(void **codep, int reg, uint64_t pc, uint64_t dpc) {
+/* the size of the access at the address for LDRxi's scaled offset */
+static inline int size_of_load(enum pcrel_load_mode load_mode) {
+    switch (load_mode) {
+        case PLM_U8:  case PLM_S8:  return 1;
+        case PLM_U16: case PLM_S16: return 2;
+        case PLM_U32: case PLM_S32: case PLM_U32_SIMD: return 4;
+        case PLM_U64: case PLM_U64_SIMD: return 8;
+        case PLM_U128_SIMD: return 16;
+        default: return 1;
+    }
+}
+
+/* Only within +/-1MB of pc. */
+static inline void ADR(void **codep, int reg, uint64_t pc, uint64_t dpc) {
+    uint64_t diff = dpc - pc;
+    op32(codep, 0x10000000 | reg | (diff & 3) << 29 | (diff & 0x1ffffc) << 3);
+}
+
+/* Only within +/-4GB of pc; the low 12 bits of dpc are left for the next
+ * instruction. */
+static inline bool ADRP_in_range(uint64_t pc, uint64_t dpc) {
+    return fits_signed((int64_t) ((dpc & ~0xfff) - (pc & ~0xfff)), 33);
+}
+
+static inline void ADRP(void **codep, int reg, uint64_t pc, uint64_t dpc) {
     uint64_t diff = (dpc & ~0xfff) - (pc & ~0xfff);
     /* ADRP reg, dpc */
     op32(codep, 0x90000000 | reg | (diff & 0x3000) << 17 |
                 (diff & 0x1ffffc000) >> 9);
+}
+
+static inline void ADRP_ADD(void **codep, int reg, uint64_t pc, uint64_t dpc) {
+    ADRP(codep, reg, pc, dpc);
     uint32_t lo = dpc & 0xfff;
     if (lo) {
         /* ADD reg, reg, #lo */
@@ -61,7 +97,20 @@ static inline void BR(void **codep, int reg, bool link) {
     op32(codep, 0xd61f0000 | reg << 5 | link << 21);
 }
 
+static inline void LDRlit(void **codep, int reg, int offset) {
+    /* LDR Xreg, pc+offset */
+    op32(codep, 0x58000000 | ((offset / 4) & 0x7ffff) << 5 | reg);
+}
+
+static inline void Brel(void **codep, int offset) {
+    op32(codep, 0x14000000 | ((offset / 4) & 0x3ffffff));
+}
+
+static inline void BLrel(void **codep, int offset) {
+    op32(codep, 0x94000000 | ((offset / 4) & 0x3ffffff));
+}
+
 static inline void Bccrel(void **codep, int cc, int offset) {
-    op32(codep, 0x54000000 | (offset / 4) << 5 | cc);
+    op32(codep, 0x54000000 | ((offset / 4) & 0x7ffff) << 5 | cc);
 }
 
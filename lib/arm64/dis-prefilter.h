@@ -0,0 +1,63 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+/* A cheap superset test for the instructions that make the decoder call
+ * P(branch), P(pcrel) or P(ret), so a linear sweep only has to run the full
+ * decoder on those:
+ *   ADR/ADRP               x0x1 0000 ...
+ *   B/BL                   x001 01xx ...
+ *   B.cond                 0101 010x ...
+ *   CBZ/CBNZ/TBZ/TBNZ      x011 01xx ...
+ *   LDR/PRFM (literal)     xx01 1x00 ...
+ *   BR/BLR/RET             1101 011x ... */
+#define ARM64_PREFILTER_CLASSES(X) \
+    X(0x1f000000, 0x10000000) \
+    X(0x7c000000, 0x14000000) \
+    X(0xfe000000, 0x54000000) \
+    X(0x7c000000, 0x34000000) \
+    X(0x3b000000, 0x18000000) \
+    X(0xfe000000, 0xd6000000)
+
+static inline bool arm64_prefilter_match(uint32_t op) {
+    #define X(mask, val) ((op & (mask)) == (val)) ||
+    return ARM64_PREFILTER_CLASSES(X) false;
+    #undef X
+}
+
+/* Return the index of the first candidate in insns[i..n), or n. */
+static inline size_t arm64_prefilter_next(const void *insns, size_t i,
+                                          size_t n) {
+#ifdef __ARM_NEON
+    /* 8 instructions per iteration */
+    for (; n - i >= 8; i += 8) {
+        const uint32_t *p = (const uint32_t *) insns + i;
+        uint32x4_t a = vld1q_u32(p), b = vld1q_u32(p + 4);
+        uint32x4_t ma = vdupq_n_u32(0), mb = vdupq_n_u32(0);
+        #define X(mask, val) \
+            ma = vorrq_u32(ma, vceqq_u32(vandq_u32(a, vdupq_n_u32(mask)), \
+                                         vdupq_n_u32(val))); \
+            mb = vorrq_u32(mb, vceqq_u32(vandq_u32(b, vdupq_n_u32(mask)), \
+                                         vdupq_n_u32(val)));
+        ARM64_PREFILTER_CLASSES(X)
+        #undef X
+        /* one byte per lane */
+        uint8x8_t lanes = vmovn_u16(vcombine_u16(vmovn_u32(ma),
+                                                 vmovn_u32(mb)));
+        uint64_t bits = vget_lane_u64(vreinterpret_u64_u8(lanes), 0);
+        if (bits)
+            return i + __builtin_ctzll(bits) / 8;
+    }
+#endif
+    for (; i < n; i++) {
+        uint32_t op;
+        memcpy(&op, (const uint32_t *) insns + i, 4);
+        if (arm64_prefilter_match(op))
+            return i;
+    }
+    return n;
+}
@@ -2,10 +2,22 @@
 #include "arm64/assemble.h"
 #define MAX_JUMP_PATCH_SIZE 20
 #define MAX_EXTENDED_PATCH_SIZE MAX_JUMP_PATCH_SIZE
+/* how far away a trampoline can be and still get a short patch (ADRP) */
+#define JUMP_PATCH_REACH 0xfffff000ull
+/* ...or the shortest patch, a single B */
+#define JUMP_PATCH_SHORTEST_REACH 0x7fff000ull
+#define JUMP_PATCH_SHORTEST_SIZE 4
+
+static inline bool arm64_b_in_range(uint_tptr pc, uint_tptr dpc) {
+    intptr_t diff = dpc - pc;
+    return diff >= -0x8000000 && diff < 0x8000000;
+}
 
 static inline int jump_patch_size(uint_tptr pc, uint_tptr dpc,
                                   UNUSED struct arch_dis_ctx arch,
                                   bool force) {
+    if (arm64_b_in_range(pc, dpc))
+        return 4;
     intptr_t diff = (dpc & ~0xfff) - (pc & ~0xfff);
     if (!(diff >= -0x100000000 && diff < 0x100000000))
         return force ? (size_of_MOVi64(dpc) + 4) : -1;
@@ -17,6 +29,10 @@ static inline int jump_patch_size(uint_tptr pc, uint_tptr dpc,
 
 static inline void make_jump_patch(void **codep, uint_tptr pc, uint_tptr dpc,
                                    struct arch_dis_ctx arch) {
+    if (arm64_b_in_range(pc, dpc)) {
+        Brel(codep, (int) (dpc - pc));
+        return;
+    }
     int reg = arm64_get_unwritten_temp_reg(&arch);
     intptr_t diff = (dpc & ~0xfff) - (pc & ~0xfff);
     if (!(diff >= -0x100000000 && diff < 0x100000000))
@@ -25,3 +41,111 @@ static inline void make_jump_patch(void **codep, uint_tptr pc, uint_tptr dpc,
         ADRP_ADD(codep, reg, pc, dpc);
     BR(codep, reg, false);
 }
+
+/* A jump through a pointer-sized, aligned literal (given a 16-byte aligned
+ * pc), so the destination can be changed later with a single store. */
+#define RETARGETABLE_JUMP_SIZE 16
+#define RETARGETABLE_JUMP_LITERAL 8
+static inline void make_retargetable_jump(void **codep, UNUSED uint_tptr pc,
+                                          uint_tptr dpc,
+                                          struct arch_dis_ctx arch) {
+    int reg = arm64_get_unwritten_temp_reg(&arch);
+    LDRlit(codep, reg, RETARGETABLE_JUMP_LITERAL);
+    BR(codep, reg, false);
+    op64(codep, dpc);
+}
+
+/* A probe stub: count a call in *counter, then jump through a pointer-sized
+ * literal like make_retargetable_jump (again given a 16-byte aligned pc).
+ * Used in place of an intro trampoline, so it runs at function entry, where
+ * x16 and x17 are free.  Without LSE atomics the LDXR/STXR loop needs a third
+ * register, so x15 is saved on the stack around it. */
+#ifdef __ARM_FEATURE_ATOMICS
+#define PROBE_STUB_SIZE 40
+#define PROBE_STUB_COUNTER 24
+#else
+#define PROBE_STUB_SIZE 56
+#define PROBE_STUB_COUNTER 40
+#endif
+#define PROBE_STUB_LITERAL (PROBE_STUB_COUNTER + 8)
+static inline void make_probe_stub(void **codep, UNUSED uint_tptr pc,
+                                   uint64_t *counter,
+                                   UNUSED struct arch_dis_ctx arch) {
+    void *start = *codep;
+    LDRlit(codep, 16, PROBE_STUB_COUNTER);
+#ifdef __ARM_FEATURE_ATOMICS
+    op32(codep, 0xd2800031); /* mov x17, #1 */
+    op32(codep, 0xf831021f); /* stadd x17, [x16] */
+#else
+    op32(codep, 0xf81f0fef); /* str x15, [sp, #-16]! */
+    op32(codep, 0xc85f7e11); /* 1: ldxr x17, [x16] */
+    op32(codep, 0x91000631); /* add x17, x17, #1 */
+    op32(codep, 0xc80f7e11); /* stxr w15, x17, [x16] */
+    op32(codep, 0x35ffffaf); /* cbnz w15, 1b */
+    op32(codep, 0xf84107ef); /* ldr x15, [sp], #16 */
+#endif
+    LDRlit(codep, 16, PROBE_STUB_LITERAL -
+                      ((uint8_t *) *codep - (uint8_t *) start));
+    BR(codep, 16, false);
+    op32(codep, 0xd4200000); /* brk #0 */
+    op64(codep, (uint64_t) counter);
+    op64(codep, 0);
+}
+
+/* A trace stub (see trace.h): point x16 at the trace_site in the stub and
+ * jump to the common entry code ('common').  The site's target is filled in
+ * later through the writable view at TRACE_STUB_SITE. */
+#define TRACE_STUB_SIZE 40
+#define TRACE_STUB_SITE 16
+#define TRACE_STUB_COMMON 32
+static inline void make_trace_stub(void **codep, UNUSED uint_tptr pc,
+                                   uintptr_t common, uint32_t id,
+                                   UNUSED struct arch_dis_ctx arch) {
+    op32(codep, 0x10000010 | (TRACE_STUB_SITE >> 2) << 5); /* adr x16, site */
+    LDRlit(codep, 17, TRACE_STUB_COMMON - 4);
+    BR(codep, 17, false);
+    op32(codep, 0xd4200000); /* brk #0 */
+    op64(codep, 0);
+    op32(codep, id);
+    op32(codep, 0);
+    op64(codep, common);
+}
+
+/* A reentrancy guard stub (for SUBSTITUTE_REENTRANCY_GUARD), used as a hook's
+ * replacement.  TSD slot 'key' (off TPIDRRO_EL0 on Darwin, whose low bits
+ * used to hold the CPU number) holds the real return address while the
+ * replacement runs on this thread, so if it's set, this is a nested call and
+ * it just goes to the fallback (the original).  Otherwise it saves lr there,
+ * points lr at the epilogue, and goes to the replacement; the epilogue clears
+ * the slot and returns.  The literals are at GUARD_STUB_REPLACEMENT and
+ * GUARD_STUB_FALLBACK.  Only x16 and x17 are used, at entry and at return.
+ * (The saved lr isn't signed: on arm64e, callers don't sign it, callees do.) */
+#define GUARD_STUB_SIZE 80
+#define GUARD_STUB_REPLACEMENT 64
+#define GUARD_STUB_FALLBACK 72
+/* the largest LDR/STR scaled offset */
+#define GUARD_STUB_MAX_KEY 4095
+static inline void make_guard_stub(void **codep, UNUSED uint_tptr pc,
+                                   uint32_t key, uintptr_t replacement,
+                                   UNUSED struct arch_dis_ctx arch) {
+    op32(codep, 0xd53bd070); /* mrs x16, tpidrro_el0 */
+    op32(codep, 0x927df210); /* and x16, x16, #~7 */
+    op32(codep, 0xf9400211 | key << 10); /* ldr x17, [x16, #key*8] */
+    op32(codep, 0xb50000b1); /* cbnz x17, reentered */
+    op32(codep, 0xf900021e | key << 10); /* str x30, [x16, #key*8] */
+    op32(codep, 0x100000be); /* adr x30, epilogue */
+    LDRlit(codep, 16, GUARD_STUB_REPLACEMENT - 24);
+    BR(codep, 16, false);
+    /* reentered: */
+    LDRlit(codep, 16, GUARD_STUB_FALLBACK - 32);
+    BR(codep, 16, false);
+    /* epilogue: */
+    op32(codep, 0xd53bd070); /* mrs x16, tpidrro_el0 */
+    op32(codep, 0x927df210); /* and x16, x16, #~7 */
+    op32(codep, 0xf940021e | key << 10); /* ldr x30, [x16, #key*8] */
+    op32(codep, 0xf900021f | key << 10); /* str xzr, [x16, #key*8] */
+    op32(codep, 0xd65f03c0); /* ret */
+    op32(codep, 0xd4200000); /* brk #0 */
+    op64(codep, replacement);
+    op64(codep, 0);
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include "jump-dis.h"
+#include "cbit/vec.h"
+#include <stdint.h>
+#include <stddef.h>
+/* An image-wide alternative to jump_dis_main: every branch or pc-relative
+ * reference in an image's __text, decoded once in a linear sweep and sorted
+ * by target, so checking a hook is just a binary search.  Unlike
+ * jump_dis_main this catches jumps from anywhere in the section, but it
+ * still can't see through jump tables or computed branches.
+ * Only available with ARCH_FIXED_WIDTH_INSNS. */
+struct branch_index {
+    uintptr_t text_start, text_end;
+    /* sorted by 'to' */
+    struct jump_dis_ref *refs;
+    size_t nrefs;
+};
+DECL_VEC(struct branch_index, branch_index);
+
+/* Returns 1 if anything outside [start, end) refers to (start, end) - the
+ * function start itself is fine, since that's where the jump patch goes - 0
+ * if not, or -1 if start isn't in an image's __text, in which case use
+ * jump_dis_main.  Indexes are built on first use and kept in *cache, so a
+ * batch of hooks into one image only decodes it once; free them with
+ * branch_index_cache_free. */
+int branch_index_check(struct vec_branch_index *cache, uintptr_t start,
+                       uintptr_t end, struct arch_dis_ctx arch);
+void branch_index_cache_free(struct vec_branch_index *cache);
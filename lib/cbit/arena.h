@@ -0,0 +1,78 @@
+#pragma once
+#include "misc.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* A bump allocator for scratch memory that all goes away at once.  Memory
+ * comes from a list of chunks, each twice the size of the last; arena_reset
+ * frees all but the newest (biggest) one and starts over in it, so an arena
+ * that's reset after each operation stops calling malloc once it's seen the
+ * biggest one.
+ *
+ * vec and htab can allocate from an arena instead of the heap: see
+ * VEC_STORAGE_INIT_ARENA and HTAB_STORAGE_INIT_ARENA.  Growing one leaves the
+ * old buffer behind in the arena, which is fine for scratch. */
+
+struct arena_chunk {
+    struct arena_chunk *prev;
+    size_t size;
+    char data[] __attribute__((aligned(16)));
+};
+
+struct arena {
+    struct arena_chunk *chunk;
+    char *cur, *end;
+};
+
+#define ARENA_MIN_CHUNK 4096
+#define ARENA_INIT_STATIC {NULL, NULL, NULL}
+
+UNUSED_STATIC_INLINE
+void arena_init(struct arena *a) {
+    a->chunk = NULL;
+    a->cur = a->end = NULL;
+}
+
+/* Returns NULL if out of memory. */
+UNUSED_STATIC_INLINE
+void *arena_alloc(struct arena *a, size_t size) {
+    size = safe_add(size, 15) & ~(size_t) 15;
+    if ((size_t) (a->end - a->cur) < size) {
+        size_t csize = a->chunk ? safe_mul(a->chunk->size, 2) : ARENA_MIN_CHUNK;
+        while (csize < size)
+            csize = safe_mul(csize, 2);
+        struct arena_chunk *c =
+            (struct arena_chunk *) malloc(safe_add(sizeof(*c), csize));
+        if (!c)
+            return NULL;
+        c->prev = a->chunk;
+        c->size = csize;
+        a->chunk = c;
+        a->cur = c->data;
+        a->end = c->data + csize;
+    }
+    void *ret = a->cur;
+    a->cur += size;
+    return ret;
+}
+
+UNUSED_STATIC_INLINE
+void arena_reset(struct arena *a) {
+    struct arena_chunk *c = a->chunk;
+    if (!c)
+        return;
+    for (struct arena_chunk *p = c->prev, *prev; p; p = prev) {
+        prev = p->prev;
+        free(p);
+    }
+    c->prev = NULL;
+    a->cur = c->data;
+}
+
+UNUSED_STATIC_INLINE
+void arena_free(struct arena *a) {
+    arena_reset(a);
+    free(a->chunk);
+    arena_init(a);
+}
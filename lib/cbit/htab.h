@@ -1,5 +1,6 @@
 #pragma once
 #include "misc.h"
+#include "arena.h"
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,6 +10,7 @@ struct htab_internal {
     size_t length;
     size_t capacity;
     void *base;
+    struct arena *arena; // see vec.h
     char hi_storage[1]; // see vec.h
 };
 
@@ -149,12 +151,16 @@ struct htab_internal {
                                   size_t entry_size) { \
         size_t old_size = hi->capacity * entry_size; \
         size_t new_size = safe_mul(size, entry_size); \
-        void *new_buf = malloc(new_size); \
+        void *new_buf = hi->arena ? arena_alloc(hi->arena, new_size) \
+                                  : malloc(new_size); \
+        if (hi->arena && !new_buf) \
+            abort(); \
         memset(new_buf, (nil_byte), new_size); \
         struct htab_internal temp; \
         temp.length = 0; \
         temp.capacity = size; \
         temp.base = new_buf; \
+        temp.arena = hi->arena; \
         for (size_t i = 0; i < old_size; i += entry_size) { \
             key_ty *bucket = (void *) ((char *) hi->base + i); \
             if (!null_func(bucket)) { \
@@ -166,7 +172,7 @@ struct htab_internal {
             } \
         } \
         hi->capacity = size; \
-        if (hi->base != hi->hi_storage) \
+        if (hi->base != hi->hi_storage && !hi->arena) \
             free(hi->base); \
         hi->base = new_buf; \
     } \
@@ -199,6 +205,7 @@ struct htab_internal {
                 size_t length; \
                 size_t capacity; \
                 bucket_ty *base; \
+                struct arena *arena; \
                 bucket_ty storage[1]; \
             }; \
         }; \
@@ -264,7 +271,7 @@ struct htab_internal {
     } \
     UNUSED_STATIC_INLINE \
     void htab_free_storage_##name(htab_ty *ht) { \
-        if (ht->base != ht->storage) \
+        if (ht->base != ht->storage && !ht->arena) \
             free(ht->base); \
     } \
     typedef char __plz_end_decl_htab_with_semicolon_##name
@@ -283,16 +290,23 @@ struct htab_internal {
     h->length = 0; \
     h->capacity = (sizeof((hs)->rest) / sizeof(struct htab_bucket_##name)) + 1; \
     h->base = h->storage; \
+    h->arena = NULL; \
     __htab_memset_##name(h->base, \
                          h->capacity * sizeof(struct htab_bucket_##name)); \
 } while (0)
 
+/* see VEC_STORAGE_INIT_ARENA */
+#define HTAB_STORAGE_INIT_ARENA(hs, name, a) do { \
+    HTAB_STORAGE_INIT(hs, name); \
+    (hs)->h.arena = (a); \
+} while (0)
+
 /* only works if nil_byte is 0 */
 #define HTAB_STORAGE_INIT_STATIC(hs, name) \
-    {{0, \
+    {{{{0, \
       (sizeof((hs)->rest) / sizeof(struct htab_bucket_##name)) + 1, \
       (hs)->h.storage \
-    }}
+    }}}}
 
 #define HTAB_FOREACH(ht, key_var, val_var, name) \
     LET(struct htab_##name *__htfe_ht = (ht)) \
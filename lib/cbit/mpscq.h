@@ -0,0 +1,163 @@
+#pragma once
+#include "misc.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+/* Bounded queues for handing values from other threads to one consumer
+ * without locks, and without allocating after init - so producers can be in
+ * the middle of hooked functions, signal handlers and the like.  Unlike
+ * cqueue.h, they never grow: a push to a full queue just fails, and it's up
+ * to the caller whether to drop or count the value.  The capacity must be a
+ * power of 2.
+ *
+ *   DECL_MPSCQ(ty, name);  any number of producers, one consumer
+ *   DECL_SPSCQ(ty, name);  one producer (say, per thread), one consumer
+ *
+ * The MPSC queue is Vyukov's bounded ring: each slot has a sequence number
+ * saying whether it's ready to be written or read for the current lap, so
+ * producers only contend on one compare-and-swap of the write position.  A
+ * producer stopped between claiming a slot and filling it holds up the
+ * consumer (but not other producers) until it continues; pops just return
+ * false in the meantime.  The SPSC queue needs no read-modify-write at all.
+ *
+ * The producers' and consumer's ends are kept on separate cache lines.
+ */
+
+#if defined(__arm64__) || defined(__aarch64__)
+#define CBIT_CACHE_LINE 128
+#else
+#define CBIT_CACHE_LINE 64
+#endif
+
+#define DECL_MPSCQ(ty, name) \
+    typedef ty __MPSCQ_TY_##name; \
+    struct mpscq_slot_##name { \
+        size_t seq; \
+        __MPSCQ_TY_##name val; \
+    }; \
+    struct mpscq_##name { \
+        struct mpscq_slot_##name *slots; \
+        size_t mask; \
+        char __pad1[CBIT_CACHE_LINE]; \
+        size_t write_pos; \
+        char __pad2[CBIT_CACHE_LINE]; \
+        size_t read_pos; \
+        char __pad3[CBIT_CACHE_LINE]; \
+    }; \
+    /* Returns false if out of memory. */ \
+    UNUSED_STATIC_INLINE \
+    bool mpscq_init_##name(struct mpscq_##name *q, size_t capacity) { \
+        q->slots = (struct mpscq_slot_##name *) \
+            malloc(safe_mul(capacity, sizeof(*q->slots))); \
+        if (!q->slots) \
+            return false; \
+        for (size_t i = 0; i < capacity; i++) \
+            q->slots[i].seq = i; \
+        q->mask = capacity - 1; \
+        q->write_pos = q->read_pos = 0; \
+        return true; \
+    } \
+    UNUSED_STATIC_INLINE \
+    void mpscq_free_storage_##name(struct mpscq_##name *q) { \
+        free(q->slots); \
+    } \
+    /* Any thread.  Returns false if the queue is full. */ \
+    UNUSED_STATIC_INLINE \
+    bool mpscq_push_##name(struct mpscq_##name *q, __MPSCQ_TY_##name val) { \
+        size_t pos = __atomic_load_n(&q->write_pos, __ATOMIC_RELAXED); \
+        struct mpscq_slot_##name *slot; \
+        while (1) { \
+            slot = &q->slots[pos & q->mask]; \
+            size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE); \
+            intptr_t diff = (intptr_t) (seq - pos); \
+            if (diff == 0) { \
+                if (__atomic_compare_exchange_n(&q->write_pos, &pos, pos + 1, \
+                                                /*weak*/ true, \
+                                                __ATOMIC_RELAXED, \
+                                                __ATOMIC_RELAXED)) \
+                    break; \
+            } else if (diff < 0) { \
+                /* still holding last lap's value */ \
+                return false; \
+            } else { \
+                pos = __atomic_load_n(&q->write_pos, __ATOMIC_RELAXED); \
+            } \
+        } \
+        slot->val = val; \
+        __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE); \
+        return true; \
+    } \
+    /* Consumer only.  Returns false if there's nothing (finished) to pop. */ \
+    UNUSED_STATIC_INLINE \
+    bool mpscq_pop_##name(struct mpscq_##name *q, __MPSCQ_TY_##name *valp) { \
+        size_t pos = q->read_pos; \
+        struct mpscq_slot_##name *slot = &q->slots[pos & q->mask]; \
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1) \
+            return false; \
+        *valp = slot->val; \
+        __atomic_store_n(&slot->seq, pos + q->mask + 1, __ATOMIC_RELEASE); \
+        q->read_pos = pos + 1; \
+        return true; \
+    } \
+    typedef char __plz_end_decl_mpscq_with_semicolon_##name
+
+#define DECL_SPSCQ(ty, name) \
+    typedef ty __SPSCQ_TY_##name; \
+    struct spscq_##name { \
+        __SPSCQ_TY_##name *els; \
+        size_t mask; \
+        char __pad1[CBIT_CACHE_LINE]; \
+        /* the producer's, with its last look at read_pos */ \
+        size_t write_pos, cached_read_pos; \
+        char __pad2[CBIT_CACHE_LINE]; \
+        /* and the consumer's */ \
+        size_t read_pos, cached_write_pos; \
+        char __pad3[CBIT_CACHE_LINE]; \
+    }; \
+    /* Returns false if out of memory. */ \
+    UNUSED_STATIC_INLINE \
+    bool spscq_init_##name(struct spscq_##name *q, size_t capacity) { \
+        q->els = (__SPSCQ_TY_##name *) \
+            malloc(safe_mul(capacity, sizeof(*q->els))); \
+        if (!q->els) \
+            return false; \
+        q->mask = capacity - 1; \
+        q->write_pos = q->cached_read_pos = 0; \
+        q->read_pos = q->cached_write_pos = 0; \
+        return true; \
+    } \
+    UNUSED_STATIC_INLINE \
+    void spscq_free_storage_##name(struct spscq_##name *q) { \
+        free(q->els); \
+    } \
+    /* Producer only.  Returns false if the queue is full. */ \
+    UNUSED_STATIC_INLINE \
+    bool spscq_push_##name(struct spscq_##name *q, __SPSCQ_TY_##name val) { \
+        size_t pos = q->write_pos; \
+        if (pos - q->cached_read_pos > q->mask) { \
+            q->cached_read_pos = __atomic_load_n(&q->read_pos, \
+                                                 __ATOMIC_ACQUIRE); \
+            if (pos - q->cached_read_pos > q->mask) \
+                return false; \
+        } \
+        q->els[pos & q->mask] = val; \
+        __atomic_store_n(&q->write_pos, pos + 1, __ATOMIC_RELEASE); \
+        return true; \
+    } \
+    /* Consumer only.  Returns false if the queue is empty. */ \
+    UNUSED_STATIC_INLINE \
+    bool spscq_pop_##name(struct spscq_##name *q, __SPSCQ_TY_##name *valp) { \
+        size_t pos = q->read_pos; \
+        if (pos == q->cached_write_pos) { \
+            q->cached_write_pos = __atomic_load_n(&q->write_pos, \
+                                                  __ATOMIC_ACQUIRE); \
+            if (pos == q->cached_write_pos) \
+                return false; \
+        } \
+        *valp = q->els[pos & q->mask]; \
+        __atomic_store_n(&q->read_pos, pos + 1, __ATOMIC_RELEASE); \
+        return true; \
+    } \
+    typedef char __plz_end_decl_spscq_with_semicolon_##name
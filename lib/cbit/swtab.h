@@ -0,0 +1,266 @@
+#pragma once
+#include "misc.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+/* An alternative to htab.h for big tables that are mostly looked up in (like
+ * symbol indexes): instead of checking each bucket's key in turn, it keeps a
+ * separate array of control bytes, one per bucket, holding 7 bits of the
+ * key's hash (or marking the bucket empty or deleted), and probes them a
+ * group of 16 at a time with SSE2 or NEON compares.  Keys are only compared
+ * for buckets whose hash fragment matches, so a lookup mostly reads one
+ * cache line of control bytes plus the one bucket it's after.
+ *
+ * Unlike htab.h, keys don't need a null value, and there's no inline
+ * storage: an empty table has no allocation until the first insertion.  The
+ * table is at most 7/8 full, and grows by doubling.  Pointers returned by
+ * swtab_getp/setp are invalidated by the next insertion.
+ *
+ *   DECL_SWTAB(name, key_ty, value_ty, hash_func, eq_func);
+ *
+ * hash_func(const key_ty *) returns a size_t (it gets mixed, so simple
+ * hashes like the identity are fine); eq_func(const key_ty *, const key_ty *)
+ * compares two keys.  Both may be macros.
+ */
+
+#define SWTAB_GROUP 16
+#define SWTAB_EMPTY ((uint8_t) 0x80)
+#define SWTAB_DELETED ((uint8_t) 0xfe)
+
+/* A bitmask of the slots in a group that matched, SWTAB_MASK_SHIFT bits per
+ * slot, with only the top bit of each slot's bits set. */
+#if defined(__SSE2__)
+typedef uint32_t swtab_mask;
+#define SWTAB_MASK_SHIFT 0
+UNUSED_STATIC_INLINE
+swtab_mask swtab_match(const uint8_t *ctrl, uint8_t h2) {
+    __m128i group = _mm_load_si128((const __m128i *) ctrl);
+    return (swtab_mask) _mm_movemask_epi8(
+        _mm_cmpeq_epi8(group, _mm_set1_epi8((char) h2)));
+}
+/* empty or deleted */
+UNUSED_STATIC_INLINE
+swtab_mask swtab_match_free(const uint8_t *ctrl) {
+    return (swtab_mask) _mm_movemask_epi8(
+        _mm_load_si128((const __m128i *) ctrl));
+}
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+/* NEON has no movemask; narrowing each 16-bit pair of compare results by 4
+ * gives 4 bits per slot. */
+typedef uint64_t swtab_mask;
+#define SWTAB_MASK_SHIFT 2
+UNUSED_STATIC_INLINE
+swtab_mask swtab_neon_mask(uint8x16_t cmp) {
+    uint8x8_t narrowed = vshrn_n_u16(vreinterpretq_u16_u8(cmp), 4);
+    return vget_lane_u64(vreinterpret_u64_u8(narrowed), 0) &
+           0x8888888888888888ull;
+}
+UNUSED_STATIC_INLINE
+swtab_mask swtab_match(const uint8_t *ctrl, uint8_t h2) {
+    return swtab_neon_mask(vceqq_u8(vld1q_u8(ctrl), vdupq_n_u8(h2)));
+}
+UNUSED_STATIC_INLINE
+swtab_mask swtab_match_free(const uint8_t *ctrl) {
+    return swtab_neon_mask(vtstq_u8(vld1q_u8(ctrl), vdupq_n_u8(0x80)));
+}
+#else
+typedef uint32_t swtab_mask;
+#define SWTAB_MASK_SHIFT 0
+UNUSED_STATIC_INLINE
+swtab_mask swtab_match(const uint8_t *ctrl, uint8_t h2) {
+    swtab_mask mask = 0;
+    for (int i = 0; i < SWTAB_GROUP; i++)
+        mask |= (swtab_mask) (ctrl[i] == h2) << i;
+    return mask;
+}
+UNUSED_STATIC_INLINE
+swtab_mask swtab_match_free(const uint8_t *ctrl) {
+    swtab_mask mask = 0;
+    for (int i = 0; i < SWTAB_GROUP; i++)
+        mask |= (swtab_mask) (ctrl[i] >> 7) << i;
+    return mask;
+}
+#endif
+
+UNUSED_STATIC_INLINE
+swtab_mask swtab_match_empty(const uint8_t *ctrl) {
+    return swtab_match(ctrl, SWTAB_EMPTY);
+}
+
+#define swtab_mask_next(mask) ((mask) & ((mask) - 1))
+#define swtab_mask_index(mask) \
+    ((size_t) __builtin_ctzll(mask) >> SWTAB_MASK_SHIFT)
+
+UNUSED_STATIC_INLINE
+size_t swtab_mix(size_t hash) {
+    hash *= (size_t) 0x9e3779b97f4a7c15ull;
+    return hash ^ (hash >> (sizeof(size_t) * 4));
+}
+
+/* Groups are probed in triangular order (+1, +2, +3...), which visits every
+ * group once when the number of groups is a power of two. */
+#define SWTAB_FOREACH_PROBE(t, hash, gvar) \
+    for (size_t __swp_mask = (t)->capacity / SWTAB_GROUP - 1, \
+                gvar = ((hash) >> 7) & __swp_mask, __swp_step = 0; \
+         __swp_step <= __swp_mask; \
+         gvar = (gvar + ++__swp_step) & __swp_mask)
+
+#define SWTAB_FOREACH(t, key_var, val_var, name) \
+    LET(struct swtab_##name *__swfe_t = (t)) \
+        for (size_t __swfe_i = 0; __swfe_i < __swfe_t->capacity; __swfe_i++) \
+            if (__swfe_t->ctrl[__swfe_i] & 0x80) \
+                continue; \
+            else \
+                LET_LOOP(key_var = &__swfe_t->slots[__swfe_i].key) \
+                    LET_LOOP(val_var = &__swfe_t->slots[__swfe_i].value)
+
+#define DECL_SWTAB(name, key_ty, value_ty, hash_func, eq_func) \
+    struct swtab_bucket_##name { \
+        key_ty key; \
+        value_ty value; \
+    }; \
+    struct swtab_##name { \
+        size_t length; \
+        size_t capacity; \
+        size_t growth_left; \
+        uint8_t *ctrl; \
+        struct swtab_bucket_##name *slots; \
+    }; \
+    UNUSED_STATIC_INLINE \
+    void swtab_init_##name(struct swtab_##name *t) { \
+        memset(t, 0, sizeof(*t)); \
+    } \
+    UNUSED_STATIC_INLINE \
+    void swtab_free_storage_##name(struct swtab_##name *t) { \
+        free(t->ctrl); \
+    } \
+    UNUSED_STATIC_INLINE \
+    struct swtab_bucket_##name *swtab_getbucket_##name( \
+        const struct swtab_##name *t, const key_ty *key) { \
+        if (!t->capacity) \
+            return NULL; \
+        size_t hash = swtab_mix(hash_func(key)); \
+        uint8_t h2 = hash & 0x7f; \
+        SWTAB_FOREACH_PROBE(t, hash, g) { \
+            const uint8_t *ctrl = t->ctrl + g * SWTAB_GROUP; \
+            for (swtab_mask m = swtab_match(ctrl, h2); m; \
+                 m = swtab_mask_next(m)) { \
+                struct swtab_bucket_##name *b = \
+                    &t->slots[g * SWTAB_GROUP + swtab_mask_index(m)]; \
+                if (eq_func(&b->key, key)) \
+                    return b; \
+            } \
+            if (swtab_match_empty(ctrl)) \
+                return NULL; \
+        } \
+        return NULL; \
+    } \
+    UNUSED_STATIC_INLINE \
+    value_ty *swtab_getp_##name(const struct swtab_##name *t, \
+                                const key_ty *key) { \
+        struct swtab_bucket_##name *b = swtab_getbucket_##name(t, key); \
+        return b ? &b->value : NULL; \
+    } \
+    /* a free slot for a key that isn't in the table */ \
+    UNUSED_STATIC_INLINE \
+    size_t __swtab_free_slot_##name(const struct swtab_##name *t, \
+                                   size_t hash) { \
+        SWTAB_FOREACH_PROBE(t, hash, g) { \
+            swtab_mask m = swtab_match_free(t->ctrl + g * SWTAB_GROUP); \
+            if (m) \
+                return g * SWTAB_GROUP + swtab_mask_index(m); \
+        } \
+        __builtin_unreachable(); \
+    } \
+    UNUSED_STATIC_INLINE \
+    void swtab_resize_##name(struct swtab_##name *t, size_t capacity) { \
+        size_t slots_off = (capacity + 15) & ~(size_t) 15; \
+        uint8_t *ctrl = malloc(safe_add(slots_off, \
+            safe_mul(capacity, sizeof(struct swtab_bucket_##name)))); \
+        if (!ctrl) \
+            abort(); \
+        memset(ctrl, SWTAB_EMPTY, capacity); \
+        struct swtab_##name old = *t; \
+        t->capacity = capacity; \
+        t->growth_left = capacity - capacity / 8 - old.length; \
+        t->ctrl = ctrl; \
+        t->slots = (void *) (ctrl + slots_off); \
+        for (size_t i = 0; i < old.capacity; i++) { \
+            if (old.ctrl[i] & 0x80) \
+                continue; \
+            size_t hash = swtab_mix(hash_func(&old.slots[i].key)); \
+            size_t slot = __swtab_free_slot_##name(t, hash); \
+            t->ctrl[slot] = hash & 0x7f; \
+            t->slots[slot] = old.slots[i]; \
+        } \
+        free(old.ctrl); \
+    } \
+    UNUSED_STATIC_INLINE \
+    struct swtab_bucket_##name *swtab_setbucket_##name( \
+        struct swtab_##name *t, const key_ty *key, bool *new_p) { \
+        struct swtab_bucket_##name *b = swtab_getbucket_##name(t, key); \
+        if (new_p) \
+            *new_p = !b; \
+        if (b) \
+            return b; \
+        size_t hash = swtab_mix(hash_func(key)); \
+        size_t slot = 0; \
+        if (t->capacity) \
+            slot = __swtab_free_slot_##name(t, hash); \
+        if (!t->capacity || \
+            (!t->growth_left && t->ctrl[slot] == SWTAB_EMPTY)) { \
+            /* If it's mostly tombstones, rehashing at the same size is \
+             * enough to get them back. */ \
+            size_t capacity = t->capacity; \
+            if (!capacity) \
+                capacity = SWTAB_GROUP; \
+            else if (t->length >= capacity / 2) \
+                capacity = safe_mul(capacity, 2); \
+            swtab_resize_##name(t, capacity); \
+            slot = __swtab_free_slot_##name(t, hash); \
+        } \
+        if (t->ctrl[slot] == SWTAB_EMPTY) \
+            t->growth_left--; \
+        t->ctrl[slot] = hash & 0x7f; \
+        t->length++; \
+        b = &t->slots[slot]; \
+        b->key = *key; \
+        return b; \
+    } \
+    UNUSED_STATIC_INLINE \
+    value_ty *swtab_setp_##name(struct swtab_##name *t, const key_ty *key, \
+                                bool *new_p) { \
+        return &swtab_setbucket_##name(t, key, new_p)->value; \
+    } \
+    UNUSED_STATIC_INLINE \
+    void swtab_removeat_##name(struct swtab_##name *t, \
+                               struct swtab_bucket_##name *b) { \
+        size_t slot = b - t->slots; \
+        /* A lookup only goes past a group with no empty slots, so if this \
+         * one has one, nothing was ever probed past it, and the slot can \
+         * just be emptied. */ \
+        if (swtab_match_empty(t->ctrl + (slot & ~(size_t) (SWTAB_GROUP - 1)))) { \
+            t->ctrl[slot] = SWTAB_EMPTY; \
+            t->growth_left++; \
+        } else { \
+            t->ctrl[slot] = SWTAB_DELETED; \
+        } \
+        t->length--; \
+    } \
+    UNUSED_STATIC_INLINE \
+    bool swtab_remove_##name(struct swtab_##name *t, const key_ty *key) { \
+        struct swtab_bucket_##name *b = swtab_getbucket_##name(t, key); \
+        if (!b) \
+            return false; \
+        swtab_removeat_##name(t, b); \
+        return true; \
+    } \
+    typedef char __plz_end_decl_swtab_with_semicolon_##name
@@ -7,7 +7,14 @@ void vec_realloc_internal(struct vec_internal *vi, size_t new_capacity,
     if (new_capacity == 0)
         abort();
     size_t new_size = safe_mul(new_capacity, esize);
-    if (vi->els == vi->storage) {
+    if (vi->arena) {
+        void *new = arena_alloc(vi->arena, new_size);
+        if (!new)
+            abort();
+        size_t min_cap = new_capacity < vi->capacity ? new_capacity : vi->capacity;
+        memcpy(new, vi->els, min_cap * esize);
+        vi->els = new;
+    } else if (vi->els == vi->storage) {
         void *new = malloc(new_size);
         size_t min_cap = new_capacity < vi->capacity ? new_capacity : vi->capacity;
         memcpy(new, vi->els, min_cap * esize);
@@ -22,6 +29,6 @@ void vec_realloc_internal_as_necessary(struct vec_internal *vi,
                                        size_t esize) {
     if (min_capacity > vi->capacity)
         vec_realloc_internal(vi, safe_mul(vi->capacity, 2), esize);
-    else if (min_capacity < vi->capacity / 3)
+    else if (min_capacity < vi->capacity / 3 && !vi->arena)
         vec_realloc_internal(vi, vi->capacity / 3, esize);
 }
@@ -1,5 +1,6 @@
 #pragma once
 #include "misc.h"
+#include "arena.h"
 #include <stdlib.h>
 #include <string.h>
 
@@ -7,6 +8,9 @@ struct vec_internal {
     size_t length;
     size_t capacity;
     void *els;
+    /* if set, els comes from here rather than the heap once it outgrows
+     * storage */
+    struct arena *arena;
     char storage[1]; // must be at least one byte so vec_free works correctly
 };
 
@@ -32,13 +36,14 @@ void vec_realloc_internal_as_necessary(struct vec_internal *vi,
                 size_t length; \
                 size_t capacity; \
                 VEC_TY(name) *els; \
+                struct arena *arena; \
                 VEC_TY(name) storage[1]; \
             }; \
         }; \
     }; \
     UNUSED_STATIC_INLINE \
     void vec_free_storage_##name(struct vec_##name *v) { \
-        if (v->els != v->storage) \
+        if (v->els != v->storage && !v->arena) \
             free(v->els); \
     } \
     UNUSED_STATIC_INLINE \
@@ -46,6 +51,7 @@ void vec_realloc_internal_as_necessary(struct vec_internal *vi,
         struct vec_##name v; \
         v.length = v.capacity = length; \
         v.els = els; \
+        v.arena = NULL; \
         return v; \
     } \
     UNUSED_STATIC_INLINE \
@@ -119,13 +125,21 @@ void vec_realloc_internal_as_necessary(struct vec_internal *vi,
     v->length = 0; \
     v->capacity = (sizeof((vs)->rest) / sizeof(VEC_TY(name))) + 1; \
     v->els = v->storage; \
+    v->arena = NULL; \
+} while (0)
+
+/* like VEC_STORAGE_INIT, but anything that doesn't fit in the inline storage
+ * comes from the arena (so vec_free_storage isn't needed) */
+#define VEC_STORAGE_INIT_ARENA(vs, name, a) do { \
+    VEC_STORAGE_INIT(vs, name); \
+    (vs)->v.arena = (a); \
 } while (0)
 
 #define VEC_STORAGE_INIT_STATIC(vs, name) \
-    {{0, \
-      (sizeof((vs)->rest) / sizeof((vs)->rest[0])) + 1, \
-      (vs)->v.storage \
-    }}
+    {{{{0, \
+        (sizeof((vs)->rest) / sizeof((vs)->rest[0])) + 1, \
+        (vs)->v.storage \
+    }}}}
 
 /* guaranteed to *not* cache vec->length - pretty simple */
 
@@ -0,0 +1,114 @@
+#ifdef __APPLE__
+
+#include "substitute-internal.h"
+#include "branch-index.h"
+#include <string.h>
+#include <stdlib.h>
+#include <dlfcn.h>
+#include <mach-o/loader.h>
+
+#ifdef ARCH_FIXED_WIDTH_INSNS
+
+static bool find_text(const void *hdr, uintptr_t *start_p, uintptr_t *end_p) {
+    const mach_header_x *mh = hdr;
+    const struct load_command *lc = (void *) (mh + 1);
+    for (uint32_t i = 0; i < mh->ncmds; i++) {
+        if (lc->cmd == LC_SEGMENT_X) {
+            const segment_command_x *sc = (void *) lc;
+            if (!strncmp(sc->segname, "__TEXT", 16)) {
+                intptr_t slide = (uintptr_t) hdr - sc->vmaddr;
+                const section_x *sects = (void *) (sc + 1);
+                for (uint32_t j = 0; j < sc->nsects; j++) {
+                    if (!strncmp(sects[j].sectname, "__text", 16)) {
+                        *start_p = sects[j].addr + slide;
+                        *end_p = *start_p + sects[j].size;
+                        return true;
+                    }
+                }
+                return false;
+            }
+        }
+        lc = (void *) lc + lc->cmdsize;
+    }
+    return false;
+}
+
+static int compare_refs(const void *a, const void *b) {
+    uint32_t ta = ((const struct jump_dis_ref *) a)->to;
+    uint32_t tb = ((const struct jump_dis_ref *) b)->to;
+    return ta < tb ? -1 : ta > tb;
+}
+
+static struct branch_index *get_index(struct vec_branch_index *cache,
+                                      uintptr_t pc, struct arch_dis_ctx arch) {
+    for (size_t i = 0; i < cache->length; i++) {
+        struct branch_index *bi = &cache->els[i];
+        if (pc - bi->text_start < bi->text_end - bi->text_start)
+            return bi;
+    }
+    Dl_info info;
+    struct branch_index bi;
+    if (!dladdr((void *) pc, &info) || !info.dli_fbase ||
+        !find_text(info.dli_fbase, &bi.text_start, &bi.text_end) ||
+        pc - bi.text_start >= bi.text_end - bi.text_start ||
+        bi.text_end - bi.text_start > UINT32_MAX)
+        return NULL;
+    VEC_STORAGE(jump_dis_ref) refs;
+    VEC_STORAGE_INIT(&refs, jump_dis_ref);
+    jump_dis_collect_refs((void *) bi.text_start, bi.text_start,
+                          bi.text_end - bi.text_start, arch, &refs.v);
+    qsort(refs.v.els, refs.v.length, sizeof(refs.v.els[0]), compare_refs);
+    if (refs.v.els == refs.v.storage) {
+        /* tiny section; the inline storage is about to go away */
+        bi.refs = malloc(sizeof(refs.v.storage) + sizeof(refs.rest));
+        if (!bi.refs)
+            return NULL;
+        memcpy(bi.refs, refs.v.els, refs.v.length * sizeof(refs.v.els[0]));
+    } else {
+        bi.refs = refs.v.els;
+    }
+    bi.nrefs = refs.v.length;
+    vec_append_branch_index(cache, bi);
+    return &cache->els[cache->length - 1];
+}
+
+int branch_index_check(struct vec_branch_index *cache, uintptr_t start,
+                       uintptr_t end, struct arch_dis_ctx arch) {
+    struct branch_index *bi = get_index(cache, start, arch);
+    if (!bi)
+        return -1;
+    uint32_t lo_off = start - bi->text_start, hi_off = end - bi->text_start;
+    /* first ref with to > lo_off */
+    size_t lo = 0, hi = bi->nrefs;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (bi->refs[mid].to <= lo_off)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (; lo < bi->nrefs && bi->refs[lo].to < hi_off; lo++) {
+        /* references from inside the region get relocated with it */
+        if (bi->refs[lo].from - lo_off >= hi_off - lo_off)
+            return 1;
+    }
+    return 0;
+}
+
+#else /* ARCH_FIXED_WIDTH_INSNS */
+
+int branch_index_check(UNUSED struct vec_branch_index *cache,
+                       UNUSED uintptr_t start, UNUSED uintptr_t end,
+                       UNUSED struct arch_dis_ctx arch) {
+    return -1;
+}
+
+#endif /* ARCH_FIXED_WIDTH_INSNS */
+
+void branch_index_cache_free(struct vec_branch_index *cache) {
+    for (size_t i = 0; i < cache->length; i++)
+        free(cache->els[i].refs);
+    vec_free_storage_branch_index(cache);
+}
+
+#endif /* __APPLE__ */
@@ -0,0 +1,207 @@
+#ifdef __APPLE__
+
+#include "substitute.h"
+#include "substitute-internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <mach-o/dyld.h>
+#include "cbit/htab.h"
+#include "cbit/vec.h"
+
+/* Function hooks waiting for their image to be loaded, by image path, like
+ * the lazy Objective-C hooks in objc.c.  When the image shows up, all of its
+ * pending hooks are looked up and installed with one substitute_hook_symbols
+ * call per set of options. */
+struct deferred_hook {
+    char *symbol;
+    void *replacement;
+    void *old_ptr;
+    int options;
+};
+DECL_VEC(struct deferred_hook, deferred_hook);
+struct deferred_image {
+    char *path;
+    VEC_STORAGE(deferred_hook) hooks;
+};
+static inline size_t image_path_hash(const char *const *pp) {
+    size_t hash = 2166136261;
+    for (const char *p = *pp; *p; p++)
+        hash = (hash ^ (uint8_t) *p) * 16777619;
+    return hash;
+}
+#define image_path_eq(p1p, p2p) (!strcmp(*(p1p), *(p2p)))
+#define image_path_null(pp) (!*(pp))
+DECL_STATIC_HTAB_KEY(image_path, const char *, image_path_hash, image_path_eq,
+                     image_path_null, 0);
+DECL_HTAB(deferred_images, image_path, struct deferred_image *);
+static HTAB_STORAGE(deferred_images) deferred_images =
+    HTAB_STORAGE_INIT_STATIC(&deferred_images, deferred_images);
+static pthread_mutex_t deferred_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* see lazy_registering in objc.c */
+static bool deferred_registering;
+
+/* Take the image's pending hooks, if any are still there. */
+static struct deferred_image *claim_deferred_image(const char *path) {
+    pthread_mutex_lock(&deferred_mutex);
+    struct htab_bucket_deferred_images *bucket =
+        htab_getbucket_deferred_images(&deferred_images.h, &path);
+    struct deferred_image *di = NULL;
+    if (bucket) {
+        di = bucket->value;
+        htab_removeat_deferred_images(&deferred_images.h, bucket);
+    }
+    pthread_mutex_unlock(&deferred_mutex);
+    return di;
+}
+
+static int compare_by_options(const void *a, const void *b) {
+    int oa = ((const struct deferred_hook *) a)->options;
+    int ob = ((const struct deferred_hook *) b)->options;
+    return oa < ob ? -1 : oa > ob;
+}
+
+static int install_deferred_image(struct deferred_image *di,
+                                  struct substitute_image *im) {
+    struct vec_deferred_hook *v = &di->hooks.v;
+    size_t n = v->length;
+    struct substitute_symbol_hook *hooks = malloc(n * sizeof(*hooks));
+    int *errors = malloc(n * sizeof(*errors));
+    int ret = SUBSTITUTE_ERR_OOM;
+    if (!hooks || !errors)
+        goto end;
+    ret = SUBSTITUTE_OK;
+    qsort(v->els, n, sizeof(v->els[0]), compare_by_options);
+    for (size_t i = 0; i < n; i++) {
+        hooks[i] = (struct substitute_symbol_hook) {
+            v->els[i].symbol, v->els[i].replacement, v->els[i].old_ptr
+        };
+    }
+    for (size_t start = 0, stop; start < n; start = stop) {
+        int options = v->els[start].options;
+        for (stop = start; stop < n && v->els[stop].options == options;
+             stop++)
+            ;
+        int r = substitute_hook_symbols(im, &hooks[start], stop - start,
+                                        &errors[start], NULL, options);
+        if (r && !ret)
+            ret = r;
+        for (size_t i = start; i < stop; i++) {
+            if (errors[i] == SUBSTITUTE_ERR_NO_SUCH_SYMBOL) {
+                LOG("Couldn't find \"%s\" in \"%s\" for a deferred hook",
+                    hooks[i].name, di->path);
+            } else if (errors[i]) {
+                LOG("Couldn't install deferred hook for \"%s\" in \"%s\": %s",
+                    hooks[i].name, di->path, substitute_strerror(errors[i]));
+            }
+        }
+    }
+end:
+    free(hooks);
+    free(errors);
+    for (size_t i = 0; i < n; i++)
+        free(v->els[i].symbol);
+    vec_free_storage_deferred_hook(v);
+    free(di->path);
+    free(di);
+    return ret;
+}
+
+static void deferred_image_added(const struct mach_header *mh,
+                                 UNUSED intptr_t slide) {
+    if (__atomic_load_n(&deferred_registering, __ATOMIC_ACQUIRE))
+        return;
+    pthread_mutex_lock(&deferred_mutex);
+    bool any = deferred_images.h.length != 0;
+    pthread_mutex_unlock(&deferred_mutex);
+    Dl_info info;
+    if (!any || !dladdr(mh, &info) || !info.dli_fname)
+        return;
+    struct deferred_image *di = claim_deferred_image(info.dli_fname);
+    if (!di)
+        return;
+    /* (not substitute_open_image, which would dlopen from inside dyld's
+     * callback) */
+    struct substitute_image *im = substitute_open_image_by_address(mh);
+    if (!im) {
+        LOG("Couldn't open \"%s\" for deferred hooks", di->path);
+        return;
+    }
+    install_deferred_image(di, im);
+    substitute_close_image(im);
+}
+
+static void register_deferred_image_added() {
+    __atomic_store_n(&deferred_registering, true, __ATOMIC_RELEASE);
+    _dyld_register_func_for_add_image(deferred_image_added);
+    __atomic_store_n(&deferred_registering, false, __ATOMIC_RELEASE);
+}
+
+EXPORT
+int substitute_hook_functions_deferred(const char *image_path,
+                                       const char *const *symbols,
+                                       void *const *replacements,
+                                       void *const *old_ptrs, size_t n,
+                                       int options) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    if (!n)
+        return SUBSTITUTE_OK;
+    pthread_mutex_lock(&deferred_mutex);
+    struct htab_bucket_deferred_images *bucket =
+        htab_setbucket_deferred_images(&deferred_images.h, &image_path);
+    bool new_image = !bucket->key;
+    if (new_image) {
+        struct deferred_image *di = malloc(sizeof(*di));
+        char *path = strdup(image_path);
+        if (!di || !path) {
+            free(di);
+            free(path);
+            htab_removeat_deferred_images(&deferred_images.h, bucket);
+            pthread_mutex_unlock(&deferred_mutex);
+            return SUBSTITUTE_ERR_OOM;
+        }
+        di->path = path;
+        VEC_STORAGE_INIT(&di->hooks, deferred_hook);
+        /* the key has to outlive the caller's string */
+        bucket->key = path;
+        bucket->value = di;
+    }
+    struct vec_deferred_hook *v = &bucket->value->hooks.v;
+    size_t old_len = v->length;
+    for (size_t i = 0; i < n; i++) {
+        char *symbol = strdup(symbols[i]);
+        if (!symbol) {
+            /* take back the whole call */
+            for (size_t j = old_len; j < v->length; j++)
+                free(v->els[j].symbol);
+            vec_resize_deferred_hook(v, old_len);
+            if (new_image) {
+                struct deferred_image *di = bucket->value;
+                htab_removeat_deferred_images(&deferred_images.h, bucket);
+                vec_free_storage_deferred_hook(v);
+                free(di->path);
+                free(di);
+            }
+            pthread_mutex_unlock(&deferred_mutex);
+            return SUBSTITUTE_ERR_OOM;
+        }
+        vec_append_deferred_hook(v, (struct deferred_hook) {
+            symbol, replacements[i], old_ptrs ? old_ptrs[i] : NULL, options
+        });
+    }
+    pthread_mutex_unlock(&deferred_mutex);
+
+    pthread_once(&once, register_deferred_image_added);
+    /* Already loaded?  (Checked after adding the hooks, as in
+     * substitute_hook_objc_message_lazy.) */
+    struct substitute_image *im = substitute_open_image(image_path);
+    if (!im)
+        return SUBSTITUTE_OK;
+    struct deferred_image *di = claim_deferred_image(image_path);
+    int ret = di ? install_deferred_image(di, im) : SUBSTITUTE_OK;
+    substitute_close_image(im);
+    return ret;
+}
+
+#endif /* __APPLE__ */
@@ -4,12 +4,14 @@
 #define _DARWIN_C_SOURCE
 #include "substitute.h"
 #include "substitute-internal.h"
-#include "cbit/htab.h"
+#include "cbit/vec.h"
 #include "execmem.h"
+#include "stats.h"
 #include "darwin/manual-syscall.h"
 #include "darwin/mach-decls.h"
 #include "ptrauth_helpers.h"
 #include <mach/mach.h>
+#include <libkern/OSCacheControl.h>
 #ifndef __MigPackStructs
 #error wtf
 #endif
@@ -33,6 +35,9 @@ __typeof__(mach_msg) manual_mach_msg;
 GEN_SYSCALL(mach_msg, -31);
 __typeof__(mach_thread_self) manual_thread_self;
 GEN_SYSCALL(thread_self, -27);
+/* _kernelrpc_mach_vm_protect_trap; mprotect(2) drops VM_PROT_COPY */
+__typeof__(mach_vm_protect) manual_mach_vm_protect;
+GEN_SYSCALL(mach_vm_protect, -14);
 
 extern int __sigaction(int, struct __sigaction * __restrict,
                        struct sigaction * __restrict);
@@ -45,42 +50,610 @@ static void manual_memcpy(void *restrict dest, const void *src, size_t len) {
         *d8++ = *s8++;
 }
 
+/* sys_icache_invalidate, without calling into libplatform (which might be
+ * what's being patched).  On arm64 this is the same sequence it uses, with
+ * the same assumed 64 byte line size, plus cleaning the data cache first;
+ * 32-bit ARM can't do cache maintenance from user mode, so it's the same
+ * platform call; x86 doesn't need it. */
+static void manual_icache_invalidate(void *start, size_t len) {
+#if defined(__arm64__)
+    if (!len)
+        return;
+    uintptr_t end = (uintptr_t) start + len;
+    uintptr_t line;
+    for (line = (uintptr_t) start & ~63; line < end; line += 64)
+        __asm__ volatile("dc cvau, %0" :: "r"(line) : "memory");
+    __asm__ volatile("dsb ish" ::: "memory");
+    for (line = (uintptr_t) start & ~63; line < end; line += 64)
+        __asm__ volatile("ic ivau, %0" :: "r"(line) : "memory");
+    __asm__ volatile("dsb ish\n"
+                     "isb" ::: "memory");
+#elif defined(__arm__)
+    register void *r0 __asm__("r0") = start;
+    register size_t r1 __asm__("r1") = len;
+    register int r3 __asm__("r3") = 0; /* icache invalidate */
+    register int r12 __asm__("r12") = (int) 0x80000000; /* platform call */
+    __asm__ volatile("svc #0x80"
+                     : "+r"(r0), "+r"(r1), "+r"(r3), "+r"(r12)
+                     :: "memory");
+#else
+    (void) start;
+    (void) len;
+#endif
+}
+
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-variable"
 #include "../generated/manual-mach.inc.h"
 #pragma GCC diagnostic pop
 
-#define port_hash(portp) (*(portp))
-#define port_eq(port1p, port2p) (*(port1p) == *(port2p))
-#define port_null(portp) (*(portp) == MACH_PORT_NULL)
-DECL_STATIC_HTAB_KEY(mach_port_t, mach_port_t, port_hash, port_eq, port_null, 0);
-struct empty {};
-DECL_HTAB(mach_port_set, mach_port_t, struct empty);
-
-/* This should only run on the main thread, so just use globals. */
-static HTAB_STORAGE(mach_port_set) g_suspended_ports;
-static struct sigaction old_segv, old_bus;
-static execmem_pc_patch_callback g_pc_patch_callback;
-static void *g_pc_patch_callback_ctx;
-static mach_port_t g_suspending_thread;
-
-int execmem_alloc_unsealed(uintptr_t hint, void **page_p, size_t *size_p) {
-    *size_p = PAGE_SIZE;
-    *page_p = mmap((void *) hint, *size_p, PROT_READ | PROT_WRITE,
-                   MAP_ANON | MAP_SHARED, -1, 0);
-    if (*page_p == MAP_FAILED)
+/* The trampoline arena.  Trampoline pages are kept for the life of the
+ * process, so that hook calls from many different libraries share pages
+ * rather than each mapping a mostly empty page of its own.  Pages are kept
+ * sorted by address, which groups them by the EXECMEM_ARENA_REGION_SHIFT
+ * sized region they live in; a caller that needs its trampoline to be
+ * reachable from some pc (with an ADRP or rel32) passes that pc and the
+ * reach, and we only look at pages within it.
+ *
+ * Each page is mapped twice, like the objc trampoline pages: once RX where
+ * the code runs, and once RW (anywhere) where we write it.  That way new
+ * trampolines can be appended to pages other threads are already running
+ * code from, without changing any protections.  Space handed out since the
+ * last flush can be given back with execmem_arena_abort.
+ *
+ * Trampolines for hot hooks get pages of their own, and start on a cache
+ * line, so that the few that matter share as few lines and pages as
+ * possible instead of being mixed in with all the rest. */
+struct arena_page {
+    uintptr_t addr;
+    uint8_t *rw;
+    bool hot;
+    /* bytes handed out */
+    size_t used;
+    /* bytes handed out as of the last flush */
+    size_t committed;
+};
+DECL_VEC(struct arena_page, arena_page);
+static VEC_STORAGE_CAPA(arena_page, 8) g_arena_pages =
+    VEC_STORAGE_INIT_STATIC(&g_arena_pages, arena_page);
+
+/* Space given back with execmem_arena_release, below some page's 'used', and
+ * the parts of it handed out again since the last flush (which go back on
+ * abort). */
+struct arena_block {
+    uintptr_t pc;
+    size_t size;
+};
+DECL_VEC(struct arena_block, arena_block);
+static VEC_STORAGE_CAPA(arena_block, 8) g_arena_free =
+    VEC_STORAGE_INIT_STATIC(&g_arena_free, arena_block);
+static VEC_STORAGE_CAPA(arena_block, 8) g_arena_taken =
+    VEC_STORAGE_INIT_STATIC(&g_arena_taken, arena_block);
+static pthread_mutex_t g_arena_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void execmem_arena_lock(void) {
+    pthread_mutex_lock(&g_arena_lock);
+}
+
+void execmem_arena_unlock(void) {
+    pthread_mutex_unlock(&g_arena_lock);
+}
+
+static bool arena_range_in_reach(uintptr_t lo, uintptr_t hi, uintptr_t hint,
+                                 uintptr_t reach) {
+    if (!reach)
+        return true;
+    /* every byte of the range has to be in reach */
+    if (hint >= hi)
+        return hint - lo < reach;
+    else if (hint <= lo)
+        return hi - hint < reach;
+    else
+        return true;
+}
+
+static bool arena_page_in_reach(uintptr_t page, uintptr_t hint,
+                                uintptr_t reach) {
+    return arena_range_in_reach(page, page + PAGE_SIZE, hint, reach);
+}
+
+/* first page whose address is >= addr */
+static size_t arena_lower_bound(uintptr_t addr) {
+    struct vec_arena_page *pages = &g_arena_pages.v;
+    size_t lo = 0, hi = pages->length;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (pages->els[mid].addr < addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static struct arena_page *arena_page_for(uintptr_t pc) {
+    size_t idx = arena_lower_bound((pc & ~PAGE_MASK) + 1);
+    return idx ? &g_arena_pages.v.els[idx - 1] : NULL;
+}
+
+/* Free address space, as of the last time we looked.  This is only a guess
+ * - anything else in the process can map memory in the meantime - so
+ * allocations made from it never use MAP_FIXED, and on a miss we look
+ * again. */
+struct hole {
+    uintptr_t start, end;
+};
+DECL_VEC(struct hole, hole);
+static VEC_STORAGE_CAPA(hole, 16) g_holes =
+    VEC_STORAGE_INIT_STATIC(&g_holes, hole);
+static bool g_holes_valid;
+
+static void scan_holes() {
+    struct vec_hole *holes = &g_holes.v;
+    vec_resize_hole(holes, 0);
+    mach_port_t task_self = mach_task_self();
+    vm_address_t addr = 0;
+    uintptr_t prev_end = PAGE_SIZE; /* never hand out page zero */
+    while (1) {
+        vm_size_t size = 0;
+        natural_t depth = 0;
+        struct vm_region_submap_short_info_64 info;
+        mach_msg_type_number_t count = VM_REGION_SUBMAP_SHORT_INFO_COUNT_64;
+        if (vm_region_recurse_64(task_self, &addr, &size, &depth,
+                                 (vm_region_recurse_info_t) &info, &count))
+            break;
+        if (addr > prev_end)
+            vec_append_hole(holes, (struct hole) {prev_end, addr});
+        if (addr + size < addr)
+            break;
+        prev_end = addr + size;
+        addr += size;
+    }
+    uintptr_t max = (uintptr_t) MACH_VM_MAX_ADDRESS;
+    if (prev_end < max)
+        vec_append_hole(holes, (struct hole) {prev_end, max});
+    g_holes_valid = true;
+}
+
+/* Find the address of a free page as close as possible to hint and within
+ * reach of it. */
+static bool find_hole_near(uintptr_t hint, uintptr_t reach,
+                           uintptr_t *addr_p) {
+    if (!g_holes_valid)
+        scan_holes();
+    struct vec_hole *holes = &g_holes.v;
+    uintptr_t best = 0, best_dist = UINTPTR_MAX;
+    for (size_t i = 0; i < holes->length; i++) {
+        struct hole *h = &holes->els[i];
+        if (h->end - h->start < PAGE_SIZE)
+            continue;
+        uintptr_t last = h->end - PAGE_SIZE;
+        uintptr_t cand = hint & ~PAGE_MASK;
+        if (cand < h->start)
+            cand = h->start;
+        else if (cand > last)
+            cand = last;
+        uintptr_t dist = cand > hint ? cand - hint : hint - cand;
+        if (dist < best_dist && arena_page_in_reach(cand, hint, reach)) {
+            best = cand;
+            best_dist = dist;
+        }
+    }
+    *addr_p = best;
+    return best_dist != UINTPTR_MAX;
+}
+
+static void hole_used(uintptr_t page) {
+    struct vec_hole *holes = &g_holes.v;
+    for (size_t i = 0; i < holes->length; i++) {
+        struct hole *h = &holes->els[i];
+        if (page < h->start || page >= h->end)
+            continue;
+        if (page == h->start) {
+            h->start += PAGE_SIZE;
+        } else if (page + PAGE_SIZE == h->end) {
+            h->end = page;
+        } else {
+            struct hole rest = {page + PAGE_SIZE, h->end};
+            h->end = page;
+            vec_add_space_hole(holes, i + 1, 1);
+            holes->els[i + 1] = rest;
+        }
+        return;
+    }
+}
+
+/* Map the RX alias of rw at exactly addr, or anywhere if addr is 0. */
+static kern_return_t arena_map_rx(uint8_t *rw, uintptr_t *addr_p) {
+    mach_port_t task_self = mach_task_self();
+    mach_vm_address_t addr = *addr_p;
+    vm_prot_t cur, max;
+    kern_return_t kr = mach_vm_remap(task_self, &addr, PAGE_SIZE, 0,
+                                     addr ? VM_FLAGS_FIXED : VM_FLAGS_ANYWHERE,
+                                     task_self, (mach_vm_address_t) rw,
+                                     /*copy*/ FALSE, &cur, &max,
+                                     VM_INHERIT_SHARE);
+    if (kr)
+        return kr;
+    kr = mach_vm_protect(task_self, addr, PAGE_SIZE, FALSE,
+                         VM_PROT_READ | VM_PROT_EXECUTE);
+    if (kr) {
+        mach_vm_deallocate(task_self, addr, PAGE_SIZE);
+        return kr;
+    }
+    *addr_p = addr;
+    return KERN_SUCCESS;
+}
+
+static int arena_new_page(uintptr_t hint, uintptr_t reach, bool hot,
+                          struct arena_page **pagep) {
+    uint8_t *rw = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_ANON | MAP_SHARED, -1, 0);
+    if (rw == MAP_FAILED)
         return SUBSTITUTE_ERR_VM;
+    uintptr_t addr = 0;
+    if (!reach) {
+        if (arena_map_rx(rw, &addr))
+            goto fail_vm;
+    } else {
+        /* The RW mapping itself might have just taken the hole */
+        g_holes_valid = false;
+        /* If the cached holes are out of date, the fixed mapping will fail;
+         * in that case rescan and try once more. */
+        for (int attempt = 0; ; attempt++) {
+            if (!find_hole_near(hint, reach, &addr)) {
+                munmap(rw, PAGE_SIZE);
+                return SUBSTITUTE_ERR_OUT_OF_RANGE;
+            }
+            kern_return_t kr = arena_map_rx(rw, &addr);
+            if (!kr) {
+                hole_used(addr);
+                break;
+            }
+            if (kr != KERN_NO_SPACE || attempt == 1)
+                goto fail_vm;
+            scan_holes();
+        }
+    }
+    size_t idx = arena_lower_bound(addr);
+    vec_add_space_arena_page(&g_arena_pages.v, idx, 1);
+    struct arena_page *page = &g_arena_pages.v.els[idx];
+    page->addr = addr;
+    page->rw = rw;
+    page->used = page->committed = 0;
+    page->hot = hot;
+    *pagep = page;
     return SUBSTITUTE_OK;
+
+fail_vm:
+    munmap(rw, PAGE_SIZE);
+    return SUBSTITUTE_ERR_VM;
 }
 
-int execmem_seal(void *page) {
-    if (mprotect(page, PAGE_SIZE, PROT_READ | PROT_EXEC))
-        return SUBSTITUTE_ERR_VM;
+static int arena_reserve(uintptr_t hint, uintptr_t reach, size_t size,
+                         bool hot, uintptr_t *pc_p, void **write_p) {
+    struct vec_arena_page *pages = &g_arena_pages.v;
+    size_t need = (size + EXECMEM_ARENA_ALIGN - 1) & ~(EXECMEM_ARENA_ALIGN - 1);
+    size_t align = hot ? EXECMEM_ARENA_HOT_ALIGN : EXECMEM_ARENA_ALIGN;
+    if (need > PAGE_SIZE)
+        return SUBSTITUTE_ERR_OOM;
+
+    struct vec_arena_block *free_blocks = &g_arena_free.v;
+    for (size_t i = 0; i < free_blocks->length; i++) {
+        struct arena_block *b = &free_blocks->els[i];
+        if (b->size < need || (b->pc & (align - 1)) ||
+            arena_page_for(b->pc)->hot != hot ||
+            !arena_range_in_reach(b->pc, b->pc + need, hint, reach))
+            continue;
+        uintptr_t pc = b->pc;
+        if (b->size == need) {
+            vec_remove_arena_block(free_blocks, i, 1);
+        } else {
+            b->pc += need;
+            b->size -= need;
+        }
+        vec_append_arena_block(&g_arena_taken.v,
+                               (struct arena_block) {pc, need});
+        struct arena_page *page = arena_page_for(pc);
+        *pc_p = pc;
+        *write_p = page->rw + (pc - page->addr);
+        return SUBSTITUTE_OK;
+    }
+
+    size_t start = 0, end = pages->length;
+    if (reach) {
+        start = arena_lower_bound(hint > reach ? hint - reach : 0);
+        end = arena_lower_bound(hint + reach < hint ? UINTPTR_MAX
+                                                    : hint + reach);
+    }
+    struct arena_page *page = NULL;
+    for (size_t i = start; i < end; i++) {
+        struct arena_page *p = &pages->els[i];
+        size_t off = (p->used + align - 1) & ~(align - 1);
+        if (p->hot == hot && off <= PAGE_SIZE && PAGE_SIZE - off >= need &&
+            arena_page_in_reach(p->addr, hint, reach)) {
+            page = p;
+            break;
+        }
+    }
+    if (!page) {
+        int ret;
+        if ((ret = arena_new_page(hint, reach, hot, &page)))
+            return ret;
+    }
+
+    /* (the gap left in front of a hot reservation just goes unused) */
+    uintptr_t off = (page->used + align - 1) & ~(align - 1);
+    page->used = off + need;
+    *pc_p = page->addr + off;
+    *write_p = page->rw + off;
+    return SUBSTITUTE_OK;
+}
+
+int execmem_arena_reserve(uintptr_t hint, uintptr_t reach, size_t size,
+                          bool hot, uintptr_t *pc_p, void **write_p) {
+    STATS_START(start);
+    int ret = arena_reserve(hint, reach, size, hot, pc_p, write_p);
+    STATS_END(trampoline_alloc_ns, start);
+    return ret;
+}
+
+int execmem_arena_check(uintptr_t hint, uintptr_t reach, size_t size) {
+    size_t need = (size + EXECMEM_ARENA_ALIGN - 1) & ~(EXECMEM_ARENA_ALIGN - 1);
+    if (need > PAGE_SIZE)
+        return SUBSTITUTE_ERR_OOM;
+    if (!reach)
+        return SUBSTITUTE_OK;
+    /* the same places arena_reserve looks, in the same order */
+    struct vec_arena_block *free_blocks = &g_arena_free.v;
+    for (size_t i = 0; i < free_blocks->length; i++) {
+        struct arena_block *b = &free_blocks->els[i];
+        if (b->size >= need && !(b->pc & (EXECMEM_ARENA_ALIGN - 1)) &&
+            !arena_page_for(b->pc)->hot &&
+            arena_range_in_reach(b->pc, b->pc + need, hint, reach))
+            return SUBSTITUTE_OK;
+    }
+    struct vec_arena_page *pages = &g_arena_pages.v;
+    size_t start = arena_lower_bound(hint > reach ? hint - reach : 0);
+    size_t end = arena_lower_bound(hint + reach < hint ? UINTPTR_MAX
+                                                       : hint + reach);
+    for (size_t i = start; i < end; i++) {
+        struct arena_page *p = &pages->els[i];
+        size_t off = (p->used + EXECMEM_ARENA_ALIGN - 1) &
+                     ~(EXECMEM_ARENA_ALIGN - 1);
+        if (!p->hot && off <= PAGE_SIZE && PAGE_SIZE - off >= need &&
+            arena_page_in_reach(p->addr, hint, reach))
+            return SUBSTITUTE_OK;
+    }
+    uintptr_t addr;
+    return find_hole_near(hint, reach, &addr) ? SUBSTITUTE_OK
+                                              : SUBSTITUTE_ERR_OUT_OF_RANGE;
+}
+
+void execmem_arena_trim(uintptr_t pc, size_t reserved, size_t used) {
+    reserved = (reserved + EXECMEM_ARENA_ALIGN - 1) & ~(EXECMEM_ARENA_ALIGN - 1);
+    used = (used + EXECMEM_ARENA_ALIGN - 1) & ~(EXECMEM_ARENA_ALIGN - 1);
+    if (reserved == used)
+        return;
+    struct arena_page *page = arena_page_for(pc);
+    if (!page)
+        return;
+    if (page->addr + page->used == pc + reserved) {
+        page->used -= reserved - used;
+        return;
+    }
+    /* It came from the free list. */
+    struct vec_arena_block *taken = &g_arena_taken.v;
+    for (size_t i = 0; i < taken->length; i++) {
+        if (taken->els[i].pc == pc) {
+            taken->els[i].size = used;
+            break;
+        }
+    }
+    vec_append_arena_block(&g_arena_free.v,
+                           (struct arena_block) {pc + used, reserved - used});
+}
+
+void execmem_arena_release(uintptr_t pc, size_t size) {
+    size = (size + EXECMEM_ARENA_ALIGN - 1) & ~(EXECMEM_ARENA_ALIGN - 1);
+    struct arena_page *page = arena_page_for(pc);
+    if (!size || !page)
+        return;
+    if (page->addr + page->used == pc + size) {
+        page->used -= size;
+        if (page->committed > page->used)
+            page->committed = page->used;
+        return;
+    }
+    vec_append_arena_block(&g_arena_free.v, (struct arena_block) {pc, size});
+}
+
+int execmem_arena_flush(void) {
+    struct vec_arena_page *pages = &g_arena_pages.v;
+    for (size_t i = 0; i < pages->length; i++) {
+        struct arena_page *page = &pages->els[i];
+        if (page->used == page->committed)
+            continue;
+        /* The data went in through the other mapping, so make sure it is
+         * visible to instruction fetch from this one. */
+        sys_icache_invalidate((void *) (page->addr + page->committed),
+                              page->used - page->committed);
+        page->committed = page->used;
+    }
+    /* Reused free blocks are flushed here too, to be safe. */
+    struct vec_arena_block *taken = &g_arena_taken.v;
+    for (size_t i = 0; i < taken->length; i++)
+        sys_icache_invalidate((void *) taken->els[i].pc, taken->els[i].size);
+    vec_resize_arena_block(taken, 0);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
     return SUBSTITUTE_OK;
 }
 
-void execmem_free(void *page) {
-    munmap(page, PAGE_SIZE);
+void execmem_arena_abort(void) {
+    struct vec_arena_block *taken = &g_arena_taken.v;
+    vec_concat_arena_block(&g_arena_free.v, taken);
+    vec_resize_arena_block(taken, 0);
+    struct vec_arena_page *pages = &g_arena_pages.v;
+    for (size_t i = 0; i < pages->length; ) {
+        struct arena_page *page = &pages->els[i];
+        page->used = page->committed;
+        if (!page->used) {
+            munmap((void *) page->addr, PAGE_SIZE);
+            munmap(page->rw, PAGE_SIZE);
+            vec_remove_arena_page(pages, i, 1);
+            continue;
+        }
+        i++;
+    }
+}
+
+/* with the arena lock held */
+static size_t arena_page_free_bytes(const struct arena_page *page) {
+    size_t nfree = PAGE_SIZE - page->committed;
+    struct vec_arena_block *free_blocks = &g_arena_free.v;
+    for (size_t j = 0; j < free_blocks->length; j++) {
+        if ((free_blocks->els[j].pc & ~PAGE_MASK) == page->addr)
+            nfree += free_blocks->els[j].size;
+    }
+    return nfree;
+}
+
+void execmem_arena_usage(size_t *used_p, size_t *free_p) {
+    size_t nfree = 0;
+    execmem_arena_lock();
+    struct vec_arena_page *pages = &g_arena_pages.v;
+    for (size_t i = 0; i < pages->length; i++)
+        nfree += arena_page_free_bytes(&pages->els[i]);
+    *used_p = pages->length * PAGE_SIZE - nfree;
+    *free_p = nfree;
+    execmem_arena_unlock();
+}
+
+/* Pages execmem_foreign_write_with_pc_patch has written to, which are now
+ * private copies: sorted, merged ranges. */
+struct patched_range {
+    uintptr_t start, end;
+};
+DECL_VEC(struct patched_range, patched_range);
+static VEC_STORAGE_CAPA(patched_range, 8) g_patched_ranges =
+    VEC_STORAGE_INIT_STATIC(&g_patched_ranges, patched_range);
+static pthread_mutex_t g_patched_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void note_patched_range(uintptr_t start, uintptr_t end) {
+    struct vec_patched_range *v = &g_patched_ranges.v;
+    size_t i = 0;
+    while (i < v->length && v->els[i].end < start)
+        i++;
+    if (i == v->length || v->els[i].start > end) {
+        vec_add_space_patched_range(v, i, 1);
+        v->els[i] = (struct patched_range) {start, end};
+        return;
+    }
+    struct patched_range *r = &v->els[i];
+    if (start < r->start)
+        r->start = start;
+    size_t j = i + 1;
+    while (j < v->length && v->els[j].start <= end)
+        j++;
+    if (v->els[j - 1].end > end)
+        end = v->els[j - 1].end;
+    if (end > r->end)
+        r->end = end;
+    vec_remove_patched_range(v, i + 1, j - (i + 1));
+}
+
+void execmem_enum_memory(void (*callback)(void *ctx, int kind, uintptr_t start,
+                                          size_t size, size_t used),
+                         void *ctx) {
+    execmem_arena_lock();
+    struct vec_arena_page *pages = &g_arena_pages.v;
+    for (size_t i = 0; i < pages->length; i++) {
+        struct arena_page *page = &pages->els[i];
+        callback(ctx, SUBSTITUTE_MEMORY_TRAMPOLINES, page->addr, PAGE_SIZE,
+                 PAGE_SIZE - arena_page_free_bytes(page));
+    }
+    execmem_arena_unlock();
+
+    pthread_mutex_lock(&g_patched_lock);
+    struct vec_patched_range *v = &g_patched_ranges.v;
+    for (size_t i = 0; i < v->length; i++) {
+        size_t size = v->els[i].end - v->els[i].start;
+        callback(ctx, SUBSTITUTE_MEMORY_PATCHED_CODE, v->els[i].start, size,
+                 size);
+    }
+    pthread_mutex_unlock(&g_patched_lock);
+}
+
+EXPORT
+size_t substitute_get_trampoline_region_info(
+        struct substitute_trampoline_region_info *infos, size_t ninfos) {
+    execmem_arena_lock();
+    struct vec_arena_page *pages = &g_arena_pages.v;
+    size_t nregions = 0;
+    uintptr_t cur_region = 0;
+    struct substitute_trampoline_region_info *info = NULL;
+    for (size_t i = 0; i < pages->length; i++) {
+        struct arena_page *page = &pages->els[i];
+        uintptr_t region = page->addr & ~(((uintptr_t) 1 <<
+                                           EXECMEM_ARENA_REGION_SHIFT) - 1);
+        if (!nregions || cur_region != region) {
+            cur_region = region;
+            info = nregions < ninfos ? &infos[nregions] : NULL;
+            nregions++;
+            if (info) {
+                info->start = region;
+                info->size = (uintptr_t) 1 << EXECMEM_ARENA_REGION_SHIFT;
+                info->npages = 0;
+                info->bytes_used = 0;
+                info->bytes_free = 0;
+            }
+        }
+        if (info) {
+            size_t nfree = arena_page_free_bytes(page);
+            info->npages++;
+            info->bytes_used += PAGE_SIZE - nfree;
+            info->bytes_free += nfree;
+        }
+    }
+    execmem_arena_unlock();
+    return nregions;
+}
+
+int execmem_atomic_write(void *dst, const void *src, size_t len) {
+    if (!EXECMEM_ATOMIC_WRITE_OK(dst, len))
+        return SUBSTITUTE_ERR_VM;
+    mach_port_t task_self = mach_task_self();
+    uintptr_t unit = (uintptr_t) dst & ~7;
+    uintptr_t page = unit & ~PAGE_MASK;
+
+    /* Map the page a second time, sharing the same memory, and make that
+     * mapping writable. */
+    mach_vm_address_t alias = 0;
+    vm_prot_t cur, max;
+    kern_return_t kr = mach_vm_remap(task_self, &alias, PAGE_SIZE, 0,
+                                     VM_FLAGS_ANYWHERE, task_self, page,
+                                     /*copy*/ FALSE, &cur, &max,
+                                     VM_INHERIT_NONE);
+    if (kr)
+        return SUBSTITUTE_ERR_VM;
+    if (mach_vm_protect(task_self, alias, PAGE_SIZE, FALSE,
+                        VM_PROT_READ | VM_PROT_WRITE)) {
+        mach_vm_deallocate(task_self, alias, PAGE_SIZE);
+        return SUBSTITUTE_ERR_VM;
+    }
+
+    volatile uint64_t *alias_unit = (void *) (alias + (unit - page));
+    uint64_t old = *alias_unit, new = old;
+    memcpy((uint8_t *) &new + ((uintptr_t) dst - unit), src, len);
+    __atomic_store_n(alias_unit, new, __ATOMIC_SEQ_CST);
+    mach_vm_deallocate(task_self, alias, PAGE_SIZE);
+    sys_icache_invalidate((void *) unit, 8);
+
+    /* If the memory was copy-on-write, making the alias writable gave it its
+     * own copy, and the store went nowhere useful.  Check. */
+    if (*(volatile uint64_t *) unit != new)
+        return SUBSTITUTE_ERR_VM;
+    return SUBSTITUTE_OK;
 }
 
 #if defined(__x86_64__)
@@ -140,47 +713,105 @@ static bool apply_one_pcp_with_state(native_thread_state *state,
     return changed;
 }
 
-static int apply_one_pcp(mach_port_t thread, execmem_pc_patch_callback callback,
-                         void *ctx, mach_port_t reply_port) {
+/* A thread stopped by stop_other_threads.  Its registers are read once up
+ * front: it can't move while it's suspended, so there's no need to ask the
+ * kernel again for every span that gets written. */
+struct suspended_thread {
+    mach_port_t port;
+    bool have_state; /* false if it exited before we got to it */
     native_thread_state state;
-    mach_msg_type_number_t real_cnt = sizeof(state) / sizeof(int);
-    mach_msg_type_number_t cnt = real_cnt;
-    kern_return_t kr = manual_thread_get_state(thread, NATIVE_THREAD_STATE_FLAVOR,
-                                               (thread_state_t) &state, &cnt,
-                                               reply_port);
-    if (kr == KERN_TERMINATED)
-        return SUBSTITUTE_OK;
-    if (kr || cnt != real_cnt)
-        return SUBSTITUTE_ERR_ADJUSTING_THREADS;;
+};
+
+/* The state of one execmem_foreign_write_with_pc_patch call that stops other
+ * threads.  It lives on the caller's stack; g_pc_patch_lock makes sure there
+ * is only one at a time (two threads each suspending the other would
+ * deadlock), and g_pc_patch_op is how the signal handler finds it - and
+ * whether it's armed at all. */
+struct pc_patch_op {
+    /* sorted by port; vm_allocated, since a suspended thread might hold the
+     * malloc lock */
+    struct suspended_thread *threads;
+    size_t nthreads, capacity;
+    execmem_pc_patch_callback callback;
+    void *callback_ctx;
+    mach_port_t suspending_thread;
+};
+static pthread_mutex_t g_pc_patch_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pc_patch_op *g_pc_patch_op;
+
+/* The SIGSEGV/SIGBUS handler is installed once, the first time it's needed,
+ * and stays, rather than being swapped in and out (four syscalls, racing
+ * with crash reporters) around every patch; outside a patch it passes
+ * everything on to whatever was there before.  Handlers installed after it
+ * need to chain to it for it to work. */
+static pthread_once_t g_segfault_handler_once = PTHREAD_ONCE_INIT;
+static bool g_segfault_handler_ok;
+static struct sigaction g_old_segv, g_old_bus;
 
+static int apply_one_pcp(struct suspended_thread *st,
+                         execmem_pc_patch_callback callback, void *ctx,
+                         mach_port_t reply_port) {
+    if (!st->have_state)
+        return SUBSTITUTE_OK;
+    native_thread_state state = st->state;
     if (apply_one_pcp_with_state(&state, callback, ctx)) {
-        kr = manual_thread_set_state(thread, NATIVE_THREAD_STATE_FLAVOR,
-                                     (thread_state_t) &state, real_cnt,
-                                     reply_port);
+        kern_return_t kr =
+            manual_thread_set_state(st->port, NATIVE_THREAD_STATE_FLAVOR,
+                                    (thread_state_t) &state,
+                                    sizeof(state) / sizeof(int), reply_port);
+        if (kr == KERN_TERMINATED) {
+            st->have_state = false;
+            return SUBSTITUTE_OK;
+        }
         if (kr)
             return SUBSTITUTE_ERR_ADJUSTING_THREADS;
+        st->state = state;
     }
     return SUBSTITUTE_OK;
 }
 
-static void resume_other_threads();
+static int compare_ports(const void *a, const void *b) {
+    mach_port_t pa = *(mach_port_t *) a, pb = *(mach_port_t *) b;
+    return pa < pb ? -1 : pa > pb ? 1 : 0;
+}
+
+static bool reserve_suspended(struct pc_patch_op *op, size_t n) {
+    if (n <= op->capacity)
+        return true;
+    size_t capacity = op->capacity ? op->capacity : 64;
+    while (capacity < n)
+        capacity *= 2;
+    vm_address_t new;
+    if (vm_allocate(mach_task_self(), &new, capacity * sizeof(*op->threads),
+                    VM_FLAGS_ANYWHERE))
+        return false;
+    if (op->threads) {
+        memcpy((void *) new, op->threads, op->nthreads * sizeof(*op->threads));
+        vm_deallocate(mach_task_self(), (vm_address_t) op->threads,
+                      op->capacity * sizeof(*op->threads));
+    }
+    op->threads = (void *) new;
+    op->capacity = capacity;
+    return true;
+}
 
-static int stop_other_threads() {
-    /* pthread_main should have already been checked. */
+static void resume_other_threads(struct pc_patch_op *op);
 
+static int stop_other_threads(struct pc_patch_op *op) {
     int ret;
     mach_port_t self = mach_thread_self();
+    op->threads = NULL;
+    op->nthreads = op->capacity = 0;
 
     /* The following shenanigans are for catching any new threads that are
      * created while we're looping, without suspending anything twice.  Keep
      * looping until only threads we already suspended before this loop are
-     * there. */
-    HTAB_STORAGE_INIT(&g_suspended_ports, mach_port_set);
-    struct htab_mach_port_set *suspended_set = &g_suspended_ports.h;
-
-    bool got_new;
+     * there.  Each snapshot is sorted and diffed against the (sorted) set of
+     * threads already suspended, which is usually the whole snapshot after
+     * the first pass. */
+    size_t nnew;
     do {
-        got_new = false;
+        nnew = 0;
 
         thread_act_port_array_t ports;
         mach_msg_type_number_t nports;
@@ -190,82 +821,148 @@ static int stop_other_threads() {
             ret = SUBSTITUTE_ERR_ADJUSTING_THREADS;
             goto fail;
         }
+        qsort(ports, nports, sizeof(*ports), compare_ports);
 
+        /* Move the new ports to the front of the snapshot, still sorted. */
+        size_t old = 0;
         for (mach_msg_type_number_t i = 0; i < nports; i++) {
             mach_port_t port = ports[i];
-            struct htab_bucket_mach_port_set *bucket;
+            while (old < op->nthreads && op->threads[old].port < port)
+                old++;
             if (port == self ||
-                (bucket = htab_setbucket_mach_port_set(suspended_set, &port),
-                 bucket->key)) {
+                (old < op->nthreads && op->threads[old].port == port)) {
                 /* already suspended, ignore */
                 mach_port_deallocate(mach_task_self(), port);
             } else {
-                got_new = true;
-                kr = thread_suspend(port);
-                if (kr == KERN_TERMINATED) {
-                    /* too late */
-                    mach_port_deallocate(mach_task_self(), port);
-                } else if (kr) {
-                    ret = SUBSTITUTE_ERR_ADJUSTING_THREADS;
-                    for (; i < nports; i++)
-                        mach_port_deallocate(mach_task_self(), ports[i]);
-                    vm_deallocate(mach_task_self(), (vm_address_t) ports,
-                                  nports * sizeof(*ports));
-                    goto fail;
-                }
-                bucket->key = port;
+                ports[nnew++] = port;
+            }
+        }
+
+        if (!reserve_suspended(op, op->nthreads + nnew)) {
+            ret = SUBSTITUTE_ERR_OOM;
+            for (size_t i = 0; i < nnew; i++)
+                mach_port_deallocate(mach_task_self(), ports[i]);
+            vm_deallocate(mach_task_self(), (vm_address_t) ports,
+                          nports * sizeof(*ports));
+            goto fail;
+        }
+        size_t nsuspended = 0;
+        bool failed = false;
+        for (size_t i = 0; i < nnew; i++) {
+            mach_port_t port = ports[i];
+            kr = thread_suspend(port);
+            if (kr == KERN_TERMINATED) {
+                /* too late */
+                mach_port_deallocate(mach_task_self(), port);
+            } else if (kr) {
+                ret = SUBSTITUTE_ERR_ADJUSTING_THREADS;
+                for (; i < nnew; i++)
+                    mach_port_deallocate(mach_task_self(), ports[i]);
+                failed = true;
+                break;
+            } else {
+                ports[nsuspended++] = port;
+                STATS_ADD(threads_suspended, 1);
+            }
+        }
+
+        /* Merge them in from the back, so the set stays sorted. */
+        size_t a = op->nthreads, b = nsuspended;
+        op->nthreads += nsuspended;
+        for (size_t out = op->nthreads; b; ) {
+            struct suspended_thread *st = &op->threads[--out];
+            if (a && op->threads[a - 1].port > ports[b - 1]) {
+                *st = op->threads[--a];
+            } else {
+                st->port = ports[--b];
+                st->have_state = false;
             }
         }
         vm_deallocate(mach_task_self(), (vm_address_t) ports,
                       nports * sizeof(*ports));
-    } while(got_new);
+        if (failed)
+            goto fail;
+    } while (nnew);
 
     /* Success - keep the set around for when we're done. */
     return SUBSTITUTE_OK;
 
 fail:
-    resume_other_threads();
+    resume_other_threads(op);
     return ret;
 }
 
-static void resume_other_threads() {
-    struct htab_mach_port_set *suspended_set = &g_suspended_ports.h;
-    HTAB_FOREACH(suspended_set, mach_port_t *threadp,
-                 UNUSED struct empty *_,
-                 mach_port_set) {
-        thread_resume(*threadp);
-        mach_port_deallocate(mach_task_self(), *threadp);
+static void resume_other_threads(struct pc_patch_op *op) {
+    for (size_t i = 0; i < op->nthreads; i++) {
+        thread_resume(op->threads[i].port);
+        mach_port_deallocate(mach_task_self(), op->threads[i].port);
     }
-    htab_free_storage_mach_port_set(suspended_set);
+    if (op->threads)
+        vm_deallocate(mach_task_self(), (vm_address_t) op->threads,
+                      op->capacity * sizeof(*op->threads));
+    op->threads = NULL;
+    op->nthreads = op->capacity = 0;
+}
+
+static int get_thread_states(struct pc_patch_op *op, mach_port_t reply_port) {
+    for (size_t i = 0; i < op->nthreads; i++) {
+        struct suspended_thread *st = &op->threads[i];
+        mach_msg_type_number_t real_cnt = sizeof(st->state) / sizeof(int);
+        mach_msg_type_number_t cnt = real_cnt;
+        kern_return_t kr = manual_thread_get_state(st->port,
+                                                   NATIVE_THREAD_STATE_FLAVOR,
+                                                   (thread_state_t) &st->state,
+                                                   &cnt, reply_port);
+        if (kr == KERN_TERMINATED)
+            continue;
+        if (kr || cnt != real_cnt)
+            return SUBSTITUTE_ERR_ADJUSTING_THREADS;
+        st->have_state = true;
+    }
+    return SUBSTITUTE_OK;
 }
 
 /* note: unusual prototype since we are avoiding _sigtramp */
 static void segfault_handler(UNUSED void *func, int style, int sig,
-                             UNUSED siginfo_t *sinfo, void *uap_) {
+                             siginfo_t *sinfo, void *uap_) {
     ucontext_t *uap = uap_;
-    if (manual_thread_self() == g_suspending_thread) {
-        /* The patcher itself segfaulted.  Oops.  Reset the signal so the
-         * process exits rather than going into an infinite loop. */
-        signal(sig, SIG_DFL);
+    struct pc_patch_op *op = __atomic_load_n(&g_pc_patch_op, __ATOMIC_ACQUIRE);
+    const struct sigaction *old = sig == SIGBUS ? &g_old_bus : &g_old_segv;
+    if (!op || manual_thread_self() == op->suspending_thread) {
+        /* Not ours, or the patcher itself segfaulted (oops).  Hand it to the
+         * old handler, leaving ours installed.  If there wasn't one, the
+         * signal was fatal before we came along, so it still should be:
+         * reset it and return, so the fault happens again (or, if it was
+         * sent rather than a fault, gets sent again) and the process exits
+         * rather than going into an infinite loop.  The only thing an
+         * ignored signal can mean is that it was sent; drop it. */
+        bool sent = sinfo->si_code == SI_USER || sinfo->si_code == SI_QUEUE;
+        if (old->sa_handler == SIG_IGN && sent) {
+            /* nothing */
+        } else if (old->sa_handler == SIG_DFL || old->sa_handler == SIG_IGN) {
+            struct sigaction dfl;
+            memset(&dfl, 0, sizeof(dfl));
+            dfl.sa_handler = SIG_DFL;
+            sigaction(sig, &dfl, NULL);
+            if (sent)
+                pthread_kill(pthread_self(), sig);
+        } else if (old->sa_flags & SA_SIGINFO) {
+            old->sa_sigaction(sig, sinfo, uap);
+        } else {
+            old->sa_handler(sig);
+        }
         goto sigreturn;
     }
     /* We didn't catch it before it segfaulted so have to fix it up here. */
-    apply_one_pcp_with_state(&uap->uc_mcontext->__ss, g_pc_patch_callback,
-                             g_pc_patch_callback_ctx);
+    apply_one_pcp_with_state(&uap->uc_mcontext->__ss, op->callback,
+                             op->callback_ctx);
     /* just let it continue, whatever */
 sigreturn:
     if (manual_sigreturn(uap, style))
         abort();
 }
 
-static int init_pc_patch(execmem_pc_patch_callback callback, void *ctx) {
-    g_suspending_thread = mach_thread_self();
-    g_pc_patch_callback = callback;
-    g_pc_patch_callback_ctx = ctx;
-    int ret;
-    if ((ret = stop_other_threads()))
-        return ret;
-
+static void install_segfault_handler(void) {
     struct __sigaction sa;
     memset(&sa, 0, sizeof(sa));
     sa.sa_sigaction = (void *) 0xdeadbeef;
@@ -273,37 +970,60 @@ static int init_pc_patch(execmem_pc_patch_callback callback, void *ctx) {
     sigfillset(&sa.sa_mask);
     sa.sa_flags = SA_RESTART | SA_NODEFER | SA_SIGINFO;
 
-    if (__sigaction(SIGSEGV, &sa, &old_segv))
-        return SUBSTITUTE_ERR_ADJUSTING_THREADS;
-    if (__sigaction(SIGBUS, &sa, &old_bus)) {
-        sigaction(SIGSEGV, &old_segv, NULL);
+    if (__sigaction(SIGSEGV, &sa, &g_old_segv))
+        return;
+    if (__sigaction(SIGBUS, &sa, &g_old_bus)) {
+        sigaction(SIGSEGV, &g_old_segv, NULL);
+        return;
+    }
+    g_segfault_handler_ok = true;
+}
+
+static int init_pc_patch(struct pc_patch_op *op,
+                         execmem_pc_patch_callback callback, void *ctx,
+                         mach_port_t reply_port) {
+    /* (before stopping anyone, who might hold a lock sigaction wants) */
+    pthread_once(&g_segfault_handler_once, install_segfault_handler);
+    if (!g_segfault_handler_ok)
         return SUBSTITUTE_ERR_ADJUSTING_THREADS;
+    op->suspending_thread = mach_thread_self();
+    op->callback = callback;
+    op->callback_ctx = ctx;
+    int ret;
+    STATS_START(stop_start);
+    ret = stop_other_threads(op);
+    STATS_END(stop_threads_ns, stop_start);
+    if (ret)
+        return ret;
+    STATS_START(state_start);
+    ret = get_thread_states(op, reply_port);
+    STATS_END(get_thread_state_ns, state_start);
+    if (ret) {
+        resume_other_threads(op);
+        return ret;
     }
+    __atomic_store_n(&g_pc_patch_op, op, __ATOMIC_RELEASE);
     return SUBSTITUTE_OK;
 }
 
-static int run_pc_patch(mach_port_t reply_port) {
+static int run_pc_patch(struct pc_patch_op *op, mach_port_t reply_port) {
     int ret;
 
-    struct htab_mach_port_set *suspended_set = &g_suspended_ports.h;
-    HTAB_FOREACH(suspended_set, mach_port_t *threadp,
-                 UNUSED struct empty *_,
-                 mach_port_set) {
-        if ((ret = apply_one_pcp(*threadp, g_pc_patch_callback,
-                                 g_pc_patch_callback_ctx, reply_port)))
+    STATS_START(pcp_start);
+    for (size_t i = 0; i < op->nthreads; i++) {
+        ret = apply_one_pcp(&op->threads[i], op->callback, op->callback_ctx,
+                            reply_port);
+        if (ret)
             return ret;
     }
+    STATS_END(apply_pc_patch_ns, pcp_start);
 
     return SUBSTITUTE_OK;
 }
 
-static int finish_pc_patch() {
-    if (sigaction(SIGBUS, &old_bus, NULL) ||
-        sigaction(SIGSEGV, &old_segv, NULL))
-        return SUBSTITUTE_ERR_ADJUSTING_THREADS;
-
-    resume_other_threads();
-    return SUBSTITUTE_OK;
+static void finish_pc_patch(struct pc_patch_op *op) {
+    __atomic_store_n(&g_pc_patch_op, NULL, __ATOMIC_RELEASE);
+    resume_other_threads(op);
 }
 
 static int compare_dsts(const void *a, const void *b) {
@@ -313,7 +1033,8 @@ static int compare_dsts(const void *a, const void *b) {
 }
 
 static kern_return_t get_page_info(uintptr_t ptr, vm_prot_t *prot_p,
-                                   vm_inherit_t *inherit_p) {
+                                   vm_inherit_t *inherit_p,
+                                   uintptr_t *region_end_p) {
 
     vm_address_t region = (vm_address_t) ptr;
     vm_size_t region_len = 0;
@@ -324,11 +1045,71 @@ static kern_return_t get_page_info(uintptr_t ptr, vm_prot_t *prot_p,
                                             &max_depth,
                                             (vm_region_recurse_info_t) &info,
                                             &info_count);
+    if (!kr && region > ptr)
+        kr = KERN_INVALID_ADDRESS; /* ptr is in a hole */
     *prot_p = info.protection & (PROT_READ | PROT_WRITE | PROT_EXEC);
     *inherit_p = info.inheritance;
+    *region_end_p = region + region_len;
     return kr;
 }
 
+/* A maximal run of pages touched by writes[first..last], all in one VM
+ * region, which gets a single copy and remap. */
+struct write_span {
+    uintptr_t start, end;
+    size_t first, last;
+    vm_prot_t prot;
+    vm_inherit_t inherit;
+};
+
+
+/* writes must be sorted.  Group them into spans; spans must have room for
+ * nwrites entries. */
+static int plan_write_spans(const struct execmem_foreign_write *writes,
+                            size_t nwrites, struct write_span *spans,
+                            size_t *nspans_p) {
+    size_t nspans = 0;
+    struct write_span *span = NULL;
+    uintptr_t region_end = 0;
+    for (size_t i = 0; i < nwrites; i++) {
+        const struct execmem_foreign_write *write = &writes[i];
+        if (!write->len)
+            continue;
+        uintptr_t this_start = (uintptr_t) write->dst & ~PAGE_MASK;
+        uintptr_t this_end = (((uintptr_t) write->dst + write->len - 1)
+                              & ~PAGE_MASK) + PAGE_SIZE;
+        /* Extend the current span if this write overlaps or is adjacent to
+         * it and stays in the same region. */
+        if (span && this_start <= span->end && this_end <= region_end) {
+            if (this_end > span->end)
+                span->end = this_end;
+            span->last = i;
+            continue;
+        }
+        span = &spans[nspans++];
+        span->start = this_start;
+        span->end = this_end;
+        span->first = span->last = i;
+        /* Assume that a single region will be pages of all the same
+         * protection, since the alternative is probably someone doing
+         * something wrong. */
+        if (get_page_info(this_start, &span->prot, &span->inherit,
+                          &region_end)) {
+            /* Weird; this probably means the region doesn't exist, but we
+             * should have already read from the memory in order to generate
+             * the patch. */
+            return SUBSTITUTE_ERR_VM;
+        }
+        if (this_end > region_end) {
+            /* A single write across regions; just treat the rest as the
+             * same. */
+            region_end = this_end;
+        }
+    }
+    *nspans_p = nspans;
+    return SUBSTITUTE_OK;
+}
+
 int execmem_foreign_write_with_pc_patch(struct execmem_foreign_write *writes,
                                         size_t nwrites,
                                         execmem_pc_patch_callback callback,
@@ -337,9 +1118,21 @@ int execmem_foreign_write_with_pc_patch(struct execmem_foreign_write *writes,
 
     qsort(writes, nwrites, sizeof(*writes), compare_dsts);
 
+    /* Plan everything before stopping other threads, since one of them might
+     * be holding the malloc lock. */
+    struct write_span *spans = malloc(nwrites * sizeof(*spans));
+    if (!spans && nwrites)
+        return SUBSTITUTE_ERR_OOM;
+    size_t nspans;
+    if ((ret = plan_write_spans(writes, nwrites, spans, &nspans))) {
+        free(spans);
+        return ret;
+    }
+
     mach_port_t task_self = mach_task_self();
     mach_port_t reply_port = mig_get_reply_port();
 
+    struct pc_patch_op op;
     if (callback) {
         /* Set the segfault handler - stopping all other threads before
          * doing so in case they were using it for something (this
@@ -348,51 +1141,54 @@ int execmem_foreign_write_with_pc_patch(struct execmem_foreign_write *writes,
          * threads that might run during this process.  Hopefully no
          * *injected* threads try to use segfault handlers for something!
          */
-        if ((ret = init_pc_patch(callback, callback_ctx)))
+        pthread_mutex_lock(&g_pc_patch_lock);
+        if ((ret = init_pc_patch(&op, callback, callback_ctx, reply_port))) {
+            pthread_mutex_unlock(&g_pc_patch_lock);
+            free(spans);
             return ret;
+        }
     }
 
-    size_t last;
-    for (size_t first = 0; first < nwrites; first = last + 1) {
-        const struct execmem_foreign_write *first_write = &writes[first];
-        uintptr_t page_start = (uintptr_t) first_write->dst & ~PAGE_MASK;
-        uintptr_t page_end = ((uintptr_t) first_write->dst +
-                              first_write->len - 1) & ~PAGE_MASK;
-
-        last = first;
-        while (last + 1 < nwrites) {
-            const struct execmem_foreign_write *write = &writes[last + 1];
-            uintptr_t this_start = (uintptr_t) write->dst & ~PAGE_MASK;
-            uintptr_t this_end = ((uintptr_t) write->dst +
-                                  first_write->len - 1) & ~PAGE_MASK;
-            if (page_start <= this_start && this_start <= page_end) {
-                if (this_end > page_end)
-                    page_end = this_end;
-            } else if (page_start <= this_end && this_end <= page_end) {
-                if (this_start < page_start)
-                    page_start = this_start;
-            } else {
-                break;
+    size_t ndone = 0;
+    for (size_t si = 0; si < nspans; si++) {
+        const struct write_span *span = &spans[si];
+        uintptr_t page_start = span->start;
+        size_t len = span->end - span->start;
+        vm_prot_t prot = span->prot;
+        vm_inherit_t inherit = span->inherit;
+        kern_return_t kr;
+        STATS_START(remap_start);
+        /* First try asking for a private writable copy in place: with
+         * VM_PROT_COPY the kernel makes one even if max_protection lacks
+         * VM_PROT_WRITE (as for shared cache text), which saves the trips
+         * through the VM system below.  This is the start of the danger zone
+         * too, since the pages aren't executable until we put prot back. */
+        kr = manual_mach_vm_protect(task_self, page_start, len, FALSE,
+                                    VM_PROT_READ | VM_PROT_WRITE |
+                                    VM_PROT_COPY);
+        if (!kr) {
+            for (size_t i = span->first; i <= span->last; i++) {
+                struct execmem_foreign_write *write = &writes[i];
+                manual_memcpy(write->dst, write->src, write->len);
+                /* Unlike below, these are the same physical pages the old
+                 * code may still be cached from. */
+                manual_icache_invalidate(write->dst, write->len);
             }
-            last++;
-        }
-        size_t len = page_end - page_start + PAGE_SIZE;
-
-        vm_prot_t prot;
-        vm_inherit_t inherit;
-        /* Assume that a single patch region will be pages of all the same
-         * protection, since the alternative is probably someone doing
-         * something wrong. */
-        kern_return_t kr = get_page_info(page_start, &prot, &inherit);
-        if (kr) {
-            /* Weird; this probably means the region doesn't exist, but we should
-             * have already read from the memory in order to generate the patch. */
-            ret = SUBSTITUTE_ERR_VM;
-            goto fail;
+            /* see below */
+            if (callback && (ret = run_pc_patch(&op, reply_port)))
+                goto fail;
+            if (manual_mprotect((void *) page_start, len, prot)) {
+                ret = SUBSTITUTE_ERR_VM;
+                goto fail;
+            }
+            STATS_END(remap_ns, remap_start);
+            STATS_ADD(protect_copies, 1);
+            ndone++;
+            continue;
         }
-        /* Instead of trying to set the existing region to write, which may
-         * fail due to max_protection, we make a fresh copy and remap it over
-         * the original. */
+        /* Otherwise (if the kernel refuses), instead of trying to set the
+         * existing region to write, which may fail due to max_protection, we
+         * make a fresh copy and remap it over the original. */
         void *new = mmap(NULL, len, PROT_READ | PROT_WRITE,
                          MAP_ANON | MAP_SHARED, -1, 0);
         if (new == MAP_FAILED) {
@@ -422,7 +1218,7 @@ int execmem_foreign_write_with_pc_patch(struct execmem_foreign_write *writes,
             goto fail_unmap;
         }
         /* Write patches to the copy. */
-        for (size_t i = first; i <= last; i++) {
+        for (size_t i = span->first; i <= span->last; i++) {
             struct execmem_foreign_write *write = &writes[i];
             ptrdiff_t off = (uintptr_t) write->dst - page_start;
             manual_memcpy(new + off, write->src, write->len);
@@ -437,7 +1233,7 @@ int execmem_foreign_write_with_pc_patch(struct execmem_foreign_write *writes,
              * patched.  (A call instruction within the affected region would
              * break this assumption, as then a thread could move to an
              * affected PC by returning. */
-            if ((ret = run_pc_patch(reply_port)))
+            if ((ret = run_pc_patch(&op, reply_port)))
                 goto fail_unmap;
         }
 
@@ -458,7 +1254,11 @@ int execmem_foreign_write_with_pc_patch(struct execmem_foreign_write *writes,
         }
         /* Danger zone over.  Ignore errors when unmapping the temporary buffer. */
         munmap(new, len);
+        STATS_END(remap_ns, remap_start);
+        STATS_ADD(remaps, 1);
+        STATS_ADD(pages_remapped, len / PAGE_SIZE);
 
+        ndone++;
         continue;
 
     fail_unmap:
@@ -473,13 +1273,19 @@ int execmem_foreign_write_with_pc_patch(struct execmem_foreign_write *writes,
 
 fail:
     if (callback) {
-        /* Other threads are no longer in danger of segfaulting, so put
-         * back the old segfault handler. */
-        int ret2;
-        if ((ret2 = finish_pc_patch()))
-            return ret2;
+        /* Other threads are no longer in danger of segfaulting, so disarm
+         * the segfault handler. */
+        finish_pc_patch(&op);
+        pthread_mutex_unlock(&g_pc_patch_lock);
     }
 
+    /* (only now that nobody could be holding the malloc lock) */
+    pthread_mutex_lock(&g_patched_lock);
+    for (size_t si = 0; si < ndone; si++)
+        note_patched_range(spans[si].start, spans[si].end);
+    pthread_mutex_unlock(&g_patched_lock);
+
+    free(spans);
     return ret;
 }
 
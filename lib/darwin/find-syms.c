@@ -6,11 +6,17 @@
 #include <sys/mman.h>
 #include <limits.h>
 #include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <dispatch/dispatch.h>
 #include "ptrauth_helpers.h"
 
 #include "substitute.h"
 #include "substitute-internal.h"
 #include "dyld_cache_format.h"
+#include "stats.h"
+#include "cbit/htab.h"
+#include "darwin/read.h"
 
 static pthread_once_t dyld_inspect_once = PTHREAD_ONCE_INIT;
 static pthread_once_t all_image_infos_once = PTHREAD_ONCE_INIT;
@@ -51,6 +57,12 @@ const struct dyld_all_image_infos *dyld_get_all_image_infos() {
     return _aii;
 }
 
+static int compare_lse_offsets(const void *a, const void *b) {
+    uint32_t oa = ((const struct dyld_cache_local_symbols_entry *) a)->dylibOffset;
+    uint32_t ob = ((const struct dyld_cache_local_symbols_entry *) b)->dylibOffset;
+    return oa < ob ? -1 : oa > ob;
+}
+
 static bool oscf_try_dir(const char *dir, const char *arch,
                          const struct dyld_cache_header *dch) {
     char path[PATH_MAX];
@@ -90,6 +102,8 @@ static bool oscf_try_dir(const char *dir, const char *arch,
         goto fail;
     }
 
+    /* sorted, for get_shared_cache_syms to binary search */
+    qsort(lses, count, sizeof(*lses), compare_lse_offsets);
     s_cur_shared_cache_fd = fd;
     s_cache_local_symbols_entries = lses;
     return true;
@@ -138,43 +152,377 @@ static bool ul_mmap(int fd, off_t offset, size_t size,
     return true;
 }
 
-static bool get_shared_cache_syms(const void *hdr,
-                                  const substitute_sym **syms_p,
-                                  const char **strs_p,
-                                  size_t *nsyms_p,
-                                  void **mapping_p,
-                                  size_t *mapping_size_p) {
-    pthread_once(&s_open_cache_once, open_shared_cache_file_once);
-    int fd = s_cur_shared_cache_fd;
+/* The index substitute_build_shared_cache_sym_index writes: for each dylib
+ * with local symbols, an open addressing table (linear probing, so the first
+ * of several symbols with the same name comes first) of 64-bit name hashes
+ * and n_values, so a process can look names up by mapping just the table for
+ * the dylib it's interested in.  The file is named after the cache's UUID. */
+#define CACHE_SYM_INDEX_DIR "/var/tmp"
+#define CACHE_SYM_INDEX_MAGIC 0x78697373 /* 'ssix' */
+#define CACHE_SYM_INDEX_VERSION 1
+struct cache_sym_index_header {
+    uint32_t magic;
+    uint32_t version;
+    uint8_t uuid[16];
+    uint32_t ndylibs;
+    uint32_t pad;
+    /* followed by ndylibs cache_sym_index_dylibs, sorted by dylib_offset */
+};
+struct cache_sym_index_dylib {
+    uint32_t dylib_offset;
+    uint32_t log2_capacity;
+    uint64_t table_offset;
+};
+struct cache_sym_index_entry {
+    /* 0 for an empty entry */
+    uint64_t hash;
+    uint64_t value;
+};
+#define CACHE_SYM_INDEX_THUMB (1ull << 63)
+
+static pthread_once_t s_cache_sym_index_once = PTHREAD_ONCE_INIT;
+static int s_cache_sym_index_fd = -1;
+static struct cache_sym_index_dylib *s_cache_sym_index_dylibs;
+static uint32_t s_cache_sym_index_ndylibs;
+
+static uint64_t hash_sym_name64(const char *name) {
+    uint64_t hash = 14695981039346656037ull;
+    for (const char *p = name; *p; p++)
+        hash = (hash ^ (uint8_t) *p) * 1099511628211ull;
+    return hash ? hash : 1;
+}
+
+static void cache_sym_index_path(const struct dyld_cache_header *dch,
+                                 char path[static PATH_MAX]) {
+    char uuid[33];
+    for (int i = 0; i < 16; i++)
+        snprintf(uuid + 2 * i, 3, "%02x", dch->uuid[i]);
+    snprintf(path, PATH_MAX, CACHE_SYM_INDEX_DIR "/substitute-cache-syms.%s",
+             uuid);
+}
+
+/* Open and check the index for the current cache, if it exists and was
+ * written by root (or us). */
+static bool load_cache_sym_index(const struct dyld_cache_header *dch,
+                                 int *fd_p,
+                                 struct cache_sym_index_dylib **dylibs_p,
+                                 uint32_t *ndylibs_p) {
+    char path[PATH_MAX];
+    cache_sym_index_path(dch, path);
+    int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
     if (fd == -1)
         return false;
-    const struct dyld_cache_header *dch = s_cur_shared_cache_hdr;
-    const struct dyld_cache_local_symbols_info *lsi = &s_cache_local_symbols_info;
-    struct dyld_cache_local_symbols_entry lse;
-    for (uint32_t i = 0; i < lsi->entriesCount; i++) {
-        lse = s_cache_local_symbols_entries[i];
-        if (lse.dylibOffset == (uintptr_t) hdr - (uintptr_t) dch)
-            goto got_lse;
+    struct stat st;
+    struct cache_sym_index_header hdr;
+    struct cache_sym_index_dylib *dylibs = NULL;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+        (st.st_uid != 0 && st.st_uid != geteuid()) || (st.st_mode & 022))
+        goto fail;
+    if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        hdr.magic != CACHE_SYM_INDEX_MAGIC ||
+        hdr.version != CACHE_SYM_INDEX_VERSION ||
+        memcmp(hdr.uuid, dch->uuid, 16) ||
+        hdr.ndylibs > 1000000)
+        goto fail;
+    size_t dylibs_size = hdr.ndylibs * sizeof(*dylibs);
+    if (!(dylibs = malloc(dylibs_size)) ||
+        pread(fd, dylibs, dylibs_size, sizeof(hdr)) != dylibs_size)
+        goto fail;
+    for (uint32_t i = 0; i < hdr.ndylibs; i++) {
+        if (dylibs[i].log2_capacity >= 32 ||
+            dylibs[i].table_offset > (uint64_t) st.st_size ||
+            ((uint64_t) st.st_size - dylibs[i].table_offset) /
+                sizeof(struct cache_sym_index_entry) <
+                (1ull << dylibs[i].log2_capacity))
+            goto fail;
     }
+    *fd_p = fd;
+    *dylibs_p = dylibs;
+    *ndylibs_p = hdr.ndylibs;
+    return true;
+fail:
+    free(dylibs);
+    close(fd);
     return false;
-got_lse:
-    /* map - we don't do this persistently to avoid wasting address space on
-     * iOS (my random OS X 10.10 blob pushes 55MB) */
-    if (lse.nlistStartIndex > lsi->nlistCount ||
-        lsi->nlistCount - lse.nlistStartIndex < lse.nlistCount)
+}
+
+static void open_cache_sym_index_once() {
+    load_cache_sym_index(s_cur_shared_cache_hdr, &s_cache_sym_index_fd,
+                         &s_cache_sym_index_dylibs, &s_cache_sym_index_ndylibs);
+}
+
+static const struct cache_sym_index_dylib *
+find_cache_sym_index_dylib(uintptr_t dylib_offset) {
+    pthread_once(&s_cache_sym_index_once, open_cache_sym_index_once);
+    const struct cache_sym_index_dylib *dylibs = s_cache_sym_index_dylibs;
+    size_t lo = 0, hi = s_cache_sym_index_ndylibs;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (dylibs[mid].dylib_offset < dylib_offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == s_cache_sym_index_ndylibs ||
+        dylibs[lo].dylib_offset != dylib_offset)
+        return NULL;
+    return &dylibs[lo];
+}
+
+/* A mapping of one dylib's local symbols from the cache file: its nlist
+ * entries, and the part of the string pool they point into.  'strs' is
+ * offset so that strs + n_strx works.  Or, if there's an index, just the
+ * dylib's table from that ('index'), and no symbols.  The last few are kept
+ * around, since lookups tend to hit the same few dylibs; entries in use
+ * (refs) aren't evicted, and if they all are, the mapping is made
+ * uncached. */
+struct cache_syms_map {
+    uint32_t dylib_offset;
+    unsigned refs;
+    bool uncached;
+    uint64_t last_used;
+    const substitute_sym *syms;
+    const char *strs;
+    size_t nsyms;
+    const struct cache_sym_index_entry *index;
+    size_t index_mask;
+    void *mapping, *strs_mapping;
+    size_t mapping_size, strs_mapping_size;
+};
+#define CACHE_SYMS_MAPS 4
+/* most strings end within this much of where the last one starts */
+#define CACHE_SYMS_STR_SLACK 4096
+static struct cache_syms_map s_cache_syms_maps[CACHE_SYMS_MAPS];
+static uint64_t s_cache_syms_clock;
+static pthread_mutex_t s_cache_syms_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void unmap_cache_syms(struct cache_syms_map *map) {
+    if (map->mapping_size)
+        munmap(map->mapping, map->mapping_size);
+    if (map->strs_mapping_size)
+        munmap(map->strs_mapping, map->strs_mapping_size);
+    map->mapping_size = map->strs_mapping_size = 0;
+}
+
+/* (an uncached mapping is only around during the lookup that made it) */
+void find_syms_enum_memory(memory_region_callback callback, void *ctx) {
+    pthread_mutex_lock(&s_cache_syms_lock);
+    for (size_t i = 0; i < CACHE_SYMS_MAPS; i++) {
+        struct cache_syms_map *map = &s_cache_syms_maps[i];
+        if (map->mapping_size)
+            callback(ctx, SUBSTITUTE_MEMORY_SYMBOL_TABLES,
+                     (uintptr_t) map->mapping, map->mapping_size,
+                     map->mapping_size);
+        if (map->strs_mapping_size)
+            callback(ctx, SUBSTITUTE_MEMORY_SYMBOL_TABLES,
+                     (uintptr_t) map->strs_mapping, map->strs_mapping_size,
+                     map->strs_mapping_size);
+    }
+    pthread_mutex_unlock(&s_cache_syms_lock);
+}
+
+static bool map_cache_syms(int fd, const struct dyld_cache_header *dch,
+                           const struct dyld_cache_local_symbols_info *lsi,
+                           const struct dyld_cache_local_symbols_entry *lse,
+                           struct cache_syms_map *map) {
+    map->mapping_size = map->strs_mapping_size = 0;
+    map->index = NULL;
+    map->nsyms = lse->nlistCount;
+    const substitute_sym *syms;
+    if (!ul_mmap(fd, dch->localSymbolsOffset + lsi->nlistOffset +
+                     (off_t) lse->nlistStartIndex * sizeof(substitute_sym),
+                 lse->nlistCount * sizeof(substitute_sym),
+                 &syms, &map->mapping, &map->mapping_size))
         return false;
+    map->syms = syms;
 
-    char *ls_data;
-    if (!ul_mmap(fd, dch->localSymbolsOffset, dch->localSymbolsSize,
-                 &ls_data, mapping_p, mapping_size_p))
+    /* Each dylib's strings are normally together, so only map from the
+     * lowest one to a bit past the highest. */
+    uint32_t min_strx = UINT32_MAX, max_strx = 0;
+    for (size_t i = 0; i < map->nsyms; i++) {
+        uint32_t strx = syms[i].n_un.n_strx;
+        if (strx == 0 || strx >= lsi->stringsSize)
+            continue;
+        if (strx < min_strx)
+            min_strx = strx;
+        if (strx > max_strx)
+            max_strx = strx;
+    }
+    if (min_strx == UINT32_MAX)
+        min_strx = max_strx = 0;
+    size_t end = (size_t) max_strx + CACHE_SYMS_STR_SLACK;
+    if (end > lsi->stringsSize)
+        end = lsi->stringsSize;
+    for (int try = 0; try < 2; try++) {
+        const char *strs;
+        if (!ul_mmap(fd, dch->localSymbolsOffset + lsi->stringsOffset + min_strx,
+                     end - min_strx, &strs,
+                     &map->strs_mapping, &map->strs_mapping_size)) {
+            unmap_cache_syms(map);
+            return false;
+        }
+        map->strs = strs - min_strx;
+        if (end == lsi->stringsSize ||
+            memchr(map->strs + max_strx, 0, end - max_strx))
+            return true;
+        /* a really long last string; take the rest of the pool */
+        munmap(map->strs_mapping, map->strs_mapping_size);
+        map->strs_mapping_size = 0;
+        end = lsi->stringsSize;
+    }
+    __builtin_unreachable();
+}
+
+static bool map_cache_sym_index(const struct cache_sym_index_dylib *isd,
+                                struct cache_syms_map *map) {
+    map->mapping_size = map->strs_mapping_size = 0;
+    map->syms = NULL;
+    map->strs = NULL;
+    map->nsyms = 0;
+    size_t capacity = (size_t) 1 << isd->log2_capacity;
+    const struct cache_sym_index_entry *index;
+    if (!ul_mmap(s_cache_sym_index_fd, isd->table_offset,
+                 capacity * sizeof(*index),
+                 &index, &map->mapping, &map->mapping_size))
+        return false;
+    map->index = index;
+    map->index_mask = capacity - 1;
+    return true;
+}
+
+/* All of the cache file's local symbols at once, for
+ * substitute_find_syms_multi to resolve every group in: one pair of mappings
+ * in place of one per dylib (and nothing is read but the pages of the dylibs
+ * looked in).  Not one of s_cache_syms_maps; it's only around for the call. */
+static bool map_cache_syms_all(struct cache_syms_map *map) {
+    const struct dyld_cache_header *dch = s_cur_shared_cache_hdr;
+    const struct dyld_cache_local_symbols_info *lsi = &s_cache_local_symbols_info;
+    int fd = s_cur_shared_cache_fd;
+    map->mapping_size = map->strs_mapping_size = 0;
+    map->index = NULL;
+    map->nsyms = lsi->nlistCount;
+    const substitute_sym *syms;
+    const char *strs;
+    if (!ul_mmap(fd, dch->localSymbolsOffset + lsi->nlistOffset,
+                 lsi->nlistCount * sizeof(substitute_sym),
+                 &syms, &map->mapping, &map->mapping_size))
+        return false;
+    if (!ul_mmap(fd, dch->localSymbolsOffset + lsi->stringsOffset,
+                 lsi->stringsSize, &strs,
+                 &map->strs_mapping, &map->strs_mapping_size)) {
+        unmap_cache_syms(map);
         return false;
-    const substitute_sym *syms = (void *) (ls_data + lsi->nlistOffset);
-    *syms_p = syms + lse.nlistStartIndex;
-    *strs_p = ls_data + lsi->stringsOffset;
-    *nsyms_p = lse.nlistCount;
+    }
+    map->syms = syms;
+    map->strs = strs;
     return true;
 }
 
+static void *cache_sym_index_lookup_hash(const struct cache_syms_map *map,
+                                         uint64_t hash, intptr_t slide) {
+    size_t slot = hash & map->index_mask;
+    for (size_t i = 0; i <= map->index_mask; i++) {
+        const struct cache_sym_index_entry *e = &map->index[slot];
+        if (!e->hash)
+            break;
+        if (e->hash == hash) {
+            uintptr_t addr = (e->value & ~CACHE_SYM_INDEX_THUMB) + slide;
+            if (e->value & CACHE_SYM_INDEX_THUMB)
+                addr |= 1;
+            return (void *) addr;
+        }
+        slot = (slot + 1) & map->index_mask;
+    }
+    return NULL;
+}
+
+static void *cache_sym_index_lookup(const struct cache_syms_map *map,
+                                    const char *name, intptr_t slide) {
+    return cache_sym_index_lookup_hash(map, hash_sym_name64(name), slide);
+}
+
+static const struct dyld_cache_local_symbols_entry *
+find_cache_lse(uintptr_t dylib_offset) {
+    pthread_once(&s_open_cache_once, open_shared_cache_file_once);
+    if (s_cur_shared_cache_fd == -1)
+        return NULL;
+    const struct dyld_cache_local_symbols_info *lsi = &s_cache_local_symbols_info;
+    const struct dyld_cache_local_symbols_entry *lses =
+        s_cache_local_symbols_entries;
+    size_t lo = 0, hi = lsi->entriesCount;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (lses[mid].dylibOffset < dylib_offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == lsi->entriesCount || lses[lo].dylibOffset != dylib_offset)
+        return NULL;
+    const struct dyld_cache_local_symbols_entry *lse = &lses[lo];
+    if (lse->nlistStartIndex > lsi->nlistCount ||
+        lsi->nlistCount - lse->nlistStartIndex < lse->nlistCount)
+        return NULL;
+    return lse;
+}
+
+static struct cache_syms_map *get_shared_cache_syms(const void *hdr) {
+    const struct dyld_cache_header *dch = s_cur_shared_cache_hdr;
+    uintptr_t dylib_offset = (uintptr_t) hdr - (uintptr_t) dch;
+    /* the cross-process index if it's there, else the cache file */
+    const struct cache_sym_index_dylib *isd =
+        find_cache_sym_index_dylib(dylib_offset);
+    const struct dyld_cache_local_symbols_entry *lse = NULL;
+    if (!isd && !(lse = find_cache_lse(dylib_offset)))
+        return NULL;
+
+    pthread_mutex_lock(&s_cache_syms_lock);
+    struct cache_syms_map *map = NULL, *victim = NULL;
+    for (int i = 0; i < CACHE_SYMS_MAPS; i++) {
+        struct cache_syms_map *m = &s_cache_syms_maps[i];
+        if (m->mapping_size && m->dylib_offset == dylib_offset) {
+            map = m;
+            break;
+        }
+        if (!m->refs && (!victim || m->last_used < victim->last_used))
+            victim = m;
+    }
+    if (!map) {
+        if (victim) {
+            unmap_cache_syms(victim);
+            map = victim;
+            map->uncached = false;
+        } else {
+            if (!(map = malloc(sizeof(*map))))
+                goto out;
+            map->uncached = true;
+        }
+        map->refs = 0;
+        map->dylib_offset = dylib_offset;
+        if (!(isd ? map_cache_sym_index(isd, map)
+                  : map_cache_syms(s_cur_shared_cache_fd, dch,
+                                   &s_cache_local_symbols_info, lse, map))) {
+            if (map->uncached)
+                free(map);
+            map = NULL;
+            goto out;
+        }
+    }
+    map->refs++;
+    map->last_used = ++s_cache_syms_clock;
+out:
+    pthread_mutex_unlock(&s_cache_syms_lock);
+    return map;
+}
+
+static void put_shared_cache_syms(struct cache_syms_map *map) {
+    pthread_mutex_lock(&s_cache_syms_lock);
+    if (!--map->refs && map->uncached) {
+        unmap_cache_syms(map);
+        free(map);
+    }
+    pthread_mutex_unlock(&s_cache_syms_lock);
+}
 
 static const struct dyld_cache_header *get_cur_shared_cache_hdr() {
     const struct dyld_cache_header *dch = s_cur_shared_cache_hdr;
@@ -218,36 +566,93 @@ static void *sym_to_ptr(const substitute_sym *sym, intptr_t slide) {
     return (void *) addr;
 }
 
-static void find_syms_raw(const void *hdr, intptr_t *restrict slide,
-                          const char **restrict names, void **restrict syms,
-                          size_t nsyms) {
-    memset(syms, 0, sizeof(*syms) * nsyms);
+/* The requested names, for looking up each symbol in one probe rather than
+ * comparing it against every name.  The hash and length are computed in the
+ * same pass over the string, and compared before the bytes. */
+struct sym_name {
+    const char *name;
+    size_t len;
+    size_t hash;
+};
+static inline size_t hash_sym_name(const char *name, size_t *lenp) {
+    size_t hash = 2166136261;
+    const char *p;
+    for (p = name; *p; p++)
+        hash = (hash ^ (uint8_t) *p) * 16777619;
+    *lenp = p - name;
+    return hash;
+}
+#define sym_name_hash(k) ((k)->hash)
+#define sym_name_eq(k1, k2) ((k1)->hash == (k2)->hash && \
+                             (k1)->len == (k2)->len && \
+                             !memcmp((k1)->name, (k2)->name, (k1)->len))
+#define sym_name_null(k) (!(k)->name)
+DECL_STATIC_HTAB_KEY(sym_name, struct sym_name, sym_name_hash, sym_name_eq,
+                     sym_name_null, 0);
+/* the value is the index of the first request for the name */
+DECL_HTAB(sym_name_idx, sym_name, size_t);
+
+#define u64_hash(kp) ((size_t) *(kp))
+#define u64_eq(k1p, k2p) (*(k1p) == *(k2p))
+#define u64_null(kp) (!*(kp))
+DECL_STATIC_HTAB_KEY(u64, uint64_t, u64_hash, u64_eq, u64_null, 0);
+/* for substitute_find_private_syms_hashed, like sym_name_idx */
+DECL_HTAB(u64_idx, u64, size_t);
 
-    void *mapping = NULL;
-    size_t mapping_size = 0;
-    const substitute_sym *cache_syms = NULL;
-    const char *cache_strs = NULL;
-    size_t ncache_syms = 0;
-    if (addr_in_shared_cache(hdr))
-        get_shared_cache_syms(hdr, &cache_syms, &cache_strs, &ncache_syms,
-                              &mapping, &mapping_size);
+/* below this many names, just strcmp against each of them */
+#define FIND_SYMS_HASH_MIN 4
+
+#ifndef LC_DYLD_EXPORTS_TRIE
+#define LC_DYLD_EXPORTS_TRIE (0x33 | LC_REQ_DYLD)
+#endif
+
+/* An image's symbol table, plus the extra local symbols the shared cache
+ * has for it (whose mapping is released by release_symtabs), and its export
+ * trie if it has one. */
+struct symtabs {
+    const substitute_sym *syms[2];
+    const char *strs[2];
+    size_t nsyms[2];
+    struct cache_syms_map *cache_map;
+    const void *exports;
+    size_t exports_size;
+};
+
+static void release_symtabs(struct symtabs *st) {
+    if (st->cache_map)
+        put_shared_cache_syms(st->cache_map);
+}
 
+static bool find_symtabs(const void *hdr, intptr_t *restrict slide,
+                         struct symtabs *st, bool with_cache) {
+    memset(st, 0, sizeof(*st));
     /* note: no verification at all */
     const mach_header_x *mh = hdr;
     uint32_t ncmds = mh->ncmds;
     struct load_command *lc = (void *) (mh + 1);
     struct symtab_command syc;
+    bool have_symtab = false;
+    uint32_t export_off = 0, export_size = 0;
     for (uint32_t i = 0; i < ncmds; i++) {
         if (lc->cmd == LC_SYMTAB) {
             syc = *(struct symtab_command *) lc;
-            goto ok;
+            have_symtab = true;
+        } else if (lc->cmd == LC_DYLD_INFO || lc->cmd == LC_DYLD_INFO_ONLY) {
+            struct dyld_info_command *dc = (void *) lc;
+            export_off = dc->export_off;
+            export_size = dc->export_size;
+        } else if (lc->cmd == LC_DYLD_EXPORTS_TRIE) {
+            struct linkedit_data_command *ldc = (void *) lc;
+            export_off = ldc->dataoff;
+            export_size = ldc->datasize;
         }
         lc = (void *) lc + lc->cmdsize;
     }
-    return; /* no symtab, no symbols */
-ok: ;
+    if (!have_symtab)
+        return false; /* no symtab, no symbols */
     substitute_sym *symtab = NULL;
     const char *strtab = NULL;
+    const void *exports = NULL;
     lc = (void *) (mh + 1);
     for (uint32_t i = 0; i < ncmds; i++) {
         if (lc->cmd == LC_SEGMENT_X) {
@@ -256,34 +661,214 @@ ok: ;
                 symtab = (void *) sc->vmaddr + syc.symoff - sc->fileoff;
             if (syc.stroff - sc->fileoff < sc->filesize)
                 strtab = (void *) sc->vmaddr + syc.stroff - sc->fileoff;
+            if (export_size && export_off - sc->fileoff < sc->filesize)
+                exports = (void *) sc->vmaddr + export_off - sc->fileoff;
             if (*slide == -1 && sc->fileoff == 0) {
                 // used only for dyld
                 *slide = (uintptr_t) hdr - sc->vmaddr;
             }
-            if (symtab && strtab)
-                goto ok2;
         }
         lc = (void *) lc + lc->cmdsize;
     }
-    return; /* uh... weird */
-ok2: ;
-    symtab = (void *) symtab + *slide;
-    strtab = (void *) strtab + *slide;
+    if (!symtab || !strtab)
+        return false; /* uh... weird */
+    st->syms[0] = (void *) symtab + *slide;
+    st->strs[0] = (void *) strtab + *slide;
+    st->nsyms[0] = syc.nsyms;
+    if (exports) {
+        st->exports = exports + *slide;
+        st->exports_size = export_size;
+    }
+    if (with_cache && addr_in_shared_cache(hdr) &&
+        (st->cache_map = get_shared_cache_syms(hdr))) {
+        st->syms[1] = st->cache_map->syms;
+        st->strs[1] = st->cache_map->strs;
+        st->nsyms[1] = st->cache_map->nsyms;
+    }
+    return true;
+}
+
+static inline const char *sym_name_in(const struct symtabs *st, int type,
+                                      const substitute_sym *sym) {
+    uint32_t strx = sym->n_un.n_strx;
+    return strx == 0 ? "" : st->strs[type] + strx;
+}
+
+/* Symbol tables at least this long are split into chunks scanned on
+ * libdispatch's thread pool; 0 (the default) means never. */
+static size_t s_parallel_scan_min;
+#define PARALLEL_SCAN_MIN_CHUNK 16384
+
+EXPORT
+void substitute_set_parallel_sym_scan_threshold(size_t nsyms) {
+    __atomic_store_n(&s_parallel_scan_min, nsyms, __ATOMIC_RELAXED);
+}
+
+struct parallel_scan {
+    const substitute_sym *syms;
+    const char *strs;
+    size_t nsyms, chunk;
+    const char **names;
+    size_t nnames;
+    void *const *found; /* what earlier passes found; read only */
+    const struct htab_sym_name_idx *h; /* or NULL to strcmp each name */
+    /* per name, the lowest index of a symbol matching it, so the result is
+     * the same as a serial scan's */
+    uint32_t *best;
+};
+
+static void parallel_scan_note(uint32_t *best, uint32_t i) {
+    uint32_t cur = __atomic_load_n(best, __ATOMIC_RELAXED);
+    while (i < cur &&
+           !__atomic_compare_exchange_n(best, &cur, i, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static void parallel_scan_chunk(void *ctx, size_t c) {
+    const struct parallel_scan *ps = ctx;
+    size_t end = (c + 1) * ps->chunk;
+    if (end > ps->nsyms)
+        end = ps->nsyms;
+    for (size_t i = c * ps->chunk; i < end; i++) {
+        uint32_t strx = ps->syms[i].n_un.n_strx;
+        const char *name = strx == 0 ? "" : ps->strs + strx;
+        if (ps->h) {
+            struct sym_name key = {name};
+            key.hash = hash_sym_name(name, &key.len);
+            size_t *idxp = htab_getp_sym_name_idx(ps->h, &key);
+            if (idxp && !ps->found[*idxp])
+                parallel_scan_note(&ps->best[*idxp], i);
+            continue;
+        }
+        for (size_t j = 0; j < ps->nnames; j++) {
+            if (!ps->found[j] && !strcmp(name, ps->names[j]))
+                parallel_scan_note(&ps->best[j], i);
+        }
+    }
+}
+
+/* Scan one of st's tables on the thread pool, filling in syms for every
+ * name found and returning how many were.  Returns -1 if it couldn't. */
+static ssize_t scan_symtab_parallel(const struct symtabs *st, int type,
+                                    const struct htab_sym_name_idx *h,
+                                    const char **names, void **syms,
+                                    size_t nsyms, intptr_t slide) {
+    uint32_t *best = malloc(nsyms * sizeof(*best));
+    if (!best)
+        return -1;
+    memset(best, 0xff, nsyms * sizeof(*best));
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t chunk = st->nsyms[type] / ((ncpu > 0 ? ncpu : 1) * 4) + 1;
+    if (chunk < PARALLEL_SCAN_MIN_CHUNK)
+        chunk = PARALLEL_SCAN_MIN_CHUNK;
+    struct parallel_scan ps = {
+        .syms = st->syms[type],
+        .strs = st->strs[type],
+        .nsyms = st->nsyms[type],
+        .chunk = chunk,
+        .names = names,
+        .nnames = nsyms,
+        .found = syms,
+        .h = h,
+        .best = best,
+    };
+    dispatch_apply_f((ps.nsyms + chunk - 1) / chunk,
+                     dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0),
+                     &ps, parallel_scan_chunk);
+    ssize_t found = 0;
+    for (size_t j = 0; j < nsyms; j++) {
+        if (best[j] != UINT32_MAX) {
+            syms[j] = sym_to_ptr(&ps.syms[best[j]], slide);
+            found++;
+        }
+    }
+    free(best);
+    return found;
+}
+
+/* The lookup proper, into a zeroed 'syms', given the image's tables. */
+static void find_syms_in(const struct symtabs *st, const void *hdr,
+                         intptr_t slide, const char **restrict names,
+                         void **restrict syms, size_t nsyms) {
     size_t found_syms = 0;
 
+    /* Exported names are one walk down the trie each; only the rest need
+     * the symbol tables scanned. */
+    if (st->exports) {
+        for (size_t j = 0; j < nsyms; j++) {
+            uint64_t addr;
+            if (find_export_symbol(st->exports, st->exports_size, names[j],
+                                   (uintptr_t) hdr, &addr)) {
+                syms[j] = (void *) (uintptr_t) addr;
+                found_syms++;
+            }
+        }
+        if (found_syms == nsyms)
+            return;
+    }
+
+    bool use_htab = nsyms - found_syms >= FIND_SYMS_HASH_MIN;
+    HTAB_STORAGE_CAPA(sym_name_idx, 16) hs;
+    struct htab_sym_name_idx *h = &hs.h;
+    size_t nunique = nsyms;
+    if (use_htab) {
+        HTAB_STORAGE_INIT(&hs, sym_name_idx);
+        if (nsyms * 3 / 2 >= h->capacity)
+            htab_resize_sym_name_idx(h, nsyms * 2);
+        found_syms = 0;
+        for (size_t j = 0; j < nsyms; j++) {
+            if (syms[j])
+                continue;
+            struct sym_name key = {names[j]};
+            key.hash = hash_sym_name(names[j], &key.len);
+            bool new;
+            size_t *idxp = htab_setp_sym_name_idx(h, &key, &new);
+            if (new)
+                *idxp = j;
+        }
+        nunique = h->length;
+    }
+
     for (int type = 0; type <= 1; type++) {
-        const substitute_sym *this_symtab = type ? cache_syms : symtab;
-        const char *this_strtab = type ? cache_strs : strtab;
-        size_t this_nsyms = type ? ncache_syms : syc.nsyms;
-        /* This could be optimized for efficiency with a large number of
-         * names... */
-        for (uint32_t i = 0; i < this_nsyms; i++) {
-            const substitute_sym *sym = &this_symtab[i];
-            uint32_t strx = sym->n_un.n_strx;
-            const char *name = strx == 0 ? "" : this_strtab + strx;
+        if (type == 1 && st->cache_map && st->cache_map->index) {
+            for (size_t j = 0; j < nsyms; j++) {
+                if (!syms[j])
+                    syms[j] = cache_sym_index_lookup(st->cache_map, names[j],
+                                                     slide);
+            }
+            break;
+        }
+        size_t parallel_min = __atomic_load_n(&s_parallel_scan_min,
+                                              __ATOMIC_RELAXED);
+        if (parallel_min && st->nsyms[type] >= parallel_min) {
+            ssize_t found = scan_symtab_parallel(st, type,
+                                                 use_htab ? h : NULL, names,
+                                                 syms, nsyms, slide);
+            if (found != -1) {
+                found_syms += found;
+                if (found_syms == (use_htab ? nunique : nsyms))
+                    goto end;
+                continue;
+            }
+        }
+        for (size_t i = 0; i < st->nsyms[type]; i++) {
+            const substitute_sym *sym = &st->syms[type][i];
+            const char *name = sym_name_in(st, type, sym);
+            if (use_htab) {
+                struct sym_name key = {name};
+                key.hash = hash_sym_name(name, &key.len);
+                size_t *idxp = htab_getp_sym_name_idx(h, &key);
+                if (idxp && !syms[*idxp]) {
+                    syms[*idxp] = sym_to_ptr(sym, slide);
+                    if (++found_syms == nunique)
+                        goto end;
+                }
+                continue;
+            }
             for (size_t j = 0; j < nsyms; j++) {
                 if (!syms[j] && !strcmp(name, names[j])) {
-                    syms[j] = sym_to_ptr(sym, *slide);
+                    syms[j] = sym_to_ptr(sym, slide);
                     if (++found_syms == nsyms)
                         goto end;
                 }
@@ -292,8 +877,118 @@ ok2: ;
     }
 
 end:
-    if (mapping_size)
-        munmap(mapping, mapping_size);
+    if (use_htab) {
+        /* names requested more than once only got the first slot filled */
+        for (size_t j = 0; j < nsyms; j++) {
+            if (syms[j])
+                continue;
+            struct sym_name key = {names[j]};
+            key.hash = hash_sym_name(names[j], &key.len);
+            syms[j] = syms[*htab_getp_sym_name_idx(h, &key)];
+        }
+        htab_free_storage_sym_name_idx(h);
+    }
+}
+
+static void find_syms_raw_(const void *hdr, intptr_t *restrict slide,
+                           const char **restrict names, void **restrict syms,
+                           size_t nsyms) {
+    memset(syms, 0, sizeof(*syms) * nsyms);
+    struct symtabs st;
+    if (!find_symtabs(hdr, slide, &st, true))
+        return;
+    find_syms_in(&st, hdr, *slide, names, syms, nsyms);
+    release_symtabs(&st);
+}
+
+static void find_syms_raw(const void *hdr, intptr_t *restrict slide,
+                          const char **restrict names, void **restrict syms,
+                          size_t nsyms) {
+    STATS_START(start);
+    find_syms_raw_(hdr, slide, names, syms, nsyms);
+    STATS_END(find_syms_ns, start);
+}
+
+/* Every symbol in an image by name hash, built on a handle's second
+ * substitute_find_private_syms call so later ones don't scan the symbol
+ * tables again (the first just scans, since handles are often opened for a
+ * single lookup, which can stop early).  Open addressing with linear probing, so the first of
+ * several symbols with the same name is found first, as with a scan.  'sym'
+ * numbers the image's own symbols first, then the shared cache's; that
+ * part of the cache file stays mapped until the handle is closed. */
+#define SYM_INDEX_EMPTY UINT32_MAX
+struct sym_index_entry {
+    uint32_t hash;
+    uint32_t sym;
+};
+struct sym_index {
+    struct symtabs st;
+    size_t mask;
+    struct sym_index_entry entries[];
+};
+
+static struct sym_index *build_sym_index(struct substitute_image *im) {
+    struct symtabs st;
+    if (!find_symtabs(im->image_header, &im->slide, &st, true))
+        memset(&st, 0, sizeof(st));
+    size_t total = st.nsyms[0] + st.nsyms[1];
+    if (total >= SYM_INDEX_EMPTY)
+        goto fail;
+    size_t capacity = 16;
+    while (capacity * 3 / 4 < total)
+        capacity *= 2;
+    struct sym_index *idx = malloc(sizeof(*idx) +
+                                   capacity * sizeof(idx->entries[0]));
+    if (!idx)
+        goto fail;
+    idx->st = st;
+    idx->mask = capacity - 1;
+    memset(idx->entries, 0xff, capacity * sizeof(idx->entries[0]));
+    uint32_t n = 0;
+    for (int type = 0; type <= 1; type++) {
+        for (size_t i = 0; i < st.nsyms[type]; i++, n++) {
+            size_t len;
+            uint32_t hash = hash_sym_name(sym_name_in(&st, type,
+                                                      &st.syms[type][i]),
+                                          &len);
+            size_t slot = hash & idx->mask;
+            while (idx->entries[slot].sym != SYM_INDEX_EMPTY)
+                slot = (slot + 1) & idx->mask;
+            idx->entries[slot].hash = hash;
+            idx->entries[slot].sym = n;
+        }
+    }
+    return idx;
+fail:
+    release_symtabs(&st);
+    return NULL;
+}
+
+static void free_sym_index(struct sym_index *idx) {
+    release_symtabs(&idx->st);
+    free(idx);
+}
+
+static void *sym_index_lookup(const struct sym_index *idx, const char *name,
+                              intptr_t slide) {
+    size_t len;
+    uint32_t hash = hash_sym_name(name, &len);
+    for (size_t slot = hash & idx->mask; ; slot = (slot + 1) & idx->mask) {
+        const struct sym_index_entry *e = &idx->entries[slot];
+        if (e->sym == SYM_INDEX_EMPTY)
+            break;
+        if (e->hash != hash)
+            continue;
+        int type = e->sym >= idx->st.nsyms[0];
+        const substitute_sym *sym =
+            &idx->st.syms[type][e->sym - (type ? idx->st.nsyms[0] : 0)];
+        if (!strcmp(sym_name_in(&idx->st, type, sym), name))
+            return sym_to_ptr(sym, slide);
+    }
+    /* the shared cache's symbols might be in its index instead */
+    if (idx->st.cache_map && idx->st.cache_map->index)
+        return cache_sym_index_lookup(idx->st.cache_map, name, slide);
+    return NULL;
 }
 
 /* This is a mess because the usual _dyld_image_count loop is not thread safe.
@@ -356,15 +1051,95 @@ static void inspect_dyld() {
     }
 }
 
+/* Handles are shared: while an image has one open, every open of it, by any
+ * path or by address, gets that one (and its symbol index) back, with another
+ * reference.  The caches below don't hold a reference of their own: the last
+ * substitute_close_image takes the handle out of them and frees it, and dyld
+ * unloading the image takes it out early.  image_by_path's keys are copies of
+ * the paths the handle has been opened by.  Both tables, and every cached
+ * handle's refs, are under s_image_cache_lock. */
+DECL_HTAB(image_by_path, sym_name, struct substitute_image *);
+DECL_HTAB(image_by_header, u64, struct substitute_image *);
+static HTAB_STORAGE(image_by_path) s_image_by_path =
+    HTAB_STORAGE_INIT_STATIC(&s_image_by_path, image_by_path);
+static HTAB_STORAGE(image_by_header) s_image_by_header =
+    HTAB_STORAGE_INIT_STATIC(&s_image_by_header, image_by_header);
+static pthread_mutex_t s_image_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t s_image_cache_once = PTHREAD_ONCE_INIT;
+
+/* Call with s_image_cache_lock held.  Later opens get a new handle. */
+static void image_cache_forget(struct substitute_image *im) {
+    struct htab_image_by_path *hp = &s_image_by_path.h;
+    /* Removing shifts later entries back into the hole, so look at the same
+     * bucket again afterward. */
+    for (size_t b = 0; b < hp->capacity; ) {
+        struct htab_bucket_image_by_path *bucket = &hp->base[b];
+        if (bucket->key.name && bucket->value == im) {
+            free((char *) bucket->key.name);
+            htab_removeat_image_by_path(hp, bucket);
+        } else {
+            b++;
+        }
+    }
+    uint64_t key = (uintptr_t) im->image_header;
+    struct htab_bucket_image_by_header *bucket =
+        htab_getbucket_image_by_header(&s_image_by_header.h, &key);
+    /* (an image loaded at the same address since might have its own) */
+    if (bucket && bucket->value == im)
+        htab_removeat_image_by_header(&s_image_by_header.h, bucket);
+}
+
+static void image_cache_removed(const struct mach_header *mh,
+                                UNUSED intptr_t slide) {
+    pthread_mutex_lock(&s_image_cache_lock);
+    uint64_t key = (uintptr_t) mh;
+    struct substitute_image **imp =
+        htab_getp_image_by_header(&s_image_by_header.h, &key);
+    /* anyone still holding it can close it as usual */
+    if (imp)
+        image_cache_forget(*imp);
+    pthread_mutex_unlock(&s_image_cache_lock);
+}
+
+static void register_image_cache() {
+    _dyld_register_func_for_remove_image(image_cache_removed);
+}
+
+/* Call with s_image_cache_lock held.  Returns a new reference. */
+static struct substitute_image *image_for_header(const void *image_header,
+                                                 intptr_t slide) {
+    uint64_t key = (uintptr_t) image_header;
+    bool new;
+    struct substitute_image **imp =
+        htab_setp_image_by_header(&s_image_by_header.h, &key, &new);
+    if (new) {
+        struct substitute_image *im = malloc(sizeof(*im));
+        if (!im) {
+            htab_remove_image_by_header(&s_image_by_header.h, &key);
+            return NULL;
+        }
+        im->slide = slide;
+        im->image_header = image_header;
+        im->sym_index = NULL;
+        im->sym_lookups = 0;
+        im->function_starts = NULL;
+        im->refs = 0;
+        *imp = im;
+    }
+    (*imp)->refs++;
+    return *imp;
+}
+
 /* 'dlhandle' keeps the image alive */
-EXPORT
-struct substitute_image *substitute_open_image(const char *filename) {
+static bool open_image_uncached(const char *filename,
+                                const void **image_header_p,
+                                intptr_t *slide_p) {
     pthread_once(&dyld_inspect_once, inspect_dyld);
 
     void *dlhandle = dlopen(filename, RTLD_LAZY | RTLD_LOCAL | RTLD_NOLOAD);
     if (!dlhandle) {
         dlerror();
-        return NULL;
+        return false;
     }
 
     void* image = (void*)(((uintptr_t)dlhandle) & (-4));
@@ -394,18 +1169,117 @@ struct substitute_image *substitute_open_image(const char *filename) {
 
     dlclose(dlhandle);
     if (!image_header)
-        return NULL;
+        return false;
+    *image_header_p = image_header;
+    *slide_p = slide;
+    return true;
+}
+
+EXPORT
+struct substitute_image *substitute_open_image(const char *filename) {
+    pthread_once(&s_image_cache_once, register_image_cache);
+    struct sym_name key = {filename};
+    key.hash = hash_sym_name(filename, &key.len);
+    pthread_mutex_lock(&s_image_cache_lock);
+    struct substitute_image **imp =
+        htab_getp_image_by_path(&s_image_by_path.h, &key);
+    if (imp) {
+        struct substitute_image *im = *imp;
+        im->refs++;
+        pthread_mutex_unlock(&s_image_cache_lock);
+        return im;
+    }
+    pthread_mutex_unlock(&s_image_cache_lock);
 
-    struct substitute_image *im = malloc(sizeof(*im));
-    if (!im)
+    /* dyld might call image_cache_removed, so not under the lock */
+    const void *image_header;
+    intptr_t slide;
+    if (!open_image_uncached(filename, &image_header, &slide))
         return NULL;
-    im->slide = slide;
-    im->image_header = image_header;
+
+    pthread_mutex_lock(&s_image_cache_lock);
+    struct substitute_image *im = image_for_header(image_header, slide);
+    if (im) {
+        /* if this fails, the next open just won't be cached */
+        char *name = strdup(filename);
+        if (name) {
+            key.name = name;
+            bool new;
+            imp = htab_setp_image_by_path(&s_image_by_path.h, &key, &new);
+            if (new)
+                *imp = im;
+            else
+                free(name);
+        }
+    }
+    pthread_mutex_unlock(&s_image_cache_lock);
     return im;
 }
 
+static bool image_contains(const mach_header_x *mh, uintptr_t addr,
+                           intptr_t *slide_p) {
+    /* note: no verification, as in find_symtabs */
+    const struct load_command *lc = (void *) (mh + 1);
+    for (uint32_t i = 0; i < mh->ncmds; i++) {
+        const segment_command_x *sc = (void *) lc;
+        if (lc->cmd == LC_SEGMENT_X && sc->fileoff == 0 && sc->filesize) {
+            *slide_p = (uintptr_t) mh - sc->vmaddr;
+            goto ok;
+        }
+        lc = (void *) lc + lc->cmdsize;
+    }
+    return false;
+ok:
+    lc = (void *) (mh + 1);
+    for (uint32_t i = 0; i < mh->ncmds; i++) {
+        const segment_command_x *sc = (void *) lc;
+        /* (initprot rules out __PAGEZERO) */
+        if (lc->cmd == LC_SEGMENT_X && sc->initprot &&
+            addr - (sc->vmaddr + *slide_p) < sc->vmsize)
+            return true;
+        lc = (void *) lc + lc->cmdsize;
+    }
+    return false;
+}
+
+EXPORT
+struct substitute_image *substitute_open_image_by_address(const void *addr) {
+    pthread_once(&s_image_cache_once, register_image_cache);
+    const struct dyld_all_image_infos *aii = dyld_get_all_image_infos();
+    /* dyld NULLs out infoArray while it's changing it */
+    const struct dyld_image_info *infos;
+    for (int try = 0; !(infos = __atomic_load_n(&aii->infoArray,
+                                               __ATOMIC_ACQUIRE)); try++) {
+        if (try == 100)
+            return NULL;
+        usleep(10);
+    }
+    uint32_t count = aii->infoArrayCount;
+    for (uint32_t i = 0; i < count; i++) {
+        const mach_header_x *mh = (void *) infos[i].imageLoadAddress;
+        intptr_t slide;
+        if (mh && image_contains(mh, (uintptr_t) addr, &slide)) {
+            pthread_mutex_lock(&s_image_cache_lock);
+            struct substitute_image *im = image_for_header(mh, slide);
+            pthread_mutex_unlock(&s_image_cache_lock);
+            return im;
+        }
+    }
+    return NULL;
+}
+
 EXPORT
 void substitute_close_image(struct substitute_image *im) {
+    pthread_mutex_lock(&s_image_cache_lock);
+    bool last = !--im->refs;
+    if (last)
+        image_cache_forget(im);
+    pthread_mutex_unlock(&s_image_cache_lock);
+    if (!last)
+        return;
+    if (im->sym_index)
+        free_sym_index(im->sym_index);
+    free(im->function_starts);
     free(im);
 }
 
@@ -414,7 +1288,515 @@ int substitute_find_private_syms(struct substitute_image *im,
                                  const char **restrict names,
                                  void **restrict syms,
                                  size_t nsyms) {
-    find_syms_raw(im->image_header, &im->slide, names, syms, nsyms);
+    struct sym_index *idx = __atomic_load_n(&im->sym_index, __ATOMIC_ACQUIRE);
+    if (!idx && __atomic_fetch_add(&im->sym_lookups, 1, __ATOMIC_RELAXED) == 0) {
+        find_syms_raw(im->image_header, &im->slide, names, syms, nsyms);
+        return SUBSTITUTE_OK;
+    }
+    if (!idx) {
+        STATS_START(start);
+        struct sym_index *new_idx = build_sym_index(im);
+        STATS_END(find_syms_ns, start);
+        if (!new_idx) {
+            /* no memory for it; scan instead */
+            find_syms_raw(im->image_header, &im->slide, names, syms, nsyms);
+            return SUBSTITUTE_OK;
+        }
+        /* someone else might have beaten us to it */
+        if (__atomic_compare_exchange_n(&im->sym_index, &idx, new_idx, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            idx = new_idx;
+        else
+            free_sym_index(new_idx);
+    }
+    STATS_START(start);
+    for (size_t i = 0; i < nsyms; i++)
+        syms[i] = sym_index_lookup(idx, names[i], im->slide);
+    STATS_END(find_syms_ns, start);
     return SUBSTITUTE_OK;
 }
+
+/* State across the groups of one substitute_find_syms_multi call. */
+struct multi_ctx {
+    struct cache_syms_map all;
+    bool tried_all;
+};
+
+/* Like find_syms_raw_, but with the shared cache's local symbols for the
+ * image taken from ctx->all, unless the cross-process index has them. */
+static void find_syms_multi_group(struct multi_ctx *ctx,
+                                  struct substitute_image *im,
+                                  const char **names, void **syms,
+                                  size_t nsyms) {
+    memset(syms, 0, sizeof(*syms) * nsyms);
+    const void *hdr = im->image_header;
+    struct symtabs st;
+    if (!find_symtabs(hdr, &im->slide, &st, false))
+        return;
+    if (addr_in_shared_cache(hdr)) {
+        uintptr_t dylib_offset = (uintptr_t) hdr -
+                                 (uintptr_t) s_cur_shared_cache_hdr;
+        const struct dyld_cache_local_symbols_entry *lse;
+        if (find_cache_sym_index_dylib(dylib_offset)) {
+            if ((st.cache_map = get_shared_cache_syms(hdr))) {
+                st.syms[1] = st.cache_map->syms;
+                st.strs[1] = st.cache_map->strs;
+                st.nsyms[1] = st.cache_map->nsyms;
+            }
+        } else if ((lse = find_cache_lse(dylib_offset))) {
+            if (!ctx->tried_all) {
+                ctx->tried_all = true;
+                map_cache_syms_all(&ctx->all);
+            }
+            if (ctx->all.mapping_size) {
+                st.syms[1] = ctx->all.syms + lse->nlistStartIndex;
+                st.strs[1] = ctx->all.strs;
+                st.nsyms[1] = lse->nlistCount;
+            }
+        }
+    }
+    find_syms_in(&st, hdr, im->slide, names, syms, nsyms);
+    release_symtabs(&st);
+}
+
+static int compare_queries_by_image(const void *a, const void *b) {
+    const struct substitute_sym_query *qa =
+        *(const struct substitute_sym_query *const *) a;
+    const struct substitute_sym_query *qb =
+        *(const struct substitute_sym_query *const *) b;
+    int c = strcmp(qa->image, qb->image);
+    if (c)
+        return c;
+    /* keep each image's names in order */
+    return qa < qb ? -1 : qa > qb;
+}
+
+EXPORT
+int substitute_find_syms_multi(const struct substitute_sym_query *queries,
+                               size_t n) {
+    const struct substitute_sym_query **sorted = malloc(n * sizeof(*sorted));
+    const char **names = malloc(n * sizeof(*names));
+    void **syms = malloc(n * sizeof(*syms));
+    int ret = SUBSTITUTE_ERR_OOM;
+    if (!sorted || !names || !syms)
+        goto end;
+    ret = SUBSTITUTE_OK;
+    for (size_t i = 0; i < n; i++)
+        sorted[i] = &queries[i];
+    qsort(sorted, n, sizeof(*sorted), compare_queries_by_image);
+
+    struct multi_ctx ctx = {.tried_all = false};
+    for (size_t start = 0, stop; start < n; start = stop) {
+        const char *image = sorted[start]->image;
+        for (stop = start; stop < n && !strcmp(sorted[stop]->image, image);
+             stop++)
+            names[stop - start] = sorted[stop]->name;
+        size_t count = stop - start;
+        struct substitute_image *im = substitute_open_image(image);
+        if (!im) {
+            memset(syms, 0, count * sizeof(*syms));
+        } else if (__atomic_load_n(&im->sym_index, __ATOMIC_ACQUIRE)) {
+            /* already has everything indexed */
+            substitute_find_private_syms(im, names, syms, count);
+        } else {
+            STATS_START(group_start);
+            find_syms_multi_group(&ctx, im, names, syms, count);
+            STATS_END(find_syms_ns, group_start);
+        }
+        if (im)
+            substitute_close_image(im);
+        for (size_t i = 0; i < count; i++)
+            *sorted[start + i]->sym = syms[i];
+    }
+    unmap_cache_syms(&ctx.all);
+end:
+    free(sorted);
+    free(names);
+    free(syms);
+    return ret;
+}
+
+EXPORT
+uint64_t substitute_hash_sym_name(const char *name) {
+    return hash_sym_name64(name);
+}
+
+/* Like find_syms_raw_, minus the export trie (which is walked by name), and
+ * matching each symbol's name hash against the requested ones without
+ * computing its length or comparing any bytes. */
+EXPORT
+int substitute_find_private_syms_hashed(struct substitute_image *im,
+                                        const uint64_t *restrict name_hashes,
+                                        void **restrict syms,
+                                        size_t nsyms) {
+    STATS_START(start);
+    memset(syms, 0, sizeof(*syms) * nsyms);
+    struct symtabs st;
+    if (!find_symtabs(im->image_header, &im->slide, &st, true))
+        goto out;
+
+    bool use_htab = nsyms >= FIND_SYMS_HASH_MIN;
+    HTAB_STORAGE_CAPA(u64_idx, 16) hs;
+    struct htab_u64_idx *h = &hs.h;
+    size_t nunique = nsyms, found_syms = 0;
+    if (use_htab) {
+        HTAB_STORAGE_INIT(&hs, u64_idx);
+        if (nsyms * 3 / 2 >= h->capacity)
+            htab_resize_u64_idx(h, nsyms * 2);
+        for (size_t j = 0; j < nsyms; j++) {
+            /* (0 is never a name's hash, and would be the null key) */
+            if (!name_hashes[j])
+                continue;
+            bool new;
+            size_t *idxp = htab_setp_u64_idx(h, &name_hashes[j], &new);
+            if (new)
+                *idxp = j;
+        }
+        nunique = h->length;
+    }
+
+    for (int type = 0; type <= 1; type++) {
+        if (type == 1 && st.cache_map && st.cache_map->index) {
+            for (size_t j = 0; j < nsyms; j++) {
+                if (!syms[j])
+                    syms[j] = cache_sym_index_lookup_hash(st.cache_map,
+                                                          name_hashes[j],
+                                                          im->slide);
+            }
+            break;
+        }
+        for (size_t i = 0; i < st.nsyms[type]; i++) {
+            const substitute_sym *sym = &st.syms[type][i];
+            uint64_t hash = hash_sym_name64(sym_name_in(&st, type, sym));
+            if (use_htab) {
+                size_t *idxp = htab_getp_u64_idx(h, &hash);
+                if (idxp && !syms[*idxp]) {
+                    syms[*idxp] = sym_to_ptr(sym, im->slide);
+                    if (++found_syms == nunique)
+                        goto end;
+                }
+                continue;
+            }
+            for (size_t j = 0; j < nsyms; j++) {
+                if (!syms[j] && hash == name_hashes[j]) {
+                    syms[j] = sym_to_ptr(sym, im->slide);
+                    if (++found_syms == nsyms)
+                        goto end;
+                }
+            }
+        }
+    }
+
+end:
+    if (use_htab) {
+        /* hashes requested more than once only got the first slot filled */
+        for (size_t j = 0; j < nsyms; j++) {
+            if (syms[j] || !name_hashes[j])
+                continue;
+            syms[j] = syms[*htab_getp_u64_idx(h, &name_hashes[j])];
+        }
+        htab_free_storage_u64_idx(h);
+    }
+    release_symtabs(&st);
+out:
+    STATS_END(find_syms_ns, start);
+    return SUBSTITUTE_OK;
+}
+
+EXPORT
+int substitute_enumerate_syms(struct substitute_image *im, const char *prefix,
+                              substitute_enumerate_syms_callback callback,
+                              void *ctx) {
+    struct symtabs st;
+    if (!find_symtabs(im->image_header, &im->slide, &st, false))
+        return SUBSTITUTE_OK;
+    /* The LRU'd mappings (get_shared_cache_syms) might be of the index,
+     * which doesn't have names, so map the cache's nlist entries here. */
+    struct cache_syms_map cache_map;
+    bool have_cache_map = false;
+    if (addr_in_shared_cache(im->image_header)) {
+        uintptr_t dylib_offset = (uintptr_t) im->image_header -
+                                 (uintptr_t) s_cur_shared_cache_hdr;
+        const struct dyld_cache_local_symbols_entry *lse =
+            find_cache_lse(dylib_offset);
+        if (lse && map_cache_syms(s_cur_shared_cache_fd,
+                                  s_cur_shared_cache_hdr,
+                                  &s_cache_local_symbols_info, lse,
+                                  &cache_map)) {
+            have_cache_map = true;
+            st.syms[1] = cache_map.syms;
+            st.strs[1] = cache_map.strs;
+            st.nsyms[1] = cache_map.nsyms;
+        }
+    }
+
+    size_t prefix_len = prefix ? strlen(prefix) : 0;
+    for (int type = 0; type <= 1; type++) {
+        for (size_t i = 0; i < st.nsyms[type]; i++) {
+            const substitute_sym *sym = &st.syms[type][i];
+            if ((sym->n_type & N_STAB) || (sym->n_type & N_TYPE) == N_UNDF)
+                continue;
+            const char *name = sym_name_in(&st, type, sym);
+            if (prefix_len && (name[0] != prefix[0] ||
+                               strncmp(name, prefix, prefix_len)))
+                continue;
+            if (!callback(ctx, name, sym, sym_to_ptr(sym, im->slide)))
+                goto end;
+        }
+    }
+end:
+    if (have_cache_map)
+        unmap_cache_syms(&cache_map);
+    return SUBSTITUTE_OK;
+}
+
+/* Results of find_sym_in_loaded_images, keyed by 64-bit name hash, with a
+ * copy of the name to check on lookup.  Only names that have been asked for
+ * go in, and it's emptied once it has LOADED_IMAGE_SYMS_MAX of them, so it
+ * stays small however many images (and symbols) are loaded.  An image's
+ * entries go when dyld unloads it, and s_loaded_image_syms_gen counts those
+ * unloads so a search that raced one doesn't add a stale entry. */
+struct loaded_image_sym {
+    char *name;
+    void *ptr;
+    const void *image;
+};
+DECL_HTAB(loaded_image_syms, u64, struct loaded_image_sym);
+static HTAB_STORAGE(loaded_image_syms) s_loaded_image_syms =
+    HTAB_STORAGE_INIT_STATIC(&s_loaded_image_syms, loaded_image_syms);
+static pthread_rwlock_t s_loaded_image_syms_lock = PTHREAD_RWLOCK_INITIALIZER;
+static uint64_t s_loaded_image_syms_gen;
+/* held for the whole search on a miss, so there's only one at a time (this
+ * is never taken inside dyld's callbacks, so it can be held while calling
+ * into dyld) */
+static pthread_mutex_t s_loaded_image_search_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t s_loaded_image_syms_once = PTHREAD_ONCE_INIT;
+enum { LOADED_IMAGE_SYMS_MAX = 4096 };
+
+static void loaded_image_removed(const struct mach_header *mh,
+                                 UNUSED intptr_t slide) {
+    pthread_rwlock_wrlock(&s_loaded_image_syms_lock);
+    struct htab_loaded_image_syms *h = &s_loaded_image_syms.h;
+    /* (removing shifts later entries back, as in image_cache_forget) */
+    for (size_t b = 0; b < h->capacity; ) {
+        struct htab_bucket_loaded_image_syms *bucket = &h->base[b];
+        if (bucket->key && bucket->value.image == mh) {
+            free(bucket->value.name);
+            htab_removeat_loaded_image_syms(h, bucket);
+        } else {
+            b++;
+        }
+    }
+    s_loaded_image_syms_gen++;
+    pthread_rwlock_unlock(&s_loaded_image_syms_lock);
+}
+
+static void register_loaded_image_syms() {
+    _dyld_register_func_for_remove_image(loaded_image_removed);
+}
+
+/* Call with s_loaded_image_syms_lock held for writing. */
+static void loaded_image_syms_add(uint64_t hash, const char *name, void *ptr,
+                                  const void *image) {
+    struct htab_loaded_image_syms *h = &s_loaded_image_syms.h;
+    if (h->length >= LOADED_IMAGE_SYMS_MAX) {
+        HTAB_FOREACH(h, uint64_t *hashp, struct loaded_image_sym *lis,
+                     loaded_image_syms) {
+            (void) hashp;
+            free(lis->name);
+        }
+        htab_free_storage_loaded_image_syms(h);
+        HTAB_STORAGE_INIT(&s_loaded_image_syms, loaded_image_syms);
+    }
+    char *copy = strdup(name);
+    if (!copy)
+        return;
+    bool new;
+    struct loaded_image_sym *lis =
+        htab_setp_loaded_image_syms(h, &hash, &new);
+    /* a different name with the same hash just replaces it */
+    if (!new)
+        free(lis->name);
+    lis->name = copy;
+    lis->ptr = ptr;
+    lis->image = image;
+}
+
+/* The slow way: each image in dyld's list, in load order, shared cache local
+ * symbols and all. */
+static void *search_loaded_images(const char *name, const void **image_p) {
+    pthread_once(&s_image_cache_once, register_image_cache);
+    const struct dyld_all_image_infos *aii = dyld_get_all_image_infos();
+    /* dyld NULLs out infoArray while it's changing it */
+    const struct dyld_image_info *infos;
+    for (int try = 0; !(infos = __atomic_load_n(&aii->infoArray,
+                                               __ATOMIC_ACQUIRE)); try++) {
+        if (try == 100)
+            return NULL;
+        usleep(10);
+    }
+    uint32_t count = aii->infoArrayCount;
+    for (uint32_t i = 0; i < count; i++) {
+        const mach_header_x *mh = (void *) infos[i].imageLoadAddress;
+        intptr_t slide;
+        if (!mh || !image_contains(mh, (uintptr_t) mh, &slide))
+            continue;
+        pthread_mutex_lock(&s_image_cache_lock);
+        struct substitute_image *im = image_for_header(mh, slide);
+        pthread_mutex_unlock(&s_image_cache_lock);
+        if (!im)
+            continue;
+        void *ptr;
+        substitute_find_private_syms(im, &name, &ptr, 1);
+        substitute_close_image(im);
+        if (ptr) {
+            *image_p = mh;
+            return ptr;
+        }
+    }
+    return NULL;
+}
+
+void *find_sym_in_loaded_images(const char *name, bool *searchedp) {
+    pthread_once(&s_loaded_image_syms_once, register_loaded_image_syms);
+    uint64_t hash = hash_sym_name64(name);
+    void *ptr = NULL;
+    pthread_rwlock_rdlock(&s_loaded_image_syms_lock);
+    struct loaded_image_sym *lis =
+        htab_getp_loaded_image_syms(&s_loaded_image_syms.h, &hash);
+    if (lis && !strcmp(lis->name, name))
+        ptr = lis->ptr;
+    uint64_t gen = s_loaded_image_syms_gen;
+    pthread_rwlock_unlock(&s_loaded_image_syms_lock);
+    *searchedp = !ptr;
+    if (ptr)
+        return ptr;
+
+    pthread_mutex_lock(&s_loaded_image_search_lock);
+    const void *image = NULL;
+    ptr = search_loaded_images(name, &image);
+    if (ptr) {
+        pthread_rwlock_wrlock(&s_loaded_image_syms_lock);
+        if (s_loaded_image_syms_gen == gen)
+            loaded_image_syms_add(hash, name, ptr, image);
+        pthread_rwlock_unlock(&s_loaded_image_syms_lock);
+    }
+    pthread_mutex_unlock(&s_loaded_image_search_lock);
+    return ptr;
+}
+
+EXPORT
+int substitute_build_shared_cache_sym_index() {
+    const struct dyld_cache_header *dch = get_cur_shared_cache_hdr();
+    if (!dch)
+        return SUBSTITUTE_ERR_NOT_SUPPORTED;
+    pthread_once(&s_open_cache_once, open_shared_cache_file_once);
+    int fd = s_cur_shared_cache_fd;
+    if (fd == -1)
+        return SUBSTITUTE_ERR_NOT_SUPPORTED;
+
+    /* already done? */
+    int old_fd;
+    struct cache_sym_index_dylib *old_dylibs;
+    uint32_t old_ndylibs;
+    if (load_cache_sym_index(dch, &old_fd, &old_dylibs, &old_ndylibs)) {
+        close(old_fd);
+        free(old_dylibs);
+        return SUBSTITUTE_OK;
+    }
+
+    const struct dyld_cache_local_symbols_info *lsi = &s_cache_local_symbols_info;
+    const struct dyld_cache_local_symbols_entry *lses =
+        s_cache_local_symbols_entries;
+    char *ls_data;
+    void *mapping;
+    size_t mapping_size;
+    if (!ul_mmap(fd, dch->localSymbolsOffset, dch->localSymbolsSize,
+                 &ls_data, &mapping, &mapping_size))
+        return SUBSTITUTE_ERR_VM;
+    const substitute_sym *all_syms = (void *) (ls_data + lsi->nlistOffset);
+    const char *strs = ls_data + lsi->stringsOffset;
+
+    int ret = SUBSTITUTE_OK;
+    char path[PATH_MAX], tmp_path[PATH_MAX + 16];
+    cache_sym_index_path(dch, path);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, (int) getpid());
+    struct cache_sym_index_dylib *dylibs = NULL;
+    struct cache_sym_index_entry *table = NULL;
+    int out = open(tmp_path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW |
+                             O_CLOEXEC, 0644);
+    if (out == -1) {
+        ret = SUBSTITUTE_ERR_VM;
+        goto end;
+    }
+    uint32_t ndylibs = lsi->entriesCount;
+    if (!(dylibs = calloc(ndylibs, sizeof(*dylibs)))) {
+        ret = SUBSTITUTE_ERR_OOM;
+        goto end;
+    }
+    uint64_t offset = sizeof(struct cache_sym_index_header) +
+                      ndylibs * sizeof(*dylibs);
+    for (uint32_t d = 0; d < ndylibs; d++) {
+        const struct dyld_cache_local_symbols_entry *lse = &lses[d];
+        uint32_t count = lse->nlistCount;
+        if (lse->nlistStartIndex > lsi->nlistCount ||
+            lsi->nlistCount - lse->nlistStartIndex < count)
+            count = 0;
+        uint32_t log2_capacity = 0;
+        while (((size_t) 1 << log2_capacity) * 3 / 4 < count)
+            log2_capacity++;
+        size_t capacity = (size_t) 1 << log2_capacity;
+        if (!(table = calloc(capacity, sizeof(*table)))) {
+            ret = SUBSTITUTE_ERR_OOM;
+            goto end;
+        }
+        const substitute_sym *syms = all_syms + lse->nlistStartIndex;
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t strx = syms[i].n_un.n_strx;
+            if (strx >= lsi->stringsSize)
+                continue;
+            uint64_t hash = hash_sym_name64(strx == 0 ? "" : strs + strx);
+            size_t slot = hash & (capacity - 1);
+            while (table[slot].hash)
+                slot = (slot + 1) & (capacity - 1);
+            table[slot].hash = hash;
+            table[slot].value = syms[i].n_value;
+            if (syms[i].n_desc & N_ARM_THUMB_DEF)
+                table[slot].value |= CACHE_SYM_INDEX_THUMB;
+        }
+        size_t table_size = capacity * sizeof(*table);
+        if (pwrite(out, table, table_size, offset) != table_size) {
+            ret = SUBSTITUTE_ERR_VM;
+            goto end;
+        }
+        free(table);
+        table = NULL;
+        dylibs[d].dylib_offset = lse->dylibOffset;
+        dylibs[d].log2_capacity = log2_capacity;
+        dylibs[d].table_offset = offset;
+        offset += table_size;
+    }
+    struct cache_sym_index_header hdr = {
+        .magic = CACHE_SYM_INDEX_MAGIC,
+        .version = CACHE_SYM_INDEX_VERSION,
+        .ndylibs = ndylibs,
+    };
+    memcpy(hdr.uuid, dch->uuid, 16);
+    size_t dylibs_size = ndylibs * sizeof(*dylibs);
+    if (pwrite(out, dylibs, dylibs_size, sizeof(hdr)) != dylibs_size ||
+        pwrite(out, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        fchmod(out, 0644) || fsync(out) ||
+        rename(tmp_path, path))
+        ret = SUBSTITUTE_ERR_VM;
+end:
+    if (out != -1) {
+        close(out);
+        if (ret)
+            unlink(tmp_path);
+    }
+    free(table);
+    free(dylibs);
+    munmap(mapping, mapping_size);
+    return ret;
+}
 #endif /* __APPLE__ */
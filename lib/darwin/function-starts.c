@@ -0,0 +1,127 @@
+#ifdef __APPLE__
+
+#include "substitute.h"
+#include "substitute-internal.h"
+#include "function-starts.h"
+#include "darwin/read.h"
+#include <stdlib.h>
+#include <string.h>
+#include <mach-o/loader.h>
+
+struct function_starts {
+    uintptr_t text_start, text_end;
+    size_t count;
+    /* from text_start, ascending */
+    uint32_t offsets[];
+};
+
+/* An image without LC_FUNCTION_STARTS still gets one, with count 0, so its
+ * bounds are remembered. */
+static struct function_starts *decode_function_starts(
+    const struct substitute_image *im) {
+    const mach_header_x *mh = im->image_header;
+    const segment_command_x *text = NULL, *linkedit = NULL;
+    const struct linkedit_data_command *fs = NULL;
+    const struct load_command *lc = (void *) (mh + 1);
+    for (uint32_t i = 0; i < mh->ncmds; i++) {
+        if (lc->cmd == LC_SEGMENT_X) {
+            const segment_command_x *sc = (void *) lc;
+            if (!strncmp(sc->segname, "__TEXT", 16))
+                text = sc;
+            else if (!strncmp(sc->segname, "__LINKEDIT", 16))
+                linkedit = sc;
+        } else if (lc->cmd == LC_FUNCTION_STARTS) {
+            fs = (void *) lc;
+        }
+        lc = (void *) lc + lc->cmdsize;
+    }
+    if (!text)
+        return NULL;
+    void *p = NULL, *end = NULL;
+    size_t max = 0;
+    if (fs && linkedit && fs->dataoff >= linkedit->fileoff &&
+        fs->dataoff - linkedit->fileoff + fs->datasize <= linkedit->filesize) {
+        p = (void *) (linkedit->vmaddr + im->slide +
+                      (fs->dataoff - linkedit->fileoff));
+        end = p + fs->datasize;
+        /* every entry is at least a byte */
+        max = fs->datasize;
+    }
+    struct function_starts *fst = malloc(sizeof(*fst) +
+                                         max * sizeof(fst->offsets[0]));
+    if (!fst)
+        return NULL;
+    fst->text_start = text->vmaddr + im->slide;
+    fst->text_end = fst->text_start + text->vmsize;
+    fst->count = 0;
+    uint64_t off = 0, delta;
+    while (p < end && read_leb128(&p, end, false, &delta) && delta) {
+        off += delta;
+        if (off >= text->vmsize)
+            break;
+#ifdef TARGET_arm
+        /* Thumb functions have the low bit set */
+        fst->offsets[fst->count++] = off & ~1;
+#else
+        fst->offsets[fst->count++] = off;
+#endif
+    }
+    return fst;
+}
+
+static struct function_starts *get_function_starts(struct substitute_image *im) {
+    struct function_starts *fst =
+        __atomic_load_n(&im->function_starts, __ATOMIC_ACQUIRE);
+    if (fst)
+        return fst;
+    struct function_starts *new_fst = decode_function_starts(im);
+    if (!new_fst)
+        return NULL;
+    /* as with sym_index, someone else might have beaten us to it */
+    if (__atomic_compare_exchange_n(&im->function_starts, &fst, new_fst, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return new_fst;
+    free(new_fst);
+    return fst;
+}
+
+uintptr_t function_end(struct function_starts_cache *cache, uintptr_t pc) {
+    if (!cache->im ||
+        pc - cache->text_start >= cache->text_end - cache->text_start) {
+        function_starts_cache_free(cache);
+        cache->im = substitute_open_image_by_address((void *) pc);
+        if (!cache->im)
+            return 0;
+    }
+    struct function_starts *fst = get_function_starts(cache->im);
+    if (!fst)
+        return 0;
+    cache->text_start = fst->text_start;
+    cache->text_end = fst->text_end;
+    uintptr_t off = pc - fst->text_start;
+    if (off >= fst->text_end - fst->text_start)
+        return 0;
+    /* the first start after pc */
+    size_t lo = 0, hi = fst->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (fst->offsets[mid] <= off)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    /* pc has to be in some listed function */
+    if (lo == 0)
+        return 0;
+    return fst->text_start +
+           (lo < fst->count ? fst->offsets[lo] : fst->text_end - fst->text_start);
+}
+
+void function_starts_cache_free(struct function_starts_cache *cache) {
+    if (cache->im)
+        substitute_close_image(cache->im);
+    cache->im = NULL;
+    cache->text_start = cache->text_end = 0;
+}
+
+#endif /* __APPLE__ */
@@ -0,0 +1,141 @@
+#ifdef __APPLE__
+
+#include "substitute.h"
+#include "substitute-internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <mach-o/dyld.h>
+#include <mach-o/getsect.h>
+#include <objc/runtime.h>
+
+typedef struct substitute_hook_manifest_entry manifest_entry;
+
+static const manifest_entry *get_manifest(const void *header, size_t *countp) {
+    unsigned long size = 0;
+    const void *data = getsectiondata(header,
+                                      SUBSTITUTE_HOOK_MANIFEST_SEGMENT,
+                                      SUBSTITUTE_HOOK_MANIFEST_SECTION,
+                                      &size);
+    *countp = data ? size / sizeof(manifest_entry) : 0;
+    return data;
+}
+
+static const char *entry_image(const manifest_entry *e) {
+    return e->image_or_class ?: _dyld_get_image_name(0);
+}
+
+static int compare_by_image(const void *a, const void *b) {
+    const manifest_entry *ea = *(const manifest_entry **) a;
+    const manifest_entry *eb = *(const manifest_entry **) b;
+    return strcmp(entry_image(ea), entry_image(eb));
+}
+
+/* Resolve the symbols for entries[0..n), which all name the same image. */
+static int resolve_image_group(const manifest_entry **entries, size_t n,
+                               struct substitute_function_hook *hooks,
+                               size_t *nhooksp) {
+    struct substitute_image *im = substitute_open_image(entry_image(entries[0]));
+    if (!im)
+        return SUBSTITUTE_ERR_NO_SUCH_SYMBOL;
+    const char **names = malloc(n * sizeof(*names));
+    void **syms = malloc(n * sizeof(*syms));
+    int ret = SUBSTITUTE_OK;
+    if (!names || !syms) {
+        ret = SUBSTITUTE_ERR_OOM;
+        goto end;
+    }
+    for (size_t i = 0; i < n; i++)
+        names[i] = entries[i]->name;
+    substitute_find_private_syms(im, names, syms, n);
+    for (size_t i = 0; i < n; i++) {
+        if (!syms[i]) {
+            ret = SUBSTITUTE_ERR_NO_SUCH_SYMBOL;
+            continue;
+        }
+        hooks[(*nhooksp)++] = (struct substitute_function_hook) {
+            .function = syms[i],
+            .replacement = entries[i]->replacement,
+            .old_ptr = entries[i]->old_ptr,
+        };
+    }
+end:
+    free(names);
+    free(syms);
+    substitute_close_image(im);
+    return ret;
+}
+
+EXPORT
+int substitute_apply_hook_manifests(const void *const *headers,
+                                    size_t nheaders, int options) {
+    int ret = SUBSTITUTE_OK;
+    size_t nfuncs = 0;
+    for (size_t i = 0; i < nheaders; i++) {
+        size_t count;
+        const manifest_entry *entries = get_manifest(headers[i], &count);
+        for (size_t j = 0; j < count; j++)
+            nfuncs += entries[j].kind == SUBSTITUTE_HOOK_MANIFEST_FUNCTION &&
+                      entries[j].name;
+    }
+
+    const manifest_entry **funcs = malloc(nfuncs * sizeof(*funcs) ?: 1);
+    struct substitute_function_hook *hooks =
+        malloc(nfuncs * sizeof(*hooks) ?: 1);
+    if (!funcs || !hooks) {
+        ret = SUBSTITUTE_ERR_OOM;
+        goto end;
+    }
+
+    /* Objective-C hooks don't need anything looked up in advance */
+    size_t ifunc = 0;
+    for (size_t i = 0; i < nheaders; i++) {
+        size_t count;
+        const manifest_entry *entries = get_manifest(headers[i], &count);
+        for (size_t j = 0; j < count; j++) {
+            const manifest_entry *e = &entries[j];
+            if (e->kind == SUBSTITUTE_HOOK_MANIFEST_FUNCTION && e->name) {
+                funcs[ifunc++] = e;
+            } else if (e->kind == SUBSTITUTE_HOOK_MANIFEST_OBJC &&
+                       e->image_or_class && e->name) {
+                int r = substitute_hook_objc_message_lazy(
+                    e->image_or_class, sel_registerName(e->name),
+                    e->replacement, e->old_ptr, NULL);
+                if (r == SUBSTITUTE_ERR_NO_SUCH_SELECTOR)
+                    r = SUBSTITUTE_ERR_NO_SUCH_SYMBOL;
+                if (r && !ret)
+                    ret = r;
+            } else if (!ret) {
+                ret = SUBSTITUTE_ERR_NO_SUCH_SYMBOL;
+            }
+        }
+    }
+
+    /* one symbol lookup per image */
+    qsort(funcs, nfuncs, sizeof(*funcs), compare_by_image);
+    size_t nhooks = 0;
+    for (size_t start = 0, stop; start < nfuncs; start = stop) {
+        for (stop = start + 1; stop < nfuncs &&
+             !compare_by_image(&funcs[start], &funcs[stop]); stop++)
+            ;
+        int r = resolve_image_group(&funcs[start], stop - start, hooks,
+                                    &nhooks);
+        if (r == SUBSTITUTE_ERR_OOM) {
+            ret = r;
+            goto end;
+        }
+        if (r && !ret)
+            ret = r;
+    }
+
+    if (nhooks) {
+        int r = substitute_hook_functions(hooks, nhooks, NULL, options);
+        if (r)
+            ret = r;
+    }
+end:
+    free(funcs);
+    free(hooks);
+    return ret;
+}
+
+#endif /* __APPLE__ */
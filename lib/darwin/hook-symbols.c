@@ -0,0 +1,88 @@
+#ifdef __APPLE__
+
+#include "substitute.h"
+#include "substitute-internal.h"
+#include <stdlib.h>
+
+struct sym_order {
+    uintptr_t addr;
+    size_t idx;
+};
+
+static int compare_by_addr(const void *a, const void *b) {
+    uintptr_t aa = ((const struct sym_order *) a)->addr;
+    uintptr_t ab = ((const struct sym_order *) b)->addr;
+    return aa < ab ? -1 : aa > ab;
+}
+
+EXPORT
+int substitute_hook_symbols(struct substitute_image *im,
+                            const struct substitute_symbol_hook *hooks,
+                            size_t n, int *errors,
+                            struct substitute_function_hook_record **records,
+                            int options) {
+    if (!n)
+        return SUBSTITUTE_OK;
+    const char **names = malloc(n * sizeof(*names));
+    void **syms = malloc(n * sizeof(*syms));
+    struct sym_order *order = malloc(n * sizeof(*order));
+    int ret = SUBSTITUTE_ERR_OOM;
+    if (!names || !syms || !order) {
+        for (size_t i = 0; errors && i < n; i++)
+            errors[i] = ret;
+        goto end;
+    }
+    ret = SUBSTITUTE_OK;
+    for (size_t i = 0; i < n; i++)
+        names[i] = hooks[i].name;
+    substitute_find_private_syms(im, names, syms, n);
+
+    /* Prepare the hooks in address order, so targets on the same text page
+     * are next to each other: their trampolines come out of the same
+     * execmem page, and the commit, which sorts its patches anyway, has less
+     * to move around. */
+    for (size_t i = 0; i < n; i++)
+        order[i] = (struct sym_order) {(uintptr_t) syms[i], i};
+    qsort(order, n, sizeof(*order), compare_by_addr);
+
+    /* Each hook is prepared by its own substitute_hook_functions call, so one
+     * that can't be hooked doesn't take the rest down with it, but they're
+     * all patched in by a single commit. */
+    substitute_hook_begin();
+    for (size_t i = 0; i < n; i++) {
+        size_t idx = order[i].idx;
+        struct substitute_function_hook_record **recordp =
+            records ? &records[idx] : NULL;
+        if (recordp)
+            *recordp = NULL;
+        int r = SUBSTITUTE_ERR_NO_SUCH_SYMBOL;
+        if (syms[idx]) {
+            struct substitute_function_hook fh = {
+                .function = syms[idx],
+                .replacement = hooks[idx].replacement,
+                .old_ptr = hooks[idx].old_ptr,
+            };
+            r = substitute_hook_functions(&fh, 1, recordp, options);
+        }
+        if (errors)
+            errors[idx] = r;
+        if (r && !ret)
+            ret = r;
+    }
+    int r = substitute_hook_commit();
+    if (r) {
+        /* nothing that was queued went in */
+        for (size_t i = 0; errors && i < n; i++) {
+            if (!errors[i])
+                errors[i] = r;
+        }
+        ret = r;
+    }
+end:
+    free(names);
+    free(syms);
+    free(order);
+    return ret;
+}
+
+#endif /* __APPLE__ */
@@ -18,24 +18,48 @@ GEN_SYSCALL(semaphore_wait_trap, -36);
  * initialized manually; the format of this has changed in the past, and could
  * again. */
 
+/* mach_msg_header_t */
+struct msg_header {
+    unsigned bits, size, remote_port, local_port, voucher_port;
+    int id;
+};
+enum { MACH_SEND_MSG = 1 };
+
 struct baton {
-    int (*pthread_create)(int *, void *, void *(*)(void *), void *);
-    int (*pthread_detach)(int);
+    int (*pthread_create)(void **, void *, void *(*)(void *), void *);
+    int (*pthread_detach)(void *);
     void *(*dlopen)(const char *, int);
     void *(*dlsym)(void *, const char *);
     int (*munmap)(void *, long);
-    const char *path;
+    int (*mach_msg)(struct msg_header *, int, unsigned, unsigned, unsigned,
+                    unsigned, unsigned);
+    /* dlopened in order */
+    const char **paths;
     /* bsd_thread_func uses this to wait for entry to go away */
     long sem_port;
     long nshuttle;
+    long npaths;
+    /* in the page shared with the injector; results[npaths] is set once
+     * they've all been tried */
+    int *results;
+    /* if non-NULL, all set up to send (with the results after it) */
+    struct msg_header *done_msg;
+    /* how much to unmap from the start of the stack page once done; see
+     * inject_into in inject.c */
+    unsigned long unmap_len;
     char shuttle[0];
 };
+/* must match SUBSTITUTE_INJECT_* in substitute-internal.h */
+enum {
+    INJECT_LOADED = 1,
+    INJECT_DLOPEN_FAILED = 2,
+};
 static int bsd_thread_func(void *);
 #if defined(__i386__)
 __attribute__((fastcall))
 #endif
 void entry(struct baton *baton) {
-    int pt = 0;
+    void *pt = 0;
     baton->pthread_create(&pt, 0, (void *) bsd_thread_func, baton);
     baton->pthread_detach(pt);
     manual_bsdthread_terminate(0, 0, 0, baton->sem_port);
@@ -43,28 +67,32 @@ void entry(struct baton *baton) {
 }
 static int bsd_thread_func(void *arg) {
     struct baton *baton = arg;
-    void *r = baton->dlopen(baton->path, 0);
-    if (r) {
-        __attribute__((section("__TEXT,__text"), aligned(4)))
-        static char name[] = "substitute_init";
-        void (*init)(void *, unsigned long) = baton->dlsym(r, name);
-        if (init)
-            init(baton->shuttle, baton->nshuttle);
-
+    for (long i = 0; i < baton->npaths; i++) {
+        void *r = baton->dlopen(baton->paths[i], 0);
+        int result = INJECT_DLOPEN_FAILED;
+        if (r) {
+            __attribute__((section("__TEXT,__text"), aligned(4)))
+            static char name[] = "substitute_init";
+            void (*init)(void *, unsigned long) = baton->dlsym(r, name);
+            if (init)
+                init(baton->shuttle, baton->nshuttle);
+            result = INJECT_LOADED;
+        }
+        __atomic_store_n(&baton->results[i], result, __ATOMIC_RELEASE);
     }
+    __atomic_store_n(&baton->results[baton->npaths], 1, __ATOMIC_RELEASE);
+    if (baton->done_msg)
+        baton->mach_msg(baton->done_msg, MACH_SEND_MSG, baton->done_msg->size,
+                        0, 0, 0, 0);
     manual_semaphore_wait_trap(baton->sem_port);
+    /* The stack page is followed by the shared page and then, unless the
+     * injector is keeping it mapped for later injections, this code's page;
+     * unmap_len covers whichever of those there are. */
 #ifndef __i386__
     /* since we're munmapping our own code, this must be optimized into a jump
      * (tail call elimination) */
-    enum { page_size =
-#ifdef __arm64__
-            0x4000
-#else
-            0x1000
-#endif
-    };
     unsigned long ptr = (unsigned long) baton & ~(_PAGE_SIZE - 1);
-    return baton->munmap((void *) ptr, 2 * page_size);
+    return baton->munmap((void *) ptr, baton->unmap_len);
 #else
     /* i386 can't normally eliminate tail calls in caller-cleanup calling
      * conventions, unless the number of arguments is the same, so use a nasty
@@ -82,9 +110,10 @@ asm(".globl _jump_to_munmap;"
         "sub $0x400, %ebp;"
         "mov 8(%esp), %edx;" /* baton */
         "mov 16(%edx), %eax;" /* munmap */
+        "mov 48(%edx), %ecx;" /* unmap_len */
+        "mov %ecx, 12(%ebp);"
         "and $~0xfff, %edx;"
         "mov %edx, 8(%ebp);"
-        "movl $0x2000, 12(%ebp);"
         "add $3, %eax;" /* !? */
         "jmp *%eax;"
 );
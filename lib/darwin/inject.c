@@ -7,6 +7,7 @@
 #include <mach-o/dyld_images.h>
 #include <dlfcn.h>
 #include <pthread.h>
+#include <dispatch/dispatch.h>
 #include <sys/param.h>
 #include <sys/mman.h>
 #include <stdint.h>
@@ -57,8 +58,125 @@ struct foreign_image {
     uint64_t address;
 };
 
+/* A few views of another task's memory, mapped with mach_vm_remap and
+ * reused as long as what's wanted falls inside one, rather than a
+ * mach_vm_read_overwrite per string. */
+#define REMOTE_VIEWS 8
+struct remote_views {
+    mach_port_t task;
+    unsigned next;
+    struct {
+        mach_vm_address_t addr;
+        mach_vm_address_t local;
+        mach_vm_size_t size;
+    } v[REMOTE_VIEWS];
+};
+
+static const void *remote_view(struct remote_views *rv,
+                               mach_vm_address_t addr, mach_vm_size_t size) {
+    for (unsigned i = 0; i < REMOTE_VIEWS; i++) {
+        if (rv->v[i].size && addr - rv->v[i].addr < rv->v[i].size &&
+            size <= rv->v[i].size - (addr - rv->v[i].addr))
+            return (void *) (rv->v[i].local + (addr - rv->v[i].addr));
+    }
+    mach_vm_address_t base = addr & ~(mach_vm_address_t) (PAGE_SIZE - 1);
+    mach_vm_size_t map_size = ((addr + size + PAGE_SIZE - 1) &
+                               ~(mach_vm_address_t) (PAGE_SIZE - 1)) - base;
+    mach_vm_address_t local = 0;
+    vm_prot_t cur, max;
+    kern_return_t kr = mach_vm_remap(mach_task_self(), &local, map_size, 0,
+                                     VM_FLAGS_ANYWHERE, rv->task, base,
+                                     /*copy*/ false, &cur, &max,
+                                     VM_INHERIT_NONE);
+    if (kr)
+        return NULL;
+    unsigned i = rv->next;
+    rv->next = rv->next + 1 == REMOTE_VIEWS ? 1 : rv->next + 1;
+    if (rv->v[i].size)
+        mach_vm_deallocate(mach_task_self(), rv->v[i].local, rv->v[i].size);
+    rv->v[i].addr = base;
+    rv->v[i].local = local;
+    rv->v[i].size = map_size;
+    return (void *) (local + (addr - base));
+}
+
+/* A path in the other task, if it's terminated within MAXPATHLEN. */
+static const char *remote_cstring(struct remote_views *rv,
+                                  mach_vm_address_t addr) {
+    /* usually the rest of the page is enough */
+    mach_vm_size_t sizes[] = {MIN(MAXPATHLEN, -addr & (PAGE_SIZE - 1)),
+                              MAXPATHLEN};
+    for (int i = 0; i < 2; i++) {
+        if (!sizes[i])
+            continue;
+        const char *s = remote_view(rv, addr, sizes[i]);
+        if (s && strnlen(s, sizes[i]) < sizes[i])
+            return s;
+    }
+    return NULL;
+}
+
+static void remote_views_free(struct remote_views *rv) {
+    for (unsigned i = 0; i < REMOTE_VIEWS; i++) {
+        if (rv->v[i].size)
+            mach_vm_deallocate(mach_task_self(), rv->v[i].local,
+                               rv->v[i].size);
+    }
+}
+
+/* Where the symbols substitute_dlopen_in_pid needs are, relative to their
+ * images' headers, for targets using a given shared cache; they're the same
+ * for every process on it, so only the first injection has to map libdyld's
+ * __LINKEDIT and walk export tries.  (The UUID covers the architecture, but
+ * the cputype is needed anyway.) */
+enum {
+    FOREIGN_DLOPEN,
+    FOREIGN_DLSYM,
+    FOREIGN_PTHREAD_CREATE,
+    FOREIGN_PTHREAD_DETACH,
+    FOREIGN_MUNMAP,
+    FOREIGN_MACH_MSG,
+    FOREIGN_NSYMS
+};
+struct foreign_sym_cache_entry {
+    uint8_t cache_uuid[16];
+    cpu_type_t cputype;
+    uint64_t offsets[FOREIGN_NSYMS];
+};
+#define FOREIGN_SYM_CACHE_SIZE 4
+static struct foreign_sym_cache_entry foreign_sym_cache[FOREIGN_SYM_CACHE_SIZE];
+static size_t foreign_sym_cache_next;
+static pthread_mutex_t foreign_sym_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool get_cached_foreign_syms(const uint8_t *cache_uuid,
+                                    struct foreign_sym_cache_entry *out) {
+    bool found = false;
+    pthread_mutex_lock(&foreign_sym_cache_lock);
+    for (size_t i = 0; i < FOREIGN_SYM_CACHE_SIZE; i++) {
+        if (foreign_sym_cache[i].cputype &&
+            !memcmp(foreign_sym_cache[i].cache_uuid, cache_uuid, 16)) {
+            *out = foreign_sym_cache[i];
+            found = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&foreign_sym_cache_lock);
+    return found;
+}
+
+static void cache_foreign_syms(const struct foreign_sym_cache_entry *entry) {
+    pthread_mutex_lock(&foreign_sym_cache_lock);
+    foreign_sym_cache[foreign_sym_cache_next] = *entry;
+    foreign_sym_cache_next = (foreign_sym_cache_next + 1) %
+                             FOREIGN_SYM_CACHE_SIZE;
+    pthread_mutex_unlock(&foreign_sym_cache_lock);
+}
+
+/* *have_cache_uuid says whether the target is using a shared cache, whose
+ * UUID then goes in cache_uuid. */
 static int find_foreign_images(mach_port_t task,
                                struct foreign_image *images, size_t nimages,
+                               uint8_t *cache_uuid, bool *have_cache_uuid,
                                char **error) {
     struct task_dyld_info tdi;
     mach_msg_type_number_t cnt = TASK_DYLD_INFO_COUNT;
@@ -103,6 +221,12 @@ static int find_foreign_images(mach_port_t task,
     /* If we are on the same shared cache with the same slide, then we can just
      * look up the symbols locally and don't have to do the rest of the
      * syscalls... not sure if this is any faster, but whatever. */
+    static const uint8_t zero_uuid[16];
+    *have_cache_uuid = FIELD(version) >= 13 &&
+                       !FIELD(processDetachedFromSharedRegion) &&
+                       memcmp(FIELD(sharedCacheUUID), zero_uuid, 16);
+    if (*have_cache_uuid)
+        memcpy(cache_uuid, FIELD(sharedCacheUUID), 16);
     if (FIELD(version) >= 13) {
         const struct dyld_all_image_infos *local_aii = dyld_get_all_image_infos();
         if (local_aii->version >= 13 &&
@@ -117,6 +241,32 @@ static int find_foreign_images(mach_port_t task,
     uint32_t info_array_count = FIELD(infoArrayCount);
     size_t info_array_elm_size = (is64 ? sizeof(uint64_t) : sizeof(uint32_t)) * 3;
 
+    /* Same shared cache, different slide: each image we want should be where
+     * it is here, plus the difference in slides, so only entries at those
+     * addresses need their paths checked. */
+    uint64_t candidates[nimages];
+    bool have_candidates = false;
+    if (FIELD(version) >= 13) {
+        const struct dyld_all_image_infos *local_aii = dyld_get_all_image_infos();
+        if (local_aii->version >= 13 && local_aii->infoArray &&
+            !memcmp(FIELD(sharedCacheUUID), local_aii->sharedCacheUUID, 16)) {
+            uint64_t slide_diff = FIELD(sharedCacheSlide) -
+                                  local_aii->sharedCacheSlide;
+            have_candidates = true;
+            for (size_t i = 0; i < nimages; i++) {
+                candidates[i] = 0;
+                for (uint32_t j = 0; j < local_aii->infoArrayCount; j++) {
+                    const struct dyld_image_info *ii = &local_aii->infoArray[j];
+                    if (!strcmp(ii->imageFilePath, images[i].name)) {
+                        candidates[i] = (uint64_t) ii->imageLoadAddress +
+                                        slide_diff;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
     #undef FIELD
 
     if (info_array_count > 2000) {
@@ -125,73 +275,60 @@ static int find_foreign_images(mach_port_t task,
         return SUBSTITUTE_ERR_MISC;
     }
     size_t info_array_size = info_array_count * info_array_elm_size;
-    void *info_array = malloc(info_array_count * info_array_elm_size);
-    if (!info_array)
-        return SUBSTITUTE_ERR_OOM;
-
-    kr = mach_vm_read_overwrite(task, info_array_addr, info_array_size,
-                                (mach_vm_address_t) info_array, &size);
-    if (kr || size != info_array_size) {
-        asprintf(error, "mach_vm_read_overwrite(info_array): kr=%d", kr);
-        free(info_array);
+    struct remote_views rv = {task};
+    const void *info_array = remote_view(&rv, info_array_addr, info_array_size);
+    if (!info_array) {
+        asprintf(error, "mach_vm_remap(info_array) failed");
         return SUBSTITUTE_ERR_MISC;
     }
+    /* the paths get their own views, and this one has to stay */
+    rv.next = 1;
 
-    /* yay, slow file path reads! */
-
-    void *info_array_ptr = info_array;
     size_t images_left = nimages;
-    for (uint32_t i = 0; i < info_array_count; i++) {
-        uint64_t load_address;
-        uint64_t file_path;
-        if (is64) {
-            uint64_t *e = info_array_ptr;
-            load_address = e[0];
-            file_path = e[1];
-        } else {
-            uint32_t *e = info_array_ptr;
-            load_address = e[0];
-            file_path = e[1];
-        }
+    for (int pass = have_candidates ? 0 : 1; pass < 2; pass++) {
+        const void *info_array_ptr = info_array;
+        for (uint32_t i = 0; i < info_array_count;
+             i++, info_array_ptr += info_array_elm_size) {
+            uint64_t load_address;
+            uint64_t file_path;
+            if (is64) {
+                const uint64_t *e = info_array_ptr;
+                load_address = e[0];
+                file_path = e[1];
+            } else {
+                const uint32_t *e = info_array_ptr;
+                load_address = e[0];
+                file_path = e[1];
+            }
 
-        /* mach_vm_read_overwrite won't do partial copies, so... */
+            if (pass == 0) {
+                size_t j;
+                for (j = 0; j < nimages; j++) {
+                    if (!images[j].address && candidates[j] == load_address)
+                        break;
+                }
+                if (j == nimages)
+                    continue;
+            }
 
-        char path_buf[MAXPATHLEN+1];
-        size_t toread = MIN(MAXPATHLEN, -file_path & 0xfff);
-        path_buf[toread] = '\0';
-        kr = mach_vm_read_overwrite(task, file_path, toread,
-                                    (mach_vm_address_t) path_buf, &size);
-        if (kr) {
-            /* printf("kr=%d <%p %p>\n", kr, (void *) file_path, path_buf); */
-            continue;
-        }
-        if (strlen(path_buf) == toread && toread < MAXPATHLEN) {
-            /* get the rest... */
-            kr = mach_vm_read_overwrite(task, file_path + toread,
-                                        MAXPATHLEN - toread,
-                                        (mach_vm_address_t) path_buf + toread,
-                                        &size);
-            if (kr) {
+            const char *path = remote_cstring(&rv, file_path);
+            if (!path)
                 continue;
-            }
-            path_buf[MAXPATHLEN] = '\0';
-        }
 
-        for (size_t i = 0; i < nimages; i++) {
-            if (!images[i].address &&
-                !strcmp(path_buf, images[i].name)) {
-                images[i].address = load_address;
-                if (--images_left == 0) {
-                    free(info_array);
-                    return SUBSTITUTE_OK;
+            for (size_t j = 0; j < nimages; j++) {
+                if (!images[j].address &&
+                    !strcmp(path, images[j].name)) {
+                    images[j].address = load_address;
+                    if (--images_left == 0) {
+                        remote_views_free(&rv);
+                        return SUBSTITUTE_OK;
+                    }
                 }
             }
         }
-
-        info_array_ptr += info_array_elm_size;
     }
 
-    free(info_array);
+    remote_views_free(&rv);
     asprintf(error, "couldn't find libdyld or libpthread");
     return SUBSTITUTE_ERR_MISC;
 }
@@ -333,77 +470,96 @@ fail:
     return ret;
 }
 
-static bool find_export_symbol(void *export, size_t export_size, const char *name,
-                               uint64_t hdr_addr, uint64_t *sym_addr_p) {
-    void *end = export + export_size;
-    void *ptr = export;
+/* The page shared with the target holds a message header, which the thread
+ * sends along with what follows it if there's a notify port; an int32 status
+ * per path (see SUBSTITUTE_INJECT_*) plus one that's set when the thread is
+ * done with them; then the baton's array of path pointers, then the paths
+ * themselves. */
+static size_t shared_page_layout(const char *const *filenames, size_t nfilenames,
+                                 bool is64, size_t *ptrs_off_p) {
+    size_t ptrs_off = (sizeof(mach_msg_header_t) +
+                       (nfilenames + 1) * sizeof(int32_t) + 7) & ~7;
+    size_t len = ptrs_off + nfilenames * (is64 ? 8 : 4);
+    for (size_t i = 0; i < nfilenames; i++)
+        len += strlen(filenames[i]) + 1;
+    if (ptrs_off_p)
+        *ptrs_off_p = ptrs_off;
+    return len;
+}
+
+/* returns the offset of the path pointers */
+static size_t fill_shared_page(const char *const *filenames, size_t nfilenames,
+                               bool is64, void *shared,
+                               mach_vm_address_t target_shared) {
+    size_t ptrs_off;
+    shared_page_layout(filenames, nfilenames, is64, &ptrs_off);
+    size_t off = ptrs_off + nfilenames * (is64 ? 8 : 4);
+    for (size_t i = 0; i < nfilenames; i++) {
+        uint64_t addr = target_shared + off;
+        if (is64)
+            ((uint64_t *) (shared + ptrs_off))[i] = addr;
+        else
+            ((uint32_t *) (shared + ptrs_off))[i] = (uint32_t) addr;
+        size_t len = strlen(filenames[i]) + 1;
+        memcpy(shared + off, filenames[i], len);
+        off += len;
+    }
+    return ptrs_off;
+}
+
+static int insert_remote_right(mach_port_t task, mach_port_t port,
+                               mach_msg_type_name_t right_type,
+                               mach_port_name_t *name_p, const char *what,
+                               char **error) {
     while (1) {
-        /* skip this symbol data */
-        uint64_t size;
-        if (!read_leb128(&ptr, end, false, &size) ||
-            size > (uint64_t) (end - ptr))
-            return false;
-        ptr += size;
-        if (ptr == end)
-            return false;
-        uint8_t i, nedges = *(uint8_t *) ptr;
-        ptr++;
-        for (i = 0; i < nedges; i++) {
-            char *prefix;
-            if (!read_cstring(&ptr, end, &prefix))
-                return false;
-            size_t prefix_len = (char *) ptr - prefix - 1;
-            uint64_t next_offset;
-            if (!read_leb128(&ptr, end, false, &next_offset))
-                return false;
-            if (!strncmp(name, prefix, prefix_len)) {
-                if (next_offset > export_size)
-                    return false;
-                ptr = export + next_offset;
-                name += prefix_len;
-                if (*name == '\0')
-                    goto got_symbol;
-                break;
-            }
+        mach_port_name_t name;
+        kern_return_t kr = mach_port_allocate(task, MACH_PORT_RIGHT_DEAD_NAME,
+                                              &name);
+        if (kr) {
+            asprintf(error, "mach_port_allocate(temp dead name): kr=%d", kr);
+            return SUBSTITUTE_ERR_MISC;
         }
-        if (i == nedges) {
-            /* not found */
-            return false;
+        kr = mach_port_deallocate(task, name);
+        if (kr) {
+            asprintf(error, "mach_port_deallocate(temp dead name): kr=%d", kr);
+            return SUBSTITUTE_ERR_MISC;
+        }
+        kr = mach_port_insert_right(task, name, port, right_type);
+        if (kr == KERN_NAME_EXISTS) {
+            /* between the deallocate and the insert, someone must have
+             * grabbed this name - just try again */
+             continue;
+        } else if (kr) {
+            asprintf(error, "mach_port_insert_right(%s): kr=%d", what, kr);
+            return SUBSTITUTE_ERR_MISC;
         }
+
+        /* ok */
+        *name_p = name;
+        return SUBSTITUTE_OK;
     }
-got_symbol:;
-    uint64_t size, flags, hdr_off;
-    if (!read_leb128(&ptr, end, false, &size))
-        return false;
-    if (!read_leb128(&ptr, end, false, &flags))
-        return false;
-    if (flags & (EXPORT_SYMBOL_FLAGS_REEXPORT |
-                 EXPORT_SYMBOL_FLAGS_STUB_AND_RESOLVER)) {
-        /* don't bother to support for now */
-        return false;
-    }
-    if (!read_leb128(&ptr, end, false, &hdr_off))
-        return false;
-    *sym_addr_p = hdr_addr + hdr_off;
-    return true;
 }
 
-static int do_baton(const char *filename, size_t filelen, cpu_type_t cputype,
+static int do_baton(const char *const *filenames, size_t nfilenames,
+                    cpu_type_t cputype,
                     mach_vm_address_t target_stackpage_end,
                     mach_vm_address_t *target_stack_top_p,
-                    uint64_t sym_addrs[static 5],
+                    mach_vm_address_t target_shared, void *shared,
+                    mach_vm_size_t unmap_len,
+                    const uint64_t sym_addrs[static 6],
                     const struct shuttle *shuttle, size_t nshuttle,
                     struct shuttle **target_shuttle_p,
                     semaphore_t *sem_port_p,
+                    mach_port_t notify_port,
+                    mach_port_name_t *notify_name_p,
                     mach_port_t task,
                     char **error) {
     int ret;
     bool is64 = !!(cputype & CPU_ARCH_ABI64);
 
-    size_t baton_len = 8 * (is64 ? 8 : 4);
+    size_t baton_len = 13 * (is64 ? 8 : 4);
     size_t shuttles_len = nshuttle * sizeof(struct shuttle);
-    size_t filelen_rounded = (filelen + 7) & ~7;
-    size_t total_len = baton_len + shuttles_len + filelen_rounded;
+    size_t total_len = baton_len + shuttles_len;
     mach_vm_address_t target_stack_top = target_stackpage_end - total_len;
     target_stack_top &= ~15;
     if (cputype == CPU_TYPE_X86_64)
@@ -415,7 +571,8 @@ static int do_baton(const char *filename, size_t filelen, cpu_type_t cputype,
         ret = SUBSTITUTE_ERR_OOM;
         goto fail;
     }
-    strcpy(stackbuf + baton_len + shuttles_len, filename);
+    size_t ptrs_off = fill_shared_page(filenames, nfilenames, is64, shared,
+                                       target_shared);
 
     struct shuttle *target_shuttle = calloc(nshuttle, sizeof(*target_shuttle));
     *target_shuttle_p = target_shuttle;
@@ -424,44 +581,16 @@ static int do_baton(const char *filename, size_t filelen, cpu_type_t cputype,
         struct shuttle *out = &target_shuttle[i];
         out->type = in->type;
         switch (in->type) {
-        case SUBSTITUTE_SHUTTLE_MACH_PORT:
+        case SUBSTITUTE_SHUTTLE_MACH_PORT: {
             out->u.mach.right_type = in->u.mach.right_type;
-            while (1) {
-                mach_port_name_t name;
-                kern_return_t kr = mach_port_allocate(task,
-                                                      MACH_PORT_RIGHT_DEAD_NAME,
-                                                      &name);
-                if (kr) {
-                    asprintf(error, "mach_port_allocate(temp dead name): kr=%d",
-                             kr);
-                    ret = SUBSTITUTE_ERR_MISC;
-                    goto fail;
-                }
-                kr = mach_port_deallocate(task, name);
-                if (kr) {
-                    asprintf(error, "mach_port_deallocate(temp dead name): kr=%d",
-                             kr);
-                    ret = SUBSTITUTE_ERR_MISC;
-                    goto fail;
-                }
-                kr = mach_port_insert_right(task, name, in->u.mach.port,
-                                            in->u.mach.right_type);
-                if (kr == KERN_NAME_EXISTS) {
-                    /* between the deallocate and the insert, someone must have
-                     * grabbed this name - just try again */
-                     continue;
-                } else if (kr) {
-                    asprintf(error, "mach_port_insert_right(shuttle %zu): kr=%d",
-                                     i, kr);
-                    ret = SUBSTITUTE_ERR_MISC;
-                    goto fail;
-                }
-
-                /* ok */
-                out->u.mach.port = name;
-                break;
-            }
+            char what[32];
+            snprintf(what, sizeof(what), "shuttle %zu", i);
+            if ((ret = insert_remote_right(task, in->u.mach.port,
+                                           in->u.mach.right_type,
+                                           &out->u.mach.port, what, error)))
+                goto fail;
             break;
+        }
         default:
             asprintf(error, "bad shuttle type %d", in->type);
             ret = SUBSTITUTE_ERR_MISC;
@@ -472,6 +601,25 @@ static int do_baton(const char *filename, size_t filelen, cpu_type_t cputype,
     memcpy(stackbuf + baton_len, target_shuttle,
            nshuttle * sizeof(*target_shuttle));
 
+    mach_port_name_t notify_name = MACH_PORT_NULL;
+    if (notify_port) {
+        if ((ret = insert_remote_right(task, notify_port,
+                                       MACH_MSG_TYPE_MAKE_SEND, &notify_name,
+                                       "notify port", error)))
+            goto fail;
+        *notify_name_p = notify_name;
+        /* moving the right means the target is left with nothing to leak,
+         * and the caller gets a no-senders notification (if they asked) once
+         * this has arrived or the target has died without sending it */
+        mach_msg_header_t *hdr = shared;
+        hdr->msgh_bits = MACH_MSGH_BITS(MACH_MSG_TYPE_MOVE_SEND, 0);
+        hdr->msgh_size = sizeof(*hdr) + (nfilenames + 1) * sizeof(int32_t);
+        hdr->msgh_remote_port = notify_name;
+        hdr->msgh_local_port = MACH_PORT_NULL;
+        hdr->msgh_voucher_port = MACH_PORT_NULL;
+        hdr->msgh_id = SUBSTITUTE_INJECT_DONE_MSG_ID;
+    }
+
     semaphore_t sem_port = MACH_PORT_NULL;
     kern_return_t kr = semaphore_create(task, &sem_port, SYNC_POLICY_FIFO, 0);
     if (kr) {
@@ -487,9 +635,14 @@ static int do_baton(const char *filename, size_t filelen, cpu_type_t cputype,
         sym_addrs[2],
         sym_addrs[3],
         sym_addrs[4],
-        target_stack_top + baton_len + shuttles_len,
+        sym_addrs[5],
+        target_shared + ptrs_off,
         sem_port,
-        nshuttle
+        nshuttle,
+        nfilenames,
+        target_shared + sizeof(mach_msg_header_t),
+        notify_name ? target_shared : 0,
+        unmap_len
     };
 
     if (is64) {
@@ -517,24 +670,52 @@ fail:
     return ret;
 }
 
-EXPORT
-int substitute_dlopen_in_pid(int pid, const char *filename, int options,
-                             const struct shuttle *shuttle, size_t nshuttle,
-                             char **error) {
+static int check_dlopen_args(const char *const *filenames, size_t nfilenames,
+                             size_t nshuttle, char **error) {
     if (nshuttle > 10) {
         asprintf(error, "nshuttle too high");
         return SUBSTITUTE_ERR_MISC;
     }
-    size_t filelen = strlen(filename);
-    if (filelen >= 0x400) {
-        asprintf(error, "you gave me a terrible filename (%s)", filename);
+    if (!nfilenames) {
+        asprintf(error, "no filenames");
+        return SUBSTITUTE_ERR_MISC;
+    }
+    /* they all have to fit in the smallest page any target could have */
+    size_t len = shared_page_layout(filenames, nfilenames, true, NULL);
+    if (len > 0x1000) {
+        asprintf(error, "you gave me terrible filenames (%zu bytes)", len);
         return SUBSTITUTE_ERR_MISC;
     }
+    return SUBSTITUTE_OK;
+}
 
+/* What injecting into a task takes, found once by inject_target_open. */
+struct inject_target {
+    mach_port_t task;
+    cpu_type_t cputype;
+    int page_size;
+    /* pthread_create, pthread_detach, dlopen, dlsym, munmap, mach_msg */
+    uint64_t sym_addrs[6];
+    /* If nonzero, the inject page as kept mapped in the target by a
+     * substitute_inject_ctx.  Otherwise each injection maps it after its
+     * stack and shared page, and the remote thread unmaps all three when it's
+     * done. */
+    mach_vm_address_t code_page;
+};
+
+UNUSED
+extern char inject_page_start[],
+            inject_start_x86_64[],
+            inject_start_i386[],
+            inject_start_arm[],
+            inject_start_arm64[];
+
+/* *resolved is set once the target's symbols have been found, which means
+ * they're in foreign_sym_cache for any other process using the same shared
+ * cache. */
+static int inject_target_open(int pid, struct inject_target *t,
+                              bool *resolved, char **error) {
     mach_port_t task;
-    mach_vm_address_t target_stack = 0;
-    struct shuttle *target_shuttle = NULL;
-    semaphore_t sem_port = MACH_PORT_NULL;
     int ret;
     *error = NULL;
 
@@ -549,18 +730,23 @@ int substitute_dlopen_in_pid(int pid, const char *filename, int options,
         {"/usr/lib/system/libsystem_pthread.dylib", 0},
         {"/usr/lib/system/libsystem_kernel.dylib", 0}
     };
-    if ((ret = find_foreign_images(task, images, 3, error)) > 0)
+    uint8_t cache_uuid[16];
+    bool have_cache_uuid;
+    if ((ret = find_foreign_images(task, images, 3, cache_uuid,
+                                   &have_cache_uuid, error)) > 0)
         goto fail;
 
     uint64_t pthread_create_addr, pthread_detach_addr;
-    uint64_t dlopen_addr, dlsym_addr, munmap_addr;
+    uint64_t dlopen_addr, dlsym_addr, munmap_addr, mach_msg_addr;
     cpu_type_t cputype;
+    struct foreign_sym_cache_entry cached;
     if (ret == FFI_SHORT_CIRCUIT) {
         pthread_create_addr = (uint64_t) pthread_create;
         pthread_detach_addr = (uint64_t) pthread_detach;
         dlopen_addr = (uint64_t) dlopen;
         dlsym_addr = (uint64_t) dlsym;
         munmap_addr = (uint64_t) munmap;
+        mach_msg_addr = (uint64_t) mach_msg;
 #if defined(__x86_64__)
         cputype = CPU_TYPE_X86_64;
 #elif defined(__i386__)
@@ -570,6 +756,16 @@ int substitute_dlopen_in_pid(int pid, const char *filename, int options,
 #elif defined(__arm64__)
         cputype = CPU_TYPE_ARM64;
 #endif
+    } else if (have_cache_uuid && get_cached_foreign_syms(cache_uuid, &cached)) {
+        dlopen_addr = images[0].address + cached.offsets[FOREIGN_DLOPEN];
+        dlsym_addr = images[0].address + cached.offsets[FOREIGN_DLSYM];
+        pthread_create_addr = images[1].address +
+                              cached.offsets[FOREIGN_PTHREAD_CREATE];
+        pthread_detach_addr = images[1].address +
+                              cached.offsets[FOREIGN_PTHREAD_DETACH];
+        munmap_addr = images[2].address + cached.offsets[FOREIGN_MUNMAP];
+        mach_msg_addr = images[2].address + cached.offsets[FOREIGN_MACH_MSG];
+        cputype = cached.cputype;
     } else {
         struct {
             uint64_t addr;
@@ -583,7 +779,8 @@ int substitute_dlopen_in_pid(int pid, const char *filename, int options,
                                     {"_dlsym", 0}}},
             {images[1].address, 2, {{"_pthread_create", 0},
                                     {"_pthread_detach", 0}}},
-            {images[2].address, 1, {{"_munmap", 0}}},
+            {images[2].address, 2, {{"_munmap", 0},
+                                    {"_mach_msg", 0}}},
         };
 
         for (int i = 0; i < 3; i++) {
@@ -619,51 +816,119 @@ int substitute_dlopen_in_pid(int pid, const char *filename, int options,
         pthread_create_addr = libs[1].syms[0].symaddr;
         pthread_detach_addr = libs[1].syms[1].symaddr;
         munmap_addr = libs[2].syms[0].symaddr;
+        mach_msg_addr = libs[2].syms[1].symaddr;
+
+        if (have_cache_uuid) {
+            memcpy(cached.cache_uuid, cache_uuid, 16);
+            cached.cputype = cputype;
+            cached.offsets[FOREIGN_DLOPEN] = dlopen_addr - images[0].address;
+            cached.offsets[FOREIGN_DLSYM] = dlsym_addr - images[0].address;
+            cached.offsets[FOREIGN_PTHREAD_CREATE] =
+                pthread_create_addr - images[1].address;
+            cached.offsets[FOREIGN_PTHREAD_DETACH] =
+                pthread_detach_addr - images[1].address;
+            cached.offsets[FOREIGN_MUNMAP] = munmap_addr - images[2].address;
+            cached.offsets[FOREIGN_MACH_MSG] =
+                mach_msg_addr - images[2].address;
+            cache_foreign_syms(&cached);
+        }
     }
 
-    UNUSED
-    extern char inject_page_start[],
-                inject_start_x86_64[],
-                inject_start_i386[],
-                inject_start_arm[],
-                inject_start_arm64[];
+    *resolved = true;
 
-    int target_page_size =
+    t->task = task;
+    t->cputype = cputype;
+    t->page_size =
 #if defined(__arm__) || defined(__arm64__)
         cputype == CPU_TYPE_ARM64 ? 0x4000 :
 #endif
         0x1000;
-    kr = mach_vm_allocate(task, &target_stack, 2 * target_page_size,
-                          VM_FLAGS_ANYWHERE);
+    t->sym_addrs[0] = pthread_create_addr;
+    t->sym_addrs[1] = pthread_detach_addr;
+    t->sym_addrs[2] = dlopen_addr;
+    t->sym_addrs[3] = dlsym_addr;
+    t->sym_addrs[4] = munmap_addr;
+    t->sym_addrs[5] = mach_msg_addr;
+    t->code_page = 0;
+    return SUBSTITUTE_OK;
+
+fail:
+    mach_port_deallocate(mach_task_self(), task);
+    return ret;
+}
+
+static int inject_into(const struct inject_target *t,
+                       const char *const *filenames, size_t nfilenames,
+                       const struct shuttle *shuttle, size_t nshuttle,
+                       mach_port_t notify_port, volatile int32_t **status,
+                       char **error) {
+    mach_port_t task = t->task;
+    cpu_type_t cputype = t->cputype;
+    int target_page_size = t->page_size;
+    mach_vm_address_t target_stack = 0;
+    mach_vm_address_t shared = 0;
+    mach_port_name_t notify_name = MACH_PORT_NULL;
+    struct shuttle *target_shuttle = NULL;
+    semaphore_t sem_port = MACH_PORT_NULL;
+    int ret;
+    *error = NULL;
+
+    /* The stack, the shared page and, unless it's kept, the code page: the
+     * remote thread unmaps them all in one go (the baton's unmap_len) when
+     * it's done. */
+    mach_vm_size_t unmap_len = (t->code_page ? 2 : 3) * target_page_size;
+    kern_return_t kr = mach_vm_allocate(task, &target_stack, unmap_len,
+                                        VM_FLAGS_ANYWHERE);
     if (kr) {
         asprintf(error, "couldn't allocate target stack");
         ret = SUBSTITUTE_ERR_OOM;
         goto fail;
     }
 
-    mach_vm_address_t target_code_page = target_stack + target_page_size;
+    mach_vm_address_t target_stackpage_end = target_stack + target_page_size;
+    mach_vm_address_t target_code_page = t->code_page;
     vm_prot_t cur, max;
-    kr = mach_vm_remap(task, &target_code_page, target_page_size, 0,
-                       VM_FLAGS_OVERWRITE, mach_task_self(),
-                       (mach_vm_address_t) inject_page_start,
+    if (!target_code_page) {
+        target_code_page = target_stack + 2 * target_page_size;
+        kr = mach_vm_remap(task, &target_code_page, target_page_size, 0,
+                           VM_FLAGS_OVERWRITE, mach_task_self(),
+                           (mach_vm_address_t) inject_page_start,
+                           /*copy*/ false,
+                           &cur, &max, VM_INHERIT_NONE);
+        if (kr) {
+            asprintf(error, "couldn't remap target code");
+            ret = SUBSTITUTE_ERR_VM;
+            goto fail;
+        }
+    }
+
+    /* ours is at least as big as the target's */
+    kr = mach_vm_allocate(mach_task_self(), &shared, vm_page_size,
+                          VM_FLAGS_ANYWHERE);
+    if (kr) {
+        shared = 0;
+        asprintf(error, "couldn't allocate shared page");
+        ret = SUBSTITUTE_ERR_OOM;
+        goto fail;
+    }
+    mach_vm_address_t target_shared = target_stackpage_end;
+    kr = mach_vm_remap(task, &target_shared, target_page_size, 0,
+                       VM_FLAGS_OVERWRITE, mach_task_self(), shared,
                        /*copy*/ false,
                        &cur, &max, VM_INHERIT_NONE);
     if (kr) {
-        asprintf(error, "couldn't remap target code");
+        asprintf(error, "couldn't remap shared page");
         ret = SUBSTITUTE_ERR_VM;
         goto fail;
     }
 
-    uint64_t sym_addrs[] = {pthread_create_addr,
-                            pthread_detach_addr,
-                            dlopen_addr,
-                            dlsym_addr,
-                            munmap_addr};
     mach_vm_address_t target_stack_top;
-    if ((ret = do_baton(filename, filelen, cputype,
-                        target_code_page, &target_stack_top,
-                        sym_addrs, shuttle, nshuttle, &target_shuttle, &sem_port,
-                        task, error)))
+    if ((ret = do_baton(filenames, nfilenames, cputype,
+                        target_stackpage_end, &target_stack_top,
+                        target_shared, (void *) shared, unmap_len,
+                        t->sym_addrs,
+                        shuttle, nshuttle, &target_shuttle, &sem_port,
+                        notify_port, &notify_name, task, error)))
         goto fail;
 
     union {
@@ -741,12 +1006,17 @@ int substitute_dlopen_in_pid(int pid, const char *filename, int options,
     /* it will terminate itself */
     mach_port_deallocate(mach_task_self(), thread);
 
-    (void) options;
+    if (status) {
+        *status = (void *) (shared + sizeof(mach_msg_header_t));
+        shared = 0;
+    }
 
     ret = 0;
 fail:
     if (target_stack)
-        mach_vm_deallocate(task, target_stack, 2 * target_page_size);
+        mach_vm_deallocate(task, target_stack, unmap_len);
+    if (shared)
+        mach_vm_deallocate(mach_task_self(), shared, vm_page_size);
     if (target_shuttle) {
         if (ret) {
             for (size_t i = 0; i < nshuttle; i++) {
@@ -763,7 +1033,309 @@ fail:
     }
     if (sem_port && ret)
         mach_port_deallocate(task, sem_port);
-    mach_port_deallocate(mach_task_self(), task);
+    if (notify_name && ret)
+        mach_port_deallocate(task, notify_name);
+    return ret;
+}
+
+static int dlopen_in_pid(int pid, const char *const *filenames,
+                         size_t nfilenames,
+                         const struct shuttle *shuttle, size_t nshuttle,
+                         mach_port_t notify_port,
+                         volatile int32_t **status, bool *resolved,
+                         char **error) {
+    struct inject_target t;
+    int ret = inject_target_open(pid, &t, resolved, error);
+    if (ret)
+        return ret;
+    ret = inject_into(&t, filenames, nfilenames, shuttle, nshuttle,
+                      notify_port, status, error);
+    mach_port_deallocate(mach_task_self(), t.task);
     return ret;
 }
+
+EXPORT
+int substitute_dlopen_in_pid(int pid, const char *filename, int options,
+                             const struct shuttle *shuttle, size_t nshuttle,
+                             char **error) {
+    return substitute_dlopen_all_in_pid(pid, &filename, 1, options,
+                                        shuttle, nshuttle, NULL, error);
+}
+
+EXPORT
+int substitute_dlopen_all_in_pid(int pid, const char *const *filenames,
+                                 size_t nfilenames, int options,
+                                 const struct shuttle *shuttle, size_t nshuttle,
+                                 volatile int32_t **status, char **error) {
+    bool resolved;
+    int ret;
+    if ((ret = check_dlopen_args(filenames, nfilenames, nshuttle, error)))
+        return ret;
+    (void) options;
+    return dlopen_in_pid(pid, filenames, nfilenames, shuttle, nshuttle,
+                         MACH_PORT_NULL, status, &resolved, error);
+}
+
+EXPORT
+void substitute_free_inject_status(volatile int32_t *status) {
+    mach_vm_deallocate(mach_task_self(),
+                       (mach_vm_address_t) status & ~(vm_page_size - 1),
+                       vm_page_size);
+}
+
+EXPORT
+int substitute_dlopen_all_in_pid_notify(int pid, const char *const *filenames,
+                                        size_t nfilenames, int options,
+                                        const struct shuttle *shuttle,
+                                        size_t nshuttle,
+                                        mach_port_t notify_port,
+                                        char **error) {
+    bool resolved;
+    int ret;
+    if ((ret = check_dlopen_args(filenames, nfilenames, nshuttle, error)))
+        return ret;
+    (void) options;
+    return dlopen_in_pid(pid, filenames, nfilenames, shuttle, nshuttle,
+                         notify_port, NULL, &resolved, error);
+}
+
+struct dlopen_async {
+    mach_port_t port;
+    dispatch_source_t source;
+    int pid;
+    size_t nfilenames;
+    void (*callback)(void *ctx, int pid, const int32_t *status);
+    void *ctx;
+};
+
+static void dlopen_async_received(void *ctx) {
+    struct dlopen_async *da = ctx;
+    size_t msg_size = sizeof(mach_msg_header_t) +
+                      (da->nfilenames + 1) * sizeof(int32_t);
+    /* (check_dlopen_args keeps the statuses well within a page) */
+    union {
+        mach_msg_header_t hdr;
+        char buf[0x1000 + MAX_TRAILER_SIZE];
+    } msg;
+    kern_return_t kr = mach_msg(&msg.hdr, MACH_RCV_MSG | MACH_RCV_TIMEOUT, 0,
+                                sizeof(msg), da->port, 0, MACH_PORT_NULL);
+    if (kr)
+        return;
+    /* Either the thread's report, or the no-senders notification meaning
+     * the target died first (or the thread crashed), which gets all
+     * SUBSTITUTE_INJECT_PENDING. */
+    const int32_t *status;
+    int32_t none[da->nfilenames + 1];
+    if (msg.hdr.msgh_id == SUBSTITUTE_INJECT_DONE_MSG_ID &&
+        msg.hdr.msgh_size == msg_size) {
+        status = (void *) (&msg.hdr + 1);
+    } else {
+        mach_msg_destroy(&msg.hdr);
+        memset(none, 0, sizeof(none));
+        status = none;
+    }
+    dispatch_source_cancel(da->source);
+    da->callback(da->ctx, da->pid, status);
+}
+
+static void dlopen_async_cancelled(void *ctx) {
+    struct dlopen_async *da = ctx;
+    mach_port_mod_refs(mach_task_self(), da->port, MACH_PORT_RIGHT_RECEIVE, -1);
+    dispatch_release(da->source);
+    free(da);
+}
+
+EXPORT
+int substitute_dlopen_all_in_pid_async(int pid, const char *const *filenames,
+                                       size_t nfilenames, int options,
+                                       const struct shuttle *shuttle,
+                                       size_t nshuttle,
+                                       dispatch_queue_t queue,
+                                       void (*callback)(void *ctx, int pid,
+                                                        const int32_t *status),
+                                       void *ctx, char **error) {
+    int ret;
+    *error = NULL;
+    if ((ret = check_dlopen_args(filenames, nfilenames, nshuttle, error)))
+        return ret;
+    struct dlopen_async *da = calloc(1, sizeof(*da));
+    if (!da) {
+        asprintf(error, "out of memory");
+        return SUBSTITUTE_ERR_OOM;
+    }
+    da->pid = pid;
+    da->nfilenames = nfilenames;
+    da->callback = callback;
+    da->ctx = ctx;
+    kern_return_t kr = mach_port_allocate(mach_task_self(),
+                                          MACH_PORT_RIGHT_RECEIVE, &da->port);
+    if (kr) {
+        asprintf(error, "mach_port_allocate(notify port): kr=%d", kr);
+        free(da);
+        return SUBSTITUTE_ERR_MISC;
+    }
+    /* We never hold a send right ourselves, so this fires once the target's
+     * one has been used or destroyed, after any message it sent. */
+    mach_port_t prev;
+    kr = mach_port_request_notification(mach_task_self(), da->port,
+                                        MACH_NOTIFY_NO_SENDERS, 1, da->port,
+                                        MACH_MSG_TYPE_MAKE_SEND_ONCE, &prev);
+    if (kr) {
+        asprintf(error, "mach_port_request_notification: kr=%d", kr);
+        ret = SUBSTITUTE_ERR_MISC;
+        goto fail;
+    }
+    da->source = dispatch_source_create(DISPATCH_SOURCE_TYPE_MACH_RECV,
+                                        da->port, 0, queue);
+    if (!da->source) {
+        asprintf(error, "dispatch_source_create failed");
+        ret = SUBSTITUTE_ERR_OOM;
+        goto fail;
+    }
+    dispatch_set_context(da->source, da);
+    dispatch_source_set_event_handler_f(da->source, dlopen_async_received);
+    dispatch_source_set_cancel_handler_f(da->source, dlopen_async_cancelled);
+    bool resolved;
+    (void) options;
+    ret = dlopen_in_pid(pid, filenames, nfilenames, shuttle, nshuttle,
+                        da->port, NULL, &resolved, error);
+    /* on failure, the cancel handler cleans up */
+    if (ret)
+        dispatch_source_cancel(da->source);
+    dispatch_resume(da->source);
+    return ret;
+
+fail:
+    mach_port_mod_refs(mach_task_self(), da->port, MACH_PORT_RIGHT_RECEIVE, -1);
+    free(da);
+    return ret;
+}
+
+struct dlopen_in_pids {
+    const int *pids;
+    const char *filename;
+    const struct shuttle *shuttle;
+    size_t nshuttle;
+    int *rets;
+    char **errors;
+};
+
+static void dlopen_in_pids_one(void *ctx, size_t i) {
+    struct dlopen_in_pids *d = ctx;
+    bool resolved;
+    d->rets[i] = dlopen_in_pid(d->pids[i], &d->filename, 1,
+                               d->shuttle, d->nshuttle, MACH_PORT_NULL, NULL,
+                               &resolved,
+                               &d->errors[i]);
+}
+
+EXPORT
+int substitute_dlopen_in_pids(const int *pids, size_t npids,
+                              const char *filename, int options,
+                              const struct shuttle *shuttle, size_t nshuttle,
+                              int *rets, char **errors) {
+    int ret;
+    if (!npids)
+        return SUBSTITUTE_OK;
+    for (size_t i = 0; i < npids; i++)
+        errors[i] = NULL;
+    (void) options;
+    if ((ret = check_dlopen_args(&filename, 1, nshuttle, &errors[0]))) {
+        for (size_t i = 0; i < npids; i++)
+            rets[i] = ret;
+        return ret;
+    }
+
+    /* Go one at a time until some target has had its symbols resolved, so
+     * the rest (which nearly always share its shared cache) find them in
+     * foreign_sym_cache instead of all parsing the same export tries at
+     * once. */
+    size_t i = 0;
+    bool resolved = false;
+    while (i < npids && !resolved) {
+        rets[i] = dlopen_in_pid(pids[i], &filename, 1, shuttle, nshuttle,
+                                MACH_PORT_NULL, NULL, &resolved, &errors[i]);
+        i++;
+    }
+    struct dlopen_in_pids d = {
+        .pids = pids + i,
+        .filename = filename,
+        .shuttle = shuttle,
+        .nshuttle = nshuttle,
+        .rets = rets + i,
+        .errors = errors + i,
+    };
+    if (i < npids)
+        dispatch_apply_f(npids - i,
+                         dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH,
+                                                   0),
+                         &d, dlopen_in_pids_one);
+
+    for (i = 0; i < npids; i++) {
+        if (rets[i])
+            return rets[i];
+    }
+    return SUBSTITUTE_OK;
+}
+
+struct substitute_inject_ctx {
+    struct inject_target t;
+};
+
+EXPORT
+int substitute_inject_ctx_open(int pid, struct substitute_inject_ctx **ctxp,
+                               char **error) {
+    *error = NULL;
+    struct substitute_inject_ctx *ctx = malloc(sizeof(*ctx));
+    if (!ctx) {
+        asprintf(error, "out of memory allocating inject ctx");
+        return SUBSTITUTE_ERR_OOM;
+    }
+    bool resolved;
+    int ret = inject_target_open(pid, &ctx->t, &resolved, error);
+    if (ret) {
+        free(ctx);
+        return ret;
+    }
+    mach_vm_address_t code_page = 0;
+    vm_prot_t cur, max;
+    kern_return_t kr = mach_vm_remap(ctx->t.task, &code_page,
+                                     ctx->t.page_size, 0, VM_FLAGS_ANYWHERE,
+                                     mach_task_self(),
+                                     (mach_vm_address_t) inject_page_start,
+                                     /*copy*/ false,
+                                     &cur, &max, VM_INHERIT_NONE);
+    if (kr) {
+        asprintf(error, "couldn't remap target code");
+        mach_port_deallocate(mach_task_self(), ctx->t.task);
+        free(ctx);
+        return SUBSTITUTE_ERR_VM;
+    }
+    ctx->t.code_page = code_page;
+    *ctxp = ctx;
+    return SUBSTITUTE_OK;
+}
+
+EXPORT
+int substitute_inject_ctx_dlopen(struct substitute_inject_ctx *ctx,
+                                 const char *const *filenames,
+                                 size_t nfilenames, int options,
+                                 const struct shuttle *shuttle,
+                                 size_t nshuttle, volatile int32_t **status,
+                                 char **error) {
+    int ret;
+    if ((ret = check_dlopen_args(filenames, nfilenames, nshuttle, error)))
+        return ret;
+    (void) options;
+    return inject_into(&ctx->t, filenames, nfilenames, shuttle, nshuttle,
+                       MACH_PORT_NULL, status, error);
+}
+
+EXPORT
+void substitute_inject_ctx_close(struct substitute_inject_ctx *ctx) {
+    /* (the code page stays, since threads from earlier injections could
+     * still be running from it) */
+    mach_port_deallocate(mach_task_self(), ctx->t.task);
+    free(ctx);
+}
 #endif /* __APPLE__ */
@@ -2,29 +2,282 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <mach-o/dyld.h>
+#include <mach-o/fat.h>
 
 #include "substitute.h"
 #include "substitute-internal.h"
+#include "ptrauth_helpers.h"
 #include "darwin/read.h"
+#include "cbit/vec.h"
+#include "cbit/htab.h"
+
+/* a bound slot we changed, with its contents before and after */
+struct import_slot {
+    void *p;
+    uint8_t type;
+    /* in a segment dyld made read-only (SG_READ_ONLY) */
+    bool readonly;
+    uintptr_t old_raw, new_raw;
+};
+DECL_VEC(struct import_slot, import_slot);
+
+struct global_interpose;
+struct substitute_import_hook_record {
+    /* for substitute_interpose_imports_all, where the slots keep coming as
+     * images load, so they're kept there; otherwise NULL */
+    struct global_interpose *global;
+    size_t nslots;
+    struct import_slot slots[];
+};
+
+/* One bound slot, as decoded from either bind opcodes or a fixup chain. */
+struct bind_site {
+    const char *sym;
+    void *p;
+    int64_t addend;
+    uint8_t type;
+    bool readonly;
+    /* arm64e authenticated pointers: how it's signed */
+    bool auth, addr_div;
+    uint8_t key;
+    uint16_t diversity;
+};
+
+/* Hook names, looked up once per BIND_OPCODE_SET_SYMBOL_TRAILING_FLAGS_IMM
+ * rather than for every bind.  With only a few hooks, strcmp against each is
+ * faster than hashing. */
+struct hook_name {
+    const char *name;
+    size_t len;
+    size_t hash;
+};
+static inline size_t hash_hook_name(const char *name, size_t *lenp) {
+    size_t hash = 2166136261;
+    const char *p;
+    for (p = name; *p; p++)
+        hash = (hash ^ (uint8_t) *p) * 16777619;
+    *lenp = p - name;
+    return hash;
+}
+#define hook_name_hash(k) ((k)->hash)
+#define hook_name_eq(k1, k2) ((k1)->hash == (k2)->hash && \
+                              (k1)->len == (k2)->len && \
+                              !memcmp((k1)->name, (k2)->name, (k1)->len))
+#define hook_name_null(k) (!(k)->name)
+DECL_STATIC_HTAB_KEY(hook_name, struct hook_name, hook_name_hash,
+                     hook_name_eq, hook_name_null, 0);
+/* the value is the first hook with the name, as with a linear search */
+DECL_HTAB(hook_by_name, hook_name, const struct substitute_import_hook *);
+#define INTERPOSE_HASH_MIN 8
+
+/* A decoded list of every bind in an image, kept (see s_bind_tables) so
+ * later passes over the image just look up the hooked names.  Sorted by
+ * name hash. */
+struct cached_bind {
+    size_t hash;
+    struct bind_site site;
+};
+DECL_VEC(struct cached_bind, cached_bind);
+struct bind_table {
+    /* the image's extent, for forgetting slots in it when it's unloaded */
+    uintptr_t start, end;
+    size_t nbinds;
+    struct cached_bind binds[];
+};
 
 struct interpose_state {
     size_t nsegments;
     segment_command_x **segments;
     size_t max_segments;
     uintptr_t slide;
+    const mach_header_x *mh;
+    /* What to do with the binds: for each symbol, 'want' says whether (and
+     * as what) it's interesting, and then 'visit' gets each of its slots
+     * along with that.  Either patch_bind or add_to_bind_table. */
+    const void *(*want)(struct interpose_state *st, const char *sym);
+    void (*visit)(struct interpose_state *st, const struct bind_site *b,
+                  const void *wanted);
+    int ret;
+    /* for patch_bind */
     const struct substitute_import_hook *hooks;
     size_t nhooks;
+    /* NULL if there are fewer than INTERPOSE_HASH_MIN hooks */
+    const struct htab_hook_by_name *hooks_by_name;
+    /* NULL if the caller didn't ask for a record */
+    struct vec_import_slot *record;
+    /* for add_to_bind_table */
+    struct vec_cached_bind *binds;
+    const char *last_sym;
+    size_t last_hash;
     segment_command_x *stack_segments[32];
 };
 
+static void init_hooks_by_name(struct htab_hook_by_name *h,
+                               const struct substitute_import_hook *hooks,
+                               size_t nhooks) {
+    htab_resize_hook_by_name(h, nhooks * 2);
+    for (size_t i = 0; i < nhooks; i++) {
+        struct hook_name key = {hooks[i].name};
+        key.hash = hash_hook_name(hooks[i].name, &key.len);
+        bool new;
+        const struct substitute_import_hook **hp =
+            htab_setp_hook_by_name(h, &key, &new);
+        if (new)
+            *hp = &hooks[i];
+    }
+}
+
+static const struct substitute_import_hook *
+find_hook(const struct interpose_state *st, const char *sym) {
+    if (st->hooks_by_name) {
+        struct hook_name key = {sym};
+        key.hash = hash_hook_name(sym, &key.len);
+        const struct substitute_import_hook **hp =
+            htab_getp_hook_by_name(st->hooks_by_name, &key);
+        return hp ? *hp : NULL;
+    }
+    for (size_t i = 0; i < st->nhooks; i++) {
+        if (!strcmp(sym, st->hooks[i].name))
+            return &st->hooks[i];
+    }
+    return NULL;
+}
+
+static const void *want_hook(struct interpose_state *st, const char *sym) {
+    return find_hook(st, sym);
+}
+
+#if __arm64e__
+static uintptr_t sign_bind(uintptr_t val, const struct bind_site *b) {
+    uint64_t disc = b->addr_div ?
+        ptrauth_blend_discriminator(b->p, b->diversity) : b->diversity;
+    void *v = (void *) val;
+    switch (b->key) {
+    case 0: v = ptrauth_sign_unauthenticated(v, ptrauth_key_asia, disc); break;
+    case 1: v = ptrauth_sign_unauthenticated(v, ptrauth_key_asib, disc); break;
+    case 2: v = ptrauth_sign_unauthenticated(v, ptrauth_key_asda, disc); break;
+    case 3: v = ptrauth_sign_unauthenticated(v, ptrauth_key_asdb, disc); break;
+    }
+    return (uintptr_t) v;
+}
+#endif
+
+static void patch_bind(struct interpose_state *st, const struct bind_site *b,
+                       const void *wanted) {
+    const struct substitute_import_hook *h = wanted;
+#if !__arm64e__
+    if (b->auth) {
+        /* can't sign, and the process can't use it anyway */
+        return;
+    }
+#endif
+    int pmask = getpagesize() - 1;
+    void *p = b->p;
+    void *page = (void *) ((uintptr_t) p & ~pmask);
+    if (b->readonly && mprotect(page, pmask + 1, PROT_READ | PROT_WRITE)) {
+        st->ret = SUBSTITUTE_ERR_VM;
+        return;
+    }
+    uintptr_t new = (uintptr_t) make_sym_readable(h->replacement) +
+                    (intptr_t) b->addend;
+    uintptr_t old, old_raw, raw;
+    switch (b->type) {
+    case BIND_TYPE_POINTER: {
+#if __arm64e__
+        if (b->auth)
+            new = sign_bind(new, b);
+#endif
+        old = old_raw = __atomic_exchange_n((uintptr_t *) p, new,
+                                            __ATOMIC_RELAXED);
+        raw = new;
+        break;
+    }
+    case BIND_TYPE_TEXT_ABSOLUTE32: {
+        if ((uint32_t) new != new) {
+            /* text rels should only show up on i386, where this is
+             * impossible... */
+            substitute_panic("bad TEXT_ABSOLUTE32 rel\n");
+        }
+        old = old_raw = __atomic_exchange_n((uint32_t *) p, (uint32_t) new,
+                                            __ATOMIC_RELAXED);
+        raw = (uint32_t) new;
+        break;
+    }
+    case BIND_TYPE_TEXT_PCREL32: {
+        uintptr_t pc = (uintptr_t) p + 4;
+        uintptr_t rel = new - pc;
+        if ((uint32_t) rel != rel) {
+            /* ditto */
+            substitute_panic("bad TEXT_ABSOLUTE32 rel\n");
+        }
+        old_raw = __atomic_exchange_n((uint32_t *) p, (uint32_t) rel,
+                                      __ATOMIC_RELAXED);
+        raw = (uint32_t) rel;
+        old = old_raw + pc;
+        break;
+    }
+    default:
+        substitute_panic("unknown relocation type\n");
+        break;
+    }
+    if (b->readonly)
+        mprotect(page, pmask + 1, PROT_READ);
+    if (st->record) {
+        vec_append_import_slot(st->record,
+            (struct import_slot) {p, b->type, b->readonly, old_raw, raw});
+    }
+    if (h->old_ptr) {
+#if __arm64e__
+        if (b->auth) {
+            old = (uintptr_t) ptrauth_strip((void *) old, ptrauth_key_asia);
+            old -= b->addend;
+            /* code pointers are signed as C function pointers */
+            if (b->key == 0)
+                old = (uintptr_t) make_sym_callable((void *) old);
+            *(uintptr_t *) h->old_ptr = old;
+            return;
+        }
+#endif
+        *(uintptr_t *) h->old_ptr = old - b->addend;
+    }
+}
+
+static const void *want_all(struct interpose_state *st, const char *sym) {
+    return sym;
+}
+
+static void add_to_bind_table(struct interpose_state *st,
+                              const struct bind_site *b,
+                              UNUSED const void *wanted) {
+    /* (runs of binds usually share a symbol) */
+    if (b->sym != st->last_sym) {
+        size_t len;
+        st->last_sym = b->sym;
+        st->last_hash = hash_hook_name(b->sym, &len);
+    }
+    vec_append_cached_bind(st->binds,
+                           (struct cached_bind) {st->last_hash, *b});
+}
+
+static bool segment_readonly(const segment_command_x *sc);
+
 static int try_bind_section(void *bind, size_t size,
-                            const struct interpose_state *st, bool lazy) {
+                            struct interpose_state *st, bool lazy) {
     void *ptr = bind, *end = bind + size;
     char *sym = NULL;
+    /* what st->want said about the current symbol */
+    const void *wanted = NULL;
     uint8_t type = lazy ? BIND_TYPE_POINTER : 0;
     uint64_t addend = 0;
     uint64_t offset = 0, added_offset;
     void *segment = NULL;
+    bool readonly = false;
     while (ptr < end) {
         uint8_t byte = *(uint8_t *) ptr;
         ptr++;
@@ -42,7 +295,7 @@ static int try_bind_section(void *bind, size_t size,
             read_leb128(&ptr, end, false, NULL);
             break;
         case BIND_OPCODE_SET_SYMBOL_TRAILING_FLAGS_IMM:
-            read_cstring(&ptr, end, &sym);
+            wanted = read_cstring(&ptr, end, &sym) ? st->want(st, sym) : NULL;
             /* ignoring flags for now */
             break;
         case BIND_OPCODE_SET_TYPE_IMM:
@@ -52,8 +305,10 @@ static int try_bind_section(void *bind, size_t size,
             read_leb128(&ptr, end, true, &addend);
             break;
         case BIND_OPCODE_SET_SEGMENT_AND_OFFSET_ULEB:
-            if (immediate < st->nsegments)
+            if (immediate < st->nsegments) {
                 segment = (void *) (st->segments[immediate]->vmaddr + st->slide);
+                readonly = segment_readonly(st->segments[immediate]);
+            }
             read_leb128(&ptr, end, false, &offset);
             break;
         case BIND_OPCODE_ADD_ADDR_ULEB:
@@ -79,60 +334,15 @@ static int try_bind_section(void *bind, size_t size,
             stride += sizeof(void *);
             goto bind;
         bind:
-            if (segment && sym) {
-                const struct substitute_import_hook *h;
-                size_t i;
-                for (i = 0; i < st->nhooks; i++) {
-                    h = &st->hooks[i];
-                    if (!strcmp(sym, h->name))
-                        break;
-                }
-                if (i != st->nhooks) {
-                    while (count--) {
-                        uintptr_t new = (uintptr_t) h->replacement +
-                                        (intptr_t) addend;
-                        uintptr_t old;
-                        void *p = (void *) (segment + offset);
-                        switch (type) {
-                        case BIND_TYPE_POINTER: {
-                            old = __atomic_exchange_n((uintptr_t *) p,
-                                                      new, __ATOMIC_RELAXED);
-                            break;
-                        }
-                        case BIND_TYPE_TEXT_ABSOLUTE32: {
-                            if ((uint32_t) new != new) {
-                                /* text rels should only show up on i386, where
-                                 * this is impossible... */
-                                substitute_panic("bad TEXT_ABSOLUTE32 rel\n");
-                            }
-                            old = __atomic_exchange_n((uint32_t *) p,
-                                                      (uint32_t) new,
-                                                      __ATOMIC_RELAXED);
-                            break;
-                        }
-                        case BIND_TYPE_TEXT_PCREL32: {
-                            uintptr_t pc = (uintptr_t) p + 4;
-                            uintptr_t rel = new - pc;
-                            if ((uint32_t) rel != rel) {
-                                /* ditto */
-                                substitute_panic("bad TEXT_ABSOLUTE32 rel\n");
-                            }
-                            old = __atomic_exchange_n((uint32_t *) p,
-                                                      (uint32_t) rel,
-                                                      __ATOMIC_RELAXED);
-                            old += pc;
-                            break;
-                        }
-                        default:
-                            substitute_panic("unknown relocation type\n");
-                            break;
-                        }
-                        if (h->old_ptr)
-                            *(uintptr_t *) h->old_ptr = old - addend;
-                        offset += stride;
-                    }
-                    break;
+            if (segment && wanted) {
+                struct bind_site b = {sym, NULL, (int64_t) addend, type,
+                                      readonly};
+                while (count--) {
+                    b.p = segment + offset;
+                    st->visit(st, &b, wanted);
+                    offset += stride;
                 }
+                break;
             }
             offset += count * stride;
             break;
@@ -150,6 +360,522 @@ static void *off_to_addr(const struct interpose_state *st, uint32_t off) {
     return NULL;
 }
 
+/* Chained fixups (LC_DYLD_CHAINED_FIXUPS).  The layouts are those of
+ * <mach-o/fixup-chains.h>, which older SDKs don't have. */
+#ifndef LC_DYLD_CHAINED_FIXUPS
+#define LC_DYLD_CHAINED_FIXUPS (0x34 | LC_REQ_DYLD)
+#endif
+#ifndef SG_READ_ONLY
+#define SG_READ_ONLY 0x10
+#endif
+struct chained_fixups_header {
+    uint32_t fixups_version;
+    uint32_t starts_offset;
+    uint32_t imports_offset;
+    uint32_t symbols_offset;
+    uint32_t imports_count;
+    uint32_t imports_format;
+    uint32_t symbols_format;
+};
+struct chained_starts_in_segment {
+    uint32_t size;
+    uint16_t page_size;
+    uint16_t pointer_format;
+    uint64_t segment_offset;
+    uint32_t max_valid_pointer;
+    uint16_t page_count;
+    uint16_t page_start[];
+};
+#define CHAINED_IMPORT 1
+#define CHAINED_IMPORT_ADDEND 2
+#define CHAINED_IMPORT_ADDEND64 3
+#define CHAINED_PTR_ARM64E 1
+#define CHAINED_PTR_64 2
+#define CHAINED_PTR_64_OFFSET 6
+#define CHAINED_PTR_ARM64E_USERLAND 9
+#define CHAINED_PTR_ARM64E_USERLAND24 12
+#define CHAINED_PTR_START_NONE 0xffff
+
+/* Returns whether the pointer is a bind (filling in its ordinal and b's
+ * addend and signing), and the distance to the next one in units of the
+ * format's stride (0 at the end of the chain). */
+static bool decode_chained_ptr(uint16_t format, uint64_t v, uint32_t *next,
+                               uint32_t *ordinal, struct bind_site *b) {
+    switch (format) {
+    case CHAINED_PTR_ARM64E:
+    case CHAINED_PTR_ARM64E_USERLAND:
+    case CHAINED_PTR_ARM64E_USERLAND24:
+        *next = (v >> 51) & 0x7ff;
+        if (!((v >> 62) & 1))
+            return false;
+        *ordinal = v & (format == CHAINED_PTR_ARM64E_USERLAND24 ?
+                        0xffffff : 0xffff);
+        b->auth = v >> 63;
+        if (b->auth) {
+            b->addend = 0;
+            b->diversity = (v >> 32) & 0xffff;
+            b->addr_div = (v >> 48) & 1;
+            b->key = (v >> 49) & 3;
+        } else {
+            /* 19 bits, signed */
+            b->addend = (int64_t) (v << 13) >> 45;
+        }
+        return true;
+    case CHAINED_PTR_64:
+    case CHAINED_PTR_64_OFFSET:
+        *next = (v >> 51) & 0xfff;
+        if (!(v >> 63))
+            return false;
+        *ordinal = v & 0xffffff;
+        b->addend = (v >> 24) & 0xff;
+        b->auth = false;
+        return true;
+    default:
+        __builtin_unreachable();
+    }
+}
+
+static size_t chained_ptr_stride(uint16_t format) {
+    switch (format) {
+    case CHAINED_PTR_ARM64E:
+    case CHAINED_PTR_ARM64E_USERLAND:
+    case CHAINED_PTR_ARM64E_USERLAND24:
+        return 8;
+    case CHAINED_PTR_64:
+    case CHAINED_PTR_64_OFFSET:
+        return 4;
+    default:
+        /* 32-bit and kernel formats */
+        return 0;
+    }
+}
+
+static bool segment_readonly(const segment_command_x *sc) {
+    return sc->flags & SG_READ_ONLY;
+}
+
+static inline uint32_t be32(uint32_t x) {
+    /* (every host we run on is little endian) */
+    return __builtin_bswap32(x);
+}
+
+/* dyld overwrites the chains with what they resolve to, so they have to be
+ * read from the image's file.  Returns an fd for it and the offset of the
+ * slice, after checking that its header and load commands are the ones in
+ * memory; or -1. */
+static int open_image_file(const mach_header_x *mh, off_t *slice_off_p) {
+    Dl_info info;
+    if (!dladdr(mh, &info) || !info.dli_fname)
+        return -1;
+    int fd = open(info.dli_fname, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    off_t slice_off = 0;
+    uint32_t magic;
+    if (pread(fd, &magic, sizeof(magic), 0) != sizeof(magic))
+        goto fail;
+    if (magic == FAT_CIGAM || magic == FAT_CIGAM_64) {
+        bool is64 = magic == FAT_CIGAM_64;
+        struct fat_header fh;
+        if (pread(fd, &fh, sizeof(fh), 0) != sizeof(fh))
+            goto fail;
+        uint32_t narch = be32(fh.nfat_arch);
+        off_t pos = sizeof(fh);
+        for (uint32_t i = 0; i < narch; i++) {
+            union {
+                struct fat_arch a;
+                struct fat_arch_64 a64;
+            } fa;
+            size_t fa_size = is64 ? sizeof(fa.a64) : sizeof(fa.a);
+            if (pread(fd, &fa, fa_size, pos) != fa_size)
+                goto fail;
+            pos += fa_size;
+            /* the layouts agree up to the offset */
+            if ((cpu_type_t) be32(fa.a.cputype) == mh->cputype &&
+                ((be32(fa.a.cpusubtype) ^ mh->cpusubtype) &
+                 ~CPU_SUBTYPE_MASK) == 0) {
+                slice_off = is64 ? (off_t) __builtin_bswap64(fa.a64.offset)
+                                 : be32(fa.a.offset);
+                goto found;
+            }
+        }
+        goto fail;
+    }
+found:;
+    size_t hdr_size = sizeof(*mh) + mh->sizeofcmds;
+    void *hdr = malloc(hdr_size);
+    if (!hdr)
+        goto fail;
+    bool same = pread(fd, hdr, hdr_size, slice_off) == hdr_size &&
+                !memcmp(hdr, mh, hdr_size);
+    free(hdr);
+    if (!same)
+        goto fail;
+    *slice_off_p = slice_off;
+    return fd;
+fail:
+    close(fd);
+    return -1;
+}
+
+struct chained_import {
+    const char *sym;
+    int64_t addend;
+    /* what st->want said about it */
+    const void *wanted;
+};
+
+static int walk_chained_segment(struct interpose_state *st,
+                                const segment_command_x *sc,
+                                const struct chained_starts_in_segment *sis,
+                                const struct chained_import *imports,
+                                uint32_t nimports, int fd, off_t slice_off,
+                                void *page_buf) {
+    uint16_t format = sis->pointer_format;
+    size_t stride = chained_ptr_stride(format);
+    if (!stride)
+        return SUBSTITUTE_ERR_NOT_SUPPORTED;
+    void *seg = (void *) (sc->vmaddr + st->slide);
+    struct bind_site b = {.type = BIND_TYPE_POINTER,
+                          .readonly = segment_readonly(sc)};
+    for (uint16_t pi = 0; pi < sis->page_count; pi++) {
+        uint16_t start = sis->page_start[pi];
+        if (start == CHAINED_PTR_START_NONE)
+            continue;
+        uint64_t page_off = (uint64_t) pi * sis->page_size;
+        if (page_off >= sc->filesize)
+            break;
+        size_t len = sis->page_size;
+        if (len > sc->filesize - page_off)
+            len = sc->filesize - page_off;
+        if (pread(fd, page_buf, len, slice_off + sc->fileoff + page_off) !=
+            (ssize_t) len)
+            return SUBSTITUTE_ERR_VM;
+        for (size_t off = start; off + 8 <= len; ) {
+            uint64_t v;
+            memcpy(&v, (char *) page_buf + off, sizeof(v));
+            uint32_t next, ordinal;
+            if (decode_chained_ptr(format, v, &next, &ordinal, &b) &&
+                ordinal < nimports && imports[ordinal].wanted) {
+                const struct chained_import *imp = &imports[ordinal];
+                b.sym = imp->sym;
+                b.addend += imp->addend;
+                b.p = seg + page_off + off;
+                st->visit(st, &b, imp->wanted);
+            }
+            if (!next)
+                break;
+            off += next * stride;
+        }
+    }
+    return SUBSTITUTE_OK;
+}
+
+static int try_chained_fixups(const struct linkedit_data_command *ldc,
+                              struct interpose_state *st) {
+    const struct chained_fixups_header *cfh = off_to_addr(st, ldc->dataoff);
+    if (!cfh || cfh->symbols_format != 0)
+        return SUBSTITUTE_ERR_NOT_SUPPORTED;
+    uint32_t nimports = cfh->imports_count;
+    const void *raw_imports = (void *) cfh + cfh->imports_offset;
+    const char *symbols = (void *) cfh + cfh->symbols_offset;
+
+    /* Look each import up once; the chains just have ordinals. */
+    struct chained_import *imports = calloc(nimports, sizeof(*imports));
+    if (nimports && !imports)
+        return SUBSTITUTE_ERR_OOM;
+    bool any = false;
+    for (uint32_t i = 0; i < nimports; i++) {
+        uint32_t name_offset;
+        int64_t addend = 0;
+        switch (cfh->imports_format) {
+        case CHAINED_IMPORT:
+            name_offset = ((const uint32_t *) raw_imports)[i] >> 9;
+            break;
+        case CHAINED_IMPORT_ADDEND: {
+            const uint32_t *imp = (const uint32_t *) raw_imports + 2 * i;
+            name_offset = imp[0] >> 9;
+            addend = (int32_t) imp[1];
+            break;
+        }
+        case CHAINED_IMPORT_ADDEND64: {
+            const uint64_t *imp = (const uint64_t *) raw_imports + 2 * i;
+            name_offset = imp[0] >> 32;
+            addend = (int64_t) imp[1];
+            break;
+        }
+        default:
+            free(imports);
+            return SUBSTITUTE_ERR_NOT_SUPPORTED;
+        }
+        imports[i].sym = symbols + name_offset;
+        imports[i].addend = addend;
+        if ((imports[i].wanted = st->want(st, imports[i].sym)))
+            any = true;
+    }
+    int ret = SUBSTITUTE_OK;
+    if (!any)
+        goto out;
+
+    off_t slice_off;
+    int fd = open_image_file(st->mh, &slice_off);
+    if (fd == -1) {
+        ret = SUBSTITUTE_ERR_NOT_SUPPORTED;
+        goto out;
+    }
+    const void *starts = (void *) cfh + cfh->starts_offset;
+    uint32_t seg_count = *(const uint32_t *) starts;
+    const uint32_t *seg_info_offset = (const uint32_t *) starts + 1;
+    void *page_buf = NULL;
+    for (uint32_t i = 0; i < seg_count && i < st->nsegments; i++) {
+        if (!seg_info_offset[i])
+            continue;
+        const struct chained_starts_in_segment *sis =
+            starts + seg_info_offset[i];
+        /* (page_size is 16 bits) */
+        if (!page_buf && !(page_buf = malloc(65536))) {
+            ret = SUBSTITUTE_ERR_OOM;
+            break;
+        }
+        int seg_ret = walk_chained_segment(st, st->segments[i], sis, imports,
+                                           nimports, fd, slice_off, page_buf);
+        if (seg_ret && !ret)
+            ret = seg_ret;
+    }
+    free(page_buf);
+    close(fd);
+out:
+    free(imports);
+    return ret;
+}
+
+/* Fill in st's segments (and mh and slide), and run its want/visit over
+ * every bind in the image. */
+static int walk_binds(const mach_header_x *mh, intptr_t slide,
+                      struct interpose_state *st) {
+    st->mh = mh;
+    st->slide = slide;
+    st->nsegments = 0;
+    st->segments = st->stack_segments;
+    st->max_segments = sizeof(st->stack_segments) / sizeof(*st->stack_segments);
+    st->ret = SUBSTITUTE_OK;
+
+    const struct dyld_info_command *dc = NULL;
+    const struct linkedit_data_command *chained = NULL;
+    const struct load_command *lc = (void *) (mh + 1);
+    for (uint32_t i = 0; i < mh->ncmds; i++) {
+        if (lc->cmd == LC_SEGMENT_X) {
+            segment_command_x *sc = (void *) lc;
+            if (st->nsegments == st->max_segments) {
+                segment_command_x **new = calloc(st->nsegments * 2,
+                                                 sizeof(*st->segments));
+                if (!new)
+                    substitute_panic("%s: out of memory\n", __func__);
+                memcpy(new, st->segments, st->nsegments * sizeof(*st->segments));
+                if (st->segments != st->stack_segments)
+                    free(st->segments);
+                st->segments = new;
+                st->max_segments = st->nsegments * 2;
+            }
+            st->segments[st->nsegments++] = sc;
+        } else if (lc->cmd == LC_DYLD_INFO || lc->cmd == LC_DYLD_INFO_ONLY) {
+            dc = (void *) lc;
+        } else if (lc->cmd == LC_DYLD_CHAINED_FIXUPS) {
+            chained = (void *) lc;
+        }
+        lc = (void *) lc + lc->cmdsize;
+    }
+
+    int ret = SUBSTITUTE_OK;
+    if (dc) {
+        if ((ret = try_bind_section(off_to_addr(st, dc->bind_off),
+                                    dc->bind_size, st, false)) ||
+            (ret = try_bind_section(off_to_addr(st, dc->weak_bind_off),
+                                    dc->weak_bind_size, st, false)) ||
+            (ret = try_bind_section(off_to_addr(st, dc->lazy_bind_off),
+                                    dc->lazy_bind_size, st, true)))
+            goto out;
+    } else if (chained) {
+        ret = try_chained_fixups(chained, st);
+    }
+out:
+    if (st->segments != st->stack_segments)
+        free(st->segments);
+    return ret ? ret : st->ret;
+}
+
+static int compare_cached_binds(const void *a, const void *b) {
+    size_t ha = ((const struct cached_bind *) a)->hash;
+    size_t hb = ((const struct cached_bind *) b)->hash;
+    return ha < hb ? -1 : ha > hb;
+}
+
+static struct bind_table *build_bind_table(const mach_header_x *mh,
+                                           intptr_t slide) {
+    struct interpose_state st;
+    VEC_STORAGE(cached_bind) binds;
+    VEC_STORAGE_INIT(&binds, cached_bind);
+    st.want = want_all;
+    st.visit = add_to_bind_table;
+    st.binds = &binds.v;
+    st.last_sym = NULL;
+    struct bind_table *table = NULL;
+    if (walk_binds(mh, slide, &st))
+        goto out;
+    size_t n = binds.v.length;
+    if (!(table = malloc(sizeof(*table) + n * sizeof(table->binds[0]))))
+        goto out;
+    table->nbinds = n;
+    memcpy(table->binds, binds.v.els, n * sizeof(table->binds[0]));
+    qsort(table->binds, n, sizeof(table->binds[0]), compare_cached_binds);
+    table->start = UINTPTR_MAX;
+    table->end = 0;
+    const struct load_command *lc = (void *) (mh + 1);
+    for (uint32_t i = 0; i < mh->ncmds; i++) {
+        if (lc->cmd == LC_SEGMENT_X) {
+            const segment_command_x *sc = (void *) lc;
+            if (sc->vmsize && sc->initprot) {
+                uintptr_t start = sc->vmaddr + slide;
+                if (start < table->start)
+                    table->start = start;
+                if (start + sc->vmsize > table->end)
+                    table->end = start + sc->vmsize;
+            }
+        }
+        lc = (void *) lc + lc->cmdsize;
+    }
+out:
+    vec_free_storage_cached_bind(&binds.v);
+    return table;
+}
+
+/* Run patch_bind (set up in st) over the slots for st's hooks in 'table'. */
+static void apply_bind_table(struct interpose_state *st,
+                             const struct bind_table *table) {
+    for (size_t i = 0; i < st->nhooks; i++) {
+        const struct substitute_import_hook *h = &st->hooks[i];
+        /* a repeated name goes to the first hook with it */
+        if (find_hook(st, h->name) != h)
+            continue;
+        size_t len;
+        size_t hash = hash_hook_name(h->name, &len);
+        size_t lo = 0, hi = table->nbinds;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (table->binds[mid].hash < hash)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        for (; lo < table->nbinds && table->binds[lo].hash == hash; lo++) {
+            const struct bind_site *b = &table->binds[lo].site;
+            if (!strcmp(b->sym, h->name))
+                patch_bind(st, b, h);
+        }
+    }
+}
+
+/* Every loaded image's bind table, by header, once anyone has called
+ * substitute_interpose_imports_all (from then on, dyld's add-image callback
+ * builds them as images load); and the hooks passed to that, which are
+ * applied to each new image.  All under s_interpose_lock. */
+#define image_key_hash(kp) ((size_t) (*(kp) >> 12))
+#define image_key_eq(k1p, k2p) (*(k1p) == *(k2p))
+#define image_key_null(kp) (!*(kp))
+DECL_STATIC_HTAB_KEY(image_key, uintptr_t, image_key_hash, image_key_eq,
+                     image_key_null, 0);
+DECL_HTAB(bind_tables, image_key, struct bind_table *);
+static HTAB_STORAGE(bind_tables) s_bind_tables =
+    HTAB_STORAGE_INIT_STATIC(&s_bind_tables, bind_tables);
+
+struct global_interpose {
+    struct global_interpose *next;
+    /* copies, names and all */
+    struct substitute_import_hook *hooks;
+    size_t nhooks;
+    bool have_by_name;
+    HTAB_STORAGE(hook_by_name) by_name;
+    /* if there's still a record to put them back with */
+    bool want_slots;
+    VEC_STORAGE(import_slot) slots;
+};
+static struct global_interpose *s_globals;
+static pthread_mutex_t s_interpose_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t s_interpose_all_once = PTHREAD_ONCE_INIT;
+
+static void apply_global(struct global_interpose *g,
+                         const struct bind_table *table) {
+    struct interpose_state st;
+    st.hooks = g->hooks;
+    st.nhooks = g->nhooks;
+    st.hooks_by_name = g->have_by_name ? &g->by_name.h : NULL;
+    st.record = g->want_slots ? &g->slots.v : NULL;
+    st.ret = SUBSTITUTE_OK;
+    apply_bind_table(&st, table);
+}
+
+static void interpose_image_added(const struct mach_header *mh,
+                                  intptr_t slide) {
+    struct bind_table *table = build_bind_table((const void *) mh, slide);
+    if (!table)
+        return;
+    pthread_mutex_lock(&s_interpose_lock);
+    uintptr_t key = (uintptr_t) mh;
+    bool new;
+    struct bind_table **tp = htab_setp_bind_tables(&s_bind_tables.h, &key,
+                                                   &new);
+    if (!new)
+        free(*tp);
+    *tp = table;
+    for (struct global_interpose *g = s_globals; g; g = g->next)
+        apply_global(g, table);
+    pthread_mutex_unlock(&s_interpose_lock);
+}
+
+static void interpose_image_removed(const struct mach_header *mh,
+                                    UNUSED intptr_t slide) {
+    pthread_mutex_lock(&s_interpose_lock);
+    uintptr_t key = (uintptr_t) mh;
+    struct htab_bucket_bind_tables *bucket =
+        htab_getbucket_bind_tables(&s_bind_tables.h, &key);
+    if (bucket) {
+        struct bind_table *table = bucket->value;
+        htab_removeat_bind_tables(&s_bind_tables.h, bucket);
+        /* those slots are gone, so don't try to put them back */
+        for (struct global_interpose *g = s_globals; g; g = g->next) {
+            struct vec_import_slot *slots = &g->slots.v;
+            if (!g->want_slots)
+                continue;
+            size_t j = 0;
+            for (size_t i = 0; i < slots->length; i++) {
+                uintptr_t p = (uintptr_t) slots->els[i].p;
+                if (p - table->start >= table->end - table->start)
+                    slots->els[j++] = slots->els[i];
+            }
+            slots->length = j;
+        }
+        free(table);
+    }
+    pthread_mutex_unlock(&s_interpose_lock);
+}
+
+static void register_interpose_all() {
+    /* (this calls interpose_image_added for everything already loaded) */
+    _dyld_register_func_for_add_image(interpose_image_added);
+    _dyld_register_func_for_remove_image(interpose_image_removed);
+}
+
+static void free_global(struct global_interpose *g) {
+    for (size_t i = 0; i < g->nhooks; i++)
+        free((char *) g->hooks[i].name);
+    free(g->hooks);
+    if (g->have_by_name)
+        htab_free_storage_hook_by_name(&g->by_name.h);
+    if (g->want_slots)
+        vec_free_storage_import_slot(&g->slots.v);
+    free(g);
+}
+
 EXPORT
 int substitute_interpose_imports(const struct substitute_image *image,
                                  const struct substitute_import_hook *hooks,
@@ -165,54 +891,179 @@ int substitute_interpose_imports(const struct substitute_image *image,
         *recordp = NULL;
 
     struct interpose_state st;
-    st.slide = image->slide;
-    st.nsegments = 0;
     st.hooks = hooks;
     st.nhooks = nhooks;
-    st.segments = st.stack_segments;
-    st.max_segments = sizeof(st.stack_segments) / sizeof(*st.stack_segments);
+    st.want = want_hook;
+    st.visit = patch_bind;
+    HTAB_STORAGE(hook_by_name) hooks_by_name_storage;
+    st.hooks_by_name = NULL;
+    if (nhooks >= INTERPOSE_HASH_MIN) {
+        HTAB_STORAGE_INIT(&hooks_by_name_storage, hook_by_name);
+        init_hooks_by_name(&hooks_by_name_storage.h, hooks, nhooks);
+        st.hooks_by_name = &hooks_by_name_storage.h;
+    }
+    VEC_STORAGE(import_slot) record_storage;
+    st.record = NULL;
+    if (recordp) {
+        VEC_STORAGE_INIT(&record_storage, import_slot);
+        st.record = &record_storage.v;
+    }
 
-    const mach_header_x *mh = image->image_header;
-    const struct load_command *lc = (void *) (mh + 1);
-    for (uint32_t i = 0; i < mh->ncmds; i++) {
-        if (lc->cmd == LC_SEGMENT_X) {
-            segment_command_x *sc = (void *) lc;
-            if (st.nsegments == st.max_segments) {
-                segment_command_x **new = calloc(st.nsegments * 2,
-                                                 sizeof(*st.segments));
-                if (!new)
-                    substitute_panic("%s: out of memory\n", __func__);
-                memcpy(new, st.segments, st.nsegments * sizeof(*st.segments));
-                if (st.segments != st.stack_segments)
-                    free(st.segments);
-                st.segments = new;
-            }
-            st.segments[st.nsegments++] = sc;
+    /* If substitute_interpose_imports_all has decoded the image's binds
+     * already, just look up the hooked names. */
+    pthread_mutex_lock(&s_interpose_lock);
+    uintptr_t key = (uintptr_t) image->image_header;
+    struct bind_table **tp = htab_getp_bind_tables(&s_bind_tables.h, &key);
+    if (tp) {
+        st.ret = SUBSTITUTE_OK;
+        apply_bind_table(&st, *tp);
+        ret = st.ret;
+    }
+    pthread_mutex_unlock(&s_interpose_lock);
+    if (!tp)
+        ret = walk_binds(image->image_header, image->slide, &st);
+    if (ret)
+        goto fail;
+
+    if (recordp) {
+        size_t nslots = st.record->length;
+        struct substitute_import_hook_record *record =
+            malloc(sizeof(*record) + nslots * sizeof(record->slots[0]));
+        if (!record) {
+            substitute_panic("%s: out of memory\n", __func__);
         }
-        lc = (void *) lc + lc->cmdsize;
+        record->global = NULL;
+        record->nslots = nslots;
+        memcpy(record->slots, st.record->els, nslots * sizeof(record->slots[0]));
+        *recordp = record;
     }
+fail:
+    if (st.hooks_by_name)
+        htab_free_storage_hook_by_name(&hooks_by_name_storage.h);
+    if (st.record)
+        vec_free_storage_import_slot(st.record);
+    return ret;
+}
 
-    lc = (void *) (mh + 1);
-    for (uint32_t i = 0; i < mh->ncmds; i++) {
-        if (lc->cmd == LC_DYLD_INFO || lc->cmd == LC_DYLD_INFO_ONLY) {
-            struct dyld_info_command *dc = (void *) lc;
-            int ret;
-            if ((ret = try_bind_section(off_to_addr(&st, dc->bind_off),
-                                        dc->bind_size, &st, false)) ||
-                (ret = try_bind_section(off_to_addr(&st, dc->weak_bind_off),
-                                        dc->weak_bind_size, &st, false)) ||
-                (ret = try_bind_section(off_to_addr(&st, dc->lazy_bind_off),
-                                        dc->lazy_bind_size, &st, true)))
-                goto fail;
+EXPORT
+int substitute_interpose_imports_all(const struct substitute_import_hook *hooks,
+                                     size_t nhooks,
+                                     struct substitute_import_hook_record **recordp) {
+    if (recordp)
+        *recordp = NULL;
+    struct global_interpose *g = calloc(1, sizeof(*g));
+    struct substitute_import_hook_record *record = NULL;
+    if (!g)
+        return SUBSTITUTE_ERR_OOM;
+    if (!(g->hooks = calloc(nhooks, sizeof(*g->hooks))) && nhooks)
+        goto oom;
+    for (size_t i = 0; i < nhooks; i++) {
+        g->hooks[i] = hooks[i];
+        if (!(g->hooks[i].name = strdup(hooks[i].name)))
+            goto oom;
+        g->nhooks = i + 1;
+    }
+    if (nhooks >= INTERPOSE_HASH_MIN) {
+        HTAB_STORAGE_INIT(&g->by_name, hook_by_name);
+        init_hooks_by_name(&g->by_name.h, g->hooks, nhooks);
+        g->have_by_name = true;
+    }
+    if (recordp) {
+        if (!(record = malloc(sizeof(*record))))
+            goto oom;
+        record->global = g;
+        record->nslots = 0;
+        VEC_STORAGE_INIT(&g->slots, import_slot);
+        g->want_slots = true;
+    }
 
-            break;
+    pthread_once(&s_interpose_all_once, register_interpose_all);
+    pthread_mutex_lock(&s_interpose_lock);
+    HTAB_FOREACH(&s_bind_tables.h, uintptr_t *k, struct bind_table **tp,
+                 bind_tables) {
+        (void) k;
+        apply_global(g, *tp);
+    }
+    g->next = s_globals;
+    s_globals = g;
+    pthread_mutex_unlock(&s_interpose_lock);
+    if (recordp)
+        *recordp = record;
+    return SUBSTITUTE_OK;
+oom:
+    free(record);
+    free_global(g);
+    return SUBSTITUTE_ERR_OOM;
+}
+
+/* backwards, in case the same slot was hooked twice */
+static int restore_slots(const struct import_slot *slots, size_t nslots) {
+    int ret = SUBSTITUTE_OK;
+    int pmask = getpagesize() - 1;
+    for (size_t i = nslots; i-- > 0; ) {
+        const struct import_slot *slot = &slots[i];
+        void *page = (void *) ((uintptr_t) slot->p & ~pmask);
+        if (slot->readonly && mprotect(page, pmask + 1, PROT_READ | PROT_WRITE)) {
+            ret = SUBSTITUTE_ERR_VM;
+            continue;
         }
-        lc = (void *) lc + lc->cmdsize;
+        bool ok;
+        if (slot->type == BIND_TYPE_POINTER) {
+            uintptr_t expected = slot->new_raw;
+            ok = __atomic_compare_exchange_n((uintptr_t *) slot->p, &expected,
+                                             slot->old_raw, false,
+                                             __ATOMIC_RELAXED,
+                                             __ATOMIC_RELAXED);
+        } else {
+            uint32_t expected = (uint32_t) slot->new_raw;
+            ok = __atomic_compare_exchange_n((uint32_t *) slot->p, &expected,
+                                             (uint32_t) slot->old_raw, false,
+                                             __ATOMIC_RELAXED,
+                                             __ATOMIC_RELAXED);
+        }
+        if (slot->readonly)
+            mprotect(page, pmask + 1, PROT_READ);
+        /* someone else rebound it since; leave theirs alone */
+        if (!ok)
+            ret = SUBSTITUTE_ERR_HOOK_CHANGED;
     }
-fail:
-    if (st.segments != st.stack_segments)
-        free(st.segments);
     return ret;
 }
 
+EXPORT
+int substitute_unhook_imports(struct substitute_import_hook_record *record) {
+    int ret;
+    struct global_interpose *g = record->global;
+    if (g) {
+        pthread_mutex_lock(&s_interpose_lock);
+        for (struct global_interpose **gp = &s_globals; *gp; gp = &(*gp)->next) {
+            if (*gp == g) {
+                *gp = g->next;
+                break;
+            }
+        }
+        ret = restore_slots(g->slots.v.els, g->slots.v.length);
+        pthread_mutex_unlock(&s_interpose_lock);
+        free_global(g);
+    } else {
+        ret = restore_slots(record->slots, record->nslots);
+    }
+    free(record);
+    return ret;
+}
+
+EXPORT
+void substitute_free_import_hook_record(
+        struct substitute_import_hook_record *record) {
+    struct global_interpose *g = record->global;
+    if (g) {
+        /* the hooks stay, but can't be undone now */
+        pthread_mutex_lock(&s_interpose_lock);
+        vec_free_storage_import_slot(&g->slots.v);
+        g->want_slots = false;
+        pthread_mutex_unlock(&s_interpose_lock);
+    }
+    free(record);
+}
+
 #endif /* __APPLE__ */
@@ -12,6 +12,8 @@ kern_return_t mach_vm_write(vm_map_t, mach_vm_address_t, vm_offset_t,
                             mach_msg_type_number_t);
 kern_return_t mach_vm_allocate(vm_map_t, mach_vm_address_t *, mach_vm_size_t, int);
 kern_return_t mach_vm_deallocate(vm_map_t, mach_vm_address_t, mach_vm_size_t);
+kern_return_t mach_vm_protect(vm_map_t, mach_vm_address_t, mach_vm_size_t,
+                              boolean_t, vm_prot_t);
 kern_return_t mach_vm_region(vm_map_t, mach_vm_address_t *, mach_vm_size_t *,
                              vm_region_flavor_t, vm_region_info_t,
                              mach_msg_type_number_t *, mach_port_t *);
@@ -0,0 +1,82 @@
+#ifdef __APPLE__
+
+#include "substitute.h"
+#include "substitute-internal.h"
+#include "execmem.h"
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/* Each module calls back with its pages; adjacent pages of the same kind
+ * accumulate in 'cur' until something else comes along. */
+struct report_ctx {
+    struct substitute_memory_region *regions;
+    size_t nregions, count;
+    struct substitute_memory_region cur;
+};
+
+static void flush_region(struct report_ctx *rc) {
+    if (!rc->cur.size)
+        return;
+    if (rc->count < rc->nregions)
+        rc->regions[rc->count] = rc->cur;
+    rc->count++;
+    rc->cur.size = 0;
+}
+
+/* Resident and dirty bytes, asking mincore a chunk at a time. */
+static void count_pages(uintptr_t start, size_t size, size_t *resident_p,
+                        size_t *dirty_p) {
+    size_t page_size = getpagesize();
+    size_t resident = 0, dirty = 0;
+    char vec[256];
+    while (size) {
+        size_t chunk = size < sizeof(vec) * page_size ? size
+                                                      : sizeof(vec) * page_size;
+        size_t npages = (chunk + page_size - 1) / page_size;
+        /* (if it fails, the range just shows up as not resident) */
+        if (!mincore((caddr_t) start, chunk, vec)) {
+            for (size_t i = 0; i < npages; i++) {
+                if (vec[i] & MINCORE_INCORE)
+                    resident += page_size;
+                if (vec[i] & (MINCORE_MODIFIED | MINCORE_MODIFIED_OTHER))
+                    dirty += page_size;
+            }
+        }
+        start += chunk;
+        size -= chunk;
+    }
+    *resident_p = resident;
+    *dirty_p = dirty;
+}
+
+static void add_region(void *ctx, int kind, uintptr_t start, size_t size,
+                       size_t used) {
+    struct report_ctx *rc = ctx;
+    struct substitute_memory_region *cur = &rc->cur;
+    if (cur->size && (cur->kind != kind || cur->start + cur->size != start))
+        flush_region(rc);
+    if (!cur->size)
+        *cur = (struct substitute_memory_region) {.kind = kind, .start = start};
+    size_t resident, dirty;
+    count_pages(start, size, &resident, &dirty);
+    cur->size += size;
+    cur->resident += resident;
+    cur->dirty += dirty;
+    cur->used += used;
+}
+
+EXPORT
+size_t substitute_memory_report(struct substitute_memory_region *regions,
+                                size_t nregions) {
+    struct report_ctx rc = {regions, nregions, 0, {0}};
+    execmem_enum_memory(add_region, &rc);
+    flush_region(&rc);
+    objc_enum_memory(add_region, &rc);
+    flush_region(&rc);
+    find_syms_enum_memory(add_region, &rc);
+    flush_region(&rc);
+    return rc.count;
+}
+
+#endif /* __APPLE__ */
@@ -8,7 +8,12 @@
 #include <sys/mman.h>
 #include <sys/queue.h>
 #include <errno.h>
+#include <dlfcn.h>
+#include <mach-o/dyld.h>
+#include <dispatch/dispatch.h>
 #include <ptrauth_helpers.h>
+#include "cbit/htab.h"
+#include "cbit/vec.h"
 
 /* These trampolines will call e->func(e->arg1, e->arg2), and jump to there,
  * preserving all arguments.  imp_implementationWithBlock would be easier and
@@ -21,11 +26,12 @@ struct tramp_info_page_header {
     struct tramp_info_page_entry *first_free;
     size_t nfree;
     LIST_ENTRY(tramp_info_page_header) free_pages;
+    LIST_ENTRY(tramp_info_page_header) all_pages;
 };
 
 enum {
     TRAMP_MAGIC = 0xf00df17e,
-    TRAMP_VERSION = 0,
+    TRAMP_VERSION = 1,
 };
 
 struct tramp_info_page_entry {
@@ -47,12 +53,16 @@ _Static_assert(sizeof(struct tramp_info_page_header) +
 static pthread_mutex_t tramp_mutex = PTHREAD_MUTEX_INITIALIZER;
 LIST_HEAD(tramp_info_page_list, tramp_info_page_header)
     tramp_free_page_list = LIST_HEAD_INITIALIZER(tramp_info_page_list);
+/* every page, for objc_enum_memory */
+LIST_HEAD(tramp_info_all_page_list, tramp_info_page_header)
+    tramp_all_page_list = LIST_HEAD_INITIALIZER(tramp_info_all_page_list);
 
 extern char remap_start[];
 
-static int get_trampoline(void *func, void *arg1, void *arg2, void *tramp_ptr) {
+/* with tramp_mutex held */
+static int get_trampoline_locked(void *func, void *arg1, void *arg2,
+                                 void *tramp_ptr) {
     int ret, rerrno = 0;
-    pthread_mutex_lock(&tramp_mutex);
 
     struct tramp_info_page_header *header = LIST_FIRST(&tramp_free_page_list);
     if (!header) {
@@ -90,6 +100,7 @@ static int get_trampoline(void *func, void *arg1, void *arg2, void *tramp_ptr) {
         header->first_free = NULL;
         header->nfree = TRAMPOLINES_PER_PAGE;
         LIST_INSERT_HEAD(&tramp_free_page_list, header, free_pages);
+        LIST_INSERT_HEAD(&tramp_all_page_list, header, all_pages);
     }
 
     void *page = (void *) (((uintptr_t) header) & ~(_PAGE_SIZE - 1));
@@ -114,13 +125,62 @@ static int get_trampoline(void *func, void *arg1, void *arg2, void *tramp_ptr) {
     *(void **) tramp_ptr = tramp;
     ret = SUBSTITUTE_OK;
 out:
-    pthread_mutex_unlock(&tramp_mutex);
     errno = rerrno;
     return ret;
 }
 
-static void free_trampoline(void *tramp) {
-    pthread_mutex_lock(&tramp_mutex);
+/* With substitute_set_objc_super_imp_cache, superclass-call trampolines cache
+ * what class_getMethodImplementation returned, until objc_generation changes.
+ * That's bumped whenever methods might have changed: by the runtime calls in
+ * watch_objc_runtime (hooked in every image) and by any image loading, since
+ * that can attach categories.  This misses some changes (see substitute.h),
+ * so it's off by default and the trampolines just call
+ * class_getMethodImplementation. */
+struct super_imp_cache {
+    Class super;
+    SEL selector;
+    IMP imp;
+    /* 0: nothing cached yet */
+    uintptr_t generation;
+};
+#define SUPER_IMP_BUSY UINTPTR_MAX
+static uintptr_t objc_generation = 1;
+/* if the runtime couldn't be watched, there's no caching */
+static bool objc_generation_valid;
+static bool objc_super_imp_cache_enabled;
+
+static void bump_objc_generation() {
+    __atomic_add_fetch(&objc_generation, 1, __ATOMIC_RELEASE);
+}
+
+static IMP cached_super_imp(struct super_imp_cache *c, UNUSED void *_) {
+    uintptr_t gen = __atomic_load_n(&objc_generation, __ATOMIC_ACQUIRE);
+    uintptr_t cached = __atomic_load_n(&c->generation, __ATOMIC_ACQUIRE);
+    if (cached == gen)
+        return __atomic_load_n(&c->imp, __ATOMIC_RELAXED);
+    IMP imp = class_getMethodImplementation(c->super, c->selector);
+    /* One filler at a time, else a slow one could store a stale IMP after
+     * a newer one had been marked current. */
+    if (__atomic_load_n(&objc_generation_valid, __ATOMIC_RELAXED) &&
+        cached != SUPER_IMP_BUSY &&
+        __atomic_compare_exchange_n(&c->generation, &cached, SUPER_IMP_BUSY,
+                                    false, __ATOMIC_ACQUIRE,
+                                    __ATOMIC_RELAXED)) {
+        __atomic_store_n(&c->imp, imp, __ATOMIC_RELAXED);
+        __atomic_store_n(&c->generation, gen, __ATOMIC_RELEASE);
+    }
+    return imp;
+}
+
+static void free_entry_data(struct tramp_info_page_entry *entry) {
+    if (entry->func == (void *) cached_super_imp) {
+        free(entry->arg1);
+        entry->func = NULL;
+    }
+}
+
+/* with tramp_mutex held */
+static void free_trampoline_locked(void *tramp) {
     void *page = (void *) (((uintptr_t) tramp) & ~(_PAGE_SIZE - 1));
     size_t i = (tramp - page) / TRAMPOLINE_SIZE;
     struct tramp_info_page_entry *entries = page + _PAGE_SIZE;
@@ -135,6 +195,7 @@ static void free_trampoline(void *tramp) {
         return;
     }
 
+    free_entry_data(entry);
     entry->next_free = header->first_free;
     header->first_free = entry;
     header->nfree++;
@@ -146,16 +207,218 @@ static void free_trampoline(void *tramp) {
          LIST_NEXT(header, free_pages))) {
         /* free the trampoline and info pages */
         LIST_REMOVE(header, free_pages);
+        LIST_REMOVE(header, all_pages);
         munmap(page, 2 * _PAGE_SIZE);
     }
+}
+
+void objc_enum_memory(memory_region_callback callback, void *ctx) {
+    pthread_mutex_lock(&tramp_mutex);
+    struct tramp_info_page_header *header;
+    LIST_FOREACH(header, &tramp_all_page_list, all_pages) {
+        /* (trampolines sitting in some thread's cache count as used) */
+        size_t nused = TRAMPOLINES_PER_PAGE - header->nfree;
+        uintptr_t page = ((uintptr_t) header) & ~(_PAGE_SIZE - 1);
+        callback(ctx, SUBSTITUTE_MEMORY_OBJC_TRAMPOLINES, page - _PAGE_SIZE,
+                 2 * _PAGE_SIZE,
+                 nused * (TRAMPOLINE_SIZE +
+                          sizeof(struct tramp_info_page_entry)));
+    }
+    pthread_mutex_unlock(&tramp_mutex);
+}
+
+/* Each thread keeps a few free trampolines of its own, so creating and freeing
+ * IMPs only takes tramp_mutex to refill or drain the cache a batch at a time.
+ * Cached trampolines still count as allocated in their page's header, so the
+ * page layout (and the check in free_trampoline_locked) is unchanged. */
+#define TRAMP_CACHE_SIZE 32
+#define TRAMP_CACHE_BATCH 16
+struct tramp_cache {
+    size_t n;
+    void *tramps[TRAMP_CACHE_SIZE];
+};
+static pthread_key_t tramp_cache_key;
+static pthread_once_t tramp_cache_once = PTHREAD_ONCE_INIT;
 
+static void tramp_cache_drain(struct tramp_cache *cache, size_t keep) {
+    pthread_mutex_lock(&tramp_mutex);
+    while (cache->n > keep)
+        free_trampoline_locked(cache->tramps[--cache->n]);
     pthread_mutex_unlock(&tramp_mutex);
 }
 
+static void tramp_cache_thread_exited(void *ptr) {
+    struct tramp_cache *cache = ptr;
+    tramp_cache_drain(cache, 0);
+    free(cache);
+}
+
+static void make_tramp_cache_key() {
+    if (pthread_key_create(&tramp_cache_key, tramp_cache_thread_exited))
+        substitute_panic("%s: pthread_key_create failed\n", __func__);
+}
+
+static struct tramp_cache *get_tramp_cache() {
+    pthread_once(&tramp_cache_once, make_tramp_cache_key);
+    struct tramp_cache *cache = pthread_getspecific(tramp_cache_key);
+    if (!cache && (cache = calloc(1, sizeof(*cache))))
+        pthread_setspecific(tramp_cache_key, cache);
+    return cache;
+}
+
+static int get_trampoline(void *func, void *arg1, void *arg2, void *tramp_ptr) {
+    struct tramp_cache *cache = get_tramp_cache();
+    if (!cache)
+        return SUBSTITUTE_ERR_OOM;
+    if (!cache->n) {
+        int ret = SUBSTITUTE_OK, rerrno = 0;
+        pthread_mutex_lock(&tramp_mutex);
+        while (cache->n < TRAMP_CACHE_BATCH) {
+            if ((ret = get_trampoline_locked(NULL, NULL, NULL,
+                                             &cache->tramps[cache->n]))) {
+                rerrno = errno;
+                break;
+            }
+            cache->n++;
+        }
+        pthread_mutex_unlock(&tramp_mutex);
+        /* a partial batch is fine */
+        if (!cache->n) {
+            errno = rerrno;
+            return ret;
+        }
+    }
+    void *tramp = cache->tramps[--cache->n];
+    void *page = (void *) (((uintptr_t) tramp) & ~(_PAGE_SIZE - 1));
+    struct tramp_info_page_entry *entry =
+        (struct tramp_info_page_entry *) (page + _PAGE_SIZE) +
+        (tramp - page) / TRAMPOLINE_SIZE;
+    entry->func = func;
+    entry->arg1 = arg1;
+    entry->arg2 = arg2;
+    *(void **) tramp_ptr = tramp;
+    return SUBSTITUTE_OK;
+}
+
+static void free_trampoline(void *tramp) {
+    void *page = (void *) (((uintptr_t) tramp) & ~(_PAGE_SIZE - 1));
+    struct tramp_info_page_header *header = page + 2 * _PAGE_SIZE - sizeof(*header);
+    if (header->magic != TRAMP_MAGIC)
+        substitute_panic("%s: bad pointer\n", __func__);
+    struct tramp_cache *cache = get_tramp_cache();
+    if (!cache || header->version != TRAMP_VERSION) {
+        pthread_mutex_lock(&tramp_mutex);
+        free_trampoline_locked(tramp);
+        pthread_mutex_unlock(&tramp_mutex);
+        return;
+    }
+    free_entry_data((struct tramp_info_page_entry *) (page + _PAGE_SIZE) +
+                    (tramp - page) / TRAMPOLINE_SIZE);
+    if (cache->n == TRAMP_CACHE_SIZE)
+        tramp_cache_drain(cache, TRAMP_CACHE_SIZE - TRAMP_CACHE_BATCH);
+    cache->tramps[cache->n++] = tramp;
+}
+
+static BOOL (*old_class_addMethod)(Class, SEL, IMP, const char *);
+static BOOL my_class_addMethod(Class c, SEL s, IMP i, const char *t) {
+    BOOL ret = old_class_addMethod(c, s, i, t);
+    bump_objc_generation();
+    return ret;
+}
+static IMP (*old_class_replaceMethod)(Class, SEL, IMP, const char *);
+static IMP my_class_replaceMethod(Class c, SEL s, IMP i, const char *t) {
+    IMP ret = old_class_replaceMethod(c, s, i, t);
+    bump_objc_generation();
+    return ret;
+}
+static IMP (*old_method_setImplementation)(Method, IMP);
+static IMP my_method_setImplementation(Method m, IMP i) {
+    IMP ret = old_method_setImplementation(m, i);
+    bump_objc_generation();
+    return ret;
+}
+static void (*old_method_exchangeImplementations)(Method, Method);
+static void my_method_exchangeImplementations(Method m1, Method m2) {
+    old_method_exchangeImplementations(m1, m2);
+    bump_objc_generation();
+}
+
+static void objc_image_added(UNUSED const struct mach_header *mh,
+                             UNUSED intptr_t slide) {
+    bump_objc_generation();
+}
+
+static void watch_objc_runtime() {
+    /* set up front, since a hooked import can be called before the hook
+     * call has stored them */
+    old_class_addMethod = class_addMethod;
+    old_class_replaceMethod = class_replaceMethod;
+    old_method_setImplementation = method_setImplementation;
+    old_method_exchangeImplementations = method_exchangeImplementations;
+    struct substitute_import_hook hooks[] = {
+        {"_class_addMethod", my_class_addMethod, &old_class_addMethod},
+        {"_class_replaceMethod", my_class_replaceMethod,
+         &old_class_replaceMethod},
+        {"_method_setImplementation", my_method_setImplementation,
+         &old_method_setImplementation},
+        {"_method_exchangeImplementations", my_method_exchangeImplementations,
+         &old_method_exchangeImplementations},
+    };
+    if (substitute_interpose_imports_all(hooks, sizeof(hooks) / sizeof(*hooks),
+                                         NULL))
+        return;
+    _dyld_register_func_for_add_image(objc_image_added);
+    __atomic_store_n(&objc_generation_valid, true, __ATOMIC_RELEASE);
+}
+
+/* not with tramp_mutex held, since this can take dyld's lock */
+static void start_watching_objc_runtime() {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, watch_objc_runtime);
+}
+
+EXPORT
+void substitute_set_objc_super_imp_cache(bool enabled) {
+    if (enabled)
+        start_watching_objc_runtime();
+    __atomic_store_n(&objc_super_imp_cache_enabled, enabled, __ATOMIC_RELEASE);
+}
+
+/* A trampoline calling the superclass's implementation of 'selector'. */
+static int get_super_trampoline(Class super, SEL selector, bool locked,
+                                void *tramp_ptr) {
+    if (!__atomic_load_n(&objc_super_imp_cache_enabled, __ATOMIC_ACQUIRE)) {
+        return locked ?
+            get_trampoline_locked(class_getMethodImplementation, super,
+                                  selector, tramp_ptr) :
+            get_trampoline(class_getMethodImplementation, super, selector,
+                           tramp_ptr);
+    }
+    struct super_imp_cache *c = malloc(sizeof(*c));
+    if (!c)
+        return SUBSTITUTE_ERR_OOM;
+    c->super = super;
+    c->selector = selector;
+    c->imp = NULL;
+    c->generation = 0;
+    int ret = locked ?
+        get_trampoline_locked(cached_super_imp, c, NULL, tramp_ptr) :
+        get_trampoline(cached_super_imp, c, NULL, tramp_ptr);
+    if (ret)
+        free(c);
+    return ret;
+}
+
 static IMP dereference(IMP *old_ptr, UNUSED void *_) {
     return *old_ptr;
 }
 
+/* if so, class_replaceMethod will add rather than replace */
+static bool method_is_inherited(Class class, SEL selector, Method meth) {
+    Class super = class_getSuperclass(class);
+    return super && class_getInstanceMethod(super, selector) == meth;
+}
+
 EXPORT
 int substitute_hook_objc_message(Class class, SEL selector, void *replacement,
                                  void *old_ptr, bool *created_imp_ptr) {
@@ -170,15 +433,24 @@ int substitute_hook_objc_message(Class class, SEL selector, void *replacement,
     if (created_imp_ptr)
         *created_imp_ptr = false;
 
-    /* temporary trampoline just tries again */
+    /* Until class_replaceMethod returns, a call to the replacement might see
+     * old_ptr.  If the class has the method itself, the current
+     * implementation will do; if it's inherited, there's nothing to put
+     * there yet, so a temporary trampoline just tries again. */
     IMP temp = NULL;
     if (old_ptr) {
-        if ((ret = get_trampoline(dereference, old_ptr, NULL, &temp)))
-            return ret;
-        *(void **) old_ptr = make_sym_callable(temp);
+        if (method_is_inherited(class, selector, meth)) {
+            if ((ret = get_trampoline(dereference, old_ptr, NULL, &temp)))
+                return ret;
+            *(void **) old_ptr = make_sym_callable(temp);
+        } else {
+            __atomic_store_n((IMP *) old_ptr, method_getImplementation(meth),
+                             __ATOMIC_RELEASE);
+        }
     }
 
     IMP old = class_replaceMethod(class, selector, make_sym_callable(replacement), types);
+    bump_objc_generation();
     if (old) {
         if (old_ptr)
             *(IMP *) old_ptr = old;
@@ -194,8 +466,8 @@ int substitute_hook_objc_message(Class class, SEL selector, void *replacement,
                                  __func__);
             }
             void *unsigned_ptr = 0;
-            ret = get_trampoline(class_getMethodImplementation, super,
-                                 selector, &unsigned_ptr);
+            ret = get_super_trampoline(super, selector, false,
+                                       &unsigned_ptr);
             *(void **)old_ptr = make_sym_callable(unsigned_ptr);
             if (created_imp_ptr)
                 *created_imp_ptr = true;
@@ -207,6 +479,309 @@ int substitute_hook_objc_message(Class class, SEL selector, void *replacement,
     return SUBSTITUTE_OK;
 }
 
+struct objc_hook_plan {
+    const struct substitute_objc_hook *hook;
+    Method meth;
+    const char *types;
+    /* preallocated if the method looked inherited: the temporary dereference
+     * trampoline and the superclass-call one */
+    IMP temp;
+    void *super_tramp;
+};
+
+static int compare_objc_hook_plans(const void *a, const void *b) {
+    const struct objc_hook_plan *pa = a, *pb = b;
+    uintptr_t ca = (uintptr_t) pa->hook->klass, cb = (uintptr_t) pb->hook->klass;
+    if (ca != cb)
+        return ca < cb ? -1 : 1;
+    /* otherwise keep the caller's order */
+    return pa->hook < pb->hook ? -1 : pa->hook > pb->hook;
+}
+
+EXPORT
+int substitute_hook_objc_messages(const struct substitute_objc_hook *hooks,
+                                  size_t nhooks) {
+    int ret = SUBSTITUTE_OK;
+    struct objc_hook_plan *plans = calloc(nhooks, sizeof(*plans));
+    if (nhooks && !plans)
+        return SUBSTITUTE_ERR_OOM;
+
+    /* Check everything first, so a typo doesn't leave half the hooks in. */
+    for (size_t i = 0; i < nhooks; i++) {
+        const struct substitute_objc_hook *h = &hooks[i];
+        Method meth = class_getInstanceMethod(h->klass, h->selector);
+        if (meth == NULL) {
+            LOG("Attempted to hook non-existant selector \"%s\" in class \"%s\"", sel_getName(h->selector), class_getName(h->klass));
+            ret = SUBSTITUTE_ERR_NO_SUCH_SELECTOR;
+            goto out;
+        }
+        plans[i].hook = h;
+        plans[i].meth = meth;
+        plans[i].types = method_getTypeEncoding(meth);
+        if (h->created_imp_ptr)
+            *h->created_imp_ptr = false;
+    }
+
+    pthread_mutex_lock(&tramp_mutex);
+    for (size_t i = 0; i < nhooks; i++) {
+        const struct substitute_objc_hook *h = plans[i].hook;
+        if (!h->old_ptr ||
+            !method_is_inherited(h->klass, h->selector, plans[i].meth))
+            continue;
+        if ((ret = get_trampoline_locked(dereference, h->old_ptr, NULL,
+                                         &plans[i].temp)) ||
+            (ret = get_super_trampoline(class_getSuperclass(h->klass),
+                                        h->selector, true,
+                                        &plans[i].super_tramp)))
+            break;
+    }
+    if (ret) {
+        for (size_t i = 0; i < nhooks; i++) {
+            if (plans[i].temp)
+                free_trampoline_locked(plans[i].temp);
+            if (plans[i].super_tramp)
+                free_trampoline_locked(plans[i].super_tramp);
+        }
+        pthread_mutex_unlock(&tramp_mutex);
+        goto out;
+    }
+    pthread_mutex_unlock(&tramp_mutex);
+
+    /* Each class_replaceMethod flushes the class's method cache (and its
+     * subclasses'); doing a class's methods back to back means the flushes
+     * after the first find it already empty, rather than refilled by calls
+     * in between. */
+    qsort(plans, nhooks, sizeof(*plans), compare_objc_hook_plans);
+    for (size_t i = 0; i < nhooks; i++) {
+        struct objc_hook_plan *plan = &plans[i];
+        const struct substitute_objc_hook *h = plan->hook;
+        /* see substitute_hook_objc_message */
+        if (plan->temp)
+            *(void **) h->old_ptr = make_sym_callable(plan->temp);
+        else if (h->old_ptr)
+            __atomic_store_n((IMP *) h->old_ptr,
+                             method_getImplementation(plan->meth),
+                             __ATOMIC_RELEASE);
+        IMP old = class_replaceMethod(h->klass, h->selector,
+                                      make_sym_callable(h->replacement),
+                                      plan->types);
+        bump_objc_generation();
+        if (!h->old_ptr)
+            continue;
+        if (old) {
+            *(IMP *) h->old_ptr = old;
+            continue;
+        }
+        if (!plan->super_tramp) {
+            /* it was added to the superclass in the meantime */
+            Class super = class_getSuperclass(h->klass);
+            if (!super)
+                substitute_panic("%s: no superclass but the method didn't exist\n",
+                                 __func__);
+            if (get_super_trampoline(super, h->selector, false,
+                                     &plan->super_tramp))
+                substitute_panic("%s: couldn't allocate a trampoline\n",
+                                 __func__);
+        }
+        *(void **) h->old_ptr = make_sym_callable(plan->super_tramp);
+        plan->super_tramp = NULL;
+        if (h->created_imp_ptr)
+            *h->created_imp_ptr = true;
+    }
+
+    pthread_mutex_lock(&tramp_mutex);
+    for (size_t i = 0; i < nhooks; i++) {
+        if (plans[i].temp)
+            free_trampoline_locked(plans[i].temp);
+        /* not needed after all */
+        if (plans[i].super_tramp)
+            free_trampoline_locked(plans[i].super_tramp);
+    }
+    pthread_mutex_unlock(&tramp_mutex);
+out:
+    free(plans);
+    return ret;
+}
+
+/* Lazy hooks waiting for their class to show up, by class name.  A class
+ * that isn't loaded yet gets looked up (and so realized) only once an image
+ * that has it is loaded, and then all its pending hooks go in together. */
+struct lazy_objc_hook {
+    SEL selector;
+    void *replacement;
+    void *old_ptr;
+    bool *created_imp_ptr;
+};
+DECL_VEC(struct lazy_objc_hook, lazy_objc_hook);
+struct lazy_objc_class {
+    char *name;
+    VEC_STORAGE(lazy_objc_hook) hooks;
+};
+static inline size_t class_name_hash(const char *const *np) {
+    size_t hash = 2166136261;
+    for (const char *p = *np; *p; p++)
+        hash = (hash ^ (uint8_t) *p) * 16777619;
+    return hash;
+}
+#define class_name_eq(n1p, n2p) (!strcmp(*(n1p), *(n2p)))
+#define class_name_null(np) (!*(np))
+DECL_STATIC_HTAB_KEY(class_name, const char *, class_name_hash, class_name_eq,
+                     class_name_null, 0);
+DECL_HTAB(lazy_objc_classes, class_name, struct lazy_objc_class *);
+static HTAB_STORAGE(lazy_objc_classes) lazy_classes =
+    HTAB_STORAGE_INIT_STATIC(&lazy_classes, lazy_objc_classes);
+static pthread_mutex_t lazy_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Images that loaded while hooks were pending.  Hooking from inside dyld's
+ * callback would run the runtime (and maybe dyld, for a first trampoline
+ * page) under dyld's lock, so the callback only queues the path, and the
+ * classes are looked up and hooked from a dispatch queue. */
+struct lazy_image {
+    STAILQ_ENTRY(lazy_image) link;
+    char path[];
+};
+static STAILQ_HEAD(lazy_image_list, lazy_image)
+    lazy_images = STAILQ_HEAD_INITIALIZER(lazy_images);
+static bool lazy_drain_scheduled;
+
+/* Take the class's pending hooks, if any are still there. */
+static struct lazy_objc_class *claim_lazy_class(const char *name) {
+    pthread_mutex_lock(&lazy_mutex);
+    struct htab_bucket_lazy_objc_classes *bucket =
+        htab_getbucket_lazy_objc_classes(&lazy_classes.h, &name);
+    struct lazy_objc_class *lc = NULL;
+    if (bucket) {
+        lc = bucket->value;
+        htab_removeat_lazy_objc_classes(&lazy_classes.h, bucket);
+    }
+    pthread_mutex_unlock(&lazy_mutex);
+    return lc;
+}
+
+static int install_lazy_class(struct lazy_objc_class *lc, Class class) {
+    size_t n = lc->hooks.v.length;
+    struct substitute_objc_hook *hooks = malloc(n * sizeof(*hooks));
+    int ret = SUBSTITUTE_ERR_OOM;
+    if (hooks) {
+        for (size_t i = 0; i < n; i++) {
+            struct lazy_objc_hook *lh = &lc->hooks.v.els[i];
+            hooks[i] = (struct substitute_objc_hook) {
+                class, lh->selector, lh->replacement, lh->old_ptr,
+                lh->created_imp_ptr
+            };
+        }
+        ret = substitute_hook_objc_messages(hooks, n);
+        free(hooks);
+    }
+    if (ret)
+        LOG("Couldn't install lazy hooks for class \"%s\": %s", lc->name, substitute_strerror(ret));
+    vec_free_storage_lazy_objc_hook(&lc->hooks.v);
+    free(lc->name);
+    free(lc);
+    return ret;
+}
+
+static void install_lazy_image(const char *path) {
+    /* just names, without realizing anything */
+    unsigned count;
+    const char **names = objc_copyClassNamesForImage(path, &count);
+    if (!names)
+        return;
+    for (unsigned i = 0; i < count; i++) {
+        struct lazy_objc_class *lc = claim_lazy_class(names[i]);
+        if (lc)
+            install_lazy_class(lc, objc_getClass(names[i]));
+    }
+    free(names);
+}
+
+static void drain_lazy_images(UNUSED void *_) {
+    while (1) {
+        pthread_mutex_lock(&lazy_mutex);
+        struct lazy_image *li = STAILQ_FIRST(&lazy_images);
+        if (!li) {
+            lazy_drain_scheduled = false;
+            pthread_mutex_unlock(&lazy_mutex);
+            return;
+        }
+        STAILQ_REMOVE_HEAD(&lazy_images, link);
+        pthread_mutex_unlock(&lazy_mutex);
+        install_lazy_image(li->path);
+        free(li);
+    }
+}
+
+static void lazy_image_added(const struct mach_header *mh,
+                             UNUSED intptr_t slide) {
+    pthread_mutex_lock(&lazy_mutex);
+    bool any = lazy_classes.h.length != 0;
+    pthread_mutex_unlock(&lazy_mutex);
+    Dl_info info;
+    if (!any || !dladdr(mh, &info) || !info.dli_fname)
+        return;
+    size_t len = strlen(info.dli_fname) + 1;
+    struct lazy_image *li = malloc(sizeof(*li) + len);
+    if (!li) {
+        LOG("Couldn't queue lazy hooks for image \"%s\"", info.dli_fname);
+        return;
+    }
+    memcpy(li->path, info.dli_fname, len);
+    pthread_mutex_lock(&lazy_mutex);
+    STAILQ_INSERT_TAIL(&lazy_images, li, link);
+    bool schedule = !lazy_drain_scheduled;
+    lazy_drain_scheduled = true;
+    pthread_mutex_unlock(&lazy_mutex);
+    if (schedule)
+        dispatch_async_f(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH,
+                                                   0),
+                         NULL, drain_lazy_images);
+}
+
+static void register_lazy_image_added() {
+    /* dyld calls it for every image already loaded, too, but nothing is
+     * pending yet */
+    _dyld_register_func_for_add_image(lazy_image_added);
+}
+
+EXPORT
+int substitute_hook_objc_message_lazy(const char *class_name, SEL selector,
+                                      void *replacement, void *old_ptr,
+                                      bool *created_imp_ptr) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    struct lazy_objc_hook lh = {selector, replacement, old_ptr,
+                                created_imp_ptr};
+    /* before anything is pending, so no image can be missed */
+    pthread_once(&once, register_lazy_image_added);
+    pthread_mutex_lock(&lazy_mutex);
+    struct htab_bucket_lazy_objc_classes *bucket =
+        htab_setbucket_lazy_objc_classes(&lazy_classes.h, &class_name);
+    if (!bucket->key) {
+        struct lazy_objc_class *lc = malloc(sizeof(*lc));
+        char *name = strdup(class_name);
+        if (!lc || !name) {
+            free(lc);
+            free(name);
+            htab_removeat_lazy_objc_classes(&lazy_classes.h, bucket);
+            pthread_mutex_unlock(&lazy_mutex);
+            return SUBSTITUTE_ERR_OOM;
+        }
+        lc->name = name;
+        VEC_STORAGE_INIT(&lc->hooks, lazy_objc_hook);
+        /* the key has to outlive the caller's string */
+        bucket->key = name;
+        bucket->value = lc;
+    }
+    vec_append_lazy_objc_hook(&bucket->value->hooks.v, lh);
+    pthread_mutex_unlock(&lazy_mutex);
+
+    /* Already loaded?  (Checked after adding it, so that an image loading
+     * concurrently either sees it pending or is already visible here.) */
+    Class class = objc_lookUpClass(class_name);
+    if (!class)
+        return SUBSTITUTE_OK;
+    struct lazy_objc_class *lc = claim_lazy_class(class_name);
+    return lc ? install_lazy_class(lc, class) : SUBSTITUTE_OK;
+}
+
 EXPORT
 void substitute_free_created_imp(IMP imp) {
     free_trampoline(imp);
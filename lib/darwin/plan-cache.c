@@ -0,0 +1,200 @@
+#ifdef __APPLE__
+
+#include "substitute-internal.h"
+#include "plan-cache.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <mach-o/loader.h>
+
+/* The file is a fixed size open addressing table, mapped shared by every
+ * process using it.  Writers don't lock; instead each entry has a checksum,
+ * so a torn or garbage entry just reads as a miss. */
+#define PLAN_CACHE_DIR "/var/tmp"
+#define PLAN_CACHE_MAGIC 0x6e6c7073 /* 'spln' */
+#define PLAN_CACHE_VERSION 2
+#define PLAN_CACHE_ENTRIES 8192
+#define PLAN_CACHE_PROBES 8
+
+struct plan_cache_entry {
+    uint8_t uuid[16];
+    uint32_t offset;
+    uint8_t arch;
+    uint8_t variant;
+    uint8_t patch_size;
+    uint8_t region_size;
+    /* 0 for an empty entry */
+    uint32_t check;
+    uint32_t pad;
+};
+
+struct plan_cache_file {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nentries;
+    uint32_t pad;
+    struct plan_cache_entry entries[PLAN_CACHE_ENTRIES];
+};
+
+#if defined(TARGET_x86_64)
+#define PLAN_CACHE_ARCH 1
+#elif defined(TARGET_i386)
+#define PLAN_CACHE_ARCH 2
+#elif defined(TARGET_arm64)
+#define PLAN_CACHE_ARCH 3
+#elif defined(TARGET_arm)
+#define PLAN_CACHE_ARCH 4
+#endif
+
+static pthread_once_t g_plan_cache_once = PTHREAD_ONCE_INIT;
+static struct plan_cache_file *g_plan_cache;
+
+/* the image the last lookup was in, since hooks tend to come in batches from
+ * the same library */
+static const void *g_last_image;
+static uint8_t g_last_uuid[16];
+
+static void plan_cache_open() {
+    char path[64];
+    snprintf(path, sizeof(path), PLAN_CACHE_DIR "/substitute-plan-cache.%d",
+             (int) getuid());
+    int fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0644);
+    if (fd == -1)
+        return;
+    struct stat st;
+    /* anyone can create files in /var/tmp; only trust our own */
+    if (fstat(fd, &st) || st.st_uid != geteuid() || !S_ISREG(st.st_mode))
+        goto out;
+    if (st.st_size != sizeof(struct plan_cache_file) &&
+        ftruncate(fd, sizeof(struct plan_cache_file)))
+        goto out;
+    void *map = mmap(NULL, sizeof(struct plan_cache_file),
+                     PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        goto out;
+    struct plan_cache_file *file = map;
+    if (file->magic != PLAN_CACHE_MAGIC ||
+        file->version != PLAN_CACHE_VERSION ||
+        file->nentries != PLAN_CACHE_ENTRIES) {
+        /* new or from some other version; start over */
+        memset(file->entries, 0, sizeof(file->entries));
+        file->version = PLAN_CACHE_VERSION;
+        file->nentries = PLAN_CACHE_ENTRIES;
+        __atomic_store_n(&file->magic, PLAN_CACHE_MAGIC, __ATOMIC_RELEASE);
+    }
+    g_plan_cache = file;
+out:
+    close(fd);
+}
+
+static bool image_uuid(const void *code, uint8_t uuid[16], uint32_t *offset_p) {
+    Dl_info info;
+    if (!dladdr(code, &info) || !info.dli_fbase)
+        return false;
+    uintptr_t offset = (uintptr_t) code - (uintptr_t) info.dli_fbase;
+    if (offset != (uint32_t) offset)
+        return false;
+    *offset_p = (uint32_t) offset;
+    if (info.dli_fbase == g_last_image) {
+        memcpy(uuid, g_last_uuid, 16);
+        return true;
+    }
+    const mach_header_x *mh = info.dli_fbase;
+    const struct load_command *lc = (void *) (mh + 1);
+    for (uint32_t i = 0; i < mh->ncmds; i++) {
+        if (lc->cmd == LC_UUID) {
+            const struct uuid_command *uc = (void *) lc;
+            memcpy(uuid, uc->uuid, 16);
+            memcpy(g_last_uuid, uc->uuid, 16);
+            g_last_image = info.dli_fbase;
+            return true;
+        }
+        lc = (void *) lc + lc->cmdsize;
+    }
+    return false;
+}
+
+static uint32_t fnv1a(const void *buf, size_t len, uint32_t h) {
+    const uint8_t *p = buf;
+    while (len--)
+        h = (h ^ *p++) * 16777619;
+    return h;
+}
+
+static uint32_t entry_check(const struct plan_cache_entry *e) {
+    return fnv1a(e, offsetof(struct plan_cache_entry, check), 2166136261) | 1;
+}
+
+/* Fill in the key fields of *key and return the first slot to probe. */
+static bool make_key(const void *code, unsigned variant, size_t patch_size,
+                     struct plan_cache_entry *key, size_t *slot_p) {
+    pthread_once(&g_plan_cache_once, plan_cache_open);
+    if (!g_plan_cache)
+        return false;
+    memset(key, 0, sizeof(*key));
+    if (!image_uuid(code, key->uuid, &key->offset))
+        return false;
+    key->arch = PLAN_CACHE_ARCH;
+    key->variant = variant;
+    key->patch_size = patch_size;
+    *slot_p = fnv1a(key, offsetof(struct plan_cache_entry, region_size),
+                    2166136261) % PLAN_CACHE_ENTRIES;
+    return true;
+}
+
+static bool same_key(const struct plan_cache_entry *a,
+                     const struct plan_cache_entry *b) {
+    return !memcmp(a, b, offsetof(struct plan_cache_entry, region_size));
+}
+
+bool plan_cache_lookup(const void *code, unsigned variant, size_t patch_size,
+                       size_t *region_size_p) {
+    struct plan_cache_entry key;
+    size_t slot;
+    if (!make_key(code, variant, patch_size, &key, &slot))
+        return false;
+    for (int i = 0; i < PLAN_CACHE_PROBES; i++) {
+        struct plan_cache_entry e;
+        memcpy(&e, &g_plan_cache->entries[(slot + i) % PLAN_CACHE_ENTRIES],
+               sizeof(e));
+        if (!e.check)
+            return false;
+        if (e.check == entry_check(&e) && same_key(&e, &key)) {
+            *region_size_p = e.region_size;
+            return true;
+        }
+    }
+    return false;
+}
+
+void plan_cache_store(const void *code, unsigned variant, size_t patch_size,
+                      size_t region_size) {
+    struct plan_cache_entry key;
+    size_t slot;
+    if (!make_key(code, variant, patch_size, &key, &slot))
+        return;
+    key.region_size = region_size;
+    key.check = entry_check(&key);
+    /* the first empty or matching slot, else evict the first one */
+    struct plan_cache_entry *dst = &g_plan_cache->entries[slot];
+    for (int i = 0; i < PLAN_CACHE_PROBES; i++) {
+        struct plan_cache_entry *e =
+            &g_plan_cache->entries[(slot + i) % PLAN_CACHE_ENTRIES];
+        if (!e->check || same_key(e, &key)) {
+            dst = e;
+            break;
+        }
+    }
+    __atomic_store_n(&dst->check, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(dst, &key, offsetof(struct plan_cache_entry, check));
+    __atomic_store_n(&dst->check, key.check, __ATOMIC_RELEASE);
+}
+
+#endif /* __APPLE__ */
@@ -1,5 +1,6 @@
 #include "darwin/read.h"
-bool read_leb128(void **ptr, void *end, bool is_signed, uint64_t *out) {
+#include <mach-o/loader.h>
+bool read_leb128_slow(void **ptr, void *end, bool is_signed, uint64_t *out) {
     uint64_t result = 0;
     uint8_t *p = *ptr;
     uint8_t bit;
@@ -20,3 +21,67 @@ bool read_leb128(void **ptr, void *end, bool is_signed, uint64_t *out) {
         *out = result;
     return true;
 }
+
+bool find_export_symbol(const void *export, size_t export_size,
+                        const char *name, uint64_t hdr_addr,
+                        uint64_t *sym_addr_p) {
+    void *end = (void *) export + export_size;
+    void *ptr = (void *) export;
+    while (1) {
+        /* skip this symbol data */
+        uint64_t size;
+        if (!read_leb128(&ptr, end, false, &size) ||
+            size > (uint64_t) (end - ptr))
+            return false;
+        ptr += size;
+        if (ptr == end)
+            return false;
+        uint8_t i, nedges = *(uint8_t *) ptr;
+        ptr++;
+        for (i = 0; i < nedges; i++) {
+            char *prefix;
+            if (!read_cstring(&ptr, end, &prefix))
+                return false;
+            size_t prefix_len = (char *) ptr - prefix - 1;
+            uint64_t next_offset;
+            if (!read_leb128(&ptr, end, false, &next_offset))
+                return false;
+            if (!strncmp(name, prefix, prefix_len)) {
+                if (next_offset > export_size)
+                    return false;
+                ptr = (void *) export + next_offset;
+                name += prefix_len;
+                if (*name == '\0')
+                    goto got_symbol;
+                break;
+            }
+        }
+        if (i == nedges) {
+            /* not found */
+            return false;
+        }
+    }
+got_symbol:;
+    uint64_t size, flags, hdr_off;
+    if (!read_leb128(&ptr, end, false, &size))
+        return false;
+    if (size == 0) {
+        /* only a prefix of other exports */
+        return false;
+    }
+    if (!read_leb128(&ptr, end, false, &flags))
+        return false;
+    if (flags & (EXPORT_SYMBOL_FLAGS_REEXPORT |
+                 EXPORT_SYMBOL_FLAGS_STUB_AND_RESOLVER)) {
+        /* don't bother to support for now */
+        return false;
+    }
+    uint64_t kind = flags & EXPORT_SYMBOL_FLAGS_KIND_MASK;
+    if (kind == EXPORT_SYMBOL_FLAGS_KIND_THREAD_LOCAL)
+        return false;
+    if (!read_leb128(&ptr, end, false, &hdr_off))
+        return false;
+    *sym_addr_p = kind == EXPORT_SYMBOL_FLAGS_KIND_ABSOLUTE ?
+                  hdr_off : hdr_addr + hdr_off;
+    return true;
+}
@@ -3,7 +3,49 @@
 #include <stdint.h>
 #include <stdbool.h>
 
-bool read_leb128(void **ptr, void *end, bool is_signed, uint64_t *out);
+bool read_leb128_slow(void **ptr, void *end, bool is_signed, uint64_t *out);
+
+/* Nearly every LEB128 in bind opcodes and export tries is one or two bytes,
+ * so those are decoded from a single (unaligned, little endian) load without
+ * looping; anything longer, or too close to the end to load 8 bytes, goes to
+ * read_leb128_slow. */
+static inline bool read_leb128(void **ptr, void *end, bool is_signed,
+                               uint64_t *out) {
+    uint8_t *p = *ptr;
+    if ((uint8_t *) end - p >= 8) {
+        uint64_t w;
+        memcpy(&w, p, sizeof(w));
+        uint64_t result;
+        unsigned int len;
+        if (!(w & 0x80)) {
+            result = w & 0x7f;
+            len = 1;
+        } else if (!(w & 0x8000)) {
+            result = (w & 0x7f) | ((w >> 1) & 0x3f80);
+            len = 2;
+        } else {
+            goto slow;
+        }
+        if (is_signed) {
+            /* sign extend from bit 7*len - 1 */
+            unsigned int shift = 64 - 7 * len;
+            result = (uint64_t) ((int64_t) (result << shift) >> shift);
+        }
+        *ptr = p + len;
+        if (out)
+            *out = result;
+        return true;
+    }
+slow:
+    return read_leb128_slow(ptr, end, is_signed, out);
+}
+
+/* Look 'name' up in an export trie (LC_DYLD_INFO's export_off or
+ * LC_DYLD_EXPORTS_TRIE) of the image at hdr_addr.  Re-exports, resolvers and
+ * thread-locals aren't supported and just aren't found. */
+bool find_export_symbol(const void *export, size_t export_size,
+                        const char *name, uint64_t hdr_addr,
+                        uint64_t *sym_addr_p);
 
 static inline bool read_cstring(void **ptr, void *end, char **out) {
     char *s = *ptr;
@@ -0,0 +1,59 @@
+#include "substitute-internal.h"
+#include "substitute.h"
+#include "stats.h"
+#include "execmem.h"
+#include <pthread.h>
+
+bool g_stats_enabled;
+struct substitute_stats g_stats;
+
+/* for converting ticks to ns: the counter and the time when stats were
+ * enabled */
+static pthread_mutex_t g_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t g_calib_ticks, g_calib_ns;
+
+static uint64_t now_ns() {
+    static mach_timebase_info_data_t tb;
+    if (!tb.denom)
+        mach_timebase_info(&tb);
+    return mach_absolute_time() * tb.numer / tb.denom;
+}
+
+EXPORT
+void substitute_set_stats_enabled(bool enabled) {
+    pthread_mutex_lock(&g_stats_lock);
+    if (enabled && !g_stats_enabled) {
+        g_calib_ticks = stats_ticks();
+        g_calib_ns = now_ns();
+    }
+    __atomic_store_n(&g_stats_enabled, enabled, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&g_stats_lock);
+}
+
+EXPORT
+void substitute_get_stats(struct substitute_stats *stats) {
+    pthread_mutex_lock(&g_stats_lock);
+    uint64_t dticks = stats_ticks() - g_calib_ticks;
+    uint64_t dns = now_ns() - g_calib_ns;
+    double ns_per_tick = dticks ? (double) dns / dticks : 0;
+    pthread_mutex_unlock(&g_stats_lock);
+
+    uint64_t *src = (uint64_t *) &g_stats, *dst = (uint64_t *) stats;
+    for (size_t i = 0; i < sizeof(*stats) / sizeof(uint64_t); i++)
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+#define CONVERT(field) stats->field = (uint64_t) (stats->field * ns_per_tick)
+    CONVERT(transform_dis_ns);
+    CONVERT(jump_dis_ns);
+    CONVERT(trampoline_alloc_ns);
+    CONVERT(stop_threads_ns);
+    CONVERT(get_thread_state_ns);
+    CONVERT(apply_pc_patch_ns);
+    CONVERT(remap_ns);
+    CONVERT(find_syms_ns);
+#undef CONVERT
+
+    size_t used, wasted;
+    execmem_arena_usage(&used, &wasted);
+    stats->trampoline_bytes_used = used;
+    stats->trampoline_bytes_wasted = wasted;
+}
@@ -15,23 +15,14 @@ EXPORT
 void *SubFindSymbol(void *image, const char *name) __asm__("SubFindSymbol");
 void *SubFindSymbol(void *image, const char *name) {
     if (!image) {
-        const char *s = "SubFindSymbol: 'any image' specified, which is incredibly slow - like, 2ms on a fast x86.  I'm going to do it since it seems to be somewhat common, but you should be ashamed of yourself.";
-        LOG("%s", s);
-        fprintf(stderr, "%s\n", s);
-        /* and it isn't thread safe, but neither is MS */
-        for(uint32_t i = 0; i < _dyld_image_count(); i++) {
-            const char *im_name = _dyld_get_image_name(i);
-            struct substitute_image *im = substitute_open_image(im_name);
-            if (!im) {
-                fprintf(stderr, "(btw, couldn't open %s?)\n", im_name);
-                continue;
-            }
-            void *r = SubFindSymbol(im, name);
-            substitute_close_image(im);
-            if (r)
-                return r;
+        bool searched;
+        void *r = find_sym_in_loaded_images(name, &searched);
+        if (searched) {
+            const char *s = "SubFindSymbol: 'any image' specified for a symbol that hasn't been found that way before, which is incredibly slow - like, 2ms on a fast x86.  I'm going to do it since it seems to be somewhat common, but you should be ashamed of yourself.";
+            LOG("%s", s);
+            fprintf(stderr, "%s\n", s);
         }
-        return NULL;
+        return r;
     }
 
     void *ptr;
@@ -68,8 +59,12 @@ void SubHookMemory(void *target, const void *data, size_t size) {
     if (target == NULL || data == NULL) {
         substitute_panic("SubHookMemory: called with a NULL pointer. Don't do that.\n");
     }
-    struct execmem_foreign_write write = {target, data, size};
-    int ret = execmem_foreign_write_with_pc_patch(&write, 1, NULL, NULL);
+    bool queued;
+    int ret = substitute_txn_queue_write(target, data, size, &queued);
+    if (!ret && !queued) {
+        struct execmem_foreign_write write = {target, data, size};
+        ret = execmem_foreign_write_with_pc_patch(&write, 1, NULL, NULL);
+    }
 
     if (ret) {
         substitute_panic("SubHookMemory: execmem_foreign_write_with_pc_patch returned %s\n",
@@ -0,0 +1,505 @@
+#ifdef __APPLE__
+
+#include "substitute.h"
+#include "substitute-internal.h"
+#ifdef TARGET_DIS_SUPPORTED
+#include "jump-dis.h"
+#include "transform-dis.h"
+#include stringify(TARGET_DIR/jump-patch.h)
+#include "darwin/mach-decls.h"
+#include "cbit/vec.h"
+#include "cbit/arena.h"
+#include <mach/mach.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Hooking functions in another task through its port, without loading
+ * anything into it.  Each function is read through a mach_vm_remap view and
+ * goes through the same transform_dis_main, jump_dis_main and make_jump_patch
+ * steps as in hook_functions, with the trampolines assembled here and
+ * written into pages allocated in the target near the functions.  Then,
+ * with the task suspended, threads stopped in a patched region are moved to
+ * the same place in its outro trampoline, and the patches are written with
+ * VM_PROT_COPY, as execmem_foreign_write_with_pc_patch would in-process. */
+
+/* How much of a function to map: the patch region, and as far past it as
+ * jump_dis_main looks when the function's end isn't known. */
+#define TASK_HOOK_WINDOW 4096
+
+struct task_page {
+    mach_vm_address_t addr;
+    size_t used;
+    /* what goes in it, written all at once by flush_task_pages */
+    uint8_t *buf;
+};
+DECL_VEC(struct task_page, task_page);
+
+struct task_hooks {
+    task_t task;
+    VEC_STORAGE_CAPA(task_page, 4) pages;
+};
+
+struct task_hook {
+    mach_vm_address_t code, outro_pc;
+    uint8_t jump_patch[MAX_JUMP_PATCH_SIZE];
+    /* what the jump patch overwrites, to put back if a later one fails */
+    uint8_t orig[MAX_JUMP_PATCH_SIZE];
+    size_t jump_patch_size;
+    size_t patch_region_size;
+    int offset_by_pcdiff[MAX_EXTENDED_PATCH_SIZE + 1];
+};
+
+/* like arena_range_in_reach in execmem.c */
+static bool range_in_reach(uintptr_t lo, uintptr_t hi, uintptr_t hint,
+                           uintptr_t reach) {
+    if (!reach)
+        return true;
+    if (hint >= hi)
+        return hint - lo < reach;
+    else if (hint <= lo)
+        return hi - hint < reach;
+    else
+        return true;
+}
+
+/* The free page in the target closest to hint (and within reach of it), as
+ * last seen - the target can map things in the meantime, so the caller
+ * allocates it with VM_FLAGS_FIXED and looks again on a miss. */
+static bool task_find_hole_near(task_t task, uintptr_t hint, uintptr_t reach,
+                                mach_vm_address_t *addr_p) {
+    mach_vm_address_t addr = 0, prev_end = vm_page_size;
+    uintptr_t best_dist = UINTPTR_MAX;
+    while (1) {
+        mach_vm_size_t size = 0;
+        vm_region_basic_info_data_64_t info;
+        mach_msg_type_number_t count = VM_REGION_BASIC_INFO_COUNT_64;
+        mach_port_t object;
+        bool last = mach_vm_region(task, &addr, &size,
+                                   VM_REGION_BASIC_INFO_64,
+                                   (vm_region_info_t) &info, &count, &object);
+        if (!last)
+            mach_port_deallocate(mach_task_self(), object);
+        mach_vm_address_t hole_end = last ? MACH_VM_MAX_ADDRESS : addr;
+        if (hole_end > prev_end && hole_end - prev_end >= vm_page_size) {
+            mach_vm_address_t cand = hint & ~(vm_page_size - 1);
+            if (cand < prev_end)
+                cand = prev_end;
+            else if (cand > hole_end - vm_page_size)
+                cand = hole_end - vm_page_size;
+            uintptr_t dist = cand > hint ? cand - hint : hint - cand;
+            if (dist < best_dist &&
+                range_in_reach(cand, cand + vm_page_size, hint, reach)) {
+                *addr_p = cand;
+                best_dist = dist;
+            }
+        }
+        if (last || addr + size < addr)
+            break;
+        prev_end = addr + size;
+        addr += size;
+    }
+    return best_dist != UINTPTR_MAX;
+}
+
+/* Room for size bytes of trampoline (16-byte aligned, for
+ * make_retargetable_jump) within reach of hint, in one of our pages or a new
+ * one near hint. */
+static int task_reserve(struct task_hooks *th, uintptr_t hint,
+                        uintptr_t reach, size_t size,
+                        struct task_page **page_p, mach_vm_address_t *pc_p,
+                        void **write_p) {
+    struct vec_task_page *pages = &th->pages.v;
+    size = (size + 15) & ~(size_t) 15;
+    struct task_page *page = NULL;
+    for (size_t i = 0; i < pages->length; i++) {
+        struct task_page *p = &pages->els[i];
+        uintptr_t pc = p->addr + p->used;
+        if (p->used + size <= vm_page_size &&
+            range_in_reach(pc, pc + size, hint, reach)) {
+            page = p;
+            break;
+        }
+    }
+    if (!page) {
+        mach_vm_address_t addr = 0;
+        for (int attempt = 0; ; attempt++) {
+            if (!task_find_hole_near(th->task, hint, reach, &addr))
+                return SUBSTITUTE_ERR_OUT_OF_RANGE;
+            kern_return_t kr = mach_vm_allocate(th->task, &addr, vm_page_size,
+                                                VM_FLAGS_FIXED);
+            if (!kr)
+                break;
+            if (kr != KERN_NO_SPACE || attempt == 1)
+                return SUBSTITUTE_ERR_VM;
+        }
+        uint8_t *buf = calloc(1, vm_page_size);
+        if (!buf) {
+            mach_vm_deallocate(th->task, addr, vm_page_size);
+            return SUBSTITUTE_ERR_OOM;
+        }
+        page = vec_appendp_task_page(pages);
+        *page = (struct task_page) {addr, 0, buf};
+    }
+    *page_p = page;
+    *pc_p = page->addr + page->used;
+    *write_p = page->buf + page->used;
+    page->used += size;
+    return SUBSTITUTE_OK;
+}
+
+static int flush_task_pages(struct task_hooks *th) {
+    struct vec_task_page *pages = &th->pages.v;
+    for (size_t i = 0; i < pages->length; i++) {
+        struct task_page *p = &pages->els[i];
+        if (mach_vm_write(th->task, p->addr, (vm_offset_t) p->buf,
+                          (mach_msg_type_number_t) vm_page_size) ||
+            mach_vm_protect(th->task, p->addr, vm_page_size, FALSE,
+                            VM_PROT_READ | VM_PROT_EXECUTE))
+            return SUBSTITUTE_ERR_VM;
+    }
+    return SUBSTITUTE_OK;
+}
+
+/* Free our copies, and unless keep is set, the pages in the target. */
+static void free_task_pages(struct task_hooks *th, bool keep) {
+    struct vec_task_page *pages = &th->pages.v;
+    for (size_t i = 0; i < pages->length; i++) {
+        if (!keep)
+            mach_vm_deallocate(th->task, pages->els[i].addr, vm_page_size);
+        free(pages->els[i].buf);
+    }
+    vec_free_storage_task_page(pages);
+}
+
+/* An intro trampoline for a function whose replacement is out of reach. */
+static int make_task_intro(struct task_hooks *th, uintptr_t pc, uintptr_t dpc,
+                           uintptr_t reach, struct arch_dis_ctx arch,
+                           uintptr_t *target_p, int *patch_size_p) {
+    struct task_page *page;
+    mach_vm_address_t tpc;
+    void *tw;
+    int ret = task_reserve(th, pc, reach, RETARGETABLE_JUMP_SIZE, &page,
+                           &tpc, &tw);
+    if (ret)
+        return ret;
+    int patch_size = jump_patch_size(pc, tpc, arch, false);
+    if (patch_size == -1) {
+        page->used -= RETARGETABLE_JUMP_SIZE;
+        return SUBSTITUTE_ERR_OUT_OF_RANGE;
+    }
+    make_retargetable_jump(&tw, tpc, dpc, arch);
+    *target_p = tpc;
+    *patch_size_p = patch_size;
+    return SUBSTITUTE_OK;
+}
+
+static int prepare_task_hook(struct task_hooks *th,
+                             const struct substitute_function_hook *hook,
+                             struct task_hook *h, bool thread_safe) {
+    uintptr_t pc = (uintptr_t) hook->function;
+    uintptr_t dpc = (uintptr_t) hook->replacement;
+    struct arch_dis_ctx arch;
+    arch_dis_ctx_init(&arch);
+
+    mach_vm_address_t base = pc & ~(vm_page_size - 1);
+    mach_vm_size_t map_size = ((pc + TASK_HOOK_WINDOW + vm_page_size - 1) &
+                               ~(vm_page_size - 1)) - base;
+    mach_vm_address_t local = 0;
+    vm_prot_t cur, max;
+    if (mach_vm_remap(mach_task_self(), &local, map_size, 0,
+                      VM_FLAGS_ANYWHERE, th->task, base, /*copy*/ FALSE,
+                      &cur, &max, VM_INHERIT_NONE))
+        return SUBSTITUTE_ERR_VM;
+    const void *code = (void *) (local + (pc - base));
+
+    /* As in check_intro_trampoline: straight to the replacement if that's
+     * the shortest patch, else via a trampoline close enough for it, else
+     * straight there if possible at all. */
+    uintptr_t target = dpc;
+    int patch_size = jump_patch_size(pc, dpc, arch, false);
+    int ret = SUBSTITUTE_OK;
+#ifdef JUMP_PATCH_SHORTEST_REACH
+    if (patch_size != JUMP_PATCH_SHORTEST_SIZE)
+        make_task_intro(th, pc, dpc, JUMP_PATCH_SHORTEST_REACH, arch,
+                        &target, &patch_size);
+#endif
+    if (patch_size == -1 &&
+        (ret = make_task_intro(th, pc, dpc, JUMP_PATCH_REACH, arch, &target,
+                               &patch_size)))
+        goto out;
+
+    void *jp = h->jump_patch;
+    make_jump_patch(&jp, pc, target, arch);
+    h->jump_patch_size = (uint8_t *) jp - h->jump_patch;
+    h->code = pc;
+    memcpy(h->orig, code, h->jump_patch_size);
+
+    size_t outro_est = TD_MAX_REWRITTEN_SIZE + MAX_JUMP_PATCH_SIZE;
+    struct task_page *page;
+    void *outro_write;
+    if ((ret = task_reserve(th, pc, 0, outro_est, &page, &h->outro_pc,
+                            &outro_write)))
+        goto out;
+    void *outro_write_start = outro_write;
+    uint_tptr pc_patch_end = pc + patch_size;
+    ret = transform_dis_main(code, &outro_write, pc, &pc_patch_end,
+                             h->outro_pc, &arch, h->offset_by_pcdiff, NULL,
+                             thread_safe ? TRANSFORM_DIS_BAN_CALLS : 0);
+    if (ret)
+        goto out;
+    h->patch_region_size = pc_patch_end - pc;
+
+    struct arena scratch;
+    arena_init(&scratch);
+    bool bad = jump_dis_main((void *) code, pc, pc_patch_end, 0, arch,
+                             &scratch);
+    arena_free(&scratch);
+    if (bad) {
+        ret = SUBSTITUTE_ERR_FUNC_JUMPS_TO_START;
+        goto out;
+    }
+
+    make_jump_patch(&outro_write, h->outro_pc + ((uint8_t *) outro_write -
+                                                 (uint8_t *) outro_write_start),
+                    pc_patch_end, arch);
+    size_t outro_size = (uint8_t *) outro_write -
+                        (uint8_t *) outro_write_start;
+    /* (it was the last thing reserved on the page) */
+    page->used = (h->outro_pc - page->addr + outro_size + 15) & ~(size_t) 15;
+out:
+    mach_vm_deallocate(mach_task_self(), local, map_size);
+    return ret;
+}
+
+#if defined(__x86_64__)
+typedef x86_thread_state64_t task_thread_state;
+#define TASK_THREAD_STATE_FLAVOR x86_THREAD_STATE64
+#elif defined(__i386__)
+typedef x86_thread_state32_t task_thread_state;
+#define TASK_THREAD_STATE_FLAVOR x86_THREAD_STATE32
+#elif defined(__arm64__)
+typedef arm_thread_state64_t task_thread_state;
+#define TASK_THREAD_STATE_FLAVOR ARM_THREAD_STATE64
+#endif
+
+#ifdef TASK_THREAD_STATE_FLAVOR
+static uintptr_t task_thread_pc(const task_thread_state *state) {
+#if defined(__x86_64__)
+    return state->__rip;
+#elif defined(__i386__)
+    return state->__eip;
+#elif __DARWIN_OPAQUE_ARM_THREAD_STATE64
+    return (uintptr_t) __darwin_arm_thread_state64_get_pc(*state);
+#else
+    return state->__pc;
+#endif
+}
+
+/* Returns false if it can't be done: on arm64e the pc would have to be
+ * signed with the target's key. */
+static bool set_task_thread_pc(task_thread_state *state, uintptr_t pc) {
+#if defined(__x86_64__)
+    state->__rip = pc;
+#elif defined(__i386__)
+    state->__eip = pc;
+#elif __DARWIN_OPAQUE_ARM_THREAD_STATE64
+    (void) state; (void) pc;
+    return false;
+#else
+    state->__pc = pc;
+#endif
+    return true;
+}
+
+/* Where a thread at pc should be moved to: pc itself if it's not in any
+ * patch region, or 0 if it's in the middle of an instruction there. */
+static uintptr_t task_thread_new_pc(const struct task_hook *hs, size_t nhooks,
+                                    uintptr_t pc) {
+    for (size_t i = 0; i < nhooks; i++) {
+        const struct task_hook *h = &hs[i];
+        if (pc - h->code >= h->patch_region_size)
+            continue;
+        int offset = h->offset_by_pcdiff[pc - h->code];
+        return offset == -1 ? 0 : h->outro_pc + offset;
+    }
+    return pc;
+}
+
+/* Write size bytes of code at addr in the target, through a VM_PROT_COPY
+ * mapping, and put back whatever protection it had. */
+static int write_task_code(task_t task, mach_vm_address_t addr,
+                           const void *buf, size_t size) {
+    mach_vm_address_t page = addr & ~(vm_page_size - 1);
+    mach_vm_size_t page_size = ((addr + size + vm_page_size - 1) &
+                                ~(vm_page_size - 1)) - page;
+    mach_vm_address_t region = addr;
+    mach_vm_size_t region_size;
+    vm_region_basic_info_data_64_t info;
+    mach_msg_type_number_t count = VM_REGION_BASIC_INFO_COUNT_64;
+    mach_port_t object;
+    if (mach_vm_region(task, &region, &region_size, VM_REGION_BASIC_INFO_64,
+                       (vm_region_info_t) &info, &count, &object))
+        return SUBSTITUTE_ERR_VM;
+    mach_port_deallocate(mach_task_self(), object);
+    if (region > addr ||
+        mach_vm_protect(task, page, page_size, FALSE,
+                        VM_PROT_READ | VM_PROT_WRITE | VM_PROT_COPY))
+        return SUBSTITUTE_ERR_VM;
+    kern_return_t kr = mach_vm_write(task, addr, (vm_offset_t) buf,
+                                     (mach_msg_type_number_t) size);
+    if (mach_vm_protect(task, page, page_size, FALSE, info.protection) || kr)
+        return SUBSTITUTE_ERR_VM;
+    return SUBSTITUTE_OK;
+}
+
+/* With the target suspended (if thread_safe), move its threads out of the
+ * patch regions and write the patches.  If a patch can't be written, the
+ * ones before it are put back.  *touched_p is set once anything in the
+ * target might depend on the trampolines. */
+static int commit_task_hooks(task_t task, const struct task_hook *hs,
+                             size_t nhooks, bool thread_safe,
+                             bool *touched_p) {
+    *touched_p = false;
+    if (thread_safe && task_suspend(task))
+        return SUBSTITUTE_ERR_ADJUSTING_THREADS;
+    int ret = SUBSTITUTE_OK;
+    thread_act_array_t threads = NULL;
+    mach_msg_type_number_t nthreads = 0;
+    task_thread_state *states = NULL;
+    uintptr_t *new_pcs = NULL;
+    if (thread_safe) {
+        if (task_threads(task, &threads, &nthreads)) {
+            ret = SUBSTITUTE_ERR_ADJUSTING_THREADS;
+            goto resume;
+        }
+        states = malloc(nthreads * sizeof(*states));
+        new_pcs = malloc(nthreads * sizeof(*new_pcs));
+        if (!states || !new_pcs) {
+            ret = SUBSTITUTE_ERR_OOM;
+            goto resume;
+        }
+        /* Check every thread before moving any, so that if one can't be,
+         * nothing's been touched. */
+        for (mach_msg_type_number_t i = 0; i < nthreads; i++) {
+            mach_msg_type_number_t count = sizeof(states[i]) /
+                                           sizeof(natural_t);
+            new_pcs[i] = 0;
+            kern_return_t kr = thread_get_state(threads[i],
+                                                TASK_THREAD_STATE_FLAVOR,
+                                                (thread_state_t) &states[i],
+                                                &count);
+            if (kr == KERN_TERMINATED || kr == MACH_SEND_INVALID_DEST)
+                continue;
+            if (kr) {
+                ret = SUBSTITUTE_ERR_ADJUSTING_THREADS;
+                goto resume;
+            }
+            uintptr_t pc = task_thread_pc(&states[i]);
+            uintptr_t new_pc = task_thread_new_pc(hs, nhooks, pc);
+            if (!new_pc) {
+                ret = SUBSTITUTE_ERR_UNEXPECTED_PC_ON_OTHER_THREAD;
+                goto resume;
+            }
+            if (new_pc == pc)
+                continue;
+            if (!set_task_thread_pc(&states[i], new_pc)) {
+                ret = SUBSTITUTE_ERR_UNEXPECTED_PC_ON_OTHER_THREAD;
+                goto resume;
+            }
+            new_pcs[i] = new_pc;
+        }
+        for (mach_msg_type_number_t i = 0; i < nthreads; i++) {
+            if (!new_pcs[i])
+                continue;
+            *touched_p = true;
+            kern_return_t kr = thread_set_state(
+                threads[i], TASK_THREAD_STATE_FLAVOR,
+                (thread_state_t) &states[i],
+                sizeof(states[i]) / sizeof(natural_t));
+            if (kr && kr != KERN_TERMINATED) {
+                ret = SUBSTITUTE_ERR_ADJUSTING_THREADS;
+                goto resume;
+            }
+        }
+    }
+
+    /* (threads moved into the outro trampolines keep them in use whatever
+     * happens to the patches) */
+    bool threads_moved = *touched_p;
+    for (size_t i = 0; i < nhooks; i++) {
+        const struct task_hook *h = &hs[i];
+        *touched_p = true;
+        if ((ret = write_task_code(task, h->code, h->jump_patch,
+                                   h->jump_patch_size))) {
+            /* including hook i, in case only the protection failed */
+            bool restored = true;
+            for (size_t j = i + 1; j-- > 0; ) {
+                if (write_task_code(task, hs[j].code, hs[j].orig,
+                                    hs[j].jump_patch_size))
+                    restored = false;
+            }
+            if (restored)
+                *touched_p = threads_moved;
+            goto resume;
+        }
+    }
+
+resume:
+    free(states);
+    free(new_pcs);
+    if (threads) {
+        for (mach_msg_type_number_t i = 0; i < nthreads; i++)
+            mach_port_deallocate(mach_task_self(), threads[i]);
+        mach_vm_deallocate(mach_task_self(), (mach_vm_address_t) threads,
+                           nthreads * sizeof(*threads));
+    }
+    if (thread_safe)
+        task_resume(task);
+    return ret;
+}
+#endif /* TASK_THREAD_STATE_FLAVOR */
+
+EXPORT
+int substitute_hook_functions_in_task(task_t task,
+                                      const struct substitute_function_hook *hooks,
+                                      size_t nhooks, int options) {
+#ifdef TASK_THREAD_STATE_FLAVOR
+    bool thread_safe = !(options & SUBSTITUTE_NO_THREAD_SAFETY);
+    /* (suspending ourselves would be the end of it) */
+    if (thread_safe && task == mach_task_self())
+        return SUBSTITUTE_ERR_NOT_SUPPORTED;
+    if (!nhooks)
+        return SUBSTITUTE_OK;
+    struct task_hook *hs = malloc(nhooks * sizeof(*hs));
+    if (!hs)
+        return SUBSTITUTE_ERR_OOM;
+    struct task_hooks th = {.task = task};
+    VEC_STORAGE_INIT(&th.pages, task_page);
+    int ret;
+    bool touched = false;
+    for (size_t i = 0; i < nhooks; i++) {
+        if ((ret = prepare_task_hook(&th, &hooks[i], &hs[i], thread_safe)))
+            goto end;
+    }
+    if ((ret = flush_task_pages(&th)))
+        goto end;
+    ret = commit_task_hooks(task, hs, nhooks, thread_safe, &touched);
+    if (!ret) {
+        for (size_t i = 0; i < nhooks; i++) {
+            if (hooks[i].old_ptr)
+                *(void **) hooks[i].old_ptr = (void *) hs[i].outro_pc;
+        }
+    }
+end:
+    /* The trampolines stay once any thread or patch might use them. */
+    free_task_pages(&th, touched);
+    free(hs);
+    return ret;
+#else
+    (void) task; (void) hooks; (void) nhooks; (void) options;
+    return SUBSTITUTE_ERR_NOT_SUPPORTED;
+#endif
+}
+
+#endif /* TARGET_DIS_SUPPORTED */
+#endif /* __APPLE__ */
@@ -0,0 +1,308 @@
+#ifdef __APPLE__
+
+#include "substitute.h"
+#include "substitute-internal.h"
+#include "trace.h"
+#include "ptrauth_helpers.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <mach/mach_time.h>
+
+#if defined(TARGET_x86_64) || defined(TARGET_arm64)
+
+/* Each thread that calls a traced function gets a trace_thread, with a
+ * single-producer single-consumer ring of events: the thread itself only
+ * writes 'head', and the drainer thread only writes 'tail', so recording an
+ * event takes no locks or atomic read-modify-writes.  When the ring is full,
+ * events are counted as dropped rather than waiting for the drainer.
+ *
+ * Buffers are never freed, since a thread might still be about to return
+ * through the exit code (the shadow stack in here says where to).  They're
+ * linked into g_threads with a CAS, and reused once their thread has exited
+ * and the drainer has emptied them. */
+#define TRACE_RING_EVENTS 4096
+#define TRACE_SHADOW_DEPTH 256
+#define TRACE_DRAIN_INTERVAL_US 1000
+
+struct trace_frame {
+    uintptr_t key;
+    uintptr_t ret;
+    uint32_t id;
+};
+
+struct trace_thread {
+    struct trace_thread *next;
+    uint64_t thread_id;
+    /* set by the TSD destructor; the drainer empties the ring one last time
+     * and then lets another thread claim it */
+    bool dead;
+    /* set while this thread is in the recorder (or is the drainer), so
+     * anything traced that it calls is left alone */
+    bool busy;
+    size_t depth;
+    struct trace_frame shadow[TRACE_SHADOW_DEPTH];
+    uint64_t dropped;
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t tail __attribute__((aligned(64)));
+    struct substitute_trace_event events[TRACE_RING_EVENTS];
+};
+_Static_assert(!(TRACE_RING_EVENTS & (TRACE_RING_EVENTS - 1)),
+               "ring size must be a power of two");
+
+static struct trace_thread *g_threads;
+static pthread_key_t g_thread_key;
+static pthread_once_t g_thread_key_once = PTHREAD_ONCE_INIT;
+/* the value of g_thread_key while a thread's buffer is being set up */
+#define TRACE_THREAD_SETTING_UP ((struct trace_thread *) 1)
+
+/* Only touched by substitute_trace_start/stop, under g_trace_lock, except
+ * that the recorders check g_tracing and the drainer writes to the file. */
+static pthread_mutex_t g_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool g_tracing;
+static bool g_drainer_stop;
+static pthread_t g_drainer;
+static struct substitute_trace_file_header *g_file;
+static size_t g_file_size;
+
+static void thread_exited(void *ptr) {
+    struct trace_thread *t = ptr;
+    if (t != TRACE_THREAD_SETTING_UP)
+        __atomic_store_n(&t->dead, true, __ATOMIC_RELEASE);
+}
+
+static void make_thread_key() {
+    if (pthread_key_create(&g_thread_key, thread_exited))
+        substitute_panic("substitute_trace: pthread_key_create failed\n");
+}
+
+static struct trace_thread *new_thread() {
+    /* a dead thread's buffer if it's been drained, or else a new one */
+    struct trace_thread *t;
+    for (t = __atomic_load_n(&g_threads, __ATOMIC_ACQUIRE); t; t = t->next) {
+        bool dead = true;
+        if (__atomic_load_n(&t->tail, __ATOMIC_ACQUIRE) == t->head &&
+            __atomic_compare_exchange_n(&t->dead, &dead, false, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            break;
+    }
+    if (!t) {
+        /* not malloc, since it might be traced */
+        void *map = mmap(NULL, sizeof(*t), PROT_READ | PROT_WRITE,
+                         MAP_ANON | MAP_PRIVATE, -1, 0);
+        if (map == MAP_FAILED)
+            return NULL;
+        t = map;
+        struct trace_thread *head = __atomic_load_n(&g_threads,
+                                                    __ATOMIC_RELAXED);
+        do
+            t->next = head;
+        while (!__atomic_compare_exchange_n(&g_threads, &head, t, true,
+                                            __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED));
+    }
+    t->busy = false;
+    t->depth = 0;
+    pthread_threadid_np(NULL, &t->thread_id);
+    return t;
+}
+
+static struct trace_thread *get_thread() {
+    pthread_once(&g_thread_key_once, make_thread_key);
+    struct trace_thread *t = pthread_getspecific(g_thread_key);
+    if (t == TRACE_THREAD_SETTING_UP)
+        return NULL;
+    if (!t) {
+        /* pthread_setspecific might call something traced */
+        pthread_setspecific(g_thread_key, TRACE_THREAD_SETTING_UP);
+        t = new_thread();
+        pthread_setspecific(g_thread_key, t ? t : TRACE_THREAD_SETTING_UP);
+    }
+    return t;
+}
+
+static void record(struct trace_thread *t, uint32_t id, uint32_t kind) {
+    uint64_t head = t->head;
+    if (head - __atomic_load_n(&t->tail, __ATOMIC_ACQUIRE) >=
+        TRACE_RING_EVENTS) {
+        t->dropped++;
+        return;
+    }
+    struct substitute_trace_event *ev =
+        &t->events[head & (TRACE_RING_EVENTS - 1)];
+    ev->timestamp = mach_absolute_time();
+    ev->thread_id = t->thread_id;
+    ev->function_id = id;
+    ev->kind = kind;
+    __atomic_store_n(&t->head, head + 1, __ATOMIC_RELEASE);
+}
+
+uintptr_t substitute_trace_enter(const struct trace_site *site,
+                                 uintptr_t *ret_slot, uintptr_t key) {
+    if (!__atomic_load_n(&g_tracing, __ATOMIC_RELAXED))
+        return site->target;
+    struct trace_thread *t = get_thread();
+    if (!t || t->busy)
+        return site->target;
+    t->busy = true;
+    record(t, site->id, SUBSTITUTE_TRACE_ENTRY);
+    /* If the shadow stack is full, the exit just isn't recorded. */
+    if (t->depth < TRACE_SHADOW_DEPTH) {
+        struct trace_frame *f = &t->shadow[t->depth++];
+        f->key = key;
+        f->ret = *ret_slot;
+        f->id = site->id;
+        *ret_slot = (uintptr_t) make_sym_readable(substitute_trace_exit_asm);
+    }
+    t->busy = false;
+    return site->target;
+}
+
+uintptr_t substitute_trace_exit(uintptr_t key) {
+    struct trace_thread *t = pthread_getspecific(g_thread_key);
+    t->busy = true;
+    /* Frames that were skipped by longjmp have lower keys (stacks grow
+     * down); a function tail calling another traced function leaves two
+     * frames with the same key, which pop one after the other. */
+    while (t->depth && t->shadow[t->depth - 1].key < key)
+        t->depth--;
+    if (!t->depth || t->shadow[t->depth - 1].key != key)
+        substitute_panic("substitute_trace: returned with unknown sp %p\n",
+                         (void *) key);
+    struct trace_frame *f = &t->shadow[--t->depth];
+    if (__atomic_load_n(&g_tracing, __ATOMIC_RELAXED))
+        record(t, f->id, SUBSTITUTE_TRACE_EXIT);
+    t->busy = false;
+    return f->ret;
+}
+
+static void drain() {
+    struct substitute_trace_file_header *file = g_file;
+    struct substitute_trace_event *events = (void *) (file + 1);
+    for (struct trace_thread *t = __atomic_load_n(&g_threads, __ATOMIC_ACQUIRE);
+         t; t = t->next) {
+        uint64_t head = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = t->tail;
+        uint64_t n = head - tail;
+        uint64_t room = file->capacity - file->nevents;
+        uint64_t copy = n < room ? n : room;
+        for (uint64_t i = 0; i < copy; i++)
+            events[file->nevents + i] =
+                t->events[(tail + i) & (TRACE_RING_EVENTS - 1)];
+        __atomic_store_n(&file->nevents, file->nevents + copy,
+                         __ATOMIC_RELEASE);
+        file->dropped += n - copy;
+        /* (racy: the thread might be dropping one right now; a lost
+         * increment here just means a slightly low count) */
+        uint64_t dropped = __atomic_exchange_n(&t->dropped, 0,
+                                               __ATOMIC_RELAXED);
+        file->dropped += dropped;
+        __atomic_store_n(&t->tail, head, __ATOMIC_RELEASE);
+    }
+}
+
+static void *drainer_main(UNUSED void *arg) {
+    /* nothing this thread calls gets traced */
+    pthread_once(&g_thread_key_once, make_thread_key);
+    pthread_setspecific(g_thread_key, TRACE_THREAD_SETTING_UP);
+    pthread_setname_np("substitute trace drainer");
+    while (!__atomic_load_n(&g_drainer_stop, __ATOMIC_ACQUIRE)) {
+        drain();
+        usleep(TRACE_DRAIN_INTERVAL_US);
+    }
+    drain();
+    return NULL;
+}
+
+EXPORT
+int substitute_trace_start(const char *path, size_t max_events) {
+    int ret = SUBSTITUTE_OK;
+    pthread_mutex_lock(&g_trace_lock);
+    if (g_file) {
+        ret = SUBSTITUTE_ERR_TRACE_STATE;
+        goto out;
+    }
+    size_t size = sizeof(*g_file) +
+                  max_events * sizeof(struct substitute_trace_event);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        ret = SUBSTITUTE_ERR_VM;
+        goto out;
+    }
+    void *map = MAP_FAILED;
+    if (!ftruncate(fd, size))
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        ret = SUBSTITUTE_ERR_VM;
+        goto out;
+    }
+    g_file = map;
+    g_file_size = size;
+    mach_timebase_info_data_t tb;
+    mach_timebase_info(&tb);
+    g_file->magic = SUBSTITUTE_TRACE_MAGIC;
+    g_file->version = SUBSTITUTE_TRACE_VERSION;
+    g_file->timebase_numer = tb.numer;
+    g_file->timebase_denom = tb.denom;
+    g_file->capacity = max_events;
+
+    /* throw away whatever was recorded after the last stop */
+    for (struct trace_thread *t = __atomic_load_n(&g_threads, __ATOMIC_ACQUIRE);
+         t; t = t->next) {
+        t->dropped = 0;
+        __atomic_store_n(&t->tail, __atomic_load_n(&t->head, __ATOMIC_ACQUIRE),
+                         __ATOMIC_RELEASE);
+    }
+
+    g_drainer_stop = false;
+    if (pthread_create(&g_drainer, NULL, drainer_main, NULL)) {
+        munmap(g_file, g_file_size);
+        g_file = NULL;
+        ret = SUBSTITUTE_ERR_OOM;
+        goto out;
+    }
+    __atomic_store_n(&g_tracing, true, __ATOMIC_RELEASE);
+out:
+    pthread_mutex_unlock(&g_trace_lock);
+    return ret;
+}
+
+EXPORT
+int substitute_trace_stop() {
+    int ret = SUBSTITUTE_OK;
+    pthread_mutex_lock(&g_trace_lock);
+    if (!g_file) {
+        ret = SUBSTITUTE_ERR_TRACE_STATE;
+        goto out;
+    }
+    __atomic_store_n(&g_tracing, false, __ATOMIC_RELEASE);
+    __atomic_store_n(&g_drainer_stop, true, __ATOMIC_RELEASE);
+    pthread_join(g_drainer, NULL);
+    if (msync(g_file, g_file_size, MS_SYNC))
+        ret = SUBSTITUTE_ERR_VM;
+    munmap(g_file, g_file_size);
+    g_file = NULL;
+out:
+    pthread_mutex_unlock(&g_trace_lock);
+    return ret;
+}
+
+#else /* defined(TARGET_x86_64) || defined(TARGET_arm64) */
+
+EXPORT
+int substitute_trace_start(UNUSED const char *path, UNUSED size_t max_events) {
+    return SUBSTITUTE_ERR_NOT_SUPPORTED;
+}
+
+EXPORT
+int substitute_trace_stop() {
+    return SUBSTITUTE_ERR_NOT_SUPPORTED;
+}
+
+#endif
+
+#endif /* __APPLE__ */
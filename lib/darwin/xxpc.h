@@ -79,6 +79,7 @@ xxpc_connection_t WRAP(xpc_connection_create_mach_service, (const char *,
                                                             uint64_t));
 void WRAP(xpc_connection_resume, (xxpc_connection_t));
 void WRAP(xpc_connection_set_event_handler, (xxpc_connection_t, xxpc_handler_t));
+void WRAP(xpc_connection_set_target_queue, (xxpc_connection_t, dispatch_queue_t));
 void WRAP(xpc_connection_send_message_with_reply,
     (xxpc_connection_t, xxpc_object_t, dispatch_queue_t, xxpc_handler_t));
 xxpc_object_t WRAP(xpc_connection_send_message_with_reply_sync,
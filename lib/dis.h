@@ -6,7 +6,12 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#if DIS_BRANCHES_ONLY
+/* the cut down decoders don't reach every handler */
+#define INLINE __attribute__((always_inline, unused))
+#else
 #define INLINE __attribute__((always_inline))
+#endif
 #define NOINLINE __attribute__((noinline))
 
 static INLINE inline void unaligned_w64(void *ptr, uint64_t val) {
@@ -1,9 +1,54 @@
 #pragma once
 #include <sys/types.h>
-/* For allocating trampolines - this is just a mmap wrapper. */
-int execmem_alloc_unsealed(uintptr_t hint, void **page_p, size_t *size_p);
-int execmem_seal(void *page);
-void execmem_free(void *page);
+#include <stdbool.h>
+/* Process-wide trampoline arena.  All calls must be made with the arena lock
+ * held.  execmem_arena_reserve hands out 'size' bytes: *pc_p is where the
+ * code will run from, *write_p is where to write it (a separate writable
+ * mapping of the same memory).  If reach is nonzero, the whole reservation is
+ * within reach bytes of hint.  Written code must be published with
+ * execmem_arena_flush before anything jumps to it; execmem_arena_abort throws
+ * away everything reserved since the last flush.  If hot is set, the
+ * reservation starts on a cache line, in a page only used for hot
+ * reservations. */
+#define EXECMEM_ARENA_ALIGN 16
+#define EXECMEM_ARENA_HOT_ALIGN 64
+/* granularity of substitute_get_trampoline_region_info */
+#define EXECMEM_ARENA_REGION_SHIFT 27
+void execmem_arena_lock(void);
+void execmem_arena_unlock(void);
+int execmem_arena_reserve(uintptr_t hint, uintptr_t reach, size_t size,
+                          bool hot, uintptr_t *pc_p, void **write_p);
+/* Whether execmem_arena_reserve(hint, reach, size, false, ...) could find
+ * room - in the arena, or in free address space for a new page - without
+ * reserving or mapping anything: SUBSTITUTE_OK or the error it would return.
+ * Free address space can be taken by others in the meantime, so this is only
+ * a prediction. */
+int execmem_arena_check(uintptr_t hint, uintptr_t reach, size_t size);
+/* Give back the end of the most recent reservation. */
+void execmem_arena_trim(uintptr_t pc, size_t reserved, size_t used);
+/* Give back a flushed reservation (of size bytes, after trimming) that
+ * nothing can be running anymore. */
+void execmem_arena_release(uintptr_t pc, size_t size);
+int execmem_arena_flush(void);
+void execmem_arena_abort(void);
+/* Bytes of live trampolines and bytes unused in the arena's pages; takes the
+ * arena lock itself. */
+void execmem_arena_usage(size_t *used_p, size_t *free_p);
+/* Call back with each of the arena's pages, and then each range of pages
+ * execmem_foreign_write_with_pc_patch has written to, in address order (see
+ * memory_region_callback in substitute-internal.h). */
+void execmem_enum_memory(void (*callback)(void *ctx, int kind, uintptr_t start,
+                                          size_t size, size_t used),
+                         void *ctx);
+
+/* Write len bytes at dst with a single atomic store through a temporary
+ * writable alias of the page, without stopping other threads; only possible
+ * if the write is within one aligned 8-byte unit.  Returns SUBSTITUTE_ERR_VM
+ * if that didn't work, in which case nothing was changed and the caller
+ * should fall back to execmem_foreign_write_with_pc_patch. */
+#define EXECMEM_ATOMIC_WRITE_OK(dst, len) \
+    ((len) <= 8 && ((uintptr_t) (dst) & 7) + (len) <= 8)
+int execmem_atomic_write(void *dst, const void *src, size_t len);
 
 /* Write to "foreign" (i.e. owned by another library, not out-of-process) pages
  * which are already RX or have unknown permissions.
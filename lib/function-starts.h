@@ -0,0 +1,18 @@
+#pragma once
+#include <stdint.h>
+/* Function bounds from an image's LC_FUNCTION_STARTS, so jump_dis_main can
+ * check exactly the function being hooked.  Each image's list is decoded on
+ * first use into a sorted array and kept on its substitute_image handle (for
+ * as long as the image is loaded).  The cache holds on to the last image
+ * looked up, since a batch of hooks tends to be in one image; release it
+ * with function_starts_cache_free. */
+struct function_starts_cache {
+    struct substitute_image *im;
+    uintptr_t text_start, text_end;
+};
+#define FUNCTION_STARTS_CACHE_INIT {NULL, 0, 0}
+
+/* Returns where the function containing pc ends, or 0 if that isn't known
+ * (pc isn't in an image's __TEXT, or there's no LC_FUNCTION_STARTS). */
+uintptr_t function_end(struct function_starts_cache *cache, uintptr_t pc);
+void function_starts_cache_free(struct function_starts_cache *cache);
@@ -4,166 +4,727 @@
 #include "jump-dis.h"
 #include "transform-dis.h"
 #include "execmem.h"
+#include "plan-cache.h"
+#include "branch-index.h"
+#include "function-starts.h"
+#include "stats.h"
 #include stringify(TARGET_DIR/jump-patch.h)
+#include "cbit/vec.h"
+#include "cbit/htab.h"
+#include "cbit/arena.h"
 #include <pthread.h>
+#ifdef __APPLE__
+#include <dispatch/dispatch.h>
+#endif
 #include "ptrauth_helpers.h"
+#include "trace.h"
 
 struct hook_internal {
     int offset_by_pcdiff[MAX_EXTENDED_PATCH_SIZE + 1];
     uint8_t jump_patch[MAX_JUMP_PATCH_SIZE];
     size_t jump_patch_size;
+    /* what jump_patch replaced, for unhooking */
+    uint8_t orig[MAX_JUMP_PATCH_SIZE];
     void *code;
+    /* how far before code jump_patch starts: HOT_PATCH_PAD_SIZE if it's in
+     * hot-patch padding (see x86/jump-patch.h), else 0 */
+    size_t patch_offset;
     void *outro_trampoline;
-    /* page allocated with execmem_alloc_unsealed - only if we had to allocate
-     * one when processing this hook */
-    void *trampoline_page;
+    /* the trampolines' arena blocks (intro_size is 0 if the patch jumps
+     * straight to the replacement) */
+    uintptr_t intro_pc, outro_pc;
+    size_t intro_size, outro_size;
+    /* the intro trampoline is one of g_shared_intros, and isn't ours */
+    bool intro_shared;
+    /* how much of the function outro_trampoline has instructions for */
+    size_t patch_region_size;
+    /* some thread may return into the outro, so it can never be freed */
+    bool outro_has_call;
+    /* set while unhooking if some thread was found inside the outro, but not
+     * at an instruction boundary (or inside a probe stub, which then has to
+     * stay too) */
+    bool outro_busy;
+    /* set while unhooking if the patch was overwritten since */
+    bool changed;
+    /* A probe's intro trampoline is a stub that counts the call, and its
+     * 'replacement' is its own outro trampoline.  If it's chained onto an
+     * existing hook instead, the stub's literal (stub_target_rw) gets the
+     * previous replacement.  A trace's replacement is always a trace stub,
+     * whose target (stub_target_rw) is the outro trampoline or the previous
+     * replacement; its stub and trampolines are never freed.  A guarded
+     * hook's replacement is a guard stub, whose fallback goes through
+     * stub_target_rw the same way; that stub is never freed either. */
+    bool probe, trace;
+    uintptr_t *stub_target_rw;
+    /* Intro trampolines jump through a literal at target_rw (the writable
+     * view of it).  A hook on a function we already hooked is 'chained': it
+     * has no patch or trampolines of its own, and just stores its replacement
+     * there, remembering the previous value in chain_prev. */
+    bool chained;
+    uintptr_t *target_rw;
+    uintptr_t replacement, chain_prev;
+    /* the patch replaces a single instruction and fits in an aligned 8-byte
+     * unit, so it can be written with one atomic store */
+    bool atomic_ok;
+    /* set by substitute_set_hook_enabled: the trampoline goes to
+     * hook_fallback instead of the replacement */
+    bool disabled;
     struct arch_dis_ctx arch_dis_ctx;
 };
+DECL_VEC(struct hook_internal, hook_internal);
 
-struct pc_callback_info {
-    struct hook_internal *his;
+/* Held for the whole of every hook, unhook and commit, so they can be called
+ * from any thread. */
+static pthread_mutex_t g_hook_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Scratch for whatever doesn't outlive a single hook, unhook or commit, reset
+ * before g_hook_lock is released.  Big batches then don't make a heap
+ * allocation per hook, and nothing mallocs right next to suspending threads
+ * (one of which could hold the malloc lock). */
+static struct arena g_scratch = ARENA_INIT_STATIC;
+
+/* Hooks queued by an open substitute_hook_begin transaction.  Their
+ * trampolines are already in place; only the jump patches are left. */
+static int g_txn_depth;
+static bool g_txn_thread_safe;
+static VEC_STORAGE_CAPA(hook_internal, 4) g_txn_hooks =
+    VEC_STORAGE_INIT_STATIC(&g_txn_hooks, hook_internal);
+
+/* SubHookMemory writes made during a transaction, if deferring them is on:
+ * committed along with the hooks, in one execmem_foreign_write_with_pc_patch
+ * call, so several small patches to a page only remap it once. */
+struct txn_write {
+    uintptr_t dst;
+    size_t len;
+    void *data;
+};
+DECL_VEC(struct txn_write, txn_write);
+static bool g_defer_memory_writes;
+static VEC_STORAGE_CAPA(txn_write, 4) g_txn_writes =
+    VEC_STORAGE_INIT_STATIC(&g_txn_writes, txn_write);
+
+/* Functions whose patch jumps to an intro trampoline, by code address, so
+ * hooking them again can just retarget it.  'target' is where the trampoline
+ * will jump once queued hooks are committed.  Protected by g_hook_lock. */
+struct chain_entry {
+    uintptr_t *target_rw;
+    uintptr_t target;
+    uint8_t jump_patch[MAX_JUMP_PATCH_SIZE];
+    size_t jump_patch_size, patch_offset;
+};
+#define code_hash(codep) ((size_t) (*(codep) >> 2))
+#define code_eq(code1p, code2p) (*(code1p) == *(code2p))
+#define code_null(codep) (*(codep) == 0)
+DECL_STATIC_HTAB_KEY(uintptr_t, uintptr_t, code_hash, code_eq, code_null, 0);
+DECL_HTAB(chain_registry, uintptr_t, struct chain_entry);
+static HTAB_STORAGE(chain_registry) g_chains =
+    HTAB_STORAGE_INIT_STATIC(&g_chains, chain_registry);
+
+static struct chain_entry *chain_lookup(void *code) {
+    uintptr_t key = (uintptr_t) code;
+    return htab_getp_chain_registry(&g_chains.h, &key);
+}
+
+/* Whether ce's patch is still on the function at code. */
+static bool chain_patch_intact(const struct chain_entry *ce, void *code) {
+    return !memcmp((uint8_t *) code - ce->patch_offset, ce->jump_patch,
+                   ce->jump_patch_size);
+}
+
+/* Where hi's jump patch goes. */
+static void *hook_patch_start(const struct hook_internal *hi) {
+    return (uint8_t *) hi->code - hi->patch_offset;
+}
+
+/* The store for an atomic_ok hook: with hot-patch padding, the jump in the
+ * padding first (nothing runs there), then the short jump at the entry. */
+static int atomic_write_patch(const struct hook_internal *hi) {
+    int ret;
+    if (hi->patch_offset &&
+        (ret = execmem_atomic_write(hook_patch_start(hi), hi->jump_patch,
+                                    hi->patch_offset)))
+        return ret;
+    return execmem_atomic_write(hi->code, hi->jump_patch + hi->patch_offset,
+                                hi->jump_patch_size - hi->patch_offset);
+}
+
+/* Intro trampolines made for SUBSTITUTE_SHARE_TRAMPOLINES hooks, by
+ * replacement, the reach they were reserved with, and which reach-sized
+ * region the function they were made for is in.  Other functions in the
+ * region reuse one if their patch can reach it.  They're never freed, since a
+ * thread in one could have come from any of its functions, and nothing can
+ * chain onto them.  Protected by g_hook_lock. */
+struct shared_intro_key {
+    uintptr_t dpc, reach, region;
+};
+#define shared_intro_hash(k) ((size_t) ((k)->dpc ^ (k)->region * 31 ^ \
+                                        (k)->reach))
+#define shared_intro_eq(k1, k2) ((k1)->dpc == (k2)->dpc && \
+                                 (k1)->reach == (k2)->reach && \
+                                 (k1)->region == (k2)->region)
+#define shared_intro_null(k) (!(k)->dpc)
+DECL_STATIC_HTAB_KEY(shared_intro_key, struct shared_intro_key,
+                     shared_intro_hash, shared_intro_eq, shared_intro_null, 0);
+DECL_HTAB(shared_intros, shared_intro_key, uintptr_t);
+static HTAB_STORAGE(shared_intros) g_shared_intros =
+    HTAB_STORAGE_INIT_STATIC(&g_shared_intros, shared_intros);
+/* the ones added by the hook_functions call in progress, which go away with
+ * its trampolines if it fails */
+DECL_VEC(struct shared_intro_key, shared_intro_key);
+
+/* What old_ptr got, which is where the trampoline goes while disabled. */
+static uintptr_t hook_fallback(const struct hook_internal *hi) {
+    return hi->chained ? hi->chain_prev : (uintptr_t) hi->outro_trampoline;
+}
+
+/* What the registry should say a hook's trampoline goes to, if nothing has
+ * chained onto it since. */
+static uintptr_t hook_target(const struct hook_internal *hi) {
+    return hi->disabled ? hook_fallback(hi) : hi->replacement;
+}
+
+struct substitute_function_hook_record {
     size_t nhooks;
+    struct hook_internal his[];
+};
+
+/* Batches of at least this many hooks leave their jump_dis_main checks -
+ * usually most of the time spent preparing a hook, since they follow
+ * branches through the rest of the function - until every hook has been
+ * placed, and then run them all on libdispatch's thread pool.  Placement
+ * shares the trampoline arena, so it stays serial.  0 (the default) means
+ * never. */
+static size_t g_parallel_prepare_min;
+
+EXPORT
+void substitute_set_parallel_prepare_threshold(size_t nhooks) {
+    __atomic_store_n(&g_parallel_prepare_min, nhooks, __ATOMIC_RELAXED);
+}
+
+struct jump_check {
+    size_t idx;
+    void *code;
+    uintptr_t start, end, func_end;
+    struct arch_dis_ctx arch;
+    unsigned variant;
+    int patch_size;
+    bool bad;
+};
+DECL_VEC(struct jump_check, jump_check);
+DECL_VEC(pthread_key_t, pthread_key);
+
+static void run_jump_check(void *ctx, size_t i) {
+    struct jump_check *jc = &((struct jump_check *) ctx)[i];
+    /* g_scratch belongs to the thread holding g_hook_lock */
+    struct arena scratch;
+    arena_init(&scratch);
+    STATS_START(jump_start);
+    jc->bad = jump_dis_main(jc->code, jc->start, jc->end, jc->func_end,
+                            jc->arch, &scratch);
+    STATS_END(jump_dis_ns, jump_start);
+    arena_free(&scratch);
+}
+
+/* Code that threads might be in the middle of while we patch: when hooking,
+ * the patched region of each function; when unhooking, the trampolines.
+ * Sorted by start so pc_callback can binary search them. */
+struct pc_range {
+    uintptr_t start, end;
+    struct hook_internal *hi;
+};
+
+struct pc_callback_info {
+    struct pc_range *ranges;
+    size_t nranges;
+    bool unhook;
     bool encountered_bad_pc;
 };
 
+static int compare_pc_range(const void *a, const void *b) {
+    uintptr_t start_a = ((struct pc_range *) a)->start;
+    uintptr_t start_b = ((struct pc_range *) b)->start;
+    return start_a < start_b ? -1 : start_a > start_b ? 1 : 0;
+}
+
+static uintptr_t unhook_pc(struct hook_internal *hi, uintptr_t real_pc,
+                           uintptr_t low_bit) {
+    uintptr_t code = (uintptr_t) hi->code;
+    /* About to jump to the replacement; run the original instead. */
+    if (real_pc - hi->intro_pc < hi->intro_size) {
+        /* A probe stub might have pushed registers by now, so just let it
+         * run on into the outro, and leave both around. */
+        if (hi->probe) {
+            hi->outro_busy = true;
+            return real_pc | low_bit;
+        }
+        return code | low_bit;
+    }
+    uintptr_t offset = real_pc - hi->outro_pc;
+    for (size_t d = 0; d <= hi->patch_region_size; d++) {
+        if (hi->offset_by_pcdiff[d] == (int) offset)
+            return (code + d) | low_bit;
+    }
+    /* Somewhere in the middle of some rewritten instruction's replacement.
+     * Leave it be, and leave the trampoline around for it. */
+    hi->outro_busy = true;
+    return real_pc | low_bit;
+}
+
 static uintptr_t pc_callback(void *ctx, uintptr_t pc) {
     struct pc_callback_info *restrict info = ctx;
-    uintptr_t real_pc = pc;
+    uintptr_t real_pc = pc, low_bit = 0;
 #ifdef __arm__
     real_pc = pc & ~1;
+    low_bit = pc & 1;
 #endif
-    for (size_t i = 0; i < info->nhooks; i++) {
-        struct hook_internal *hi = &info->his[i];
-        uintptr_t diff = real_pc - (uintptr_t) hi->code;
-        if (diff < hi->jump_patch_size) {
-            int offset = hi->offset_by_pcdiff[diff];
-            if (offset == -1) {
-                info->encountered_bad_pc = true;
-                return pc;
-            }
-            return (uintptr_t) hi->outro_trampoline + offset;
-        }
+    /* find the last range starting at or before real_pc */
+    size_t lo = 0, hi_idx = info->nranges;
+    while (lo < hi_idx) {
+        size_t mid = lo + (hi_idx - lo) / 2;
+        if (info->ranges[mid].start <= real_pc)
+            lo = mid + 1;
+        else
+            hi_idx = mid;
+    }
+    if (lo == 0)
+        return pc;
+    struct pc_range *range = &info->ranges[lo - 1];
+    if (real_pc >= range->end)
+        return pc;
+    struct hook_internal *hi = range->hi;
+    if (info->unhook)
+        return unhook_pc(hi, real_pc, low_bit);
+    int offset = hi->offset_by_pcdiff[real_pc - (uintptr_t) hi->code];
+    if (offset == -1) {
+        info->encountered_bad_pc = true;
+        return pc;
     }
-    return pc;
+    return (uintptr_t) hi->outro_trampoline + offset;
 }
 
 /* Figure out the size of the patch we need to jump from pc_patch_start
  * to hook->replacement.
- * On ARM, we can jump anywhere in 8 bytes.  On ARM64, we can only do it in two
- * or three instructions if the destination PC is within 4GB or so of the
- * source.  We *could* just brute force it by adding more instructions, but
- * this increases the chance of problems caused by patching too much of the
- * function.  Instead, since we should be able to mmap a trampoline somewhere
- * in that range, we'll stop there on the way to.
+ * On ARM, we can jump anywhere in 8 bytes.  On ARM64, we can do it in one
+ * instruction within 128MB, or two or three if the destination PC is within
+ * 4GB or so of the source.  We *could* just brute force it by adding more
+ * instructions, but this increases the chance of problems caused by patching
+ * too much of the function.  Instead, since we should be able to mmap a
+ * trampoline somewhere in that range, we'll stop there on the way to.
  * In order of preference:
+ * - Jump directly with the shortest possible patch.
+ * - Jump to a trampoline close enough for the shortest possible patch (on
+ *   arm64, a B; fewer relocated instructions, and the patch can be written
+ *   atomically).
  * - Jump directly.
- * - Jump using a trampoline to be placed at our existing trampoline_ptr.
- * - Allocate a new trampoline_ptr, using the target as a hint, and jump there.
+ * - Jump using a trampoline in the arena, within JUMP_PATCH_REACH of the pc
+ *   (the arena allocates a new page near pc if there isn't one already).
  * If even that is out of range, then return an error code.
  */
 
-static int check_intro_trampoline(void **trampoline_ptr_p,
-                                  size_t *trampoline_size_left_p,
-                                  uintptr_t pc,
+/* If counter is set, the trampoline is a probe stub incrementing it, and dpc
+ * is left for the caller to fill in through hi->target_rw.  If new_shared is
+ * set, the trampoline comes from (or goes into) g_shared_intros, with its key
+ * appended to new_shared if it's new. */
+static int make_intro_trampoline(uintptr_t pc, uintptr_t dpc, uint64_t *counter,
+                                 uintptr_t reach, int *patch_size_p,
+                                 uintptr_t *initial_target_p,
+                                 struct hook_internal *hi,
+                                 struct arch_dis_ctx arch,
+                                 struct vec_shared_intro_key *new_shared) {
+    size_t size = counter ? PROBE_STUB_SIZE : RETARGETABLE_JUMP_SIZE;
+    uintptr_t tpc;
+    void *tw;
+    struct shared_intro_key key = {dpc, reach, reach ? pc / reach : 0};
+    uintptr_t *sharedp;
+    if (new_shared &&
+        (sharedp = htab_getp_shared_intros(&g_shared_intros.h, &key))) {
+        tpc = *sharedp;
+        uintptr_t dist = tpc > pc ? tpc - pc : pc - tpc;
+        *patch_size_p = jump_patch_size(pc, tpc, arch, false);
+        if ((!reach || dist <= reach) && *patch_size_p != -1) {
+            hi->intro_pc = tpc;
+            hi->intro_size = size;
+            hi->intro_shared = true;
+            *initial_target_p = tpc;
+            return SUBSTITUTE_OK;
+        }
+        /* the region's one is out of reach from this end of it, so make an
+         * ordinary one */
+        new_shared = NULL;
+    }
+    int ret = execmem_arena_reserve(pc, reach, size, false, &tpc, &tw);
+    if (ret)
+        return ret;
+    *patch_size_p = jump_patch_size(pc, tpc, arch, false);
+    if (*patch_size_p == -1) {
+        execmem_arena_trim(tpc, size, 0);
+        return SUBSTITUTE_ERR_OUT_OF_RANGE;
+    }
+    if (new_shared) {
+        *htab_setp_shared_intros(&g_shared_intros.h, &key, NULL) = tpc;
+        vec_append_shared_intro_key(new_shared, key);
+        make_retargetable_jump(&tw, tpc, dpc, arch);
+        hi->intro_pc = tpc;
+        hi->intro_size = size;
+        hi->intro_shared = true;
+        *initial_target_p = tpc;
+        return SUBSTITUTE_OK;
+    }
+    /* so later hooks of the same function can chain onto this one */
+    hi->target_rw = (uintptr_t *) ((uint8_t *) tw +
+        (counter ? PROBE_STUB_LITERAL : RETARGETABLE_JUMP_LITERAL));
+    if (counter)
+        make_probe_stub(&tw, tpc, counter, arch);
+    else
+        make_retargetable_jump(&tw, tpc, dpc, arch);
+    hi->intro_pc = tpc;
+    hi->intro_size = size;
+    *initial_target_p = tpc;
+    return SUBSTITUTE_OK;
+}
+
+static int check_intro_trampoline(uintptr_t pc,
                                   uintptr_t dpc,
+                                  uint64_t *counter,
+                                  bool toggleable,
                                   int *patch_size_p,
-                                  bool *need_intro_trampoline_p,
-                                  void **trampoline_page_p,
-                                  struct arch_dis_ctx arch) {
-    void *trampoline_ptr = *trampoline_ptr_p;
-    size_t trampoline_size_left = *trampoline_size_left_p;
+                                  uintptr_t *initial_target_p,
+                                  struct hook_internal *hi,
+                                  struct arch_dis_ctx arch,
+                                  struct vec_shared_intro_key *new_shared) {
+    /* Probes always go through their stub, and toggleable hooks through a
+     * trampoline, whose literal substitute_set_hook_enabled can swap; neither
+     * can be shared. */
+    if (counter || toggleable) {
+#ifdef JUMP_PATCH_SHORTEST_REACH
+        if (!make_intro_trampoline(pc, dpc, counter, JUMP_PATCH_SHORTEST_REACH,
+                                   patch_size_p, initial_target_p, hi, arch,
+                                   NULL))
+            return SUBSTITUTE_OK;
+#endif
+        return make_intro_trampoline(pc, dpc, counter, JUMP_PATCH_REACH,
+                                     patch_size_p, initial_target_p, hi, arch,
+                                     NULL);
+    }
 
     /* Try direct */
-    *need_intro_trampoline_p = false;
+    *initial_target_p = dpc;
     *patch_size_p = jump_patch_size(pc, dpc, arch, /*force*/ false);
+#ifdef JUMP_PATCH_SHORTEST_REACH
+    if (*patch_size_p == JUMP_PATCH_SHORTEST_SIZE)
+        return SUBSTITUTE_OK;
+    int direct_size = *patch_size_p;
+    if (!make_intro_trampoline(pc, dpc, NULL, JUMP_PATCH_SHORTEST_REACH,
+                               patch_size_p, initial_target_p, hi, arch,
+                               new_shared))
+        return SUBSTITUTE_OK;
+    *initial_target_p = dpc;
+    *patch_size_p = direct_size;
+#endif
     if (*patch_size_p != -1)
         return SUBSTITUTE_OK;
 
-    *need_intro_trampoline_p = true;
+    return make_intro_trampoline(pc, dpc, NULL, JUMP_PATCH_REACH, patch_size_p,
+                                 initial_target_p, hi, arch, new_shared);
+}
 
-    if (trampoline_ptr) {
-        /* Try existing trampoline */
-        *patch_size_p = jump_patch_size(pc, (uintptr_t) trampoline_ptr, arch,
-                                        false);
+/* Write the jump patches for his, or put back the original code if unhook is
+ * set - skipping (and marking changed) hooks whose patch has been overwritten
+ * since. */
+static int commit_hooks(struct hook_internal *his, size_t nhooks,
+                        bool thread_safe, bool unhook) {
+    if (!nhooks)
+        return SUBSTITUTE_OK;
 
-        if (*patch_size_p != -1 && (size_t) *patch_size_p
-                                   <= *trampoline_size_left_p)
-            return SUBSTITUTE_OK;
+    struct execmem_foreign_write *fws;
+    size_t max_ranges = unhook ? 2 * nhooks : nhooks;
+    struct pc_range *ranges = arena_alloc(&g_scratch,
+                                          max_ranges * sizeof(*ranges) +
+                                          nhooks * sizeof(*fws));
+    if (!ranges)
+        return SUBSTITUTE_ERR_OOM;
+    fws = (void *) (ranges + max_ranges);
+    size_t nslow = 0, nranges = 0;
+    for (size_t i = 0; i < nhooks; i++) {
+        struct hook_internal *hi = &his[i];
+        if (unhook) {
+            hi->outro_busy = false;
+            struct chain_entry *ce = hi->target_rw ? chain_lookup(hi->code)
+                                                   : NULL;
+            if (hi->chained) {
+                if (!ce || ce->target != hook_target(hi)) {
+                    hi->changed = true;
+                    continue;
+                }
+                ce->target = hi->chain_prev;
+                __atomic_store_n(hi->target_rw, hi->chain_prev,
+                                 __ATOMIC_RELEASE);
+                continue;
+            }
+            if (memcmp(hook_patch_start(hi), hi->jump_patch,
+                       hi->jump_patch_size) ||
+                (ce && ce->target != hook_target(hi))) {
+                hi->changed = true;
+                continue;
+            }
+            /* (a thread in a shared one could be on its way from some other
+             * function, so it's left to carry on) */
+            if (hi->intro_size && !hi->intro_shared)
+                ranges[nranges++] = (struct pc_range)
+                    {hi->intro_pc, hi->intro_pc + hi->intro_size, hi};
+            ranges[nranges++] = (struct pc_range)
+                {hi->outro_pc, hi->outro_pc + hi->outro_size, hi};
+        } else {
+            /* Either way, the trampoline just jumps to the new replacement
+             * from now on. */
+            if (hi->chained) {
+                __atomic_store_n(hi->target_rw, hi->replacement,
+                                 __ATOMIC_RELEASE);
+                continue;
+            }
+            /* No other thread can be in the middle of a single instruction,
+             * so if that's all we're replacing, just store the patch.  If
+             * that doesn't work (say, the page can't be aliased writable),
+             * fall back to the usual way.  (This doesn't work for unhooking,
+             * since threads might be in the trampolines.) */
+            if (hi->atomic_ok && !atomic_write_patch(hi))
+                continue;
+            /* (no thread is in the padding) */
+            uintptr_t code = (uintptr_t) hi->code;
+            ranges[nranges++] = (struct pc_range)
+                {code, code + hi->jump_patch_size - hi->patch_offset, hi};
+        }
+        fws[nslow].dst = hook_patch_start(hi);
+        fws[nslow].src = unhook ? hi->orig : hi->jump_patch;
+        fws[nslow].len = hi->jump_patch_size;
+        nslow++;
     }
+    if (!nslow)
+        return SUBSTITUTE_OK;
+    /* Sort up front, so the time other threads spend suspended doesn't
+     * depend on the number of hooks. */
+    if (thread_safe)
+        qsort(ranges, nranges, sizeof(*ranges), compare_pc_range);
 
-    /* Allocate new trampoline - try after pc.  If this fails, we can try
-     * before pc before giving up. */
-    int ret = execmem_alloc_unsealed(pc, &trampoline_ptr, &trampoline_size_left);
-    if (!ret) {
-        *patch_size_p = jump_patch_size(pc, (uintptr_t) trampoline_ptr, arch,
-                                        false);
-        if (*patch_size_p != -1) {
-            ret = SUBSTITUTE_OK;
-            goto end;
+    struct pc_callback_info info = {ranges, nranges, unhook, false};
+    int ret = execmem_foreign_write_with_pc_patch(
+        fws, nslow, thread_safe ? pc_callback : NULL, &info);
+    /* If that failed, it's too late to free the trampolines.  Chances are
+     * this is fatal anyway. */
+    if (!ret && info.encountered_bad_pc)
+        ret = SUBSTITUTE_ERR_UNEXPECTED_PC_ON_OTHER_THREAD;
+    return ret;
+}
+
+static int txn_commit_writes() {
+    struct vec_txn_write *writes = &g_txn_writes.v;
+    size_t nwrites = writes->length;
+    if (!nwrites)
+        return SUBSTITUTE_OK;
+    int ret = SUBSTITUTE_ERR_OOM;
+    struct execmem_foreign_write *fws =
+        arena_alloc(&g_scratch, nwrites * sizeof(*fws));
+    if (fws) {
+        for (size_t i = 0; i < nwrites; i++) {
+            fws[i].dst = (void *) writes->els[i].dst;
+            fws[i].src = writes->els[i].data;
+            fws[i].len = writes->els[i].len;
         }
+        ret = execmem_foreign_write_with_pc_patch(fws, nwrites, NULL, NULL);
+    }
+    for (size_t i = 0; i < nwrites; i++)
+        free(writes->els[i].data);
+    vec_resize_txn_write(writes, 0);
+    return ret;
+}
 
-        execmem_free(trampoline_ptr);
+/* with g_hook_lock held */
+static int txn_commit_pending() {
+    struct vec_hook_internal *pending = &g_txn_hooks.v;
+    int ret = commit_hooks(pending->els, pending->length, g_txn_thread_safe,
+                           false);
+    vec_resize_hook_internal(pending, 0);
+    g_txn_thread_safe = false;
+    int write_ret = txn_commit_writes();
+    return ret ?: write_ret;
+}
+
+/* Whether code has a pending patch of its own (i.e. not chained). */
+static bool txn_pending_exact(uintptr_t code) {
+    struct vec_hook_internal *pending = &g_txn_hooks.v;
+    for (size_t i = 0; i < pending->length; i++) {
+        if ((uintptr_t) pending->els[i].code == code &&
+            !pending->els[i].chained)
+            return true;
     }
+    return false;
+}
 
-    /* Allocate new trampoline - try before pc (xxx only meaningful on arm64) */
-    uintptr_t start_address = pc - 0x80000000;
-    ret = execmem_alloc_unsealed(start_address,
-                                 &trampoline_ptr, &trampoline_size_left);
-    if (!ret) {
-        *patch_size_p = jump_patch_size(pc, (uintptr_t) trampoline_ptr, arch,
-                                        false);
-        if (*patch_size_p != -1) {
-            *trampoline_ptr_p = trampoline_ptr;
-            *trampoline_size_left_p = trampoline_size_left;
-            *trampoline_page_p = trampoline_ptr;
-            return SUBSTITUTE_OK;
-        }
+/* Whether a pending hook's patch might cover code - if so, hooking the same
+ * function again has to wait until that patch is in place, or the new
+ * trampoline would skip the old hook. */
+static bool txn_overlaps(uintptr_t code) {
+    struct vec_hook_internal *pending = &g_txn_hooks.v;
+    for (size_t i = 0; i < pending->length; i++) {
+        uintptr_t start = (uintptr_t) pending->els[i].code;
+        if (code - start < MAX_EXTENDED_PATCH_SIZE ||
+            start - code < MAX_EXTENDED_PATCH_SIZE)
+            return true;
+    }
+    /* likewise, the trampoline should copy the written code */
+    struct vec_txn_write *writes = &g_txn_writes.v;
+    for (size_t i = 0; i < writes->length; i++) {
+        uintptr_t start = writes->els[i].dst;
+        if (code - start < writes->els[i].len ||
+            start - code < MAX_EXTENDED_PATCH_SIZE)
+            return true;
+    }
+    return false;
+}
 
-        execmem_free(trampoline_ptr);
-        ret = SUBSTITUTE_ERR_OUT_OF_RANGE;
+/* Whether [dst, dst + len) overlaps a pending hook's patch or write, which
+ * has to be in place first so the writes land in order. */
+static bool txn_write_overlaps(uintptr_t dst, size_t len) {
+    struct vec_hook_internal *pending = &g_txn_hooks.v;
+    for (size_t i = 0; i < pending->length; i++) {
+        uintptr_t start = (uintptr_t) pending->els[i].code;
+        if (dst - start < MAX_EXTENDED_PATCH_SIZE || start - dst < len)
+            return true;
+    }
+    struct vec_txn_write *writes = &g_txn_writes.v;
+    for (size_t i = 0; i < writes->length; i++) {
+        uintptr_t start = writes->els[i].dst;
+        if (dst - start < writes->els[i].len || start - dst < len)
+            return true;
     }
+    return false;
+}
 
-end:
-    *trampoline_ptr_p = trampoline_ptr;
-    *trampoline_size_left_p = trampoline_size_left;
-    *trampoline_page_p = trampoline_ptr;
+EXPORT
+void substitute_set_defer_memory_writes(bool enabled) {
+    pthread_mutex_lock(&g_hook_lock);
+    g_defer_memory_writes = enabled;
+    pthread_mutex_unlock(&g_hook_lock);
+}
+
+int substitute_txn_queue_write(void *dst, const void *src, size_t len,
+                               bool *queuedp) {
+    int ret = SUBSTITUTE_OK;
+    *queuedp = false;
+    pthread_mutex_lock(&g_hook_lock);
+    if (!g_txn_depth || !g_defer_memory_writes)
+        goto out;
+    if (txn_write_overlaps((uintptr_t) dst, len) &&
+        (ret = txn_commit_pending()))
+        goto out;
+    void *data = malloc(len);
+    if (!data) {
+        ret = SUBSTITUTE_ERR_OOM;
+        goto out;
+    }
+    memcpy(data, src, len);
+    vec_append_txn_write(&g_txn_writes.v,
+                         (struct txn_write) {(uintptr_t) dst, len, data});
+    *queuedp = true;
+out:
+    arena_reset(&g_scratch);
+    pthread_mutex_unlock(&g_hook_lock);
     return ret;
 }
 
+EXPORT
+void substitute_hook_begin(void) {
+    pthread_mutex_lock(&g_hook_lock);
+    g_txn_depth++;
+    pthread_mutex_unlock(&g_hook_lock);
+}
 
 EXPORT
-int substitute_hook_functions(const struct substitute_function_hook *hooks,
-                              size_t nhooks,
-                              struct substitute_function_hook_record **recordp,
-                              int options) {
+int substitute_hook_commit(void) {
+    int ret = SUBSTITUTE_OK;
+    pthread_mutex_lock(&g_hook_lock);
+    if (g_txn_depth == 0)
+        substitute_panic("%s: no transaction in progress\n", __func__);
+    if (g_txn_depth == 1)
+        ret = txn_commit_pending();
+    g_txn_depth--;
+    arena_reset(&g_scratch);
+    pthread_mutex_unlock(&g_hook_lock);
+    return ret;
+}
+
+
+/* Exactly one of hooks, probes and traces is set. */
+static int hook_functions(const struct substitute_function_hook *hooks,
+                          const struct substitute_function_probe *probes,
+                          const struct substitute_function_trace *traces,
+                          size_t nhooks,
+                          struct substitute_function_hook_record **recordp,
+                          int options) {
     bool thread_safe = !(options & SUBSTITUTE_NO_THREAD_SAFETY);
-    if (thread_safe && !pthread_main_np())
-        return SUBSTITUTE_ERR_NOT_ON_MAIN_THREAD;
+    bool use_plan_cache = options & SUBSTITUTE_USE_PLAN_CACHE;
+    bool use_branch_index = options & SUBSTITUTE_USE_BRANCH_INDEX;
+    bool guard = hooks && (options & SUBSTITUTE_REENTRANCY_GUARD);
+    bool toggleable = options & SUBSTITUTE_TOGGLEABLE;
+    bool share = hooks && (options & SUBSTITUTE_SHARE_TRAMPOLINES);
+    bool use_padding = options & SUBSTITUTE_USE_HOT_PATCH_PADDING;
 
     if (recordp)
         *recordp = NULL;
+#if !defined(GUARD_STUB_SIZE) || !defined(__APPLE__)
+    /* the stub knows where Darwin keeps TSD */
+    if (guard)
+        return SUBSTITUTE_ERR_NOT_SUPPORTED;
+#endif
 
-    struct execmem_foreign_write *fws;
-    struct hook_internal *his = malloc(nhooks * sizeof(*his) +
-                                       nhooks * sizeof(*fws));
-    if (!his)
+    pthread_mutex_lock(&g_hook_lock);
+    bool queue = g_txn_depth > 0;
+
+    /* The record is just a copy of the internal state, so allocate that way
+     * to begin with - as scratch, if the caller doesn't want it. */
+    size_t record_size = sizeof(struct substitute_function_hook_record) +
+                         nhooks * sizeof(struct hook_internal);
+    struct substitute_function_hook_record *record =
+        recordp ? malloc(record_size) : arena_alloc(&g_scratch, record_size);
+    if (!record) {
+        pthread_mutex_unlock(&g_hook_lock);
         return SUBSTITUTE_ERR_OOM;
-    fws = (void *) (his + nhooks);
+    }
+    record->nhooks = nhooks;
+    struct hook_internal *his = record->his;
+
+    VEC_STORAGE_CAPA(branch_index, 2) branch_indexes;
+    VEC_STORAGE_INIT(&branch_indexes, branch_index);
+    struct function_starts_cache func_starts = FUNCTION_STARTS_CACHE_INIT;
 
-    for (size_t i = 0; i < nhooks; i++)
-        his[i].trampoline_page = NULL;
+    size_t parallel_min = __atomic_load_n(&g_parallel_prepare_min,
+                                          __ATOMIC_RELAXED);
+    bool parallel = parallel_min && nhooks >= parallel_min;
+    VEC_STORAGE(jump_check) checks;
+    VEC_STORAGE_INIT_ARENA(&checks, jump_check, &g_scratch);
+    VEC_STORAGE(shared_intro_key) new_shared;
+    VEC_STORAGE_INIT_ARENA(&new_shared, shared_intro_key, &g_scratch);
+    /* the guard stubs' keys, deleted again if we fail */
+    VEC_STORAGE(pthread_key) new_keys;
+    VEC_STORAGE_INIT_ARENA(&new_keys, pthread_key, &g_scratch);
 
     int ret = SUBSTITUTE_OK;
 
-    void *trampoline_ptr = NULL;
-    size_t trampoline_size_left = 0;
+    /* Trampolines come from the process-wide arena, which is shared with
+     * other callers. */
+    execmem_arena_lock();
 
     /* First run through and (a) ensure all the functions are OK to hook, (b)
      * allocate memory for the trampolines. */
     for (size_t i = 0; i < nhooks; i++) {
-        const struct substitute_function_hook *hook = &hooks[i];
+        /* a probe is a hook whose replacement is filled in below */
+        const struct substitute_function_hook *hook = hooks ? &hooks[i] : NULL;
+        uint64_t *counter = probes ? probes[i].counter : NULL;
+        bool hot = hook && (hook->options & SUBSTITUTE_HOOK_HOT);
         struct hook_internal *hi = &his[i];
-        void *code = make_sym_readable(hook->function);
+        void *code = make_sym_readable(hook ? hook->function :
+                                       probes ? probes[i].function :
+                                       traces[i].function);
         struct arch_dis_ctx arch;
         arch_dis_ctx_init(&arch);
 #ifdef __arm__
@@ -174,61 +735,171 @@ int substitute_hook_functions(const struct substitute_function_hook *hooks,
 #endif
         hi->code = code;
         hi->arch_dis_ctx = arch;
+        hi->outro_busy = hi->changed = false;
+        hi->replacement = hook ? (uintptr_t) make_sym_readable(hook->replacement)
+                               : 0;
+        hi->probe = counter != NULL;
+        hi->trace = traces != NULL;
+        hi->target_rw = hi->stub_target_rw = NULL;
+        hi->intro_pc = hi->intro_size = 0;
+        hi->intro_shared = false;
+        hi->outro_size = 0;
+        hi->jump_patch_size = hi->patch_offset = 0;
+        hi->atomic_ok = false;
+        hi->disabled = false;
+
+#ifdef TRACE_STUB_SIZE
+        if (traces) {
+            uintptr_t stub_pc;
+            void *stub_write;
+            if ((ret = execmem_arena_reserve(0, 0, TRACE_STUB_SIZE, false,
+                                             &stub_pc, &stub_write)))
+                goto end;
+            hi->stub_target_rw = (uintptr_t *)
+                ((uint8_t *) stub_write + TRACE_STUB_SITE);
+            make_trace_stub(&stub_write, stub_pc,
+                            (uintptr_t) make_sym_readable(
+                                substitute_trace_enter_asm),
+                            traces[i].id, arch);
+            hi->replacement = stub_pc;
+        }
+#endif
+#if defined(GUARD_STUB_SIZE) && defined(__APPLE__)
+        /* The guard stub goes in front of the replacement; like a trace
+         * stub's target, its fallback is filled in below, and it's never
+         * freed, since threads return through it. */
+        if (guard) {
+            pthread_key_t key;
+            if (pthread_key_create(&key, NULL)) {
+                ret = SUBSTITUTE_ERR_OOM;
+                goto end;
+            }
+            if (key > GUARD_STUB_MAX_KEY) {
+                pthread_key_delete(key);
+                ret = SUBSTITUTE_ERR_NOT_SUPPORTED;
+                goto end;
+            }
+            vec_append_pthread_key(&new_keys.v, key);
+            uintptr_t stub_pc;
+            void *stub_write;
+            if ((ret = execmem_arena_reserve(0, 0, GUARD_STUB_SIZE, hot,
+                                             &stub_pc, &stub_write)))
+                goto end;
+            hi->stub_target_rw = (uintptr_t *)
+                ((uint8_t *) stub_write + GUARD_STUB_FALLBACK);
+            make_guard_stub(&stub_write, stub_pc, (uint32_t) key,
+                            hi->replacement, arch);
+            hi->replacement = stub_pc;
+        }
+#endif
+
+        /* Already hooked?  Then rather than rewriting the first hook's patch
+         * into another trampoline, point its intro trampoline at us.  The
+         * registry is updated after the loop, in case something fails. */
+        struct chain_entry *ce = chain_lookup(code);
+        if (ce && (txn_pending_exact((uintptr_t) code) ||
+                   chain_patch_intact(ce, code))) {
+            hi->chained = true;
+            hi->target_rw = ce->target_rw;
+            if (counter) {
+                /* The stub goes between the trampoline and the previous
+                 * replacement. */
+                uintptr_t stub_pc;
+                void *stub_write;
+                if ((ret = execmem_arena_reserve(0, 0, PROBE_STUB_SIZE, false,
+                                                 &stub_pc, &stub_write)))
+                    goto end;
+                hi->stub_target_rw = (uintptr_t *)
+                    ((uint8_t *) stub_write + PROBE_STUB_LITERAL);
+                make_probe_stub(&stub_write, stub_pc, counter, arch);
+                hi->replacement = stub_pc;
+            }
+            continue;
+        }
+        hi->chained = false;
+
+        if (queue && txn_overlaps((uintptr_t) code) &&
+            (ret = txn_commit_pending()))
+            goto end;
         uintptr_t pc_patch_start = (uintptr_t) code;
-        uintptr_t replacement_dat = (uintptr_t) make_sym_readable(hook->replacement);
+        uintptr_t replacement_dat = hi->replacement;
         int patch_size;
-        bool need_intro_trampoline;
-        if ((ret = check_intro_trampoline(&trampoline_ptr, &trampoline_size_left,
-                                          pc_patch_start,
-                                          replacement_dat,
-                                          &patch_size, &need_intro_trampoline,
-                                          &hi->trampoline_page, arch)))
-            goto end;
-
-        uint_tptr pc_patch_end = pc_patch_start + patch_size;
         uintptr_t initial_target;
-        if (need_intro_trampoline) {
-            initial_target = (uintptr_t) trampoline_ptr;
-            make_jump_patch(&trampoline_ptr, (uintptr_t) trampoline_ptr,
-                            replacement_dat, arch);
-        } else {
-            initial_target = replacement_dat;
-        }
+        if ((ret = check_intro_trampoline(pc_patch_start, replacement_dat,
+                                          counter, toggleable, &patch_size, &initial_target,
+                                          hi, arch,
+                                          share ? &new_shared.v : NULL)))
+            goto end;
 
-        /* Make the real jump patch for the target function. */
+        /* Make the real jump patch for the target function - in the padding
+         * before it, if it has some and asked to. */
         void *jp = hi->jump_patch;
-        make_jump_patch(&jp, pc_patch_start, initial_target, arch);
+        bool padded = false;
+#ifdef HOT_PATCH_PAD_SIZE
+        padded = use_padding && hot_patch_padding_ok(pc_patch_start) &&
+                 jump_patch_size(pc_patch_start - HOT_PATCH_PAD_SIZE,
+                                 initial_target, arch, false) ==
+                     HOT_PATCH_PAD_SIZE;
+        if (padded) {
+            make_jump_patch(&jp, pc_patch_start - HOT_PATCH_PAD_SIZE,
+                            initial_target, arch);
+            make_hot_patch_entry(&jp);
+            hi->patch_offset = HOT_PATCH_PAD_SIZE;
+            patch_size = HOT_PATCH_ENTRY_SIZE;
+        }
+#else
+        (void) use_padding;
+#endif
+        if (!padded)
+            make_jump_patch(&jp, pc_patch_start, initial_target, arch);
         hi->jump_patch_size = (uint8_t *) jp - hi->jump_patch;
+        memcpy(hi->orig, hook_patch_start(hi), hi->jump_patch_size);
+
+        uint_tptr pc_patch_end = pc_patch_start + patch_size;
 
         size_t outro_est = TD_MAX_REWRITTEN_SIZE + MAX_JUMP_PATCH_SIZE;
 
-        if (outro_est > trampoline_size_left) {
-            /* Not enough space left in our existing block... */
-            if ((ret = execmem_alloc_unsealed(0, &trampoline_ptr,
-                                              &trampoline_size_left)))
-                goto end;
-            hi->trampoline_page = trampoline_ptr;
-        }
+        uintptr_t outro_pc;
+        void *outro_write;
+        if ((ret = execmem_arena_reserve(0, 0, outro_est, hot,
+                                         &outro_pc, &outro_write)))
+            goto end;
+        void *outro_write_start = outro_write;
 
-        void *outro_trampoline_real = trampoline_ptr;
-        hi->outro_trampoline = outro_trampoline_real;
+        hi->outro_pc = outro_pc;
+        hi->outro_trampoline = (void *) outro_pc;
 #ifdef __arm__
         if (arch.pc_low_bit)
             hi->outro_trampoline++;
 #endif
-        if (hook->old_ptr)
+        if (counter) {
+            /* the stub just continues into the original */
+            hi->replacement = (uintptr_t) hi->outro_trampoline;
+            *hi->target_rw = hi->replacement;
+        }
+        if (traces || guard)
+            *hi->stub_target_rw = (uintptr_t) hi->outro_trampoline;
+        if (hook && hook->old_ptr)
             *(void **) hook->old_ptr = make_sym_callable(hi->outro_trampoline);
 
         /* Generate the rewritten start of the function for the outro
          * trampoline (complaining if any bad instructions are found)
          * (on arm64, this modifies arch.regs_possibly_written, which is used
          * by the later make_jump_patch call) */
-        if ((ret = transform_dis_main(code, &trampoline_ptr, pc_patch_start,
-                                      &pc_patch_end, (uintptr_t) trampoline_ptr,
-                                      &arch, hi->offset_by_pcdiff,
-                                      thread_safe ? TRANSFORM_DIS_BAN_CALLS : 0)))
+        STATS_START(transform_start);
+        ret = transform_dis_main(code, &outro_write, pc_patch_start,
+                                 &pc_patch_end, outro_pc,
+                                 &arch, hi->offset_by_pcdiff,
+                                 &hi->outro_has_call,
+                                 thread_safe ? TRANSFORM_DIS_BAN_CALLS : 0);
+        STATS_END(transform_dis_ns, transform_start);
+        if (ret)
             goto end;
+#ifdef TARGET_arm64
+        STATS_ADD(trampoline_bytes_saved, arch.bytes_saved);
+#endif
 
+        hi->patch_region_size = pc_patch_end - pc_patch_start;
         uintptr_t dpc = pc_patch_end;
 #ifdef __arm__
         if (arch.pc_low_bit)
@@ -238,48 +909,386 @@ int substitute_hook_functions(const struct substitute_function_hook *hooks,
         /* Now that transform_dis_main has given us the final pc_patch_end,
          * check some of the rest of the function for jumps back into the
          * patched region. */
-        if ((ret = jump_dis_main(code, pc_patch_start, pc_patch_end, arch)))
-            goto end;
+        unsigned variant = 0;
+#ifdef __arm__
+        variant = arch.pc_low_bit;
+#endif
+        size_t cached_region_size;
+        if (!(use_plan_cache &&
+              plan_cache_lookup(code, variant, patch_size,
+                                &cached_region_size) &&
+              cached_region_size == hi->patch_region_size)) {
+            STATS_START(jump_start);
+            int bad = -1;
+            if (use_branch_index)
+                bad = branch_index_check(&branch_indexes.v, pc_patch_start,
+                                         pc_patch_end, arch);
+            uintptr_t func_end = bad == -1 ?
+                function_end(&func_starts, pc_patch_start) : 0;
+            if (bad == -1 && parallel) {
+                vec_append_jump_check(&checks.v, (struct jump_check) {
+                    i, code, pc_patch_start, pc_patch_end, func_end, arch,
+                    variant, patch_size, false
+                });
+                bad = 0;
+            } else {
+                if (bad == -1)
+                    bad = jump_dis_main(code, pc_patch_start, pc_patch_end,
+                                        func_end, arch, &g_scratch);
+                if (!bad && use_plan_cache)
+                    plan_cache_store(code, variant, patch_size,
+                                     hi->patch_region_size);
+            }
+            STATS_END(jump_dis_ns, jump_start);
+            if (bad) {
+                ret = SUBSTITUTE_ERR_FUNC_JUMPS_TO_START;
+                goto end;
+            }
+        }
+
+        size_t entry_size = hi->jump_patch_size - hi->patch_offset;
+        hi->atomic_ok = EXECMEM_ATOMIC_WRITE_OK(pc_patch_start, entry_size) &&
+                        (!hi->patch_offset ||
+                         EXECMEM_ATOMIC_WRITE_OK(hook_patch_start(hi),
+                                                 hi->patch_offset));
+        for (size_t d = 1; d < entry_size; d++) {
+            if (hi->offset_by_pcdiff[d] != -1)
+                hi->atomic_ok = false;
+        }
         /* Okay, continue with the outro. */
-        make_jump_patch(&trampoline_ptr, (uintptr_t) trampoline_ptr, dpc, arch);
-        trampoline_ptr += -(uintptr_t) trampoline_ptr % ARCH_MAX_CODE_ALIGNMENT;
-        trampoline_size_left -= (uint8_t *) trampoline_ptr
-                              - (uint8_t *) outro_trampoline_real;
+        make_jump_patch(&outro_write, outro_pc + ((uint8_t *) outro_write -
+                                                  (uint8_t *) outro_write_start),
+                        dpc, arch);
+        hi->outro_size = (uint8_t *) outro_write - (uint8_t *) outro_write_start;
+        execmem_arena_trim(outro_pc, outro_est, hi->outro_size);
     }
 
-    /* Now commit. */
+    /* The checks left for the thread pool: nothing's been patched yet, so if
+     * one fails, the trampolines all go away as usual. */
+    if (checks.v.length) {
+        struct jump_check *jcs = checks.v.els;
+#ifdef __APPLE__
+        dispatch_apply_f(checks.v.length,
+                         dispatch_get_global_queue(
+                             DISPATCH_QUEUE_PRIORITY_HIGH, 0),
+                         jcs, run_jump_check);
+#else
+        for (size_t i = 0; i < checks.v.length; i++)
+            run_jump_check(jcs, i);
+#endif
+        for (size_t i = 0; i < checks.v.length; i++) {
+            if (jcs[i].bad) {
+                ret = SUBSTITUTE_ERR_FUNC_JUMPS_TO_START;
+            } else if (use_plan_cache) {
+                plan_cache_store(jcs[i].code, jcs[i].variant,
+                                 jcs[i].patch_size,
+                                 his[jcs[i].idx].patch_region_size);
+            }
+        }
+        if (ret)
+            goto end;
+    }
+
+    /* The trampolines have to be in place before anything can jump to
+     * them. */
+    if ((ret = execmem_arena_flush()))
+        goto end;
+    execmem_arena_unlock();
+
     for (size_t i = 0; i < nhooks; i++) {
         struct hook_internal *hi = &his[i];
-        void *page = hi->trampoline_page;
-        if (page)
-            execmem_seal(page);
-        fws[i].dst = hi->code;
-        fws[i].src = hi->jump_patch;
-        fws[i].len = hi->jump_patch_size;
+        if (hi->chained) {
+            struct chain_entry *ce = chain_lookup(hi->code);
+            hi->chain_prev = ce->target;
+            ce->target = hi->replacement;
+            if (hi->stub_target_rw)
+                *hi->stub_target_rw = hi->chain_prev;
+            if (hooks && hooks[i].old_ptr)
+                *(void **) hooks[i].old_ptr =
+                    make_sym_callable((void *) hi->chain_prev);
+        } else if (hi->target_rw) {
+            uintptr_t key = (uintptr_t) hi->code;
+            struct chain_entry *ce =
+                htab_setp_chain_registry(&g_chains.h, &key, NULL);
+            ce->target_rw = hi->target_rw;
+            ce->target = hi->replacement;
+            memcpy(ce->jump_patch, hi->jump_patch, hi->jump_patch_size);
+            ce->jump_patch_size = hi->jump_patch_size;
+            ce->patch_offset = hi->patch_offset;
+        }
     }
 
-    struct pc_callback_info info = {his, nhooks, false};
-    if ((ret = execmem_foreign_write_with_pc_patch(
-            fws, nhooks, thread_safe ? pc_callback : NULL, &info))) {
-        /* Too late to free the trampolines.  Chances are this is fatal anyway. */
-        goto end_dont_free;
+    if (queue) {
+        /* Leave the patches for substitute_hook_commit. */
+        struct vec_hook_internal *pending = &g_txn_hooks.v;
+        size_t old_len = pending->length;
+        vec_resize_hook_internal(pending, old_len + nhooks);
+        memcpy(&pending->els[old_len], his, nhooks * sizeof(*his));
+        g_txn_thread_safe |= thread_safe;
+    } else {
+        ret = commit_hooks(his, nhooks, thread_safe, false);
     }
-    if (info.encountered_bad_pc) {
-        ret = SUBSTITUTE_ERR_UNEXPECTED_PC_ON_OTHER_THREAD;
-        goto end_dont_free;
+    if (!ret)
+        STATS_ADD(hooks_installed, nhooks);
+    if (recordp && !ret) {
+        *recordp = record;
+        record = NULL;
     }
-
     goto end_dont_free;
 end:
     /* if we failed, get rid of the trampolines. */
+    execmem_arena_abort();
+    execmem_arena_unlock();
+    for (size_t i = 0; i < new_shared.v.length; i++)
+        htab_remove_shared_intros(&g_shared_intros.h, &new_shared.v.els[i]);
+end_dont_free:
+    if (ret) {
+        for (size_t i = 0; i < new_keys.v.length; i++)
+            pthread_key_delete(new_keys.v.els[i]);
+    }
+    arena_reset(&g_scratch);
+    pthread_mutex_unlock(&g_hook_lock);
+    branch_index_cache_free(&branch_indexes.v);
+    function_starts_cache_free(&func_starts);
+    if (recordp)
+        free(record);
+    return ret;
+}
+
+EXPORT
+int substitute_hook_functions(const struct substitute_function_hook *hooks,
+                              size_t nhooks,
+                              struct substitute_function_hook_record **recordp,
+                              int options) {
+    return hook_functions(hooks, NULL, NULL, nhooks, recordp, options);
+}
+
+EXPORT
+int substitute_probe_functions(const struct substitute_function_probe *probes,
+                               size_t nprobes,
+                               struct substitute_function_hook_record **recordp,
+                               int options) {
+    return hook_functions(NULL, probes, NULL, nprobes, recordp, options);
+}
+
+EXPORT
+int substitute_trace_functions(const struct substitute_function_trace *traces,
+                               size_t ntraces,
+                               struct substitute_function_hook_record **recordp,
+                               int options) {
+#ifdef TRACE_STUB_SIZE
+    return hook_functions(NULL, NULL, traces, ntraces, recordp, options);
+#else
+    (void) traces; (void) ntraces; (void) options;
+    if (recordp)
+        *recordp = NULL;
+    return SUBSTITUTE_ERR_NOT_SUPPORTED;
+#endif
+}
+
+/* What hook_functions would do with one hook, short of placing anything:
+ * the trampoline is assumed to land close enough to the function for the
+ * shortest patch, as it normally does. */
+static int check_hook(const struct substitute_function_hook *hook,
+                      struct substitute_hook_check *res, int options) {
+    bool thread_safe = !(options & SUBSTITUTE_NO_THREAD_SAFETY);
+    memset(res, 0, sizeof(*res));
+    void *code = make_sym_readable(hook->function);
+    struct arch_dis_ctx arch;
+    arch_dis_ctx_init(&arch);
+#ifdef __arm__
+    if ((uintptr_t) code & 1) {
+        arch.pc_low_bit = true;
+        code--;
+    }
+#endif
+#if defined(GUARD_STUB_SIZE) && defined(__APPLE__)
+    if (options & SUBSTITUTE_REENTRANCY_GUARD)
+        res->trampoline_size += GUARD_STUB_SIZE;
+#else
+    if (options & SUBSTITUTE_REENTRANCY_GUARD)
+        return SUBSTITUTE_ERR_NOT_SUPPORTED;
+#endif
+
+    /* chaining onto an existing hook doesn't touch the function */
+    pthread_mutex_lock(&g_hook_lock);
+    struct chain_entry *ce = chain_lookup(code);
+    bool chained = ce && (txn_pending_exact((uintptr_t) code) ||
+                          chain_patch_intact(ce, code));
+    pthread_mutex_unlock(&g_hook_lock);
+    if (chained)
+        return SUBSTITUTE_OK;
+
+    uintptr_t pc_patch_start = (uintptr_t) code;
+    uintptr_t dpc = (uintptr_t) make_sym_readable(hook->replacement);
+    int near = jump_patch_size(pc_patch_start, pc_patch_start, arch, false);
+    int direct = jump_patch_size(pc_patch_start, dpc, arch, false);
+    bool intro = (options & SUBSTITUTE_TOGGLEABLE) || direct == -1;
+#ifdef JUMP_PATCH_SHORTEST_REACH
+    intro = intro || direct != JUMP_PATCH_SHORTEST_SIZE;
+#endif
+    int patch_size = intro ? near : direct;
+    if (intro) {
+        res->trampoline_size += RETARGETABLE_JUMP_SIZE;
+        /* somewhere within the reach hook_functions would ask the arena for
+         * (it tries closer first, but only fails if this does) */
+        execmem_arena_lock();
+        int ret = execmem_arena_check(pc_patch_start, JUMP_PATCH_REACH,
+                                      RETARGETABLE_JUMP_SIZE);
+        execmem_arena_unlock();
+        if (ret)
+            return ret;
+    }
+#ifdef HOT_PATCH_PAD_SIZE
+    /* (the rest of the patch goes in the padding) */
+    if ((options & SUBSTITUTE_USE_HOT_PATCH_PADDING) &&
+        hot_patch_padding_ok(pc_patch_start))
+        patch_size = HOT_PATCH_ENTRY_SIZE;
+#endif
+    res->patch_size = patch_size;
+
+    /* The outro is rewritten into a buffer on the stack, as if that were
+     * where it was going to run; being nowhere near the function, it gets
+     * the longest forms of any pc-relative fixups, so the size is an upper
+     * bound. */
+    uint8_t outro[TD_MAX_REWRITTEN_SIZE + MAX_JUMP_PATCH_SIZE];
+    int offset_by_pcdiff[MAX_EXTENDED_PATCH_SIZE + 1];
+    void *outro_write = outro;
+    uintptr_t outro_pc = (uintptr_t) outro;
+    uint_tptr pc_patch_end = pc_patch_start + patch_size;
+    int ret = transform_dis_main(code, &outro_write, pc_patch_start,
+                                 &pc_patch_end, outro_pc, &arch,
+                                 offset_by_pcdiff, NULL,
+                                 thread_safe ? TRANSFORM_DIS_BAN_CALLS : 0);
+    if (ret)
+        return ret;
+    size_t region_size = pc_patch_end - pc_patch_start;
+    res->relocated_size = region_size;
+    for (size_t d = 1; d <= region_size; d++)
+        res->relocated_insns += offset_by_pcdiff[d] != -1;
+
+    struct function_starts_cache func_starts = FUNCTION_STARTS_CACHE_INIT;
+    uintptr_t func_end = function_end(&func_starts, pc_patch_start);
+    function_starts_cache_free(&func_starts);
+    struct arena scratch;
+    arena_init(&scratch);
+    bool bad = jump_dis_main(code, pc_patch_start, pc_patch_end, func_end,
+                             arch, &scratch);
+    arena_free(&scratch);
+    if (bad)
+        return SUBSTITUTE_ERR_FUNC_JUMPS_TO_START;
+
+    uintptr_t outro_dpc = pc_patch_end;
+#ifdef __arm__
+    if (arch.pc_low_bit)
+        outro_dpc++;
+#endif
+    make_jump_patch(&outro_write,
+                    outro_pc + ((uint8_t *) outro_write - outro), outro_dpc,
+                    arch);
+    res->trampoline_size += (uint8_t *) outro_write - outro;
+    return SUBSTITUTE_OK;
+}
+
+EXPORT
+int substitute_check_hooks(const struct substitute_function_hook *hooks,
+                           size_t nhooks,
+                           struct substitute_hook_check *results,
+                           int options) {
+    int ret = SUBSTITUTE_OK;
     for (size_t i = 0; i < nhooks; i++) {
-        void *page = his[i].trampoline_page;
-        if (page)
-            execmem_free(page);
+        int r = check_hook(&hooks[i], &results[i], options);
+        results[i].error = r;
+        if (r && !ret)
+            ret = r;
     }
-end_dont_free:
-    free(his);
     return ret;
 }
 
+EXPORT
+int substitute_unhook_functions(struct substitute_function_hook_record *record,
+                                int options) {
+    bool thread_safe = !(options & SUBSTITUTE_NO_THREAD_SAFETY);
+
+    int ret = SUBSTITUTE_OK;
+    pthread_mutex_lock(&g_hook_lock);
+    /* Our patches might still be queued. */
+    if ((g_txn_hooks.v.length || g_txn_writes.v.length) &&
+        (ret = txn_commit_pending()))
+        goto out;
+    if ((ret = commit_hooks(record->his, record->nhooks, thread_safe, true)))
+        goto out;
+
+    execmem_arena_lock();
+    for (size_t i = 0; i < record->nhooks; i++) {
+        struct hook_internal *hi = &record->his[i];
+        /* whoever hooked it after us may have copied our patch into their own
+         * trampoline, so ours have to stay */
+        if (hi->changed) {
+            ret = SUBSTITUTE_ERR_HOOK_CHANGED;
+            continue;
+        }
+        /* (a chained probe or trace's stub stays, since nothing checked
+         * whether some thread is in it) */
+        if (hi->chained)
+            continue;
+        if (hi->target_rw) {
+            uintptr_t key = (uintptr_t) hi->code;
+            htab_remove_chain_registry(&g_chains.h, &key);
+        }
+        if (hi->trace)
+            continue;
+        if (hi->intro_size && !hi->intro_shared &&
+            !(hi->probe && hi->outro_busy))
+            execmem_arena_release(hi->intro_pc, hi->intro_size);
+        if (!hi->outro_has_call && !hi->outro_busy)
+            execmem_arena_release(hi->outro_pc, hi->outro_size);
+    }
+    execmem_arena_unlock();
+    free(record);
+out:
+    arena_reset(&g_scratch);
+    pthread_mutex_unlock(&g_hook_lock);
+    return ret;
+}
+
+EXPORT
+int substitute_set_hook_enabled(struct substitute_function_hook_record *record,
+                                size_t idx, bool enabled) {
+    int ret = SUBSTITUTE_OK;
+    pthread_mutex_lock(&g_hook_lock);
+    /* the pending copy of the hook would put the replacement back */
+    if ((g_txn_hooks.v.length || g_txn_writes.v.length) &&
+        (ret = txn_commit_pending()))
+        goto out;
+    struct hook_internal *hi = &record->his[idx];
+    /* (an unchained probe's trampoline is its stub, which already goes to
+     * the original) */
+    if (!hi->target_rw || (hi->probe && !hi->chained)) {
+        ret = SUBSTITUTE_ERR_NOT_SUPPORTED;
+        goto out;
+    }
+    if (hi->disabled == !enabled)
+        goto out;
+    /* Only the last hook chained onto the trampoline owns its literal;
+     * earlier ones are called through later ones' old_ptr. */
+    struct chain_entry *ce = chain_lookup(hi->code);
+    if (!ce || ce->target != hook_target(hi)) {
+        ret = SUBSTITUTE_ERR_HOOK_CHANGED;
+        goto out;
+    }
+    hi->disabled = !enabled;
+    ce->target = hook_target(hi);
+    __atomic_store_n(hi->target_rw, ce->target, __ATOMIC_RELEASE);
+out:
+    arena_reset(&g_scratch);
+    pthread_mutex_unlock(&g_hook_lock);
+    return ret;
+}
+
+EXPORT
+void substitute_free_hook_record(struct substitute_function_hook_record *record) {
+    free(record);
+}
+
 #endif /* TARGET_DIS_SUPPORTED */
@@ -2,7 +2,16 @@
 #include "substitute-internal.h"
 #ifdef TARGET_DIS_SUPPORTED
 #define DIS_MAY_MODIFY 0
+/* use the cut down decoders where there are any (see gen-branch-dis.py) */
+#ifndef DIS_BRANCHES_ONLY
+#define DIS_BRANCHES_ONLY 1
+#endif
 #include "dis.h"
+#include "jump-dis.h"
+#include "cbit/arena.h"
+#ifdef TARGET_arm64
+#include "arm64/dis-prefilter.h"
+#endif
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
@@ -37,12 +46,24 @@ struct jump_dis_ctx {
      * actually guaranteed to be processed in sorted order, but we'll follow
      * the straight line before branches, which should be good enough. */
     uint_tptr pc_ret;
+    /* set if the function's end is known, in which case there's no need for
+     * the pc_ret hack */
+    bool bounded;
 
-    uint8_t seen_mask[JUMP_ANALYSIS_MAX_INSNS / 8];
+    /* one bit per MIN_INSN_SIZE from pc_patch_start, for max_insns; usually
+     * seen_inline, unless the function's known to be longer */
+    uint8_t *seen_mask;
+    size_t max_insns;
+    uint8_t seen_inline[JUMP_ANALYSIS_MAX_INSNS / 8];
     /* queue of instructions to visit (well, stack) */
     VEC_STORAGE_CAPA(uint_tptr, 10) queue;
 
     struct arch_dis_ctx arch;
+
+    /* for jump_dis_collect_refs: if set, [pc_patch_start, pc_patch_end) is
+     * the whole range being swept, and references into it are added here
+     * instead of being followed */
+    struct vec_jump_dis_ref *refs;
 };
 
 #undef P
@@ -52,7 +73,7 @@ struct jump_dis_ctx {
 
 static void jump_dis_add_to_queue(struct jump_dis_ctx *ctx, uint_tptr pc) {
     size_t diff = (pc - ctx->pc_patch_start) / MIN_INSN_SIZE;
-    if (diff >= JUMP_ANALYSIS_MAX_INSNS) {
+    if (diff >= ctx->max_insns) {
 #ifdef JUMP_DIS_VERBOSE
         fprintf(stderr, "jump-dis: not adding %llx - out of range\n",
                (unsigned long long) pc);
@@ -71,6 +92,14 @@ static void jump_dis_add_to_queue(struct jump_dis_ctx *ctx, uint_tptr pc) {
     vec_append_uint_tptr(&ctx->queue.v, pc);
 }
 
+static void jump_dis_add_ref(struct jump_dis_ctx *ctx, uint_tptr dpc) {
+    if (dpc - ctx->pc_patch_start < ctx->pc_patch_end - ctx->pc_patch_start) {
+        struct jump_dis_ref ref = {ctx->base.pc - ctx->pc_patch_start,
+                                   dpc - ctx->pc_patch_start};
+        vec_append_jump_dis_ref(ctx->refs, ref);
+    }
+}
+
 static INLINE UNUSED
 void jump_dis_data(UNUSED struct jump_dis_ctx *ctx,
                    UNUSED unsigned o0, UNUSED unsigned o1, UNUSED unsigned o2,
@@ -82,7 +111,13 @@ void jump_dis_data(UNUSED struct jump_dis_ctx *ctx,
 static INLINE UNUSED
 void jump_dis_pcrel(struct jump_dis_ctx *ctx, uint_tptr dpc,
                     UNUSED struct arch_pcrel_info info) {
+#ifdef TARGET_arm64
     if ((ctx->base.op & 0x9f000000) == 0x90000000) return; // ignore ADRP
+#endif
+    if (ctx->refs) {
+        jump_dis_add_ref(ctx, dpc);
+        return;
+    }
     ctx->bad_insn = dpc >= ctx->pc_patch_start && dpc < ctx->pc_patch_end;
 }
 
@@ -92,13 +127,17 @@ void jump_dis_indirect_call(UNUSED struct jump_dis_ctx *ctx) {
 
 static INLINE UNUSED
 void jump_dis_ret(struct jump_dis_ctx *ctx) {
-    if (ctx->pc_ret > ctx->base.pc)
+    if (!ctx->bounded && ctx->pc_ret > ctx->base.pc)
         ctx->pc_ret = ctx->base.pc;
     ctx->continue_after_this_insn = false;
 }
 
 static NOINLINE UNUSED
 void jump_dis_branch(struct jump_dis_ctx *ctx, uint_tptr dpc, int cc) {
+    if (ctx->refs) {
+        jump_dis_add_ref(ctx, dpc);
+        return;
+    }
     if (dpc >= ctx->pc_patch_start && dpc < ctx->pc_patch_end) {
         ctx->bad_insn = true;
         return;
@@ -126,8 +165,9 @@ void jump_dis_thumb_it(UNUSED struct jump_dis_ctx *ctx) {
 static void jump_dis_dis(struct jump_dis_ctx *ctx);
 
 bool jump_dis_main(void *code_ptr, uint_tptr pc_patch_start,
-                   uint_tptr pc_patch_end,
-                   struct arch_dis_ctx initial_dis_ctx) {
+                   uint_tptr pc_patch_end, uint_tptr pc_func_end,
+                   struct arch_dis_ctx initial_dis_ctx,
+                   struct arena *scratch) {
     bool ret;
     struct jump_dis_ctx ctx;
     memset(&ctx, 0, sizeof(ctx));
@@ -136,7 +176,33 @@ bool jump_dis_main(void *code_ptr, uint_tptr pc_patch_start,
     ctx.pc_ret = -1;
     ctx.base.pc = pc_patch_end;
     ctx.arch = initial_dis_ctx;
-    VEC_STORAGE_INIT(&ctx.queue, uint_tptr);
+    ctx.seen_mask = ctx.seen_inline;
+    ctx.max_insns = JUMP_ANALYSIS_MAX_INSNS;
+    uint8_t *heap_mask = NULL;
+    if (pc_func_end) {
+        /* nothing after the patch means nothing to check */
+        if (pc_func_end <= pc_patch_end)
+            return false;
+        size_t n = (pc_func_end - pc_patch_start + MIN_INSN_SIZE - 1) /
+                   MIN_INSN_SIZE;
+        if (n > JUMP_DIS_MAX_FUNC_INSNS)
+            n = JUMP_DIS_MAX_FUNC_INSNS;
+        uint8_t *mask = ctx.seen_inline;
+        if (n > JUMP_ANALYSIS_MAX_INSNS) {
+            size_t mask_size = (n + 7) / 8;
+            mask = scratch ? arena_alloc(scratch, mask_size)
+                           : (heap_mask = malloc(mask_size));
+            if (mask)
+                memset(mask, 0, mask_size);
+        }
+        /* (without the memory, just do the usual window) */
+        if (mask) {
+            ctx.seen_mask = mask;
+            ctx.max_insns = n;
+            ctx.bounded = true;
+        }
+    }
+    VEC_STORAGE_INIT_ARENA(&ctx.queue, uint_tptr, scratch);
     while (1) {
         ctx.bad_insn = false;
         ctx.continue_after_this_insn = true;
@@ -173,8 +239,37 @@ done:
     ret = false;
 fail:
     vec_free_storage_uint_tptr(&ctx.queue.v);
+    free(heap_mask);
     return ret;
 }
 
+void jump_dis_collect_refs(void *code_ptr, uint_tptr pc_start, size_t size,
+                           struct arch_dis_ctx initial_dis_ctx,
+                           struct vec_jump_dis_ref *refs) {
+    struct jump_dis_ctx ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.pc_patch_start = pc_start;
+    ctx.pc_patch_end = pc_start + size;
+    ctx.arch = initial_dis_ctx;
+    ctx.refs = refs;
+#ifdef TARGET_arm64
+    /* Most instructions can't produce a reference, and finding the ones that
+     * might is much cheaper than decoding everything. */
+    size_t n = size / 4;
+    for (size_t i = 0; (i = arm64_prefilter_next(code_ptr, i, n)) < n; i++) {
+        ctx.base.pc = pc_start + i * 4;
+        ctx.base.ptr = code_ptr + i * 4;
+        jump_dis_dis(&ctx);
+    }
+#else
+    for (ctx.base.pc = pc_start;
+         ctx.pc_patch_end - ctx.base.pc >= MIN_INSN_SIZE;
+         ctx.base.pc += MIN_INSN_SIZE) {
+        ctx.base.ptr = code_ptr + (ctx.base.pc - pc_start);
+        jump_dis_dis(&ctx);
+    }
+#endif
+}
+
 #include stringify(TARGET_DIR/dis-main.inc.h)
 #endif /* TARGET_DIS_SUPPORTED */
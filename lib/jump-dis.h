@@ -2,6 +2,31 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include "dis.h"
+#include "cbit/vec.h"
 
-bool jump_dis_main(void *code_ptr, uintptr_t pc_patch_start, uintptr_t pc_patch_end,
-                   struct arch_dis_ctx initial_dis_ctx);
+struct arena;
+/* pc_func_end is where the function ends, if known (see function-starts.h),
+ * or 0: then the analysis looks a fixed distance past the patch, and stops
+ * following the straight line at the first ret.  With it, everything
+ * reachable in the function is checked, up to JUMP_DIS_MAX_FUNC_INSNS
+ * instructions.
+ * scratch (which may be NULL) is where the queue of branches to follow goes
+ * if it gets long, and the record of what's been seen for a long function */
+enum { JUMP_DIS_MAX_FUNC_INSNS = 65536 };
+bool jump_dis_main(void *code_ptr, uint_tptr pc_patch_start, uint_tptr pc_patch_end,
+                   uint_tptr pc_func_end, struct arch_dis_ctx initial_dis_ctx,
+                   struct arena *scratch);
+
+struct jump_dis_ref {
+    /* both offsets from the start of the range */
+    uint32_t from, to;
+};
+DECL_VEC(struct jump_dis_ref, jump_dis_ref);
+
+/* Decode [pc_start, pc_start + size) straight through, appending each
+ * branch or pc-relative reference that lands inside the range to *refs.
+ * Only use this with ARCH_FIXED_WIDTH_INSNS; otherwise data in the range
+ * can knock the decoding out of sync. */
+void jump_dis_collect_refs(void *code_ptr, uint_tptr pc_start, size_t size,
+                           struct arch_dis_ctx initial_dis_ctx,
+                           struct vec_jump_dis_ref *refs);
@@ -0,0 +1,15 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+/* Cache of jump_dis_main results, shared between processes, so the same
+ * system functions don't get their bodies scanned on every launch.  An entry
+ * says that hooking 'code' (in the image it belongs to, identified by UUID)
+ * with a patch of patch_size bytes relocates region_size bytes, and that
+ * nothing later in the function jumps back into them.  Only successes are
+ * stored.  'variant' distinguishes different ways of decoding the same code
+ * (i.e. Thumb).  If the cache can't be opened, lookups just miss.
+ * Not thread safe; hook-functions.c calls these with its lock held. */
+bool plan_cache_lookup(const void *code, unsigned variant, size_t patch_size,
+                       size_t *region_size_p);
+void plan_cache_store(const void *code, unsigned variant, size_t patch_size,
+                      size_t region_size);
@@ -0,0 +1,37 @@
+#pragma once
+#include "substitute.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <mach/mach_time.h>
+/* The counters behind substitute_get_stats.  The *_ns fields of g_stats
+ * actually hold stats_ticks() units until substitute_get_stats converts
+ * them.  stats_ticks reads the CPU counter directly, so it is safe to call
+ * while other threads are stopped and the page with mach_absolute_time might
+ * be in the middle of being remapped. */
+extern bool g_stats_enabled;
+extern struct substitute_stats g_stats;
+
+static inline uint64_t stats_ticks(void) {
+#if defined(__arm64__) || defined(__aarch64__)
+    uint64_t ticks;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+#elif defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return mach_absolute_time();
+#endif
+}
+
+#define STATS_START(var) \
+    uint64_t var = __atomic_load_n(&g_stats_enabled, __ATOMIC_RELAXED) ? \
+                   stats_ticks() : 0
+#define STATS_END(field, var) do { \
+    if (var) \
+        __atomic_fetch_add(&g_stats.field, stats_ticks() - (var), \
+                           __ATOMIC_RELAXED); \
+} while (0)
+#define STATS_ADD(field, n) do { \
+    if (__atomic_load_n(&g_stats_enabled, __ATOMIC_RELAXED)) \
+        __atomic_fetch_add(&g_stats.field, (n), __ATOMIC_RELAXED); \
+} while (0)
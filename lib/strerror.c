@@ -20,6 +20,10 @@ const char *substitute_strerror(int err) {
         CASE(SUBSTITUTE_ERR_UNKNOWN_RELOCATION_TYPE);
         CASE(SUBSTITUTE_ERR_NO_SUCH_SELECTOR);
         CASE(SUBSTITUTE_ERR_ADJUSTING_THREADS);
+        CASE(SUBSTITUTE_ERR_HOOK_CHANGED);
+        CASE(SUBSTITUTE_ERR_NOT_SUPPORTED);
+        CASE(SUBSTITUTE_ERR_TRACE_STATE);
+        CASE(SUBSTITUTE_ERR_NO_SUCH_SYMBOL);
         _Static_assert(__COUNTER__ - _start ==
                        _SUBSTITUTE_CURRENT_MAX_ERR_PLUS_ONE + 1,
                        "not all errors named in strerror.c");
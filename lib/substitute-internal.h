@@ -8,6 +8,7 @@
 #include <os/log.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdbool.h>
 
 #define LOG(...) os_log(OS_LOG_DEFAULT, __VA_ARGS__);
 
@@ -25,6 +26,7 @@
 #include <mach-o/dyld.h>
 #include <mach-o/dyld_images.h>
 #include <mach-o/nlist.h>
+#include <dispatch/dispatch.h>
 #ifdef __LP64__
 typedef struct mach_header_64 mach_header_x;
 typedef struct segment_command_64 segment_command_x;
@@ -109,7 +111,123 @@ int substitute_dlopen_in_pid(int pid, const char *filename, int options,
                              const struct shuttle *shuttle, size_t nshuttle,
                              char **error);
 
+/* Values in the status array from substitute_dlopen_all_in_pid. */
+enum {
+    /* the remote thread hasn't got to this one yet */
+    SUBSTITUTE_INJECT_PENDING = 0,
+    /* dlopened, and its substitute_init (if any) has returned */
+    SUBSTITUTE_INJECT_LOADED = 1,
+    SUBSTITUTE_INJECT_DLOPEN_FAILED = 2,
+};
+
+/* Like substitute_dlopen_in_pid, but one remote thread dlopens each of the
+ * filenames in order, calling each one's substitute_init with the same
+ * shuttles.  If status is non-NULL, it's set to a page shared with the target
+ * where (*status)[i] says what happened to filenames[i], and
+ * (*status)[nfilenames] becomes nonzero once the thread is done with them;
+ * free it with substitute_free_inject_status.  All the filenames together
+ * must fit in a page. */
+int substitute_dlopen_all_in_pid(int pid, const char *const *filenames,
+                                 size_t nfilenames, int options,
+                                 const struct shuttle *shuttle, size_t nshuttle,
+                                 volatile int32_t **status, char **error);
+void substitute_free_inject_status(volatile int32_t *status);
+
+/* msgh_id of the message substitute_dlopen_all_in_pid_notify has the remote
+ * thread send */
+#define SUBSTITUTE_INJECT_DONE_MSG_ID 0x53554244
+
+/* Like substitute_dlopen_all_in_pid, but once the remote thread is done it
+ * sends a message to notify_port (a receive right of yours) with msgh_id
+ * SUBSTITUTE_INJECT_DONE_MSG_ID, consisting of the header followed by the
+ * nfilenames + 1 int32 statuses.  The target only ever gets one send right,
+ * which the message uses up, so a no-senders notification on notify_port
+ * arrives after the message or, if the target died first, instead of it. */
+int substitute_dlopen_all_in_pid_notify(int pid, const char *const *filenames,
+                                        size_t nfilenames, int options,
+                                        const struct shuttle *shuttle,
+                                        size_t nshuttle,
+                                        mach_port_t notify_port,
+                                        char **error);
+
+/* The same, but calls callback on queue with the statuses (valid for the
+ * duration of the call) once they arrive.  If the target died before
+ * finishing, they're all SUBSTITUTE_INJECT_PENDING, including the last. */
+int substitute_dlopen_all_in_pid_async(int pid, const char *const *filenames,
+                                       size_t nfilenames, int options,
+                                       const struct shuttle *shuttle,
+                                       size_t nshuttle,
+                                       dispatch_queue_t queue,
+                                       void (*callback)(void *ctx, int pid,
+                                                        const int32_t *status),
+                                       void *ctx, char **error);
+
+/* The same for several processes at once, each getting its own copy of the
+ * shuttles.  The per-task work runs concurrently once the first target's
+ * symbols are found.  rets[i] and errors[i] get what substitute_dlopen_in_pid
+ * would have returned for pids[i] (free the errors); the return value is the
+ * first nonzero rets[i], or SUBSTITUTE_OK. */
+int substitute_dlopen_in_pids(const int *pids, size_t npids,
+                              const char *filename, int options,
+                              const struct shuttle *shuttle, size_t nshuttle,
+                              int *rets, char **errors);
+
+/* For injecting into the same process over and over: the context holds on to
+ * the task port, the target's symbol addresses and a copy of the code the
+ * remote thread runs, so each substitute_inject_ctx_dlopen only has to set up
+ * a stack and the shared page (which the thread frees itself when done).
+ * substitute_inject_ctx_dlopen works like substitute_dlopen_all_in_pid, and
+ * can be called from several threads at once.  The code page is left in the
+ * target on close, one page per context. */
+struct substitute_inject_ctx;
+int substitute_inject_ctx_open(int pid, struct substitute_inject_ctx **ctxp,
+                               char **error);
+int substitute_inject_ctx_dlopen(struct substitute_inject_ctx *ctx,
+                                 const char *const *filenames,
+                                 size_t nfilenames, int options,
+                                 const struct shuttle *shuttle,
+                                 size_t nshuttle, volatile int32_t **status,
+                                 char **error);
+void substitute_inject_ctx_close(struct substitute_inject_ctx *ctx);
+
 int substitute_ios_unrestrict(task_t task, char **error);
+
+/* Hook functions in another task, given a send right to its task port,
+ * without injecting anything: the trampolines are written into pages
+ * allocated in the target, and with the options as for
+ * substitute_hook_functions, the target is suspended while its threads are
+ * checked and the patches are written.  'function' and 'replacement' are
+ * addresses in the target (which must be the same architecture as us, and
+ * on arm64e, 'replacement' must be unsigned and thread safety is only
+ * possible if no thread is in a patch region), and *old_ptr, if set, gets
+ * the target address of the outro trampoline.  On failure no patch is
+ * left written, unless putting one back failed too, in which case the
+ * trampolines are left allocated for it (and *old_ptr is still not set).
+ * There is no undoing this short of the target exiting.  Using the calling
+ * task needs SUBSTITUTE_NO_THREAD_SAFETY. */
+struct substitute_function_hook;
+int substitute_hook_functions_in_task(task_t task,
+                                      const struct substitute_function_hook *hooks,
+                                      size_t nhooks, int options);
+
+/* Look a name up in every loaded image, in load order, for SubFindSymbol with
+ * no image.  Names that have been found before come from a small table;
+ * otherwise *searchedp is set and each image is searched in turn, one such
+ * search at a time. */
+void *find_sym_in_loaded_images(const char *name, bool *searchedp);
+
+/* For SubHookMemory: if a transaction is open and deferring writes is on,
+ * copy the data and queue the write for substitute_hook_commit. */
+int substitute_txn_queue_write(void *dst, const void *src, size_t len,
+                               bool *queuedp);
+
+/* For substitute_memory_report: each of these calls back with the pages its
+ * module has mapped (a page-aligned range, of which 'used' bytes hold
+ * something), with its lock held. */
+typedef void (*memory_region_callback)(void *ctx, int kind, uintptr_t start,
+                                       size_t size, size_t used);
+void objc_enum_memory(memory_region_callback callback, void *ctx);
+void find_syms_enum_memory(memory_region_callback callback, void *ctx);
 #endif
 
 static inline const char *xbasename(const char *path) {
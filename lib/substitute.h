@@ -57,8 +57,8 @@ enum {
      * preventing pages from being marked executable. */
     SUBSTITUTE_ERR_VM = 6,
 
-    /* substitute_hook_functions: not on the main thread, and you did not pass
-     * SUBSTITUTE_NO_THREAD_SAFETY */
+    /* no longer returned; hooking used to be restricted to the main thread
+     * unless SUBSTITUTE_NO_THREAD_SAFETY was passed */
     SUBSTITUTE_ERR_NOT_ON_MAIN_THREAD = 7,
 
     /* substitute_hook_functions: when trying to patch the PC of other threads
@@ -84,6 +84,22 @@ enum {
     /* substitute_hook_functions: OS error suspending other threads */
     SUBSTITUTE_ERR_ADJUSTING_THREADS = 12,
 
+    /* substitute_unhook_functions, substitute_unhook_imports: the patched
+     * code or import slot no longer contains what we put there (something
+     * else hooked it afterward), so it was left alone */
+    SUBSTITUTE_ERR_HOOK_CHANGED = 13,
+
+    /* substitute_trace_*: not implemented for this architecture */
+    SUBSTITUTE_ERR_NOT_SUPPORTED = 14,
+
+    /* substitute_trace_start: already tracing; substitute_trace_stop: not
+     * tracing */
+    SUBSTITUTE_ERR_TRACE_STATE = 15,
+
+    /* substitute_apply_hook_manifests: an entry's image, symbol, class or
+     * selector couldn't be found; the other entries were still applied */
+    SUBSTITUTE_ERR_NO_SUCH_SYMBOL = 16,
+
     _SUBSTITUTE_CURRENT_MAX_ERR_PLUS_ONE,
 };
 
@@ -99,14 +115,79 @@ struct substitute_function_hook {
     /* Optional: out *pointer* to function pointer to call old implementation
      * (i.e. given 'void (*old_foo)(...);', pass &old_foo) */
     void *old_ptr;
-    /* Currently unused; pass 0.  (Protip: When using C {} struct initializer
-     * syntax, you can just omit this.) */
+    /* SUBSTITUTE_HOOK_* per-hook options, or 0.  (Protip: When using C {}
+     * struct initializer syntax, you can just omit this.) */
     int options;
 };
 
+/* substitute_function_hook per-hook options */
+enum {
+    /* The function is called a lot (objc_msgSend, malloc and the like): put
+     * its outro trampoline (and reentrancy guard stub) at the start of a
+     * cache line, in trampoline pages kept for such hooks, instead of packed
+     * in with all the others.  This keeps the hot paths through hooked
+     * functions to as few cache lines and pages as possible, for a few bytes
+     * of padding each. */
+    SUBSTITUTE_HOOK_HOT = 1,
+};
+
 /* substitute_hook_functions options */
 enum {
     SUBSTITUTE_NO_THREAD_SAFETY = 1,
+    /* Remember the results of checking each function for jumps back into
+     * the patched region in a file under /var/tmp (keyed by image UUID), and
+     * skip the check when the cache already has them.  This saves scanning
+     * up to a few hundred instructions per hook at every launch. */
+    SUBSTITUTE_USE_PLAN_CACHE = 2,
+    /* Instead of checking a few hundred instructions of each function for
+     * such jumps, decode the whole __text section of its image once and
+     * check for references into the patch region from anywhere in it.
+     * Worth it when hooking many functions in one image at once, and catches
+     * jumps from farther away.  Currently arm64 only; elsewhere (and for code
+     * outside __text) this is ignored. */
+    SUBSTITUTE_USE_BRANCH_INDEX = 4,
+    /* substitute_hook_functions only: while a replacement is running on some
+     * thread, calls to the hooked function on the same thread go straight to
+     * the original (i.e. what 'old_ptr' gets), so a hook that ends up calling
+     * it again (say, through logging) doesn't recurse.  The check is done by
+     * a small generated stub in front of the replacement, using a TSD slot
+     * off the thread pointer rather than a call to pthread_getspecific, and
+     * the replacement returns through the stub so it can clear the slot.  As
+     * with traces, backtraces taken while the replacement runs show the stub
+     * instead of the caller, and unwinding out of the replacement with an
+     * exception isn't supported; after a longjmp out of it, the hook stays
+     * bypassed on that thread.  Each guarded hook uses up a pthread key for
+     * good.  Darwin x86_64 and arm64 only; elsewhere this returns
+     * SUBSTITUTE_ERR_NOT_SUPPORTED. */
+    SUBSTITUTE_REENTRANCY_GUARD = 8,
+    /* Always patch in a jump to an intro trampoline (which jumps through a
+     * pointer), never straight to the replacement, so that
+     * substitute_set_hook_enabled works on the hooks.  Costs one more
+     * indirect jump per call.  (Probes, and hooks chained onto an existing
+     * one, go through a trampoline anyway.) */
+    SUBSTITUTE_TOGGLEABLE = 16,
+    /* substitute_hook_functions only: a hook whose replacement is too far
+     * away to jump to directly reuses an intro trampoline made for an earlier
+     * hook with this option and the same replacement, if there's one close
+     * enough, instead of getting its own.  For putting one replacement (say,
+     * a generic tracing stub) on many functions, this saves trampoline
+     * memory and the cache lines and pages it takes up.  Shared trampolines
+     * are never freed, and hooking one of these functions again doesn't
+     * chain onto it, but patches over it as if the hook weren't ours.
+     * Ignored with SUBSTITUTE_TOGGLEABLE. */
+    SUBSTITUTE_SHARE_TRAMPOLINES = 32,
+    /* If the 5 bytes right before a function are padding (int3 or nop), put
+     * the 5-byte jump there, and patch the function itself with a 2-byte
+     * short jump back to it.  Only the instructions covering those 2 bytes
+     * are moved to the trampoline, rather than those covering 5 - often just
+     * one - so fewer functions are too short or branchy to hook, and fewer
+     * threads are ever found in the middle of the patched region; when one
+     * instruction covers both bytes, the patch goes in with two atomic
+     * stores instead of stopping other threads.  The padding is recognized by
+     * its bytes alone, so this assumes whatever precedes the function never
+     * runs on into (or jumps into) bytes that look like it.  x86 only;
+     * ignored elsewhere. */
+    SUBSTITUTE_USE_HOT_PATCH_PADDING = 64,
 };
 
 /* Patch the machine code of the specified functions to redirect them to the
@@ -117,37 +198,39 @@ enum {
  * original first few instructions, which were written over in the real
  * function, then jumps there for the rest.)
  *
- * This function must be called from the main thread.  In return, it attempts
- * to be atomic in the face of concurrent calls to the functions being hooked.
- * Since there is no way to do that directly, it resorts to pausing all other
- * threads while doing its job; and since there is no way to do *that*
- * atomically on currently supported platforms, it does so by pausing each
- * thread one at a time.  If multiple threads each tried to pause each other
- * this way, the process would be deadlocked, so mutual exclusion must be
- * implicitly provided by running on the main thread.
- *
- * You can disable the main thread check and all synchronization by passing
- * SUBSTITUTE_NO_THREAD_SAFETY.
- *
- * Why not just use a mutex to prevent deadlock?  That would work between
- * multiple calls into libsubstitute, but there may be other libraries that
- * want to do the same thing and would not know about our mutex.  My hope is
- * that using the main thread is sufficiently natural that the author of any
- * other similar library which cares about atomicity, noticing the same
- * concern, would independently come up with the same restriction - at least,
- * if they do not find an easier method to avoid deadlocks.  Note that all
+ * If the function was already hooked by substitute, and the existing patch
+ * goes through a trampoline, the new hook is chained on instead: the
+ * trampoline is pointed at the new replacement, and 'old_ptr' gets the
+ * previous one.  This doesn't touch the function's code at all, and each
+ * additional layer costs one indirect jump.
+ *
+ * This function can be called from any thread.  It attempts to be atomic in
+ * the face of concurrent calls to the functions being hooked.  Since there is
+ * no way to do that directly, it resorts to pausing all other threads while
+ * doing its job; and since there is no way to do *that* atomically on
+ * currently supported platforms, it does so by pausing each thread one at a
+ * time.  If multiple threads each tried to pause each other this way, the
+ * process would be deadlocked, so all hooking, unhooking and committing in
+ * the process is serialized by a single lock.
+ *
+ * You can disable pausing the other threads (and the checks that go with it)
+ * by passing SUBSTITUTE_NO_THREAD_SAFETY.
+ *
+ * The lock only covers libsubstitute: another library pausing threads the
+ * same way at the same time could still deadlock with us.  Note that all
  * existing hooking libraries I know of make no attempt to do any
  * synchronization at all; this is fine if hooking is only done during
  * initialization while the process is single threaded, but I want to properly
- * support dynamic injection.  (Note - if there is such an easier method on OS
- * X that does not involve spawning a separate process, I'd be curious to hear
+ * support dynamic injection.  (Note - if there is an easier method on OS X
+ * that does not involve spawning a separate process, I'd be curious to hear
  * about it.)
  *
  *
  * @hooks    see struct substitute_function_hook
  * @nhooks   number of hooks
- * @recordp  if non-NULL, on success receives a pointer that can be used to
- *           cleanly undo the hooks; currently unimplemented, so pass NULL
+ * @recordp  if non-NULL, on success receives a pointer that can be passed to
+ *           substitute_unhook_functions to undo the hooks, or to
+ *           substitute_free_hook_record if you don't need it anymore
  * @options  options - see above
  * @return   SUBSTITUTE_OK, or any of most of the SUBSTITUTE_ERR_*
  */
@@ -157,6 +240,363 @@ int substitute_hook_functions(const struct substitute_function_hook *hooks,
                               struct substitute_function_hook_record **recordp,
                               int options);
 
+/* For batches of at least 'nhooks' hooks (or probes or traces), do the part
+ * of preparing each one that checks the rest of the function for jumps back
+ * into the patched region on libdispatch's thread pool, after every
+ * trampoline has been placed, rather than one at a time on the calling
+ * thread.  That check is most of the setup cost of a large instrumentation
+ * pass, so this makes it scale with the number of cores; the result, and the
+ * single commit, are the same either way (though if several hooks fail, the
+ * error reported may be a different one's).  0, the default, turns this
+ * off.
+ */
+void substitute_set_parallel_prepare_threshold(size_t nhooks);
+
+/* Count calls to functions without writing a replacement for each:
+ * substitute_probe_functions patches the functions the same way as
+ * substitute_hook_functions, but where a hook would jump to the replacement,
+ * a small generated stub atomically increments 'counter' and continues into
+ * the original implementation.  This costs a few instructions per call and no
+ * extra stack frame.  The stub only uses registers that are free at function
+ * entry, except that on 32-bit ARM (and on arm64 without LSE atomics; arm64e
+ * always has them) it saves a few on the stack.  On i386 the counter's two
+ * halves are updated one after the other, so it can be read torn.
+ *
+ * Probes and hooks can be combined on the same function in any order, and
+ * unhooked the same way.
+ *
+ * @probes   see struct substitute_function_probe
+ * @nprobes  number of probes
+ * @recordp  as for substitute_hook_functions
+ * @options  as for substitute_hook_functions
+ * @return   as for substitute_hook_functions
+ */
+struct substitute_function_probe {
+    /* The function to count calls to. */
+    void *function;
+    /* Incremented on each call; must stay valid as long as the probe is in
+     * place. */
+    uint64_t *counter;
+};
+int substitute_probe_functions(const struct substitute_function_probe *probes,
+                               size_t nprobes,
+                               struct substitute_function_hook_record **recordp,
+                               int options);
+
+/* Record entry and exit events for functions, with timestamps, into a file.
+ * substitute_trace_functions patches the functions like
+ * substitute_hook_functions, with a generated stub as the replacement; while
+ * tracing is started, it records an event in a per-thread ring buffer and
+ * makes the function return through a bit of code that records another.  A
+ * background thread copies the events into the file.  Nothing is taken on
+ * the traced thread's side besides a few hundred cycles per event: when the
+ * ring is full, events are dropped (and counted) instead.
+ *
+ * The return address is swapped while a traced function runs, so backtraces
+ * taken inside it show substitute's exit code in its place, and C++
+ * exceptions (or anything else that unwinds using the return address) can't
+ * propagate through it; longjmp is fine.  Functions the recorder uses itself
+ * (pthread_getspecific, mach_absolute_time) can't be traced.  Stubs and
+ * trampolines of traced functions stay allocated after unhooking, since a
+ * thread might still be on its way out of one.
+ *
+ * Only available on x86_64 and arm64; elsewhere these return
+ * SUBSTITUTE_ERR_NOT_SUPPORTED.
+ *
+ * @traces   see struct substitute_function_trace
+ * @ntraces  number of traces
+ * @recordp  as for substitute_hook_functions
+ * @options  as for substitute_hook_functions
+ * @return   as for substitute_hook_functions
+ */
+struct substitute_function_trace {
+    /* The function to trace. */
+    void *function;
+    /* Identifies the function in the events. */
+    uint32_t id;
+};
+int substitute_trace_functions(const struct substitute_function_trace *traces,
+                               size_t ntraces,
+                               struct substitute_function_hook_record **recordp,
+                               int options);
+
+/* Find out whether substitute_hook_functions would accept some hooks, and
+ * what they would take, without hooking anything: the start of each function
+ * is rewritten into a buffer on the stack and the rest checked for jumps back
+ * into it, as when hooking, but no executable memory is allocated and no
+ * threads are paused, so this can be called from any thread at any time.
+ * Whether there's room for a trampoline within reach of the function is
+ * checked against the arena and the free address space as they are now
+ * (SUBSTITUTE_ERR_OUT_OF_RANGE); other errors that only come up while
+ * placing trampolines or patching (SUBSTITUTE_ERR_VM, ...) can't be
+ * predicted.  The sizes assume a trampoline lands near enough for the
+ * shortest patch.
+ * A function that's hooked already would just be chained onto, and reports
+ * zero sizes.
+ */
+struct substitute_hook_check {
+    /* SUBSTITUTE_OK, or the error hooking the function would fail with
+     * (SUBSTITUTE_ERR_FUNC_TOO_SHORT, SUBSTITUTE_ERR_FUNC_JUMPS_TO_START,
+     * SUBSTITUTE_ERR_FUNC_CALLS_AT_START, ...) */
+    int error;
+    /* bytes of the function the jump patch overwrites */
+    size_t patch_size;
+    /* bytes of the function's start moved into the outro trampoline, and how
+     * many instructions that is */
+    size_t relocated_size;
+    size_t relocated_insns;
+    /* an upper bound on the executable memory the hook's trampolines (and
+     * stub, for SUBSTITUTE_REENTRANCY_GUARD) take */
+    size_t trampoline_size;
+};
+/* @hooks    as for substitute_hook_functions
+ * @nhooks   number of hooks
+ * @results  an array of nhooks, filled in for every hook
+ * @options  the options that would be passed to substitute_hook_functions
+ * @return   SUBSTITUTE_OK if every hook checked out, otherwise the first
+ *           error
+ */
+int substitute_check_hooks(const struct substitute_function_hook *hooks,
+                           size_t nhooks,
+                           struct substitute_hook_check *results,
+                           int options);
+
+enum {
+    SUBSTITUTE_TRACE_ENTRY = 0,
+    SUBSTITUTE_TRACE_EXIT = 1,
+};
+
+struct substitute_trace_event {
+    /* mach_absolute_time units; see the header for the timebase */
+    uint64_t timestamp;
+    /* as from pthread_threadid_np */
+    uint64_t thread_id;
+    uint32_t function_id;
+    uint32_t kind; /* SUBSTITUTE_TRACE_* */
+};
+
+#define SUBSTITUTE_TRACE_MAGIC 0x63727473 /* 'strc' */
+#define SUBSTITUTE_TRACE_VERSION 1
+
+/* The start of the file; 'nevents' events follow. */
+struct substitute_trace_file_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t timebase_numer, timebase_denom;
+    /* how many events the file has room for */
+    uint64_t capacity;
+    uint64_t nevents;
+    /* events lost because a ring or the file was full */
+    uint64_t dropped;
+};
+
+/* Start recording events from traced functions into the file at 'path',
+ * which is created (or truncated) with room for 'max_events' events: later
+ * ones are dropped.  The file is mapped shared, so it can be read while
+ * tracing goes on, up to the header's 'nevents'.
+ *
+ * @return  SUBSTITUTE_OK
+ *          SUBSTITUTE_ERR_TRACE_STATE - already started
+ *          SUBSTITUTE_ERR_VM - couldn't create or map the file (see errno)
+ *          SUBSTITUTE_ERR_OOM - couldn't start the background thread
+ *          SUBSTITUTE_ERR_NOT_SUPPORTED
+ */
+int substitute_trace_start(const char *path, size_t max_events);
+
+/* Stop recording, copy out what's left in the buffers, and close the file.
+ * Traced functions stay hooked (and cost a couple of branches) until
+ * unhooked.
+ *
+ * @return  SUBSTITUTE_OK
+ *          SUBSTITUTE_ERR_TRACE_STATE - not started
+ *          SUBSTITUTE_ERR_VM - writing the file failed
+ *          SUBSTITUTE_ERR_NOT_SUPPORTED
+ */
+int substitute_trace_stop(void);
+
+/* Undo a substitute_hook_functions (or substitute_probe_functions or
+ * substitute_trace_functions) call and free the record.  The original
+ * instructions are put back (with the same care about other threads as when
+ * hooking, unless SUBSTITUTE_NO_THREAD_SAFETY is passed), and the
+ * trampolines are returned to the pool to be used by later hooks.
+ *
+ * Functions hooked again afterward (by anyone, including hooks chained on top
+ * of these) are skipped, since restoring them would drop the later hook.
+ *
+ * It's up to the caller to make sure no thread is still running a
+ * replacement that might call the old implementation through 'old_ptr': that
+ * points into the trampolines being freed.  A thread stopped inside a
+ * trampoline is moved back to the original code.
+ *
+ * @record   from substitute_hook_functions
+ * @options  0 or SUBSTITUTE_NO_THREAD_SAFETY
+ * @return   SUBSTITUTE_OK
+ *           SUBSTITUTE_ERR_HOOK_CHANGED - some functions were skipped; the
+ *             rest were unhooked
+ *           SUBSTITUTE_ERR_VM,
+ *           SUBSTITUTE_ERR_ADJUSTING_THREADS, SUBSTITUTE_ERR_OOM - in these
+ *             cases the record is not freed
+ */
+int substitute_unhook_functions(struct substitute_function_hook_record *record,
+                                int options);
+void substitute_free_hook_record(struct substitute_function_hook_record *record);
+
+/* Switch a hook off or back on without unhooking: while it's disabled, its
+ * trampoline goes to what 'old_ptr' got (the original, or the previous hook)
+ * instead of the replacement.  That takes one atomic store to the
+ * trampoline's pointer, without pausing threads or remapping anything, so it
+ * can be flipped as often as needed.  Threads already in the replacement
+ * carry on.
+ *
+ * @record   from substitute_hook_functions, substitute_probe_functions or
+ *           substitute_trace_functions
+ * @idx      which of the record's hooks
+ * @enabled  whether calls go to the replacement
+ * @return   SUBSTITUTE_OK
+ *           SUBSTITUTE_ERR_NOT_SUPPORTED - the patch jumps straight to the
+ *             replacement (pass SUBSTITUTE_TOGGLEABLE when hooking), or
+ *             it's a probe that isn't chained onto a hook
+ *           SUBSTITUTE_ERR_HOOK_CHANGED - another hook was chained on top
+ *             since, so only that one can be switched
+ *           or anything substitute_hook_commit returns, if a transaction's
+ *             queued hooks had to be committed first
+ */
+int substitute_set_hook_enabled(struct substitute_function_hook_record *record,
+                                size_t idx, bool enabled);
+
+/* Hook transactions.  Between substitute_hook_begin and the matching
+ * substitute_hook_commit, substitute_hook_functions (from any caller,
+ * including SubHookFunction) does everything except the final patching of
+ * the hooked functions: trampolines are set up and 'old_ptr' is valid, but
+ * the functions still run their original code.  substitute_hook_commit then
+ * writes all the queued patches with a single pass - in particular, pausing
+ * other threads only once rather than once per substitute_hook_functions
+ * call.
+ *
+ * Hooking a function that already has a queued patch commits the queue
+ * first, so that the trampoline for the new hook includes the old one.
+ *
+ * Transactions nest; only the outermost commit does anything.  Like hooking,
+ * any of this can be done from any thread.
+ *
+ * @return  SUBSTITUTE_OK, or any of the errors substitute_hook_functions can
+ *          return while patching
+ */
+void substitute_hook_begin(void);
+int substitute_hook_commit(void);
+
+/* Opt in to having SubHookMemory calls made during a transaction queued too,
+ * rather than written right away, and committed with the hooks in one pass
+ * (so several small patches to the same page only remap it once).  Nothing
+ * else changes - in particular, the memory keeps its old contents until the
+ * commit, which is why this isn't the default: a tweak that patches some
+ * code and then calls it from its constructor would see the old code.
+ * Queued writes that overlap each other or a queued hook's patch are
+ * committed in order.
+ */
+void substitute_set_defer_memory_writes(bool enabled);
+
+struct substitute_trampoline_region_info {
+    /* The address range the pages are in; pages are grouped into fixed size,
+     * aligned regions. */
+    uintptr_t start;
+    size_t size;
+    /* Number of trampoline pages in the region. */
+    size_t npages;
+    /* Bytes of trampolines in those pages, and bytes still available. */
+    size_t bytes_used;
+    size_t bytes_free;
+};
+
+/* Report how full the pages substitute_hook_functions keeps around for
+ * trampolines are.  Trampoline pages are shared between calls, so this is
+ * mostly useful to check that hooks from many libraries aren't each wasting a
+ * page.
+ *
+ * @infos   array to fill in, one entry per region, in address order
+ * @ninfos  number of entries in infos
+ * @return  the total number of regions, which may be larger than ninfos
+ */
+size_t substitute_get_trampoline_region_info(
+    struct substitute_trampoline_region_info *infos, size_t ninfos);
+
+/* What the memory in a substitute_memory_region is for. */
+enum substitute_memory_kind {
+    /* trampoline pages for hooked functions (the executable view; the
+     * writable one is the same memory) */
+    SUBSTITUTE_MEMORY_TRAMPOLINES,
+    /* Objective-C trampoline page pairs (code, then the entries it uses) */
+    SUBSTITUTE_MEMORY_OBJC_TRAMPOLINES,
+    /* code pages that were patched, which no longer share memory with the
+     * file or shared cache they came from */
+    SUBSTITUTE_MEMORY_PATCHED_CODE,
+    /* the shared cache's local symbols, mapped for symbol lookups */
+    SUBSTITUTE_MEMORY_SYMBOL_TABLES,
+};
+
+struct substitute_memory_region {
+    int kind;
+    uintptr_t start;
+    size_t size;
+    /* Bytes of the region currently in memory, and how many of those have
+     * been written to, which is what counts toward the process's footprint
+     * (or, for the symbol tables, what will be paged back in from the file
+     * if reclaimed). */
+    size_t resident, dirty;
+    /* Bytes actually holding something: trampolines handed out, for the
+     * trampoline kinds; the whole region otherwise. */
+    size_t used;
+};
+
+/* Report the memory substitute has mapped, or copied by patching, in this
+ * process: for finding out which hooks cost how much footprint.  Adjacent
+ * pages of the same kind are reported as a single region.  Memory from
+ * malloc (hook records and various caches) isn't included.
+ *
+ * @regions   array to fill in, grouped by kind
+ * @nregions  number of entries in regions
+ * @return    the total number of regions, which may be larger than nregions
+ */
+size_t substitute_memory_report(struct substitute_memory_region *regions,
+                                size_t nregions);
+
+/* Cumulative counters, for finding out where time spent hooking goes.  Times
+ * are in nanoseconds; some of them are measured while other threads are
+ * stopped, using the CPU's counter, and are converted using the rate
+ * observed since stats were enabled, so they are approximate. */
+struct substitute_stats {
+    /* substitute_hook_functions phases */
+    uint64_t transform_dis_ns;
+    uint64_t jump_dis_ns;
+    uint64_t trampoline_alloc_ns;
+    /* while patching */
+    uint64_t stop_threads_ns;
+    uint64_t get_thread_state_ns; /* reading the stopped threads' registers */
+    uint64_t apply_pc_patch_ns;
+    uint64_t remap_ns; /* copying and remapping or reprotecting pages */
+    /* looking up symbols in images */
+    uint64_t find_syms_ns;
+
+    uint64_t hooks_installed;
+    uint64_t threads_suspended;
+    uint64_t remaps;
+    uint64_t pages_remapped;
+    /* spans patched in place via VM_PROT_COPY instead of remapped */
+    uint64_t protect_copies;
+    /* currently allocated trampoline pages: bytes holding trampolines, and
+     * bytes left over */
+    uint64_t trampoline_bytes_used;
+    uint64_t trampoline_bytes_wasted;
+    /* (arm64) bytes saved by relocating instructions into the outro
+     * trampolines with short PC-relative forms rather than absolute ones */
+    uint64_t trampoline_bytes_saved;
+};
+
+/* Stats are off by default, since timing costs a little.  Enabling them
+ * doesn't reset the counters. */
+void substitute_set_stats_enabled(bool enabled);
+void substitute_get_stats(struct substitute_stats *stats);
+
 #if 1 /* declare dynamic linker-related stuff? */
 
 #ifdef __APPLE__
@@ -176,16 +616,39 @@ struct substitute_image {
     const void *image_header;
 #endif
     /* possibly private fields... */
+#ifdef __APPLE__
+    /* built by the second substitute_find_private_syms */
+    struct sym_index *sym_index;
+    unsigned sym_lookups;
+    /* decoded LC_FUNCTION_STARTS, for hooking (see function-starts.h) */
+    struct function_starts *function_starts;
+    /* handles are shared; see substitute_open_image */
+    unsigned refs;
+#endif
 };
 
 /* Look up an image currently loaded into the process.
+ *
+ * Handles are shared: opening an image that already has a handle open (by the
+ * same path, or by address) returns that handle, and so reuses anything
+ * substitute_find_private_syms built for it.  Closing the last reference frees
+ * the handle and all of that, so keep one open for as long as it's worth
+ * caching.
  *
  * @filename the executable/library path (c.f. dyld(3) on Darwin)
  * @return   a handle, or NULL if the image wasn't found
  */
 struct substitute_image *substitute_open_image(const char *filename);
 
-/* Release a handle opened with substitute_open_image.
+/* Like substitute_open_image, but for whichever loaded image has a segment
+ * containing 'address', found from dyld's image list without a dlopen.
+ *
+ * @address any address in the image, such as a function's
+ * @return  a handle, or NULL if no image contains it
+ */
+struct substitute_image *substitute_open_image_by_address(const void *address);
+
+/* Release a handle opened with substitute_open_image (or ..._by_address).
  *
  * @handle a banana
  */
@@ -201,6 +664,11 @@ void substitute_close_image(struct substitute_image *handle);
  *         (on ARM, this will be | 1 for Thumb functions)
  * @nsyms  number of names
  *
+ * The first call scans the symbol tables; after that, all of the image's
+ * symbols are indexed (which takes a few bytes per symbol, and keeps the
+ * shared cache's local symbols mapped, until the handle is closed), so
+ * making many calls on one handle is cheap.
+ *
  * @return SUBSTITUTE_OK (maybe errors in the future)
  */
 int substitute_find_private_syms(struct substitute_image *handle,
@@ -208,6 +676,115 @@ int substitute_find_private_syms(struct substitute_image *handle,
                                  void **__restrict syms,
                                  size_t nsyms);
 
+/* One symbol for substitute_find_syms_multi. */
+struct substitute_sym_query {
+    /* the path, as for substitute_open_image */
+    const char *image;
+    const char *name;
+    /* set to the symbol's address, or NULL if it (or the image) wasn't
+     * found */
+    void **sym;
+};
+
+/* Look up symbols in any number of images at once, for tweaks with private
+ * symbols spread across UIKitCore, SpringBoardFoundation, FrontBoard and so
+ * on.  The queries are grouped by image, and each image is opened and looked
+ * in once, as with substitute_open_image and substitute_find_private_syms;
+ * but rather than the shared cache's local symbols being mapped separately
+ * for each image, they're mapped once for the call and every group is
+ * resolved in that.  (A handle that has already built its index of names
+ * uses it, and dylibs in the index from
+ * substitute_build_shared_cache_sym_index still use that.)  Images that
+ * aren't loaded aren't loaded; their queries just come back NULL.
+ *
+ * @return SUBSTITUTE_OK, or SUBSTITUTE_ERR_OOM
+ */
+int substitute_find_syms_multi(const struct substitute_sym_query *queries,
+                               size_t n);
+
+/* Have substitute_find_private_syms scan symbol tables with at least
+ * 'nsyms' entries (such as the shared cache's local symbols for UIKitCore or
+ * WebCore) in chunks on libdispatch's thread pool, rather than on the
+ * calling thread alone.  The results are the same either way.  0, the
+ * default, turns this off.
+ */
+void substitute_set_parallel_sym_scan_threshold(size_t nsyms);
+
+/* The hash substitute_find_private_syms_hashed identifies names by: 64-bit
+ * FNV-1a over the name's bytes (without the terminator), except that a
+ * result of 0 becomes 1.  C++ code can get it at compile time from
+ * MSHashSymbolName in substrate.h, so the names needn't be in the binary.
+ */
+uint64_t substitute_hash_sym_name(const char *name);
+
+/* Like substitute_find_private_syms, but with the names given only by their
+ * substitute_hash_sym_name hashes, for tweaks looking up many private
+ * symbols that would rather not ship (or compare) all the strings.  Each
+ * symbol table entry's name is hashed and looked up among the requested
+ * hashes; there's no string to check a match against, so two names with the
+ * same 64-bit hash can't be told apart, and the first matching symbol is
+ * used.  The export trie isn't consulted, and this always scans (it doesn't
+ * use or build the handle's index of names), after which the shared cache's
+ * symbols come from its index if substitute_build_shared_cache_sym_index has
+ * been run, as with names.
+ *
+ * @return SUBSTITUTE_OK
+ */
+int substitute_find_private_syms_hashed(struct substitute_image *handle,
+                                        const uint64_t *__restrict name_hashes,
+                                        void **__restrict syms,
+                                        size_t nsyms);
+
+/* Called by substitute_enumerate_syms for each matching symbol.
+ *
+ * @ctx  the ctx passed to substitute_enumerate_syms
+ * @name the symbol's name
+ * @sym  its symbol table entry, which is only valid during the call
+ * @ptr  the address it refers to, as from substitute_sym_to_ptr
+ * @return true to keep going, false to stop
+ */
+typedef bool (*substitute_enumerate_syms_callback)(void *ctx,
+                                                   const char *name,
+                                                   const substitute_sym *sym,
+                                                   void *ptr);
+
+/* Call 'callback' for every symbol an image defines whose name starts with
+ * 'prefix', in one pass over the same symbol tables as
+ * substitute_find_private_syms: the image's own, then (if it's in the dyld
+ * shared cache) the cache's local symbols for it, which are always read from
+ * the cache file rather than any index.  Debugging (stab) and undefined
+ * entries are skipped; anything else is up to the callback to filter.
+ * Names are raw, as for substitute_find_private_syms, and the same name can
+ * come up more than once.
+ *
+ * @handle   handle opened with substitute_open_image
+ * @prefix   the prefix to match, or NULL or "" for every symbol
+ * @callback see above
+ * @ctx      passed to callback
+ * @return   SUBSTITUTE_OK
+ */
+int substitute_enumerate_syms(struct substitute_image *handle,
+                              const char *prefix,
+                              substitute_enumerate_syms_callback callback,
+                              void *ctx);
+
+/* Write an index of the dyld shared cache's local symbols (the private
+ * symbols stripped out of the cached images, which otherwise have to be read
+ * from the cache file) that substitute_find_private_syms in every process
+ * then uses instead, mapping just a small hash table for the image being
+ * looked in.  There is one index per cache UUID, in /var/tmp; if it already
+ * exists, nothing is done.  substituted calls this at startup.
+ *
+ * Names in the index are matched by a 64-bit hash alone.
+ *
+ * @return SUBSTITUTE_OK
+ *         SUBSTITUTE_ERR_NOT_SUPPORTED - no shared cache, or no file with its
+ *           local symbols
+ *         SUBSTITUTE_ERR_VM - couldn't read the cache or write the index
+ *         SUBSTITUTE_ERR_OOM
+ */
+int substitute_build_shared_cache_sym_index(void);
+
 /* Get a pointer corresponding to a loaded symbol table entry.
  * @handle handle containing the symbol
  * @sym    symbol
@@ -250,21 +827,29 @@ struct substitute_import_hook {
  *
  * - It only works for exported functions, and even then will not catch calls
  *   from a library to its own exported functions.
- * - At present, it *only* works for a single importing library at a time.
- *   Although it is not difficult on most platforms to iterate loaded libraries
- *   in order to hook all of them, substitute does not currently provide this
- *   functionality, traversing all libraries' symbol tables may be slow, and in
- *   any case there is the matter of new importers being loaded after the fact.
+ * - It only works for a single importing library at a time; see
+ *   substitute_interpose_imports_all to hook every loaded library (and ones
+ *   loaded later).
  *
  * @handle   handle of the importing library
  * @hooks    see struct substitute_import_hook
  * @nhooks   number of hooks
- * @recordp  if non-NULL, on success receives a pointer that can be used to
- *           cleanly undo the hooks; currently unimplemented, so pass NULL
+ * @recordp  if non-NULL, on success receives a pointer that can be passed to
+ *           substitute_unhook_imports to undo the hooks, or to
+ *           substitute_free_import_hook_record
+ * On Darwin, both dyld's bind opcodes (LC_DYLD_INFO) and chained fixups
+ * (LC_DYLD_CHAINED_FIXUPS) are understood.  Since dyld overwrites fixup
+ * chains as it resolves them, the latter are read from the image's file,
+ * which must still match what's loaded.
+ *
  * @options  options - pass 0
  * @return   SUBSTITUTE_OK
  *           SUBSTITUTE_ERR_UNKNOWN_RELOCATION_TYPE
- *           SUBSTITUTE_ERR_VM - in the future with RELRO on Linux
+ *           SUBSTITUTE_ERR_NOT_SUPPORTED - chained fixups in a format we
+ *             don't handle (32-bit), or whose file couldn't be found
+ *           SUBSTITUTE_ERR_VM - couldn't make a read-only segment writable
+ *             (or in the future with RELRO on Linux)
+ *           SUBSTITUTE_ERR_OOM
  */
 struct substitute_import_hook_record;
 int substitute_interpose_imports(const struct substitute_image *handle,
@@ -273,6 +858,41 @@ int substitute_interpose_imports(const struct substitute_image *handle,
                                  struct substitute_import_hook_record **recordp,
                                  int options);
 
+/* Put back the imports changed by a substitute_interpose_imports call and
+ * free the record.  Slots that were changed again since are left alone.
+ *
+ * @return  SUBSTITUTE_OK
+ *          SUBSTITUTE_ERR_HOOK_CHANGED - some slots were skipped
+ */
+int substitute_unhook_imports(struct substitute_import_hook_record *record);
+
+/* Like substitute_interpose_imports, but for every loaded library, and any
+ * loaded afterward, until the record is passed to substitute_unhook_imports.
+ * Each library's binds are decoded once, when first needed, into a table
+ * sorted by symbol name hash that is kept as long as the library is loaded;
+ * later calls (including substitute_interpose_imports on a single library)
+ * just look up the hooked names in it.
+ *
+ * The hooks' names are copied, but old_ptr is written to whenever a library
+ * loads, so it must stay valid.  Since each importer can be bound somewhere
+ * different, old_ptr gets the most recent one.
+ *
+ * substitute_free_import_hook_record leaves the hooks in place for good
+ * (including for libraries loaded later), just without a way to undo them.
+ *
+ * @hooks    see struct substitute_import_hook
+ * @nhooks   number of hooks
+ * @recordp  as with substitute_interpose_imports
+ * @return   SUBSTITUTE_OK - libraries whose binds couldn't be decoded are
+ *             skipped
+ *           SUBSTITUTE_ERR_OOM
+ */
+int substitute_interpose_imports_all(const struct substitute_import_hook *hooks,
+                                     size_t nhooks,
+                                     struct substitute_import_hook_record **recordp);
+void substitute_free_import_hook_record(
+    struct substitute_import_hook_record *record);
+
 
 #endif /* 1 */
 
@@ -304,7 +924,204 @@ int substitute_interpose_imports(const struct substitute_image *handle,
 int substitute_hook_objc_message(Class klass, SEL selector, void *replacement,
                                  void *old_ptr, bool *created_imp_ptr);
 
+struct substitute_objc_hook {
+    Class klass;
+    SEL selector;
+    void *replacement;
+    void *old_ptr; /* optional: out *pointer* to original impl */
+    bool *created_imp_ptr; /* optional */
+};
+
+/* Like calling substitute_hook_objc_message for each hook, but all the
+ * trampolines needed are allocated up front, and the methods are replaced a
+ * class at a time.  Every selector is checked before anything is hooked, so
+ * on SUBSTITUTE_ERR_NO_SUCH_SELECTOR nothing has changed.
+ *
+ * @hooks   see struct substitute_objc_hook
+ * @nhooks  number of hooks
+ * @return  SUBSTITUTE_OK
+ *          SUBSTITUTE_ERR_NO_SUCH_SELECTOR
+ *          SUBSTITUTE_ERR_OOM
+ *          SUBSTITUTE_ERR_VM
+ */
+int substitute_hook_objc_messages(const struct substitute_objc_hook *hooks,
+                                  size_t nhooks);
+
+/* Like substitute_hook_objc_message, but by class name, for classes that
+ * might not be loaded yet.  If the class is already loaded, it is looked up
+ * (which realizes it) and hooked right away.  Otherwise the hook is recorded
+ * and installed, along with any others for the class, once an image
+ * containing it has loaded - asynchronously, on a dispatch queue, since it
+ * can't be done from inside dyld's callback - so the class can be used
+ * unhooked briefly, e.g. by the image's own initializers.  Hooks installed
+ * later can't report failure, so they are logged instead.
+ *
+ * @class_name       the class's name
+ * @old_ptr          as with substitute_hook_objc_message; since it may be
+ *                   written later, it (and created_imp_ptr) must stay valid
+ * @return           SUBSTITUTE_OK - installed or recorded
+ *                   SUBSTITUTE_ERR_NO_SUCH_SELECTOR - the class was already
+ *                     loaded, but without the selector
+ *                   SUBSTITUTE_ERR_OOM
+ */
+int substitute_hook_objc_message_lazy(const char *class_name, SEL selector,
+                                      void *replacement, void *old_ptr,
+                                      bool *created_imp_ptr);
+
 void substitute_free_created_imp(IMP imp);
+
+/* Opt in to having the superclass-call IMPs created by the functions above
+ * cache the superclass's implementation, rather than looking it up with
+ * class_getMethodImplementation on every call.  Only IMPs created after this
+ * is enabled cache.  The cache is dropped when class_addMethod,
+ * class_replaceMethod, method_setImplementation or
+ * method_exchangeImplementations is called through an image's imports, or
+ * when an image loads, but it can go stale after other changes: calls from
+ * the shared cache, class_addMethodsBulk/class_replaceMethodsBulk, categories
+ * attached inside libobjc, and runtime functions called through pointers from
+ * dlsym.  Enabling it also interposes those four imports in every image,
+ * current and future, and registers a dyld add-image callback, neither of
+ * which is ever undone.  Call it outside any dyld callback.
+ */
+void substitute_set_objc_super_imp_cache(bool enabled);
+
+/* Instead of calling MSHookFunction and friends one at a time from its
+ * constructor, a tweak can list its hooks in a __DATA,__substitute_hooks
+ * section, using the macros below.  bundle-loader applies the manifests of
+ * all the tweaks it loads into a process together, after their constructors
+ * have run: the symbols are looked up with one substitute_find_private_syms
+ * call per image, and all the function hooks go in one
+ * substitute_hook_functions call, inside the same transaction as any hooks
+ * the constructors made.
+ */
+#define SUBSTITUTE_HOOK_MANIFEST_SEGMENT "__DATA"
+#define SUBSTITUTE_HOOK_MANIFEST_SECTION "__substitute_hooks"
+
+enum {
+    SUBSTITUTE_HOOK_MANIFEST_FUNCTION = 1,
+    SUBSTITUTE_HOOK_MANIFEST_OBJC = 2,
+};
+
+struct substitute_hook_manifest_entry {
+    /* SUBSTITUTE_HOOK_MANIFEST_* */
+    uintptr_t kind;
+    /* FUNCTION: path of the image to look the symbol up in, or NULL for the
+     * main executable; OBJC: the class name */
+    const char *image_or_class;
+    /* FUNCTION: the symbol name, as in the symbol table (with the leading
+     * underscore); OBJC: the selector name */
+    const char *name;
+    void *replacement;
+    /* optional: out *pointer* to the old implementation */
+    void *old_ptr;
+};
+
+#define SUBSTITUTE_HOOK_MANIFEST_ENTRY_(id, kind, image_or_class, name, \
+                                        replacement, old_ptr) \
+    __attribute__((used, section(SUBSTITUTE_HOOK_MANIFEST_SEGMENT "," \
+                                 SUBSTITUTE_HOOK_MANIFEST_SECTION))) \
+    static struct substitute_hook_manifest_entry id = \
+        {kind, image_or_class, name, (void *) (replacement), old_ptr}
+#define SUBSTITUTE_MANIFEST_HOOK_FUNCTION(id, image, symbol, replacement, \
+                                          old_ptr) \
+    SUBSTITUTE_HOOK_MANIFEST_ENTRY_(id, SUBSTITUTE_HOOK_MANIFEST_FUNCTION, \
+                                    image, symbol, replacement, old_ptr)
+#define SUBSTITUTE_MANIFEST_HOOK_MESSAGE(id, class_name, selector_name, \
+                                         replacement, old_ptr) \
+    SUBSTITUTE_HOOK_MANIFEST_ENTRY_(id, SUBSTITUTE_HOOK_MANIFEST_OBJC, \
+                                    class_name, selector_name, replacement, \
+                                    old_ptr)
+
+/* Apply the hook manifests in the given loaded images (images without one
+ * are skipped).  Objective-C hooks are installed as with
+ * substitute_hook_objc_message_lazy.
+ *
+ * @headers   mach headers of the images, e.g. from _dyld_get_image_header
+ * @nheaders  number of headers
+ * @options   options for substitute_hook_functions
+ * @return    SUBSTITUTE_OK
+ *            SUBSTITUTE_ERR_NO_SUCH_SYMBOL - see above
+ *            SUBSTITUTE_ERR_OOM
+ *            or any error from substitute_hook_functions, in which case
+ *            none of the function hooks were installed
+ */
+int substitute_apply_hook_manifests(const void *const *headers,
+                                    size_t nheaders, int options);
+
+/* Hook functions in an image that might not be loaded yet, without loading
+ * it.  If it's already loaded, this is like looking up the symbols with
+ * substitute_find_private_syms and calling substitute_hook_functions;
+ * otherwise the hooks are remembered, and when an image with that path is
+ * loaded, all of them (from every call for the same path) are looked up
+ * together and installed with one substitute_hook_symbols call per set of
+ * options, from dyld's add-image callback.  Errors at that point can only be
+ * logged.
+ *
+ * The path has to match the one dyld reports for the image (its install
+ * name, for images in the shared cache), unless the image is already loaded,
+ * in which case anything dlopen would accept works.
+ *
+ * @image_path    the image to hook functions in
+ * @symbols       symbol names, as in the symbol table (with the leading
+ *                underscore)
+ * @replacements  the replacement for each symbol
+ * @old_ptrs      optional: where to store a pointer to each original, as
+ *                with substitute_function_hook's old_ptr (and individual
+ *                entries can be NULL); filled in once the hook goes in
+ * @n             number of symbols
+ * @options       options for substitute_hook_functions
+ * @return        SUBSTITUTE_OK - installed, or waiting for the image
+ *                SUBSTITUTE_ERR_NO_SUCH_SYMBOL - the image was loaded, and
+ *                  some symbols weren't found; the rest were hooked
+ *                SUBSTITUTE_ERR_OOM
+ *                or any error from substitute_hook_functions
+ */
+int substitute_hook_functions_deferred(const char *image_path,
+                                       const char *const *symbols,
+                                       void *const *replacements,
+                                       void *const *old_ptrs, size_t n,
+                                       int options);
+
+struct substitute_symbol_hook {
+    /* The symbol to hook, as in the symbol table (with the leading
+     * underscore). */
+    const char *name;
+    /* The replacement function. */
+    void *replacement;
+    /* Optional, as in struct substitute_function_hook. */
+    void *old_ptr;
+};
+
+/* Look up symbols by name and hook them, in one go: the names are resolved
+ * with a single substitute_find_private_syms call (which indexes the image
+ * for any later lookups), and the hooks are prepared in address order and
+ * patched in by one transaction, so threads are paused once for the lot.
+ *
+ * Unlike substitute_hook_functions, a hook that fails (the symbol isn't
+ * there, the function is too short to patch, ...) doesn't stop the others;
+ * each hook gets its own error code.  If this is called inside a
+ * transaction, the patching waits for the outer commit, as usual.
+ *
+ * @im       image to look the symbols up in
+ * @hooks    see struct substitute_symbol_hook
+ * @n        number of hooks
+ * @errors   optional: an array of n ints, each set to SUBSTITUTE_OK or the
+ *           error for the corresponding hook
+ * @records  optional: an array of n pointers, each set to the corresponding
+ *           hook's record (see substitute_hook_functions), or NULL if it
+ *           couldn't be prepared
+ * @options  options for substitute_hook_functions
+ * @return   SUBSTITUTE_OK if every hook went in, otherwise the first error
+ *           (SUBSTITUTE_ERR_NO_SUCH_SYMBOL, or anything
+ *           substitute_hook_functions or substitute_hook_commit can return);
+ *           if the commit itself failed, that error, which is also recorded
+ *           for every hook that was queued
+ */
+int substitute_hook_symbols(struct substitute_image *im,
+                            const struct substitute_symbol_hook *hooks,
+                            size_t n, int *errors,
+                            struct substitute_function_hook_record **records,
+                            int options);
 #endif
 
 #ifdef __cplusplus
@@ -0,0 +1,31 @@
+#pragma once
+#include <stdint.h>
+/* Glue between trace stubs (make_trace_stub in jump-patch.h), the common
+ * entry and exit code in darwin/trace-asm.S, and the recorder in
+ * darwin/trace.c.
+ *
+ * A trace stub jumps to substitute_trace_enter_asm with the address of its
+ * trace_site (in r11 on x86_64, x16 on arm64).  That saves the argument
+ * registers and calls substitute_trace_enter, which records the entry, swaps
+ * the return address for substitute_trace_exit_asm and returns where to
+ * continue: site->target, i.e. the original implementation or whatever hook
+ * was there before.  When the function returns into the exit code,
+ * substitute_trace_exit records the exit and returns the real return
+ * address. */
+
+/* lives in the stub, so it's read-only after hooking */
+struct trace_site {
+    uintptr_t target;
+    uint32_t id;
+    uint32_t pad;
+};
+
+void substitute_trace_enter_asm(void);
+void substitute_trace_exit_asm(void);
+
+/* ret_slot is where the return address is saved (on the stack on x86_64;
+ * the saved lr on arm64), and key is the stack pointer the function will
+ * return with, which identifies the call at exit. */
+uintptr_t substitute_trace_enter(const struct trace_site *site,
+                                 uintptr_t *ret_slot, uintptr_t key);
+uintptr_t substitute_trace_exit(uintptr_t key);
@@ -1,6 +1,7 @@
 #include "substitute-internal.h"
 #ifdef TARGET_DIS_SUPPORTED
 #define DIS_MAY_MODIFY 1
+#define DIS_BRANCHES_ONLY 0
 
 #include "substitute.h"
 #include "dis.h"
@@ -24,6 +25,7 @@ struct transform_dis_ctx {
     bool force_keep_transforming;
 
     bool ban_calls; /* i.e. trying to be thread safe */
+    bool saw_call;
 
     void **rewritten_ptr_ptr;
     void *write_newop_here;
@@ -37,6 +39,7 @@ struct transform_dis_ctx {
 
 static NOINLINE UNUSED
 void transform_dis_indirect_call(struct transform_dis_ctx *ctx) {
+    ctx->saw_call = true;
     /* see error description */
     if (ctx->ban_calls && ctx->base.pc + ctx->base.op_size < ctx->pc_patch_end)
         ctx->err = SUBSTITUTE_ERR_FUNC_CALLS_AT_START;
@@ -94,6 +97,7 @@ int transform_dis_main(const void *restrict code_ptr,
                        uint_tptr pc_trampoline,
                        struct arch_dis_ctx *arch_ctx_p,
                        int *offset_by_pcdiff,
+                       bool *saw_call_p,
                        int options) {
     struct transform_dis_ctx ctx;
     memset(&ctx, 0, sizeof(ctx));
@@ -152,6 +156,8 @@ int transform_dis_main(const void *restrict code_ptr,
     }
     *pc_patch_end_p = ctx.base.pc;
     *arch_ctx_p = ctx.arch;
+    if (saw_call_p)
+        *saw_call_p = ctx.saw_call;
     return SUBSTITUTE_OK;
 }
 
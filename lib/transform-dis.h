@@ -5,6 +5,9 @@
 
 #define TRANSFORM_DIS_BAN_CALLS 1
 
+/* If saw_call_p is non-NULL, it gets whether the rewritten code contains a
+ * call (so a return address pointing into it may be on some stack). */
+
 int transform_dis_main(const void *restrict code_ptr,
                        void **restrict rewritten_ptr_ptr,
                        uint_tptr pc_patch_start,
@@ -12,4 +15,5 @@ int transform_dis_main(const void *restrict code_ptr,
                        uint_tptr pc_trampoline,
                        struct arch_dis_ctx *arch_ctx_p,
                        int *offset_by_pcdiff,
+                       bool *saw_call_p,
                        int options);
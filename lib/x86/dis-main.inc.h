@@ -60,22 +60,22 @@ static const uint8_t onebyte_bits[] = {
 /*30*/ REP4(I_MODA), I_8, I_z, I_PFX,  i64(0), REP4(I_MODA), I_8, I_z, I_PFX,  i64(0),
 /*40*/ REP16(if64(I_PFX, 0)),
 /*50*/ REP16(0),
-/*60*/ i64(0), i64(0), i64(I_MOD), I_MODA, I_PFX, I_PFX, I_PFX, I_PFX,
+/*60*/ i64(0), i64(0), if64(I_PFX, I_MOD), I_MODA, I_PFX, I_PFX, I_PFX, I_PFX,
      /*68*/ I_z, I_MODA|I_z, I_8, I_MODA|I_8, REP4(0),
 /*70*/ REP16(I_8|I_JIMM),
-/*80*/ I_MODA|I_8, I_MODA|I_v, i64(I_MODA|I_8), I_MODA, I_MODA, I_MODA, I_MODA, I_MODA,
+/*80*/ I_MODA|I_8, I_MODA|I_z, i64(I_MODA|I_8), I_MODA|I_8, I_MODA, I_MODA, I_MODA, I_MODA,
      /*88*/ REP4(I_MODA), I_MODA, I_MOD, I_MODA, if64(I_PFX, I_MODA),
 /*90*/ REP8(0), 0, 0, i64(I_p), 0, 0, 0, 0, 0,
 /*A0*/ I_8, I_v, I_8, I_v, REP4(0), I_8, I_z, 0, 0, 0, 0, 0, 0,
 /*B0*/ REP8(I_8), REP8(I_v),
 /*C0*/ I_MODA|I_8, I_MODA|I_8, I_16|I_JMP, I_JMP,
-     /*C4*/ if64(I_PFX, I_MODA), if64(I_PFX, I_MODA), I_MODA|I_8, I_MODA|I_8,
+     /*C4*/ if64(I_PFX, I_MODA), if64(I_PFX, I_MODA), I_MODA|I_8, I_MODA|I_z,
      /*C8*/ I_24, 0, I_16|I_JMP, I_JMP, 0, I_8, i64(0), I_JMP,
 /*D0*/ REP4(I_MODA), i64(I_8), i64(I_8), I_BAD, 0, REP8(I_SPEC),
             /* don't treat ljmp as a jump for now */
 /*E0*/ REP4(I_8|I_JIMM), REP4(I_8),
      /*E8*/ I_z|I_JIMM_ONLY, I_z|I_JIMM, i64(I_p), I_8|I_JIMM, 0, 0, 0, 0,
-/*F0*/ I_PFX, I_BAD, I_PFX, I_PFX, 0, 0, I_MODA, I_MODA,
+/*F0*/ I_PFX, I_BAD, I_PFX, I_PFX, 0, 0, I_SPEC, I_SPEC,
      /*F8*/ 0, 0, 0, 0, 0, 0, I_MODA, I_SPEC,
 };
 _Static_assert(sizeof(onebyte_bits) == 256, "onebyte_bits");
@@ -90,20 +90,20 @@ _Static_assert(sizeof(onebyte_bits) == 256, "onebyte_bits");
 static const uint8_t _0f_bits[] = {
 /*00*/ I_MODA, I_MODA, 0, 0, I_BAD, o64(0), 0, o64(0),
      /*08*/ 0, 0, I_BAD, 0, 0, I_MODA, 0, 0,
-/*10*/ REP8(I_MODA), I_MODA, I_BAD, I_BAD, I_BAD, I_BAD, I_BAD, I_BAD, I_MODA,
+/*10*/ REP16(I_MODA),
 /*20*/ REP4(I_MOD), REP4(I_BAD), REP8(I_MODA),
 /*30*/ 0, 0, 0, 0, 0, 0, I_BAD, 0, I_MODA, I_BAD, I_MODA|I_8, I_BAD, REP4(I_BAD),
 /*40*/ REP16(I_MODA),
 /*50*/ I_MOD, I_MODA, I_MODA, I_MODA, REP4(I_MODA), REP8(I_MODA),
 /*60*/ REP16(I_MODA),
-/*70*/ I_MODA, I_MOD|I_8, I_MOD|I_8, I_MOD|I_8, I_MODA, I_MODA, I_MODA, 0,
+/*70*/ I_MODA|I_8, I_MOD|I_8, I_MOD|I_8, I_MOD|I_8, I_MODA, I_MODA, I_MODA, 0,
      /*78*/ I_MODA, I_MODA, I_BAD, I_BAD, REP4(I_MODA),
 /*80*/ REP16(I_z|I_JIMM),
 /*90*/ REP16(I_MODA),
-/*Ax*/ 0, 0, 0, 0, 0, 0, I_BAD, I_BAD,
+/*Ax*/ 0, 0, 0, I_MODA, I_MODA|I_8, I_MODA, I_BAD, I_BAD,
      /*A8*/ 0, 0, 0, I_MODA, I_MODA|I_8, I_MODA, I_MODA, I_MODA,
 /*B0*/ REP8(I_MODA), I_MODA, 0, I_MODA|I_8, I_MODA, REP4(I_MODA),
-/*C0*/ I_MODA, I_MODA, I_MODA|I_8, I_MODA, I_MODA|I_8, I_MOD|I_8, I_MODA|I_8, I_MODA|I_z,
+/*C0*/ I_MODA, I_MODA, I_MODA|I_8, I_MODA, I_MODA|I_8, I_MOD|I_8, I_MODA|I_8, I_MODA,
      /*C8*/ REP8(0),
 /*D0*/ REP4(I_MODA), I_MODA, I_MODA, I_MODA, I_MOD, REP8(I_MODA),
 /*E0*/ REP16(I_MODA),
@@ -112,12 +112,36 @@ static const uint8_t _0f_bits[] = {
 };
 _Static_assert(sizeof(_0f_bits) == 256, "_0f_bits");
 
+/* ModRM byte -> how many SIB and displacement bytes follow it.  With M_SIB,
+ * a SIB base of 5 under mod 0 means another 4 bytes of displacement.  (None
+ * of this depends on REX.B, and neither does RIP-relative addressing.) */
+#define M_SIB 0x10
+#define REP8V(...) __VA_ARGS__, __VA_ARGS__, __VA_ARGS__, __VA_ARGS__, \
+                   __VA_ARGS__, __VA_ARGS__, __VA_ARGS__, __VA_ARGS__
+#define MODRM_ROW(other, sib, rm5) other, other, other, other, sib, rm5, other, other
+static const uint8_t modrm_extra[] = {
+/*mod 0*/ REP8V(MODRM_ROW(0, M_SIB|1, 4)),
+/*mod 1*/ REP8V(MODRM_ROW(1, M_SIB|2, 1)),
+/*mod 2*/ REP8V(MODRM_ROW(4, M_SIB|5, 4)),
+/*mod 3*/ REP8V(MODRM_ROW(0, 0, 0)),
+};
+_Static_assert(sizeof(modrm_extra) == 256, "modrm_extra");
+
+/* [operand size 2/4/8][imm bits] -> immediate size */
+static const uint8_t imm_sizes[3][8] = {
+    /*       -  I_8 I_16 I_24 I_32 I_v I_z I_p */
+    /* 2 */ {0, 1,  2,   3,   4,   2,  2,  4},
+    /* 4 */ {0, 1,  2,   3,   4,   4,  4,  6},
+    /* 8 */ {0, 1,  2,   3,   4,   8,  4,  6},
+};
+
 static void P(dis)(tdis_ctx ctx) {
     const uint8_t *orig = ctx->base.ptr;
     const uint8_t *ptr = ctx->base.ptr;
 
     int opnd_size = 4;
-    int mod, rm = 0;
+    int mod;
+    UNUSED int rm;
 restart:;
     uint8_t byte1 = *ptr++;
     int bits = onebyte_bits[byte1];
@@ -126,10 +150,18 @@ restart:;
         if (byte1 == 0x0f) {
             uint8_t byte2 = *ptr++;
             bits = _0f_bits[byte2];
+            /* 0f 38 and 0f 3a are escapes to three-byte maps; the opcode byte
+             * doesn't matter (see above), but ModRM comes after it */
+            if (byte2 == 0x38 || byte2 == 0x3a)
+                ptr++;
         } else if ((byte1 & 0xf8) == 0xd8) {
-            /* ESC */
-            ptr++;
+            /* ESC - x87, always ModRM */
+            bits = I_MODA;
+        } else if ((byte1 & 0xfe) == 0xf6) {
+            /* group 3 - only TEST (/0, /1) has an immediate */
             bits = I_MODA;
+            if ((*ptr >> 3 & 7) < 2)
+                bits |= byte1 == 0xf6 ? I_8 : I_z;
         } else if (byte1 == 0xff) {
             uint8_t modrm = *ptr;
             int subop = modrm >> 3 & 7;
@@ -154,21 +186,38 @@ got_bits: UNUSED
         } else if ((byte1 & 0xf0) == 0x40) { /* REX */
             if (byte1 & 8) /* W */
                 opnd_size = 8;
-            if (byte1 & 1) /* B */
-                rm = 8;
             goto restart;
         } else if (byte1 == 0xc4) { /* VEX 3 */
             uint8_t byte2 = *ptr++;
-            if (!(byte2 & 0x20)) /* VEX.~B */
-                rm = 8;
             UNUSED uint8_t byte3 = *ptr++;
-            ptr++;
+            uint8_t opc = *ptr++;
             int map = byte2 & 0x1f;
             switch (map) {
             case 1:
-                bits = _0f_bits[byte2];
+                bits = _0f_bits[opc];
+                break;
+            case 2:
+                bits = _0f_bits[0x38];
+                break;
+            case 3:
+                bits = _0f_bits[0x3a];
+                break;
+            default:
+                bits = I_BAD;
+                break;
+            }
+            goto got_bits;
+        } else if (byte1 == 0x62) { /* EVEX */
+            uint8_t byte2 = *ptr;
+            ptr += 3;
+            uint8_t opc = *ptr++;
+            switch (byte2 & 7) {
+            case 1:
+                bits = _0f_bits[opc];
                 break;
             case 2:
+            case 5: /* (AVX512-FP16 maps, all ModRM) */
+            case 6:
                 bits = _0f_bits[0x38];
                 break;
             case 3:
@@ -180,8 +229,9 @@ got_bits: UNUSED
             }
             goto got_bits;
         } else if (byte1 == 0xc5) { /* VEX 2 */
-            uint8_t byte2 = *ptr++;
-            bits = _0f_bits[byte2];
+            UNUSED uint8_t byte2 = *ptr++;
+            uint8_t opc = *ptr++;
+            bits = _0f_bits[opc];
             goto got_bits;
         } else if (byte1 == 0x8f) { /* XOP (AMD only) */
             uint8_t byte2 = *ptr;
@@ -189,8 +239,6 @@ got_bits: UNUSED
             if ((byte2 >> 3 & 7) == 0)
                 goto modrm;
             ptr++; /* ok, definitely XOP */
-            if (!(byte2 & 0x20)) /* VEX.~B */
-                rm = 8;
             int map = byte2 & 0x1f;
             switch (map) {
             case 8:
@@ -219,37 +267,17 @@ got_bits: UNUSED
     modrm: UNUSED;
         modrm = *ptr++;
         mod = modrm >> 6;
-        rm |= modrm & 7;
-        if (rm == 4) {
-            /* sib */
-            ptr++;
-        }
-        /* displacement */
-#ifdef TARGET_x86_64
-        if (mod == 0 && rm == 5)
-            ptr += 4;
-#endif
-        else if (mod == 1)
-            ptr++;
-        else if (mod == 2)
-            ptr += 4;
+        rm = modrm & 7;
+        int extra = modrm_extra[modrm];
+        if ((extra & M_SIB) && mod == 0 && (*ptr & 7) == 5)
+            extra += 4;
+        ptr += extra & ~M_SIB;
     }
 
     int imm_off = ptr - orig;
 
     /* disp */
-    int imm_bits = bits & I_IMM_MASK;
-    int imm_size;
-    if (imm_bits <= I_32)
-        imm_size = imm_bits;
-    else if (imm_bits == I_v)
-        imm_size = opnd_size;
-    else if (imm_bits == I_z)
-        imm_size = opnd_size == 2 ? 2 : 4;
-    else if (imm_bits == I_p)
-        imm_size = opnd_size == 2 ? 4 : 6;
-    else /* because GCC is stupid */
-        __builtin_abort();
+    int imm_size = imm_sizes[opnd_size >> 2][bits & I_IMM_MASK];
     ptr += imm_size;
 
     ctx->base.ptr = ptr;
@@ -1,6 +1,13 @@
 #pragma once
 #define MAX_JUMP_PATCH_SIZE 14
 #define MAX_EXTENDED_PATCH_SIZE (MAX_JUMP_PATCH_SIZE+14)
+/* how far away a trampoline can be and still get a short patch (rel32); 0
+ * means anywhere */
+#ifdef TARGET_x86_64
+#define JUMP_PATCH_REACH 0x7fff0000ull
+#else
+#define JUMP_PATCH_REACH 0
+#endif
 #include "dis.h"
 
 static inline int jump_patch_size(uint_tptr pc, uint_tptr dpc,
@@ -35,3 +42,196 @@ static inline void make_jump_patch(void **codep, uint_tptr pc, uint_tptr dpc,
                                    UNUSED struct arch_dis_ctx arch) {
     make_jmp_or_call(codep, pc, dpc, false);
 }
+
+/* Hot-patch padding (SUBSTITUTE_USE_HOT_PATCH_PADDING): if the
+ * HOT_PATCH_PAD_SIZE bytes just before a function are all int3 or nop, i.e.
+ * alignment padding nothing runs, the jump patch can go there instead, with
+ * a 2-byte jmp short back to it at the function itself; then only the
+ * instructions covering those 2 bytes need relocating. */
+#define HOT_PATCH_PAD_SIZE 5
+#define HOT_PATCH_ENTRY_SIZE 2
+static inline bool hot_patch_padding_ok(uint_tptr pc) {
+    /* (only within pc's page, so looking can't fault) */
+    if (pc % 4096 < HOT_PATCH_PAD_SIZE)
+        return false;
+    const uint8_t *pad = (const uint8_t *) (uintptr_t) (pc - HOT_PATCH_PAD_SIZE);
+    for (int i = 0; i < HOT_PATCH_PAD_SIZE; i++) {
+        if (pad[i] != 0xcc && pad[i] != 0x90)
+            return false;
+    }
+    return true;
+}
+
+static inline void make_hot_patch_entry(void **codep) {
+    void *code = *codep;
+    op8(&code, 0xeb);
+    op8(&code, (uint8_t) -(HOT_PATCH_PAD_SIZE + HOT_PATCH_ENTRY_SIZE));
+    *codep = code;
+}
+
+/* A jump through a pointer-sized, aligned literal (given a 16-byte aligned
+ * pc), so the destination can be changed later with a single store. */
+#define RETARGETABLE_JUMP_SIZE 16
+#define RETARGETABLE_JUMP_LITERAL 8
+static inline void make_retargetable_jump(void **codep, uint_tptr pc,
+                                          uint_tptr dpc,
+                                          UNUSED struct arch_dis_ctx arch) {
+    void *code = *codep;
+    /* jmp *literal - (%rip) on x86_64, absolute on i386 */
+    op8(&code, 0xff);
+    op8(&code, 0x25);
+#ifdef TARGET_x86_64
+    (void) pc;
+    op32(&code, RETARGETABLE_JUMP_LITERAL - 6);
+#else
+    op32(&code, pc + RETARGETABLE_JUMP_LITERAL);
+#endif
+    op8(&code, 0xcc);
+    op8(&code, 0xcc);
+#ifdef TARGET_x86_64
+    op64(&code, dpc);
+#else
+    op32(&code, dpc);
+    op32(&code, 0);
+#endif
+    *codep = code;
+}
+
+/* A probe stub: count a call in *counter, then jump through a pointer-sized
+ * literal like make_retargetable_jump (again given a 16-byte aligned pc).
+ * Used in place of an intro trampoline, so it runs at function entry, where
+ * the flags (and on x86_64, r11) are dead.  On i386 the two halves of the
+ * counter are updated separately, so a reader can see a torn value, but no
+ * counts are lost. */
+#define PROBE_STUB_SIZE 32
+#define PROBE_STUB_LITERAL 24
+static inline void make_probe_stub(void **codep, uint_tptr pc,
+                                   uint64_t *counter,
+                                   UNUSED struct arch_dis_ctx arch) {
+    void *code = *codep;
+#ifdef TARGET_x86_64
+    (void) pc;
+    /* movabs $counter, %r11; lock incq (%r11) */
+    op8(&code, 0x49);
+    op8(&code, 0xbb);
+    op64(&code, (uint64_t) counter);
+    op32(&code, 0x03ff49f0);
+    /* jmp *literal - (%rip) */
+    op8(&code, 0xff);
+    op8(&code, 0x25);
+    op32(&code, PROBE_STUB_LITERAL - 20);
+    op32(&code, 0xcccccccc);
+    op64(&code, 0);
+#else
+    /* lock addl $1, counter; lock adcl $0, counter+4 */
+    op8(&code, 0xf0);
+    op8(&code, 0x83);
+    op8(&code, 0x05);
+    op32(&code, (uint32_t) (uintptr_t) counter);
+    op8(&code, 0x01);
+    op8(&code, 0xf0);
+    op8(&code, 0x83);
+    op8(&code, 0x15);
+    op32(&code, (uint32_t) (uintptr_t) counter + 4);
+    op8(&code, 0x00);
+    /* jmp *literal */
+    op8(&code, 0xff);
+    op8(&code, 0x25);
+    op32(&code, pc + PROBE_STUB_LITERAL);
+    op8(&code, 0xcc);
+    op8(&code, 0xcc);
+    op32(&code, 0);
+    op32(&code, 0);
+#endif
+    *codep = code;
+}
+
+#ifdef TARGET_x86_64
+/* A trace stub (see trace.h): point r11 at the trace_site in the stub and
+ * jump to the common entry code ('common').  The site's target is filled in
+ * later through the writable view at TRACE_STUB_SITE.  Not done for i386,
+ * which has no free register at function entry to pass the site in. */
+#define TRACE_STUB_SIZE 40
+#define TRACE_STUB_SITE 16
+#define TRACE_STUB_COMMON 32
+static inline void make_trace_stub(void **codep, UNUSED uint_tptr pc,
+                                   uintptr_t common, uint32_t id,
+                                   UNUSED struct arch_dis_ctx arch) {
+    void *code = *codep;
+    /* lea site(%rip), %r11 */
+    op8(&code, 0x4c);
+    op8(&code, 0x8d);
+    op8(&code, 0x1d);
+    op32(&code, TRACE_STUB_SITE - 7);
+    /* jmp *common(%rip) */
+    op8(&code, 0xff);
+    op8(&code, 0x25);
+    op32(&code, TRACE_STUB_COMMON - 13);
+    op8(&code, 0xcc);
+    op8(&code, 0xcc);
+    op8(&code, 0xcc);
+    op64(&code, 0);
+    op32(&code, id);
+    op32(&code, 0);
+    op64(&code, common);
+    *codep = code;
+}
+
+/* A reentrancy guard stub (for SUBSTITUTE_REENTRANCY_GUARD), used as a hook's
+ * replacement.  TSD slot 'key' (at %gs:key*8 on Darwin) holds the real return
+ * address while the replacement runs on this thread, so if it's set, this is
+ * a nested call and it just goes to the fallback (the original).  Otherwise
+ * it saves the return address there, swaps in the epilogue, and goes to the
+ * replacement; the epilogue clears the slot and returns.  The literals are at
+ * GUARD_STUB_REPLACEMENT and GUARD_STUB_FALLBACK (given a 16-byte aligned
+ * pc); r11 and the flags are dead at entry and at return. */
+#define GUARD_STUB_SIZE 88
+#define GUARD_STUB_REPLACEMENT 72
+#define GUARD_STUB_FALLBACK 80
+#define GUARD_STUB_MAX_KEY 0x0fffffff
+static inline void make_guard_stub(void **codep, UNUSED uint_tptr pc,
+                                   uint32_t key, uintptr_t replacement,
+                                   UNUSED struct arch_dis_ctx arch) {
+    void *code = *codep, *start = code;
+    uint32_t slot = key * 8;
+    /* cmpq $0, %gs:slot; jne reentered */
+    op32(&code, 0x3c834865);
+    op8(&code, 0x25);
+    op32(&code, slot);
+    op8(&code, 0x00);
+    op8(&code, 0x75);
+    op8(&code, 30);
+    /* mov (%rsp), %r11; mov %r11, %gs:slot */
+    op32(&code, 0x241c8b4c);
+    op32(&code, 0x1c894c65);
+    op8(&code, 0x25);
+    op32(&code, slot);
+    /* lea epilogue(%rip), %r11; mov %r11, (%rsp) */
+    op8(&code, 0x4c);
+    op8(&code, 0x8d);
+    op8(&code, 0x1d);
+    op32(&code, 16);
+    op32(&code, 0x241c894c);
+    /* jmp *replacement(%rip) */
+    op8(&code, 0xff);
+    op8(&code, 0x25);
+    op32(&code, GUARD_STUB_REPLACEMENT - 42);
+    /* reentered: jmp *fallback(%rip) */
+    op8(&code, 0xff);
+    op8(&code, 0x25);
+    op32(&code, GUARD_STUB_FALLBACK - 48);
+    /* epilogue: push %gs:slot; movq $0, %gs:slot; ret */
+    op32(&code, 0x2534ff65);
+    op32(&code, slot);
+    op32(&code, 0x04c74865);
+    op8(&code, 0x25);
+    op32(&code, slot);
+    op32(&code, 0);
+    op8(&code, 0xc3);
+    while ((uint8_t *) code - (uint8_t *) start < GUARD_STUB_REPLACEMENT)
+        op8(&code, 0xcc);
+    op64(&code, replacement);
+    op64(&code, 0);
+    *codep = code;
+}
+#endif
@@ -0,0 +1,173 @@
+#!/usr/bin/env python
+# Produce a cut down version of one of the generated decoders, for users like
+# jump-dis that only care about branches and pc-relative references.  Any
+# subtree of the decoder that can only reach leaves that don't do anything
+# interesting (i.e. just call P(data) or P(unidentified)) is collapsed into a
+# single P(unidentified) - op_size is already set by then, so that's all the
+# caller needs.
+#
+# usage: gen-branch-dis.py generic-dis-X.inc.h handwritten.inc.h... > out
+import sys, re
+
+# callbacks which matter to jump-dis; see the P(...) functions in jump-dis.c
+KEEP_CALLBACKS = ['branch', 'pcrel', 'ret', 'bad', 'thumb_it']
+
+def find_handlers(paths):
+    handlers = {}
+    for path in paths:
+        text = open(path).read()
+        for m in re.finditer(r'^static INLINE void P\((\w+)\)\(tdis_ctx ctx[^{]*\{\n(.*?)^\}', text, re.M | re.S):
+            handlers[m.group(1)] = m.group(2)
+    return handlers
+
+def interesting_leaves(handlers):
+    keep = re.compile(r'P\((%s)\)|ctx->arch' % '|'.join(KEEP_CALLBACKS))
+    interesting = set(name for name, body in handlers.items() if keep.search(body))
+    # leaves which forward to other leaves
+    while True:
+        new = set(name for name, body in handlers.items()
+                  if name not in interesting and
+                     any(callee in interesting for callee in re.findall(r'P\((\w+)\)', body)))
+        if not new:
+            return interesting
+        interesting |= new
+
+class Stmt(object):
+    def __init__(self, kind, indent, lines, children=[], leaf=None):
+        self.kind = kind
+        self.indent = indent
+        self.lines = lines
+        self.children = children
+        self.leaf = leaf
+
+class Parser(object):
+    def __init__(self, lines):
+        self.lines = lines
+        self.i = 0
+    def peek(self):
+        return self.lines[self.i].strip()
+    def take(self):
+        line = self.lines[self.i]
+        self.i += 1
+        return line
+    def indent_of(self, line):
+        return len(line) - len(line.lstrip())
+    def stmt(self):
+        s = self.peek()
+        if s.startswith('switch '):
+            head = self.take()
+            cases = []
+            while self.peek() != '}':
+                # one or more labels sharing a body
+                labels = []
+                while True:
+                    line = self.take()
+                    labels.append(line)
+                    if line.strip().endswith('{'):
+                        body = self.block()
+                        assert self.peek() == '}'
+                        body.lines = [self.take()]
+                        break
+                    if not self.peek().startswith('case '):
+                        body = self.stmt()
+                        break
+                cases.append(Stmt('case', self.indent_of(labels[0]), labels, [body]))
+            tail = self.take()
+            return Stmt('switch', self.indent_of(head), [head, tail], cases)
+        elif s.startswith('if '):
+            head = self.take()
+            then = self.block()
+            assert self.peek() == '} else {'
+            mid = self.take()
+            else_ = self.block()
+            assert self.peek() == '}'
+            tail = self.take()
+            return Stmt('if', self.indent_of(head), [head, mid, tail], [then, else_])
+        elif s.startswith('goto '):
+            line = self.take()
+            return Stmt('goto', self.indent_of(line), [line], leaf=s.split()[1].rstrip(';')[len('insn_'):])
+        elif s.startswith('insn_') or s.startswith('struct bitslice') or s.startswith('return '):
+            # a leaf: optional label, bitslices, call
+            start = self.i
+            while not self.peek().startswith('return '):
+                self.take()
+            line = self.take()
+            leaf = re.match(r'return P\((\w+)\)', line.strip()).group(1)
+            return Stmt('leaf', self.indent_of(line), self.lines[start:self.i], leaf=leaf)
+        else:
+            raise Exception('unexpected line %d: %r' % (self.i + 1, self.lines[self.i]))
+    def block(self):
+        stmts = []
+        while self.peek() not in ('}', '} else {'):
+            stmts.append(self.stmt())
+        return Stmt('block', None, [], stmts)
+
+def is_interesting(stmt, interesting):
+    if stmt.kind in ('leaf', 'goto'):
+        return stmt.leaf in interesting
+    return any(is_interesting(child, interesting) for child in stmt.children)
+
+def emit(stmt, interesting, out, indent=None):
+    if indent is None:
+        indent = stmt.indent
+    if not is_interesting(stmt, interesting):
+        out.append(' ' * indent + 'return P(unidentified)(ctx);')
+        return
+    if stmt.kind in ('leaf', 'goto'):
+        out.extend(stmt.lines)
+    elif stmt.kind == 'block':
+        for child in stmt.children:
+            emit(child, interesting, out)
+        out.extend(stmt.lines)
+    elif stmt.kind == 'if':
+        then, else_ = stmt.children
+        out.append(stmt.lines[0])
+        emit(then, interesting, out, stmt.indent + 4)
+        out.append(stmt.lines[1])
+        emit(else_, interesting, out, stmt.indent + 4)
+        out.append(stmt.lines[2])
+    elif stmt.kind == 'switch':
+        out.append(stmt.lines[0])
+        for case in stmt.children:
+            if is_interesting(case, interesting):
+                out.extend(case.lines)
+                body, = case.children
+                emit(body, interesting, out, case.indent + 4)
+        out.append(' ' * stmt.indent + 'default:')
+        out.append(' ' * (stmt.indent + 4) + 'return P(unidentified)(ctx);')
+        out.append(stmt.lines[1])
+
+def main():
+    gen_path = sys.argv[1]
+    handlers = find_handlers(sys.argv[2:])
+    interesting = interesting_leaves(handlers)
+    lines = open(gen_path).read().split('\n')
+    # skip the header comments
+    start = 0
+    in_comment = False
+    for start, line in enumerate(lines):
+        s = line.strip()
+        if in_comment:
+            in_comment = '*/' not in s
+        elif s.startswith('/*'):
+            in_comment = '*/' not in s
+        elif s:
+            break
+    parser = Parser(lines[start:])
+    top = parser.stmt()
+    for leaf in set(re.findall(r'return P\((\w+)\)', '\n'.join(lines[start:]))):
+        if leaf not in handlers and leaf != 'unidentified':
+            # be conservative about anything we can't see
+            sys.stderr.write('gen-branch-dis: no handler for %s\n' % leaf)
+            interesting.add(leaf)
+    out = ['/* Generated code; do not edit!',
+           '   generated by script/gen-branch-dis.py from %s' % gen_path.split('/')[-1],
+           '   (the same decoder, except that anything which can\'t lead to',
+           '    %s' % ', '.join('P(%s)' % c for c in KEEP_CALLBACKS),
+           '    is folded into P(unidentified))',
+           '*/',
+           '']
+    emit(top, interesting, out)
+    sys.stdout.write('\n'.join(out) + '\n')
+
+main()
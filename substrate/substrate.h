@@ -51,6 +51,7 @@ extern "C" {
 
 #include <dlfcn.h>
 #include <stdlib.h>
+#include <stdint.h>
 
 #define _finline \
     inline __attribute__((__always_inline__))
@@ -143,6 +144,47 @@ static inline Type_ &MSHookIvar(id self, const char *name) {
     return *reinterpret_cast<Type_ *>(pointer);
 }
 
+/* Per-call-site cache for MSHookIvar: the offsets for each class seen there,
+ * in a list that's only ever pushed onto, so lookups take no lock and the
+ * usual case (one class) is a load and a compare.  Entries are never freed;
+ * there's one per class the site is used with. */
+struct MSHookIvarCacheEntry {
+    Class class_;
+    ptrdiff_t offset_;
+    MSHookIvarCacheEntry *next_;
+};
+struct MSHookIvarCache {
+    MSHookIvarCacheEntry *head_;
+};
+
+template <typename Type_>
+static inline Type_ &MSHookIvar(id self, const char *name, MSHookIvarCache &cache) {
+    Class _class(object_getClass(self));
+    MSHookIvarCacheEntry *entry(__atomic_load_n(&cache.head_, __ATOMIC_ACQUIRE));
+    for (; entry != NULL; entry = entry->next_)
+        if (entry->class_ == _class)
+            return *reinterpret_cast<Type_ *>(reinterpret_cast<char *>(self) + entry->offset_);
+    Ivar ivar(class_getInstanceVariable(_class, name));
+    if (ivar == NULL)
+        return *reinterpret_cast<Type_ *>(NULL);
+    ptrdiff_t offset(ivar_getOffset(ivar));
+    entry = reinterpret_cast<MSHookIvarCacheEntry *>(malloc(sizeof(*entry)));
+    if (entry != NULL) {
+        entry->class_ = _class;
+        entry->offset_ = offset;
+        entry->next_ = __atomic_load_n(&cache.head_, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&cache.head_, &entry->next_, entry, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    return *reinterpret_cast<Type_ *>(reinterpret_cast<char *>(self) + offset);
+}
+
+/* MSHookIvar<type>(self, name), with the offset cached at this call site */
+#define MSHookIvarCached(type, self, name) \
+    (*({ \
+        static MSHookIvarCache _ms_ivar_cache; \
+        &MSHookIvar<type>(self, name, _ms_ivar_cache); \
+    }))
+
 #define MSAddMessage0(_class, type, arg0) \
     class_addMethod($ ## _class, @selector(arg0), (IMP) &$ ## _class ## $ ## arg0, type);
 #define MSAddMessage1(_class, type, arg0) \
@@ -247,7 +289,8 @@ static inline Type_ &MSHookIvar(id self, const char *name) {
     _spr(& (struct objc_super) {self, class_getSuperclass(_cls)}, _cmd, ## args)
 
 #define MSIvarHook(type, name) \
-    type &name(MSHookIvar<type>(self, #name))
+    static MSHookIvarCache _ms_ivar_cache_ ## name; \
+    type &name(MSHookIvar<type>(self, #name, _ms_ivar_cache_ ## name))
 
 #define MSClassHook(name) \
     @class name; \
@@ -284,6 +327,18 @@ static inline void MSHookFunction(const char *name, Type_ *replace, Type_ **resu
     return MSHookFunction(symbol, replace, result);
 }
 
+#if __cplusplus >= 201103L
+/* The name hash substitute_find_private_syms_hashed takes (64-bit FNV-1a,
+ * with 0 made 1), usable as a constant so the name itself needn't end up in
+ * the binary: constexpr uint64_t hash = MSHashSymbolName("_foo"); */
+static constexpr uint64_t _MSHashSymbolNameFrom(const char *name, uint64_t hash) {
+    return *name ? _MSHashSymbolNameFrom(name + 1, (hash ^ static_cast<uint8_t>(*name)) * 1099511628211ull) : hash ? hash : 1;
+}
+static constexpr uint64_t MSHashSymbolName(const char *name) {
+    return _MSHashSymbolNameFrom(name, 14695981039346656037ull);
+}
+#endif
+
 #endif
 
 #define MSHook(type, name, args...) \
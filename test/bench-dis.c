@@ -0,0 +1,52 @@
+/* Decoding throughput of jump-dis's decoder (the cut down one, unless built
+ * with -DDIS_BRANCHES_ONLY=0) over a raw code file, e.g. insns-libz-arm.bin
+ * or the .text section of an x86_64 binary.
+ * usage: bench-dis-X file [thumb] */
+#include <stdio.h>
+#include "jump-dis.c"
+#include "bench.h"
+#include <stdlib.h>
+#include <assert.h>
+
+/* the decoder uses alloca, so keep it out of the loop's frame */
+static NOINLINE void decode_one(struct jump_dis_ctx *ctx) {
+    ctx->bad_insn = false;
+    ctx->continue_after_this_insn = true;
+    jump_dis_dis(ctx);
+}
+
+int main(UNUSED int argc, char **argv) {
+    static char buf[1048576];
+    FILE *fp = fopen(argv[1], "rb");
+    assert(fp);
+    size_t size = fread(buf, 1, sizeof(buf), fp);
+    fclose(fp);
+    enum { REPS = 100 };
+    size_t ninsns = 0;
+    uint64_t start = bench_now_ns();
+    for (int rep = 0; rep < REPS; rep++) {
+        struct jump_dis_ctx ctx;
+        memset(&ctx, 0, sizeof(ctx));
+        arch_dis_ctx_init(&ctx.arch);
+#ifdef TARGET_arm
+        ctx.arch.pc_low_bit = argv[2] && atoi(argv[2]);
+#endif
+        /* nothing's patched, so nothing gets queued */
+        ctx.pc_patch_start = ctx.pc_patch_end = -1;
+        ctx.pc_ret = -1;
+        VEC_STORAGE_INIT(&ctx.queue, uint_tptr);
+        for (ctx.base.pc = 0; ctx.base.pc + 4 <= size;
+             ctx.base.pc += ctx.base.op_size) {
+            ctx.base.ptr = buf + ctx.base.pc;
+            decode_one(&ctx);
+            ninsns++;
+        }
+        vec_free_storage_uint_tptr(&ctx.queue.v);
+    }
+    uint64_t ns = bench_now_ns() - start;
+    BENCH_RESULT("jump_dis_decode",
+                 "\"file\": \"%s\", \"branches_only\": %d, \"insns\": %zu, "
+                 "\"ns_per_insn\": %.2f",
+                 argv[1], DIS_BRANCHES_ONLY, ninsns / REPS,
+                 (double) ns / ninsns);
+}
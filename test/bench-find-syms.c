@@ -0,0 +1,35 @@
+#include "substitute.h"
+#include "bench.h"
+#include <stdio.h>
+#include <assert.h>
+
+int main() {
+    static const char *names[] = {
+        "_malloc", "_free", "_calloc", "_realloc", "_strlen", "_strcmp",
+        "_strncmp", "_strcpy", "_strncpy", "_strcat", "_strchr", "_strrchr",
+        "_strstr", "_strdup", "_memchr", "_atoi", "_atol", "_strtol",
+        "_strtoul", "_strtod", "_qsort", "_bsearch", "_abort", "_exit",
+        "_atexit", "_getenv", "_setenv", "_unsetenv", "_printf", "_fprintf",
+        "_sprintf", "_snprintf", "_vprintf", "_vfprintf", "_vsnprintf",
+        "_puts", "_fputs", "_fgets", "_fopen", "_fclose", "_fread", "_fwrite",
+        "_fseek", "_ftell", "_fflush", "_perror", "_strerror", "_time",
+        "_localtime", "_gmtime", "_mktime", "_strftime", "_rand", "_srand",
+        "_random", "_srandom", "_isatty", "_ttyname", "_popen", "_pclose",
+        "_system", "_tolower", "_toupper", "_hcreate",
+    };
+    enum { NNAMES = sizeof(names) / sizeof(*names), REPS = 20 };
+    const char *path = "/usr/lib/system/libsystem_c.dylib";
+    struct substitute_image *im = substitute_open_image(path);
+    assert(im);
+    void *syms[NNAMES];
+    for (size_t n = 1; n <= NNAMES; n *= 2) {
+        uint64_t start = bench_now_ns();
+        for (int rep = 0; rep < REPS; rep++)
+            assert(!substitute_find_private_syms(im, names, syms, n));
+        uint64_t ns = (bench_now_ns() - start) / REPS;
+        BENCH_RESULT("find_private_syms",
+                     "\"image\": \"%s\", \"nsyms\": %zu, \"ns\": %llu",
+                     path, n, (unsigned long long) ns);
+    }
+    substitute_close_image(im);
+}
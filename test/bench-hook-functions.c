@@ -0,0 +1,131 @@
+#include "substitute.h"
+#include "bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <assert.h>
+
+/* 10000 distinct functions to hook, in their own writable-by-remap section
+ * like test-hook-functions'. */
+#define BENCH_FUNC(n) \
+    __attribute__((section("__TEST,__bench"), noinline)) \
+    static int bench_f##n(int x) { \
+        volatile int y = x; \
+        y *= 3; \
+        y += 7; \
+        return y; \
+    }
+#define BENCH_ADDR(n) bench_f##n,
+#define R10(m, p) m(p##0) m(p##1) m(p##2) m(p##3) m(p##4) \
+                  m(p##5) m(p##6) m(p##7) m(p##8) m(p##9)
+#define R100(m, p) R10(m, p##0) R10(m, p##1) R10(m, p##2) R10(m, p##3) \
+                   R10(m, p##4) R10(m, p##5) R10(m, p##6) R10(m, p##7) \
+                   R10(m, p##8) R10(m, p##9)
+#define R1000(m, p) R100(m, p##0) R100(m, p##1) R100(m, p##2) R100(m, p##3) \
+                    R100(m, p##4) R100(m, p##5) R100(m, p##6) R100(m, p##7) \
+                    R100(m, p##8) R100(m, p##9)
+#define R10000(m) R1000(m, 0) R1000(m, 1) R1000(m, 2) R1000(m, 3) \
+                  R1000(m, 4) R1000(m, 5) R1000(m, 6) R1000(m, 7) \
+                  R1000(m, 8) R1000(m, 9)
+
+R10000(BENCH_FUNC)
+static int (*const bench_funcs[])(int) = { R10000(BENCH_ADDR) };
+#define NFUNCS (sizeof(bench_funcs) / sizeof(*bench_funcs))
+
+static int hook_replacement(int x) {
+    return x;
+}
+
+static int (*old_pass_through)(int);
+static int hook_pass_through(int x) {
+    return old_pass_through(x);
+}
+
+static struct substitute_function_hook g_hooks[NFUNCS];
+
+/* Hook the first n functions in one call; returns the time taken. */
+static uint64_t hook_and_unhook(size_t n) {
+    for (size_t i = 0; i < n; i++)
+        g_hooks[i] = (struct substitute_function_hook)
+            {bench_funcs[i], hook_replacement, NULL};
+    struct substitute_function_hook_record *record;
+    uint64_t start = bench_now_ns();
+    int ret = substitute_hook_functions(g_hooks, n, &record, 0);
+    uint64_t end = bench_now_ns();
+    assert(!ret);
+    ret = substitute_unhook_functions(record, 0);
+    assert(!ret);
+    return end - start;
+}
+
+static pthread_mutex_t g_idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_idle_cond = PTHREAD_COND_INITIALIZER;
+static bool g_idle_done;
+
+static void *idle_thread(void *arg) {
+    (void) arg;
+    pthread_mutex_lock(&g_idle_lock);
+    while (!g_idle_done)
+        pthread_cond_wait(&g_idle_cond, &g_idle_lock);
+    pthread_mutex_unlock(&g_idle_lock);
+    return NULL;
+}
+
+static uint64_t time_calls(int (*volatile f)(int), int ncalls) {
+    uint64_t start = bench_now_ns();
+    for (int i = 0; i < ncalls; i++)
+        f(i);
+    return bench_now_ns() - start;
+}
+
+int main() {
+    enum { REPS = 5 };
+
+    /* latency vs. number of hooks */
+    for (size_t n = 1; n <= NFUNCS; n *= 10) {
+        uint64_t total = 0;
+        for (int rep = 0; rep < REPS; rep++)
+            total += hook_and_unhook(n);
+        BENCH_RESULT("hook_functions", "\"nhooks\": %zu, \"ns\": %llu",
+                     n, (unsigned long long) (total / REPS));
+    }
+
+    /* latency vs. number of threads (which all have to be stopped) */
+    static pthread_t threads[512];
+    size_t nthreads = 1;
+    for (size_t want = 1; want <= 512; want *= 2) {
+        for (; nthreads < want; nthreads++)
+            assert(!pthread_create(&threads[nthreads - 1], NULL,
+                                   idle_thread, NULL));
+        uint64_t total = 0;
+        for (int rep = 0; rep < REPS; rep++)
+            total += hook_and_unhook(16);
+        BENCH_RESULT("hook_functions_threads",
+                     "\"nthreads\": %zu, \"nhooks\": 16, \"ns\": %llu",
+                     nthreads, (unsigned long long) (total / REPS));
+    }
+    pthread_mutex_lock(&g_idle_lock);
+    g_idle_done = true;
+    pthread_cond_broadcast(&g_idle_cond);
+    pthread_mutex_unlock(&g_idle_lock);
+    for (size_t i = 0; i + 1 < nthreads; i++)
+        pthread_join(threads[i], NULL);
+
+    /* per-call overhead */
+    enum { NCALLS = 10000000 };
+    int (*f)(int) = bench_funcs[0];
+    uint64_t orig_ns = time_calls(f, NCALLS);
+    struct substitute_function_hook hook = {f, hook_pass_through,
+                                            &old_pass_through};
+    int ret = substitute_hook_functions(&hook, 1, NULL, 0);
+    assert(!ret);
+    uint64_t outro_ns = time_calls(old_pass_through, NCALLS);
+    uint64_t hooked_ns = time_calls(f, NCALLS);
+    BENCH_RESULT("call_overhead",
+                 "\"ncalls\": %d, \"original_ns\": %llu, \"outro_ns\": %llu, "
+                 "\"hooked_ns\": %llu",
+                 NCALLS, (unsigned long long) orig_ns,
+                 (unsigned long long) outro_ns,
+                 (unsigned long long) hooked_ns);
+}
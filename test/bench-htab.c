@@ -0,0 +1,88 @@
+#include "cbit/htab.h"
+#include "cbit/swtab.h"
+#include "bench.h"
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+
+/* Look up symbol-like names in a linear-probed htab and the SIMD-probed
+ * swtab, at a few table sizes, for both hits and misses. */
+struct name {
+    const char *str;
+    size_t len;
+};
+
+UNUSED_STATIC_INLINE
+size_t name_hash(const struct name *n) {
+    size_t hash = 2166136261u;
+    for (size_t i = 0; i < n->len; i++)
+        hash = (hash ^ (uint8_t) n->str[i]) * 16777619u;
+    return hash;
+}
+#define name_eq(a, b) ((a)->len == (b)->len && \
+                       !memcmp((a)->str, (b)->str, (a)->len))
+#define name_null(n) (!(n)->str)
+DECL_STATIC_HTAB_KEY(name, struct name, name_hash, name_eq, name_null, 0);
+DECL_HTAB(name_int, name, int);
+DECL_SWTAB(name_int, struct name, int, name_hash, name_eq);
+
+static struct name make_name(const char *prefix, size_t i) {
+    char *str;
+    int len = asprintf(&str, "_%s_symbol_number_%zu", prefix, i);
+    assert(len > 0);
+    return (struct name) {str, len};
+}
+
+int main() {
+    enum { LOOKUPS = 1000000 };
+    static const size_t sizes[] = {100, 1000, 10000, 100000};
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(*sizes); s++) {
+        size_t n = sizes[s];
+        struct name *present = malloc(n * sizeof(*present));
+        struct name *absent = malloc(n * sizeof(*absent));
+        HTAB_STORAGE(name_int) ht;
+        HTAB_STORAGE_INIT(&ht, name_int);
+        struct swtab_name_int sw;
+        swtab_init_name_int(&sw);
+        for (size_t i = 0; i < n; i++) {
+            present[i] = make_name("present", i);
+            absent[i] = make_name("absent", i);
+            *htab_setp_name_int(&ht.h, &present[i], NULL) = i;
+            *swtab_setp_name_int(&sw, &present[i], NULL) = i;
+        }
+
+        uint64_t ns[2][2];
+        for (int miss = 0; miss < 2; miss++) {
+            struct name *keys = miss ? absent : present;
+            size_t found[2] = {0, 0};
+            uint64_t start = bench_now_ns();
+            for (size_t i = 0; i < LOOKUPS; i++)
+                found[0] += !!htab_getp_name_int(&ht.h, &keys[i % n]);
+            ns[0][miss] = bench_now_ns() - start;
+            start = bench_now_ns();
+            for (size_t i = 0; i < LOOKUPS; i++)
+                found[1] += !!swtab_getp_name_int(&sw, &keys[i % n]);
+            ns[1][miss] = bench_now_ns() - start;
+            assert(found[0] == found[1]);
+            assert(found[0] == (miss ? 0 : LOOKUPS));
+        }
+        BENCH_RESULT("htab_lookup",
+                     "\"entries\": %zu, \"lookups\": %d, "
+                     "\"htab_hit_ns\": %llu, \"htab_miss_ns\": %llu, "
+                     "\"swtab_hit_ns\": %llu, \"swtab_miss_ns\": %llu",
+                     n, LOOKUPS,
+                     (unsigned long long) ns[0][0],
+                     (unsigned long long) ns[0][1],
+                     (unsigned long long) ns[1][0],
+                     (unsigned long long) ns[1][1]);
+
+        for (size_t i = 0; i < n; i++) {
+            free((char *) present[i].str);
+            free((char *) absent[i].str);
+        }
+        free(present);
+        free(absent);
+        htab_free_storage_name_int(&ht.h);
+        swtab_free_storage_name_int(&sw);
+    }
+}
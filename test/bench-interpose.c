@@ -0,0 +1,57 @@
+#include "substitute.h"
+#include "substitute-internal.h"
+#include "bench.h"
+#include <stdio.h>
+#include <dlfcn.h>
+#include <assert.h>
+#include <mach-o/dyld.h>
+
+static void *my_malloc(size_t size) {
+    (void) size;
+    return NULL;
+}
+
+static size_t bind_table_size(const mach_header_x *mh) {
+    const struct load_command *lc = (void *) (mh + 1);
+    for (uint32_t i = 0; i < mh->ncmds; i++) {
+        if (lc->cmd == LC_DYLD_INFO || lc->cmd == LC_DYLD_INFO_ONLY) {
+            const struct dyld_info_command *dc = (void *) lc;
+            return dc->bind_size + dc->weak_bind_size + dc->lazy_bind_size;
+        }
+        lc = (void *) lc + lc->cmdsize;
+    }
+    return 0;
+}
+
+int main() {
+    const char *paths[] = {
+        _dyld_get_image_name(0),
+        "/usr/lib/libobjc.A.dylib",
+        "/System/Library/Frameworks/CoreFoundation.framework/CoreFoundation",
+        "/System/Library/Frameworks/Foundation.framework/Foundation",
+    };
+    enum { REPS = 20 };
+    for (size_t i = 0; i < sizeof(paths) / sizeof(*paths); i++) {
+        dlopen(paths[i], RTLD_LAZY);
+        struct substitute_image *im = substitute_open_image(paths[i]);
+        if (!im)
+            continue;
+        /* interpose and then restore, so every rep does the same work */
+        void *old;
+        struct substitute_import_hook hook = {"_malloc", my_malloc, &old};
+        uint64_t total = 0;
+        for (int rep = 0; rep < REPS; rep++) {
+            struct substitute_import_hook_record *record;
+            uint64_t start = bench_now_ns();
+            int ret = substitute_interpose_imports(im, &hook, 1, &record, 0);
+            total += bench_now_ns() - start;
+            assert(!ret);
+            substitute_unhook_imports(record);
+        }
+        BENCH_RESULT("interpose_imports",
+                     "\"image\": \"%s\", \"bind_bytes\": %zu, \"ns\": %llu",
+                     paths[i], bind_table_size(im->image_header),
+                     (unsigned long long) (total / REPS));
+        substitute_close_image(im);
+    }
+}
@@ -0,0 +1,110 @@
+#include "substitute.h"
+#include "substitute-internal.h"
+#include "darwin/read.h"
+#include "bench.h"
+#include <stdio.h>
+#include <assert.h>
+#include <mach-o/dyld.h>
+
+/* Decode every LEB128 operand in an image's bind opcodes, with either the
+ * inline decoder or the loop it falls back to, and check they agree. */
+#define DECL_WALK(name, leb) \
+    static uint64_t name(void *ptr, void *end) { \
+        uint64_t sum = 0, v; \
+        char *sym; \
+        while (ptr < end) { \
+            uint8_t byte = *(uint8_t *) ptr; \
+            ptr++; \
+            switch (byte & BIND_OPCODE_MASK) { \
+            case BIND_OPCODE_SET_DYLIB_ORDINAL_ULEB: \
+            case BIND_OPCODE_SET_SEGMENT_AND_OFFSET_ULEB: \
+            case BIND_OPCODE_ADD_ADDR_ULEB: \
+            case BIND_OPCODE_DO_BIND_ADD_ADDR_ULEB: \
+                if (!leb(&ptr, end, false, &v)) \
+                    return sum; \
+                sum += v; \
+                break; \
+            case BIND_OPCODE_SET_ADDEND_SLEB: \
+                if (!leb(&ptr, end, true, &v)) \
+                    return sum; \
+                sum += v; \
+                break; \
+            case BIND_OPCODE_DO_BIND_ULEB_TIMES_SKIPPING_ULEB: \
+                if (!leb(&ptr, end, false, &v)) \
+                    return sum; \
+                sum += v; \
+                if (!leb(&ptr, end, false, &v)) \
+                    return sum; \
+                sum += v; \
+                break; \
+            case BIND_OPCODE_SET_SYMBOL_TRAILING_FLAGS_IMM: \
+                if (!read_cstring(&ptr, end, &sym)) \
+                    return sum; \
+                break; \
+            } \
+        } \
+        return sum; \
+    }
+DECL_WALK(walk_inline, read_leb128)
+DECL_WALK(walk_slow, read_leb128_slow)
+
+struct bind_streams {
+    void *start[3];
+    size_t size[3];
+};
+
+static bool get_bind_streams(const mach_header_x *mh, intptr_t slide,
+                             struct bind_streams *bs) {
+    const segment_command_x *linkedit = NULL;
+    const struct dyld_info_command *dc = NULL;
+    const struct load_command *lc = (void *) (mh + 1);
+    for (uint32_t i = 0; i < mh->ncmds; i++) {
+        if (lc->cmd == LC_SEGMENT_X &&
+            !strcmp(((segment_command_x *) lc)->segname, "__LINKEDIT"))
+            linkedit = (void *) lc;
+        else if (lc->cmd == LC_DYLD_INFO || lc->cmd == LC_DYLD_INFO_ONLY)
+            dc = (void *) lc;
+        lc = (void *) lc + lc->cmdsize;
+    }
+    if (!linkedit || !dc)
+        return false;
+    void *base = (void *) (linkedit->vmaddr + slide - linkedit->fileoff);
+    bs->start[0] = base + dc->bind_off;
+    bs->size[0] = dc->bind_size;
+    bs->start[1] = base + dc->weak_bind_off;
+    bs->size[1] = dc->weak_bind_size;
+    bs->start[2] = base + dc->lazy_bind_off;
+    bs->size[2] = dc->lazy_bind_size;
+    return true;
+}
+
+int main() {
+    enum { REPS = 50 };
+    for (uint32_t i = 0; i < _dyld_image_count(); i++) {
+        const mach_header_x *mh = (void *) _dyld_get_image_header(i);
+        struct bind_streams bs;
+        if (!get_bind_streams(mh, _dyld_get_image_vmaddr_slide(i), &bs))
+            continue;
+        size_t bytes = bs.size[0] + bs.size[1] + bs.size[2];
+        if (bytes < 4096)
+            continue;
+        uint64_t sums[2] = {0, 0}, ns[2];
+        for (int which = 0; which < 2; which++) {
+            uint64_t start = bench_now_ns();
+            for (int rep = 0; rep < REPS; rep++) {
+                for (int s = 0; s < 3; s++) {
+                    void *p = bs.start[s], *end = p + bs.size[s];
+                    sums[which] += which ? walk_slow(p, end)
+                                         : walk_inline(p, end);
+                }
+            }
+            ns[which] = (bench_now_ns() - start) / REPS;
+        }
+        assert(sums[0] == sums[1]);
+        BENCH_RESULT("leb128_bind_streams",
+                     "\"image\": \"%s\", \"bind_bytes\": %zu, "
+                     "\"inline_ns\": %llu, \"loop_ns\": %llu",
+                     _dyld_get_image_name(i), bytes,
+                     (unsigned long long) ns[0], (unsigned long long) ns[1]);
+    }
+}
@@ -0,0 +1,95 @@
+#include "cbit/mpscq.h"
+#include "bench.h"
+#include <pthread.h>
+#include <sched.h>
+#include <assert.h>
+
+/* Push ITEMS values through one MPSC queue from a number of threads at once,
+ * or through one SPSC queue per thread, with the main thread consuming.  A
+ * producer that finds its queue full, or the consumer finding nothing, yields
+ * and tries again (so as not to starve the others with more threads than
+ * cores). */
+DECL_MPSCQ(uint64_t, u64);
+DECL_SPSCQ(uint64_t, u64);
+
+enum { ITEMS = 1000000, CAPACITY = 4096, MAX_THREADS = 16 };
+
+static struct mpscq_u64 g_mpscq;
+static struct spscq_u64 g_spscqs[MAX_THREADS];
+
+struct producer {
+    size_t idx, nthreads;
+    bool spsc;
+    uint64_t full_yields;
+};
+
+static void *producer_thread(void *arg) {
+    struct producer *p = arg;
+    uint64_t yields = 0;
+    for (uint64_t v = p->idx; v < ITEMS; v += p->nthreads) {
+        if (p->spsc) {
+            for (; !spscq_push_u64(&g_spscqs[p->idx], v); yields++)
+                sched_yield();
+        } else {
+            for (; !mpscq_push_u64(&g_mpscq, v); yields++)
+                sched_yield();
+        }
+    }
+    p->full_yields = yields;
+    return NULL;
+}
+
+static void run(size_t nthreads, bool spsc) {
+    static pthread_t threads[MAX_THREADS];
+    static struct producer producers[MAX_THREADS];
+    uint64_t start = bench_now_ns();
+    for (size_t i = 0; i < nthreads; i++) {
+        producers[i] = (struct producer) {i, nthreads, spsc, 0};
+        assert(!pthread_create(&threads[i], NULL, producer_thread,
+                               &producers[i]));
+    }
+    uint64_t sum = 0, empty_polls = 0;
+    for (size_t n = 0; n < ITEMS; ) {
+        uint64_t v;
+        bool got = false;
+        if (spsc) {
+            for (size_t i = 0; i < nthreads; i++) {
+                if (spscq_pop_u64(&g_spscqs[i], &v)) {
+                    sum += v;
+                    n++;
+                    got = true;
+                }
+            }
+        } else if ((got = mpscq_pop_u64(&g_mpscq, &v))) {
+            sum += v;
+            n++;
+        }
+        if (!got) {
+            empty_polls++;
+            sched_yield();
+        }
+    }
+    uint64_t end = bench_now_ns();
+    uint64_t full_yields = 0;
+    for (size_t i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+        full_yields += producers[i].full_yields;
+    }
+    assert(sum == (uint64_t) ITEMS * (ITEMS - 1) / 2);
+    BENCH_RESULT(spsc ? "spscq" : "mpscq",
+                 "\"nproducers\": %zu, \"items\": %d, \"ns\": %llu, "
+                 "\"full_yields\": %llu, \"empty_polls\": %llu",
+                 nthreads, ITEMS, (unsigned long long) (end - start),
+                 (unsigned long long) full_yields,
+                 (unsigned long long) empty_polls);
+}
+
+int main() {
+    assert(mpscq_init_u64(&g_mpscq, CAPACITY));
+    for (size_t i = 0; i < MAX_THREADS; i++)
+        assert(spscq_init_u64(&g_spscqs[i], CAPACITY));
+    for (size_t nthreads = 1; nthreads <= MAX_THREADS; nthreads *= 2) {
+        run(nthreads, false);
+        run(nthreads, true);
+    }
+}
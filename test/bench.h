@@ -0,0 +1,17 @@
+/* Shared bits for the bench-* programs.  Each result is printed as one line
+ * of JSON, so runs can be collected and compared across releases. */
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <mach/mach_time.h>
+
+static inline uint64_t bench_now_ns(void) {
+    static mach_timebase_info_data_t tb;
+    if (!tb.denom)
+        mach_timebase_info(&tb);
+    return mach_absolute_time() * tb.numer / tb.denom;
+}
+
+/* fmt continues the JSON object, e.g. "\"nhooks\": %d, \"ns\": %llu" */
+#define BENCH_RESULT(name, fmt, ...) \
+    printf("{\"bench\": \"%s\", " fmt "}\n", name, __VA_ARGS__)
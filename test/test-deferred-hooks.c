@@ -0,0 +1,43 @@
+#include "substitute.h"
+#include <stdio.h>
+#include <assert.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <string.h>
+
+static const char *hook_zlibVersion(void) {
+    return "hooked";
+}
+
+static pid_t (*old_getppid)(void);
+static pid_t hook_getppid(void) {
+    return old_getppid() + 1;
+}
+
+int main() {
+    /* not loaded yet: waits for the dlopen */
+    const char *z_syms[] = {"_zlibVersion", "_no_such_function_here"};
+    void *z_repls[] = {hook_zlibVersion, hook_zlibVersion};
+    int ret = substitute_hook_functions_deferred("/usr/lib/libz.1.dylib",
+                                                 z_syms, z_repls, NULL, 2, 0);
+    printf("deferred ret=%d\n", ret);
+    assert(ret == SUBSTITUTE_OK);
+    void *z = dlopen("/usr/lib/libz.1.dylib", RTLD_LAZY);
+    assert(z);
+    const char *(*zv)(void) = dlsym(z, "zlibVersion");
+    printf("zlibVersion() => %s\n", zv());
+    assert(!strcmp(zv(), "hooked"));
+
+    /* already loaded: goes in right away */
+    pid_t ppid = getppid();
+    const char *k_syms[] = {"_getppid"};
+    void *k_repls[] = {hook_getppid};
+    void *k_olds[] = {&old_getppid};
+    ret = substitute_hook_functions_deferred(
+        "/usr/lib/system/libsystem_kernel.dylib", k_syms, k_repls, k_olds, 1,
+        0);
+    printf("loaded ret=%d\n", ret);
+    assert(ret == SUBSTITUTE_OK);
+    assert(getppid() == ppid + 1);
+    printf("ok\n");
+}
@@ -0,0 +1,36 @@
+/* Check that the arm64 prefilter lets through every instruction the jump-dis
+ * decoder does something with, using random words. */
+#include <stdio.h>
+#include "jump-dis.c"
+#include <stdlib.h>
+
+int main() {
+    VEC_STORAGE_CAPA(jump_dis_ref, 4) refs;
+    VEC_STORAGE_INIT(&refs, jump_dis_ref);
+    int seen = 0, missed = 0;
+    srandom(42);
+    for (int i = 0; i < 10000000; i++) {
+        uint32_t op = (uint32_t) random() << 16 ^ (uint32_t) random();
+        struct jump_dis_ctx ctx;
+        memset(&ctx, 0, sizeof(ctx));
+        /* cover the whole address space, so every reference is recorded */
+        ctx.pc_patch_start = 0;
+        ctx.pc_patch_end = -1;
+        ctx.pc_ret = -1;
+        ctx.base.pc = 0x100000;
+        ctx.base.ptr = &op;
+        ctx.refs = &refs.v;
+        refs.v.length = 0;
+        jump_dis_dis(&ctx);
+        if (!refs.v.length && ctx.pc_ret == (uint_tptr) -1)
+            continue;
+        seen++;
+        if (!arm64_prefilter_match(op)) {
+            printf("missed %08x\n", op);
+            missed++;
+        }
+    }
+    vec_free_storage_jump_dis_ref(&refs.v);
+    printf("seen=%d missed=%d\n", seen, missed);
+    return !!missed;
+}
@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <search.h> /* for the victim */
 #include <errno.h>
+#include <assert.h>
 #define NOP_SLED \
    __asm__ volatile("nop; nop; nop; nop; nop; nop; nop; nop; nop; nop;" \
                     "nop; nop; nop; nop; nop; nop; nop; nop; nop; nop;" \
@@ -25,6 +26,31 @@ int test(size_t a) {
       return 1000;
 }
 
+/* for execmem_atomic_write to turn into one that returns 7 */
+__attribute__((noinline, aligned(16)))
+int atomic_victim(size_t a) {
+   if (__builtin_expect(!a, 1))
+      return 6;
+   NOP_SLED;
+   return 0;
+}
+
+static const uint8_t return_7[] = {
+#if defined(__x86_64__) || defined(__i386__)
+   0xb8, 0x07, 0x00, 0x00, 0x00, /* mov $7, %eax */
+   0xc3, /* ret */
+#elif defined(__arm64__)
+   0xe0, 0x00, 0x80, 0x52, /* mov w0, #7 */
+   0xc0, 0x03, 0x5f, 0xd6, /* ret */
+#elif defined(__thumb__)
+   0x07, 0x20, /* movs r0, #7 */
+   0x70, 0x47, /* bx lr */
+#else
+   0x07, 0x00, 0xa0, 0xe3, /* mov r0, #7 */
+   0x1e, 0xff, 0x2f, 0xe1, /* bx lr */
+#endif
+};
+
 static int ewrite(void *dst, const void *src, size_t len) {
    struct execmem_foreign_write w = {dst, src, len};
    return execmem_foreign_write_with_pc_patch(&w, 1, NULL, NULL);
@@ -39,4 +65,16 @@ int main() {
    printf("   %s\n", strerror(errno));
    printf("modified shared cache func should be 6: %d\n", hcreate(0));
 
+   /* replace the start of atomic_victim() with a different body, called
+    * through a volatile pointer so the call can't be folded */
+   int (*volatile victim)(size_t) = atomic_victim;
+   printf("this should be 6: %d\n", victim(0));
+   int ret = execmem_atomic_write((void *) ((uintptr_t) atomic_victim & ~1),
+                                  return_7, sizeof(return_7));
+   printf("atomic write => %d\n", ret);
+   assert(!ret);
+   int val = victim(0);
+   printf("this should be 7: %d\n", val);
+   assert(val == 7);
+
 }
@@ -2,6 +2,23 @@
 #include <stdio.h>
 #include <assert.h>
 #include <dlfcn.h>
+#include <string.h>
+
+struct enum_ctx {
+	void *want;
+	int seen, matched;
+};
+
+static bool enum_cb(void *ctx, const char *name, const substitute_sym *sym,
+                    void *ptr) {
+	struct enum_ctx *ec = (struct enum_ctx *) ctx;
+	(void) sym;
+	assert(!strncmp(name, "_absolute_from_", 15));
+	ec->seen++;
+	if (ptr == ec->want)
+		ec->matched++;
+	return true;
+}
 
 int main() {
 	const char *foundation = "/System/Library/Frameworks/Foundation.framework/Foundation";
@@ -15,5 +32,71 @@ int main() {
 
 	assert(f(12345) < 0);
 
+	/* enough names to go through the hash table, with a repeat */
+	const char *names2[] = { "_absolute_from_gregorian", "_no_such_symbol_here",
+	                         "_absolute_from_gregorian", "_gregorian_from_absolute" };
+	void *syms2[4];
+	assert(!substitute_find_private_syms(im, names2, syms2, 4));
+	assert(syms2[0] == (void *) f && syms2[2] == (void *) f);
+	assert(!syms2[1]);
+
+	/* the same, by hash */
+	uint64_t hashes[4];
+	size_t i;
+	for (i = 0; i < 4; i++)
+		hashes[i] = substitute_hash_sym_name(names2[i]);
+	void *syms4[4];
+	assert(!substitute_find_private_syms_hashed(im, hashes, syms4, 4));
+	assert(!memcmp(syms4, syms2, sizeof(syms2)));
+	assert(!substitute_find_private_syms_hashed(im, hashes, syms4, 1));
+	assert(syms4[0] == (void *) f);
+
+	/* handles are shared, by path or by address */
+	struct substitute_image *im2 = substitute_open_image(foundation);
+	assert(im2 == im);
+	substitute_close_image(im2);
+	im2 = substitute_open_image_by_address((void *) f);
+	assert(im2 == im);
+	substitute_close_image(im2);
+
+	struct enum_ctx ec = { (void *) f, 0, 0 };
+	assert(!substitute_enumerate_syms(im, "_absolute_from_", enum_cb, &ec));
+	assert(ec.seen >= 1 && ec.matched >= 1);
 	substitute_close_image(im);
+
+	/* that was the last reference, so the index went with it */
+	im = substitute_open_image(foundation);
+	assert(im && !im->sym_index);
+	substitute_close_image(im);
+
+	/* a new image's first lookup: exported names come from the export
+	 * trie, and should agree with dlsym; the rest are scanned for, here on
+	 * the thread pool */
+	substitute_set_parallel_sym_scan_threshold(1);
+	const char *cf = "/System/Library/Frameworks/CoreFoundation.framework/CoreFoundation";
+	im = substitute_open_image(cf);
+	assert(im);
+	const char *names3[] = { "_CFRelease", "___CFRuntimeCreateInstance_no_such",
+	                         "___CFInitialize" };
+	void *syms3[3];
+	assert(!substitute_find_private_syms(im, names3, syms3, 3));
+	assert(syms3[0] == dlsym(RTLD_DEFAULT, "CFRelease"));
+	assert(!syms3[1]);
+	assert(syms3[2]);
+	substitute_set_parallel_sym_scan_threshold(0);
+	substitute_close_image(im);
+
+	/* both images in one call, interleaved, plus one that isn't loaded */
+	void *msyms[5];
+	struct substitute_sym_query queries[] = {
+		{ cf, "___CFInitialize", &msyms[0] },
+		{ foundation, "_absolute_from_gregorian", &msyms[1] },
+		{ "/no/such/image", "_foo", &msyms[2] },
+		{ cf, "_CFRelease", &msyms[3] },
+		{ foundation, "_no_such_symbol_here", &msyms[4] },
+	};
+	assert(!substitute_find_syms_multi(queries, 5));
+	assert(msyms[0] == syms3[2] && msyms[3] == syms3[0]);
+	assert(msyms[1] == (void *) f);
+	assert(!msyms[2] && !msyms[4]);
 }
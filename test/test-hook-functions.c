@@ -1,14 +1,43 @@
 #include "substitute.h"
 #include "substitute-internal.h"
 #include <stdio.h>
+#include <assert.h>
 #include <search.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
+#include <mach/mach.h>
 static pid_t (*old_getpid)();
 static pid_t hook_getpid() {
     return old_getpid() * 2;
 }
 
+static pid_t (*old_getpid2)();
+static pid_t hook_getpid2() {
+    return old_getpid2() + 1;
+}
+
+static pid_t (*old_getppid)();
+static pid_t hook_getppid() {
+    return old_getppid() * 2;
+}
+
+static gid_t hook_getgid() {
+    return 4242;
+}
+
+static uid_t hook_getuid() {
+    return 4343;
+}
+
+static uid_t hook_geteuid() {
+    return 4444;
+}
+
+static void *hook_in_thread(void *hook) {
+    return (void *) (intptr_t) substitute_hook_functions(hook, 1, NULL, 0);
+}
+
 static int hook_hcreate(size_t nel) {
     return (int) nel;
 }
@@ -40,6 +69,66 @@ static int hook_my_own_function(int x) {
     return x + 5;
 }
 
+/* (through a pointer so the recursion can't be turned into a loop) */
+static int (*volatile traced_fib_ptr)(int);
+__attribute__((section("__TEST,__foo"), noinline))
+static int traced_fib(int n) {
+    return n < 2 ? n : traced_fib_ptr(n - 1) + traced_fib_ptr(n - 2);
+}
+
+/* (likewise, so the nested call isn't folded into the hook) */
+static int (*volatile guarded_ptr)(int);
+__attribute__((section("__TEST,__foo"), noinline))
+static int guarded(int x) {
+    return x + 6;
+}
+
+static int guard_hook_calls;
+static int hook_guarded(int x) {
+    guard_hook_calls++;
+    /* with the guard, this gets the original */
+    return guarded_ptr(x) * 10;
+}
+
+__attribute__((section("__TEST,__foo"), noinline))
+static int toggled(int x) {
+    return x + 7;
+}
+
+static int hook_toggled(int x) {
+    return x * 100;
+}
+
+static int hook_shared() {
+    return 4646;
+}
+
+__attribute__((section("__TEST,__foo"), noinline))
+static int in_task(int x) {
+    return x + 3;
+}
+
+static int hook_in_task(int x) {
+    return x * 3;
+}
+
+#ifdef __x86_64__
+/* x + 9, after some int3 padding, with a first instruction (lea) covering
+ * the 2 bytes SUBSTITUTE_USE_HOT_PATCH_PADDING patches */
+int padded_function(int x);
+__asm__(".text\n"
+        ".p2align 4, 0xcc\n"
+        ".fill 16, 1, 0xcc\n"
+        ".globl _padded_function\n"
+        "_padded_function:\n"
+        "    leal 9(%rdi), %eax\n"
+        "    ret\n");
+
+static int hook_padded_function(int x) {
+    return x * 9;
+}
+#endif
+
 static const struct substitute_function_hook hooks[] = {
     {my_own_function, hook_my_own_function, NULL},
     {getpid, hook_getpid, &old_getpid},
@@ -57,16 +146,284 @@ int main() {
 
     }
     printf("getpid() => %d\n", getpid());
+    substitute_set_stats_enabled(true);
+    /* the first batch's jump checks run on the thread pool */
+    substitute_set_parallel_prepare_threshold(2);
     break_before();
     int ret = substitute_hook_functions(hooks, sizeof(hooks)/sizeof(*hooks),
                                         NULL, 0);
     break_after();
+    substitute_set_parallel_prepare_threshold(0);
     int e = errno;
     printf("ret = %d\n", ret);
     printf("errno = %d\n", e);
     printf("getpid() => %d\n", getpid());
     printf("hcreate() => %d\n", hcreate(42));
     printf("my_own_function() => %d\n", my_own_function(0));
+
+    /* A second batch should carve its trampolines out of the same pages. */
+    static const struct substitute_function_hook hooks2[] = {
+        {getppid, hook_getppid, &old_getppid, SUBSTITUTE_HOOK_HOT},
+    };
+    /* (checking first doesn't touch anything) */
+    struct substitute_hook_check check;
+    ret = substitute_check_hooks(hooks2, 1, &check, 0);
+    printf("check ret = %d: patch %zu, relocated %zu (%zu insns), "
+           "trampolines %zu\n", ret, check.patch_size, check.relocated_size,
+           check.relocated_insns, check.trampoline_size);
+    struct substitute_function_hook_record *record;
+    ret = substitute_hook_functions(hooks2, 1, &record, 0);
+    printf("second batch ret = %d\n", ret);
+    printf("hot outro trampoline at %p (should be 64-byte aligned)\n",
+           (void *) old_getppid);
+    struct substitute_trampoline_region_info infos[8];
+    size_t nregions = substitute_get_trampoline_region_info(infos, 8);
+    for (size_t i = 0; i < nregions && i < 8; i++)
+        printf("region %p+%zx: %zu pages, %zu used, %zu free\n",
+               (void *) infos[i].start, infos[i].size, infos[i].npages,
+               infos[i].bytes_used, infos[i].bytes_free);
+
+    /* Within a transaction, nothing is patched until the commit. */
+    static const struct substitute_function_hook hooks3[] = {
+        {getgid, hook_getgid, NULL},
+    };
+    substitute_hook_begin();
+    ret = substitute_hook_functions(hooks3, 1, NULL, 0);
+    printf("queued ret = %d, getgid() => %d\n", ret, getgid());
+    ret = substitute_hook_commit();
+    printf("commit ret = %d, getgid() should be 4242: %d\n", ret, getgid());
+
+    /* Hooking getpid again chains onto the first hook. */
+    static const struct substitute_function_hook hooks4[] = {
+        {getpid, hook_getpid2, &old_getpid2},
+    };
+    ret = substitute_hook_functions(hooks4, 1, NULL, 0);
+    printf("chained ret = %d, getpid() => %d\n", ret, getpid());
+
+    /* Hooking doesn't have to be on the main thread, even concurrently. */
+    static const struct substitute_function_hook hooks5[] = {
+        {getuid, hook_getuid, NULL},
+        {geteuid, hook_geteuid, NULL},
+    };
+    pthread_t pts[2];
+    for (int i = 0; i < 2; i++)
+        pthread_create(&pts[i], NULL, hook_in_thread, (void *) &hooks5[i]);
+    for (int i = 0; i < 2; i++) {
+        void *thread_ret;
+        pthread_join(pts[i], &thread_ret);
+        printf("thread %d ret = %d\n", i, (int) (intptr_t) thread_ret);
+    }
+    printf("getuid() should be 4343: %d, geteuid() should be 4444: %d\n",
+           getuid(), geteuid());
+
+    /* Probes count calls, on their own or chained onto a hook. */
+    static uint64_t getpgrp_calls, getpid_calls;
+    static const struct substitute_function_probe probes[] = {
+        {getpgrp, &getpgrp_calls},
+        {getpid, &getpid_calls},
+    };
+    struct substitute_function_hook_record *probe_record;
+    ret = substitute_probe_functions(probes, 2, &probe_record, 0);
+    printf("probe ret = %d\n", ret);
+    for (int i = 0; i < 10; i++) {
+        getpgrp();
+        getpid();
+    }
+    printf("getpgrp calls should be 10: %llu, getpid calls should be 10: "
+           "%llu, getpid() still => %d\n",
+           (unsigned long long) getpgrp_calls,
+           (unsigned long long) getpid_calls, getpid());
+    ret = substitute_unhook_functions(probe_record, 0);
+    getpgrp();
+    printf("probe unhook ret = %d, getpgrp calls still 10: %llu\n", ret,
+           (unsigned long long) getpgrp_calls);
+
+    /* Traces record entries and exits, properly nested even through
+     * recursion, and chain onto hooks like probes do. */
+    static const struct substitute_function_trace traces[] = {
+        {traced_fib, 1},
+        {getpid, 2},
+    };
+    traced_fib_ptr = traced_fib;
+    struct substitute_function_hook_record *trace_record;
+    ret = substitute_trace_functions(traces, 2, &trace_record, 0);
+    printf("trace ret = %d\n", ret);
+    if (!ret) {
+        const char *trace_path = "/tmp/substitute-test-trace";
+        ret = substitute_trace_start(trace_path, 1000);
+        printf("trace start ret = %d\n", ret);
+        printf("traced_fib(5) should be 5: %d, getpid() still => %d\n",
+               traced_fib(5), getpid());
+        ret = substitute_trace_stop();
+        printf("trace stop ret = %d\n", ret);
+        FILE *fp = fopen(trace_path, "rb");
+        struct substitute_trace_file_header header = {0};
+        fread(&header, sizeof(header), 1, fp);
+        int depth = 0, max_depth = 0, fib_entries = 0;
+        for (uint64_t i = 0; i < header.nevents; i++) {
+            struct substitute_trace_event ev;
+            fread(&ev, sizeof(ev), 1, fp);
+            if (ev.function_id != 1)
+                continue;
+            if (ev.kind == SUBSTITUTE_TRACE_ENTRY) {
+                fib_entries++;
+                if (++depth > max_depth)
+                    max_depth = depth;
+            } else {
+                depth--;
+            }
+        }
+        fclose(fp);
+        printf("%llu events, %llu dropped; traced_fib entries should be 15: "
+               "%d, max depth 5: %d, unbalanced by %d\n",
+               (unsigned long long) header.nevents,
+               (unsigned long long) header.dropped, fib_entries, max_depth,
+               depth);
+        ret = substitute_unhook_functions(trace_record, 0);
+        printf("trace unhook ret = %d, getpid() => %d\n", ret, getpid());
+    }
+
+    /* A guarded hook calling its own function gets the original. */
+    static const struct substitute_function_hook guard_hooks[] = {
+        {guarded, hook_guarded, NULL},
+    };
+    guarded_ptr = guarded;
+    ret = substitute_hook_functions(guard_hooks, 1, NULL,
+                                    SUBSTITUTE_REENTRANCY_GUARD);
+    printf("guard ret = %d\n", ret);
+    if (!ret) {
+        int first = guarded_ptr(1);
+        int second = guarded_ptr(2);
+        printf("guarded(1) should be 70: %d, guarded(2) should be 80: %d, "
+               "hook calls should be 2: %d\n", first, second,
+               guard_hook_calls);
+    }
+
+    /* A toggleable hook can be switched off and on without unhooking. */
+    static const struct substitute_function_hook toggle_hooks[] = {
+        {toggled, hook_toggled, NULL},
+    };
+    int (*volatile toggled_ptr)(int) = toggled;
+    struct substitute_function_hook_record *toggle_record;
+    ret = substitute_hook_functions(toggle_hooks, 1, &toggle_record,
+                                    SUBSTITUTE_TOGGLEABLE);
+    printf("toggleable ret = %d, toggled(1) should be 100: %d\n", ret,
+           toggled_ptr(1));
+    if (!ret) {
+        ret = substitute_set_hook_enabled(toggle_record, 0, false);
+        printf("disable ret = %d, toggled(1) should be 8: %d\n", ret,
+               toggled_ptr(1));
+        ret = substitute_set_hook_enabled(toggle_record, 0, true);
+        printf("enable ret = %d, toggled(1) should be 100: %d\n", ret,
+               toggled_ptr(1));
+        ret = substitute_unhook_functions(toggle_record, 0);
+        printf("toggleable unhook ret = %d\n", ret);
+    }
+
+    /* Far-away functions going to the same replacement can share an intro
+     * trampoline. */
+    static const struct substitute_function_hook shared_hooks[] = {
+        {getegid, hook_shared, NULL},
+        {issetugid, hook_shared, NULL},
+    };
+    struct substitute_function_hook_record *shared_record;
+    ret = substitute_hook_functions(shared_hooks, 2, &shared_record,
+                                    SUBSTITUTE_SHARE_TRAMPOLINES);
+    printf("shared ret = %d, getegid() and issetugid() should be 4646: "
+           "%d %d\n", ret, (int) getegid(), issetugid());
+    if (!ret) {
+        ret = substitute_unhook_functions(shared_record, 0);
+        printf("shared unhook ret = %d, issetugid() => %d\n", ret,
+               issetugid());
+    }
+
+#ifdef __x86_64__
+    /* The jump goes in the padding, with a short jump to it at the start. */
+    static const struct substitute_function_hook padded_hooks[] = {
+        {padded_function, hook_padded_function, NULL},
+    };
+    int (*volatile padded_ptr)(int) = padded_function;
+    struct substitute_function_hook_record *padded_record;
+    ret = substitute_hook_functions(padded_hooks, 1, &padded_record,
+                                    SUBSTITUTE_USE_HOT_PATCH_PADDING);
+    printf("padded ret = %d, first bytes %02x %02x, padded_function(2) "
+           "should be 18: %d\n", ret, ((uint8_t *) padded_function)[0],
+           ((uint8_t *) padded_function)[1], padded_ptr(2));
+    if (!ret) {
+        ret = substitute_unhook_functions(padded_record, 0);
+        printf("padded unhook ret = %d, padded_function(2) should be 11: "
+               "%d\n", ret, padded_ptr(2));
+    }
+#endif
+
+    /* The same, through the task port, as it would be done to another
+     * process, leaving the trampolines in pages it allocates itself. */
+    static int (*old_in_task)(int);
+    struct substitute_function_hook task_hooks[] = {
+        {in_task, hook_in_task, &old_in_task},
+    };
+    int (*volatile in_task_ptr)(int) = in_task;
+    ret = substitute_hook_functions_in_task(mach_task_self(), task_hooks, 1,
+                                            SUBSTITUTE_NO_THREAD_SAFETY);
+    printf("in-task ret = %d, in_task(2) should be 6: %d, old should be 5: "
+           "%d\n", ret, in_task_ptr(2), ret ? -1 : old_in_task(2));
+    printf("in-task with thread safety should be %d: %d\n",
+           SUBSTITUTE_ERR_NOT_SUPPORTED,
+           substitute_hook_functions_in_task(mach_task_self(), task_hooks, 1,
+                                             0));
+
+    /* Unhooking puts the original back and frees the trampolines. */
+    printf("getppid() => %d\n", getppid());
+    ret = substitute_unhook_functions(record, 0);
+    printf("unhook ret = %d, getppid() => %d\n", ret, getppid());
+    nregions = substitute_get_trampoline_region_info(infos, 8);
+    for (size_t i = 0; i < nregions && i < 8; i++)
+        printf("region %p+%zx: %zu pages, %zu used, %zu free\n",
+               (void *) infos[i].start, infos[i].size, infos[i].npages,
+               infos[i].bytes_used, infos[i].bytes_free);
+
+    struct substitute_memory_region mregions[16];
+    size_t nmregions = substitute_memory_report(mregions, 16);
+    for (size_t i = 0; i < nmregions && i < 16; i++)
+        printf("memory kind %d %p+%zx: %zu resident, %zu dirty, %zu used\n",
+               mregions[i].kind, (void *) mregions[i].start, mregions[i].size,
+               mregions[i].resident, mregions[i].dirty, mregions[i].used);
+    assert(nmregions <= 16);
+    assert(substitute_memory_report(NULL, 0) == nmregions);
+    /* getpid stays hooked from the first batch */
+    uintptr_t getpid_addr = (uintptr_t) getpid & ~1;
+    bool saw_trampolines = false, saw_getpid = false;
+    for (size_t i = 0; i < nmregions; i++) {
+        struct substitute_memory_region *mr = &mregions[i];
+        assert(mr->used <= mr->size);
+        assert(mr->dirty <= mr->resident && mr->resident <= mr->size);
+        if (mr->kind == SUBSTITUTE_MEMORY_TRAMPOLINES)
+            saw_trampolines = true;
+        if (mr->kind == SUBSTITUTE_MEMORY_PATCHED_CODE &&
+            getpid_addr >= mr->start && getpid_addr - mr->start < mr->size)
+            saw_getpid = true;
+    }
+    assert(saw_trampolines);
+    assert(saw_getpid);
+
+    struct substitute_stats stats;
+    substitute_get_stats(&stats);
+    printf("stats: %llu hooks, transform %lluns, jump %lluns, stop %lluns, "
+           "get state %lluns, "
+           "%llu threads suspended, %llu pages remapped, "
+           "%llu protect copies, "
+           "trampolines %llu used/%llu wasted/%llu saved\n",
+           (unsigned long long) stats.hooks_installed,
+           (unsigned long long) stats.transform_dis_ns,
+           (unsigned long long) stats.jump_dis_ns,
+           (unsigned long long) stats.stop_threads_ns,
+           (unsigned long long) stats.get_thread_state_ns,
+           (unsigned long long) stats.threads_suspended,
+           (unsigned long long) stats.pages_remapped,
+           (unsigned long long) stats.protect_copies,
+           (unsigned long long) stats.trampoline_bytes_used,
+           (unsigned long long) stats.trampoline_bytes_wasted,
+           (unsigned long long) stats.trampoline_bytes_saved);
 #else
     (void) hooks;
     printf("can't test this here\n");
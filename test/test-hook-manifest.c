@@ -0,0 +1,46 @@
+#include "substitute.h"
+#include "substitute-internal.h"
+#include <stdio.h>
+#include <assert.h>
+#include <unistd.h>
+
+__attribute__((section("__TEST,__foo"), noinline))
+int manifest_own_function(int x) {
+    return x + 4;
+}
+
+static int (*old_manifest_own_function)(int);
+static int hook_manifest_own_function(int x) {
+    return old_manifest_own_function(x) * 10;
+}
+
+static pid_t (*old_getpid)(void);
+static pid_t hook_getpid(void) {
+    return old_getpid() * 2;
+}
+
+SUBSTITUTE_MANIFEST_HOOK_FUNCTION(own_function_entry, NULL,
+                                  "_manifest_own_function",
+                                  hook_manifest_own_function,
+                                  &old_manifest_own_function);
+SUBSTITUTE_MANIFEST_HOOK_FUNCTION(getpid_entry,
+                                  "/usr/lib/system/libsystem_kernel.dylib",
+                                  "_getpid", hook_getpid, &old_getpid);
+SUBSTITUTE_MANIFEST_HOOK_FUNCTION(missing_entry, NULL,
+                                  "_no_such_function_here",
+                                  hook_getpid, NULL);
+
+int main() {
+    int (*volatile own)(int) = manifest_own_function;
+    pid_t pid = getpid();
+    assert(own(1) == 5);
+
+    const void *header = _dyld_get_image_header(0);
+    int ret = substitute_apply_hook_manifests(&header, 1, 0);
+    printf("ret=%d (%s)\n", ret, substitute_strerror(ret));
+    /* the missing one is reported, but the others still go in */
+    assert(ret == SUBSTITUTE_ERR_NO_SUCH_SYMBOL);
+    assert(own(1) == 50);
+    assert(getpid() == pid * 2);
+    printf("ok\n");
+}
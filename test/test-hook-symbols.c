@@ -0,0 +1,47 @@
+#include "substitute.h"
+#include <stdio.h>
+#include <assert.h>
+#include <unistd.h>
+
+static pid_t (*old_getppid)(void);
+static pid_t hook_getppid(void) {
+    return old_getppid() + 1;
+}
+
+static uid_t (*old_getuid)(void);
+static uid_t hook_getuid(void) {
+    return old_getuid() + 2;
+}
+
+int main() {
+    struct substitute_image *im =
+        substitute_open_image("/usr/lib/system/libsystem_kernel.dylib");
+    assert(im);
+    pid_t ppid = getppid();
+    uid_t uid = getuid();
+    struct substitute_symbol_hook hooks[] = {
+        {"_getuid", hook_getuid, &old_getuid},
+        {"_no_such_function_here", hook_getuid, NULL},
+        {"_getppid", hook_getppid, &old_getppid},
+    };
+    int errors[3];
+    struct substitute_function_hook_record *records[3];
+    int ret = substitute_hook_symbols(im, hooks, 3, errors, records, 0);
+    printf("ret=%d (%s)\n", ret, substitute_strerror(ret));
+    /* the missing one is reported, but doesn't stop the others */
+    assert(ret == SUBSTITUTE_ERR_NO_SUCH_SYMBOL);
+    assert(errors[0] == SUBSTITUTE_OK && records[0]);
+    assert(errors[1] == SUBSTITUTE_ERR_NO_SUCH_SYMBOL && !records[1]);
+    assert(errors[2] == SUBSTITUTE_OK && records[2]);
+    assert(getppid() == ppid + 1);
+    assert(getuid() == uid + 2);
+
+    for (int i = 0; i < 3; i++) {
+        if (records[i])
+            assert(!substitute_unhook_functions(records[i], 0));
+    }
+    assert(getppid() == ppid);
+    assert(getuid() == uid);
+    substitute_close_image(im);
+    printf("ok\n");
+}
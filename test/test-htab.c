@@ -1,4 +1,5 @@
 #include "cbit/htab.h"
+#include "cbit/swtab.h"
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -20,6 +21,10 @@ DECL_HTAB(teststr_int, teststr, int);
 DECL_STATIC_HTAB_KEY(u32, uint32_t, u32_hash, u32_eq, u32_null, 0);
 DECL_HTAB(u32_u32, u32, uint32_t);
 
+#define u32_swhash(up) (*(up))
+#define u32_sweq(u1p, u2p) (*(u1p) == *(u2p))
+DECL_SWTAB(u32_u32, uint32_t, uint32_t, u32_swhash, u32_sweq);
+
 int main() {
     /* test loop crap */
     LET(int y = 5)
@@ -85,6 +90,38 @@ int main() {
         /* printf("%d %x %x\n", k, raw, hashed); */
         assert(hashed == raw);
     }
+
+    /* same again with the SIMD-probed layout, with enough keys to need a
+     * few groups, and zero as a key */
+    struct swtab_u32_u32 sw;
+    swtab_init_u32_u32(&sw);
+    uint32_t sw_raw[2000];
+    memset(sw_raw, 0xff, sizeof(sw_raw));
+    for (int i = 0; i < 20000; i++) {
+        uint32_t op = arc4random() % 3;
+        uint32_t key = arc4random() % 2000;
+        if (op != 2) { /* set */
+            uint32_t val = arc4random() & 0x7fffffff;
+            bool new;
+            *swtab_setp_u32_u32(&sw, &key, &new) = val;
+            assert(new == (sw_raw[key] == (uint32_t) -1));
+            sw_raw[key] = val;
+        } else { /* delete */
+            assert(swtab_remove_u32_u32(&sw, &key) ==
+                   (sw_raw[key] != (uint32_t) -1));
+            sw_raw[key] = -1;
+        }
+    }
+    size_t sw_count = 0;
+    for (uint32_t k = 0; k < 2000; k++) {
+        uint32_t *hashedp = swtab_getp_u32_u32(&sw, &k);
+        assert((hashedp ? *hashedp : (uint32_t) -1) == sw_raw[k]);
+        sw_count += sw_raw[k] != (uint32_t) -1;
+    }
+    assert(sw.length == sw_count);
+    SWTAB_FOREACH(&sw, uint32_t *k, uint32_t *v, u32_u32)
+        assert(sw_raw[*k] == *v);
+    swtab_free_storage_u32_u32(&sw);
 }
 
 /*
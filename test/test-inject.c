@@ -7,9 +7,53 @@
 #include <assert.h>
 #include <time.h>
 
+static void receive(mach_port_t port) {
+    static struct {
+        mach_msg_header_t hdr;
+        char body[5];
+        mach_msg_trailer_t huh;
+    } msg;
+    kern_return_t kr = mach_msg_overwrite(NULL, MACH_RCV_MSG, 0, sizeof(msg), port,
+                                          MACH_MSG_TIMEOUT_NONE, MACH_PORT_NULL,
+                                          &msg.hdr, 0);
+    printf("kr=%x\n", kr);
+    assert(!kr);
+    printf("received '%.5s'\n", msg.body);
+}
+
+/* the message substitute_dlopen_all_in_pid_notify has the thread send, for
+ * the two paths below */
+static void receive_done(mach_port_t port) {
+    struct {
+        mach_msg_header_t hdr;
+        int32_t status[3];
+        mach_msg_trailer_t trailer;
+    } msg;
+    kern_return_t kr = mach_msg(&msg.hdr, MACH_RCV_MSG | MACH_RCV_TIMEOUT, 0,
+                                sizeof(msg), port, 10000, MACH_PORT_NULL);
+    printf("done kr=%x id=%x size=%u\n", kr, msg.hdr.msgh_id,
+           msg.hdr.msgh_size);
+    assert(!kr);
+    assert(msg.hdr.msgh_id == SUBSTITUTE_INJECT_DONE_MSG_ID);
+    assert(msg.hdr.msgh_size == sizeof(msg.hdr) + sizeof(msg.status));
+    printf("status=%d,%d,%d\n", msg.status[0], msg.status[1], msg.status[2]);
+    assert(msg.status[0] == SUBSTITUTE_INJECT_DLOPEN_FAILED);
+    assert(msg.status[1] == SUBSTITUTE_INJECT_LOADED);
+    assert(msg.status[2]);
+}
+
+static void async_done(void *ctx, int pid, const int32_t *status) {
+    printf("pid %d done: status=%d,%d,%d\n", pid, status[0], status[1],
+           status[2]);
+    assert(status[0] == SUBSTITUTE_INJECT_DLOPEN_FAILED);
+    assert(status[1] == SUBSTITUTE_INJECT_LOADED);
+    assert(status[2]);
+    dispatch_semaphore_signal(ctx);
+}
+
 int main(int argc, char **argv) {
     if (argc <= 2) {
-        printf("usage: test-inject <pid> <dylib>\n");
+        printf("usage: test-inject <pid> <dylib> [<pid>...]\n");
         return 1;
     }
     int pid = atoi(argv[1]);
@@ -21,22 +65,89 @@ int main(int argc, char **argv) {
          .u.mach.port = port,
          .u.mach.right_type = MACH_MSG_TYPE_MAKE_SEND}
     };
+    if (argc > 3) {
+        size_t npids = argc - 2;
+        int pids[npids], rets[npids];
+        char *errors[npids];
+        pids[0] = pid;
+        for (size_t i = 1; i < npids; i++)
+            pids[i] = atoi(argv[i + 2]);
+        clock_t a = clock();
+        int ret = substitute_dlopen_in_pids(pids, npids, argv[2], 0, shuttles,
+                                            1, rets, errors);
+        clock_t b = clock();
+        printf("ret=%d time=%ld\n", ret, (long) (b - a));
+        for (size_t i = 0; i < npids; i++) {
+            printf("pid %d: ret=%d err=%s\n", pids[i], rets[i], errors[i]);
+            free(errors[i]);
+        }
+        assert(!ret);
+        for (size_t i = 0; i < npids; i++)
+            receive(port);
+        return 0;
+    }
     clock_t a = clock();
     int ret = substitute_dlopen_in_pid(pid, argv[2], 0, shuttles, 1, &error);
     clock_t b = clock();
     printf("ret=%d err=%s time=%ld\n", ret, error, (long) (b - a));
     assert(!ret);
     free(error);
-    static struct {
-        mach_msg_header_t hdr;
-        char body[5];
-        mach_msg_trailer_t huh;
-    } msg;
-    kern_return_t kr = mach_msg_overwrite(NULL, MACH_RCV_MSG, 0, sizeof(msg), port,
-                                          MACH_MSG_TIMEOUT_NONE, MACH_PORT_NULL,
-                                          &msg.hdr, 0);
-    printf("kr=%x\n", kr);
-    assert(!kr);
-    printf("received '%.5s'\n", msg.body);
+    receive(port);
+
+    /* again, along with one that can't be loaded, in one thread */
+    const char *filenames[] = {"/nonexistent.dylib", argv[2]};
+    volatile int32_t *status;
+    ret = substitute_dlopen_all_in_pid(pid, filenames, 2, 0, shuttles, 1,
+                                       &status, &error);
+    printf("ret=%d err=%s\n", ret, error);
+    assert(!ret);
+    free(error);
+    receive(port);
+    while (!__atomic_load_n(&status[2], __ATOMIC_ACQUIRE))
+        usleep(1000);
+    printf("status=%d,%d\n", status[0], status[1]);
+    assert(status[0] == SUBSTITUTE_INJECT_DLOPEN_FAILED);
+    assert(status[1] == SUBSTITUTE_INJECT_LOADED);
+    substitute_free_inject_status(status);
+
+    /* twice through one context */
+    struct substitute_inject_ctx *ictx;
+    ret = substitute_inject_ctx_open(pid, &ictx, &error);
+    printf("ctx open ret=%d err=%s\n", ret, error);
+    assert(!ret);
+    free(error);
+    for (int i = 0; i < 2; i++) {
+        ret = substitute_inject_ctx_dlopen(ictx, &filenames[1], 1, 0, shuttles, 1,
+                                           NULL, &error);
+        printf("ctx dlopen ret=%d err=%s\n", ret, error);
+        assert(!ret);
+        free(error);
+        receive(port);
+    }
+    substitute_inject_ctx_close(ictx);
 
+    /* waiting for the completion message */
+    mach_port_t notify_port = 0;
+    assert(!mach_port_allocate(mach_task_self(), MACH_PORT_RIGHT_RECEIVE,
+                               &notify_port));
+    ret = substitute_dlopen_all_in_pid_notify(pid, filenames, 2, 0, shuttles, 1,
+                                              notify_port, &error);
+    printf("ret=%d err=%s\n", ret, error);
+    assert(!ret);
+    free(error);
+    receive(port);
+    receive_done(notify_port);
+    mach_port_mod_refs(mach_task_self(), notify_port, MACH_PORT_RIGHT_RECEIVE,
+                       -1);
+
+    /* and once more, through the dispatch source */
+    dispatch_semaphore_t sem = dispatch_semaphore_create(0);
+    ret = substitute_dlopen_all_in_pid_async(pid, filenames, 2, 0, shuttles, 1,
+                                             dispatch_get_global_queue(0, 0),
+                                             async_done, sem, &error);
+    printf("ret=%d err=%s\n", ret, error);
+    assert(!ret);
+    free(error);
+    receive(port);
+    dispatch_semaphore_wait(sem, DISPATCH_TIME_FOREVER);
 }
@@ -14,6 +14,12 @@ static pid_t my_getpid() {
 static gid_t my_getgid() {
 	return 42;
 }
+static uid_t my_getuid() {
+	return 43;
+}
+static pid_t my_getppid() {
+	return 44;
+}
 
 int main() {
 	const char *self = _dyld_get_image_name(0);
@@ -31,5 +37,31 @@ int main() {
 	printf("new pid: %d\n", (int) gp());
 	printf("new gid: %d\n", (int) getgid());
 
+	/* enough hooks to look names up in a hash table */
+	struct substitute_import_hook many_hooks[] = {
+		{"_no_such_import_1", my_getuid, NULL},
+		{"_no_such_import_2", my_getuid, NULL},
+		{"_no_such_import_3", my_getuid, NULL},
+		{"_no_such_import_4", my_getuid, NULL},
+		{"_no_such_import_5", my_getuid, NULL},
+		{"_no_such_import_6", my_getuid, NULL},
+		{"_no_such_import_7", my_getuid, NULL},
+		{"_getuid", my_getuid, NULL},
+	};
+	substitute_interpose_imports(handle, many_hooks,
+	                             sizeof(many_hooks)/sizeof(*many_hooks), NULL, 0);
+	assert(getuid() == 43);
+
+	/* every image, including this one */
+	pid_t ppid = getppid();
+	struct substitute_import_hook all_hook = {"_getppid", my_getppid, NULL};
+	struct substitute_import_hook_record *record;
+	int ret = substitute_interpose_imports_all(&all_hook, 1, &record);
+	assert(!ret);
+	assert(getppid() == 44);
+	ret = substitute_unhook_imports(record);
+	assert(!ret);
+	assert(getppid() == ppid);
+
 	substitute_close_image(handle);
 }
@@ -13,6 +13,6 @@ int main(UNUSED int argc, char **argv) {
     int thumb = atoi(argv[2]);
     arch.pc_low_bit = thumb;
 #endif
-    bool bad = P(main)(buf, 0x10000, 0x10000 + patch_size, arch);
+    bool bad = P(main)(buf, 0x10000, 0x10000 + patch_size, 0, arch, NULL);
     printf("final: bad = %d\n", bad);
 }
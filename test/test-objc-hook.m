@@ -37,10 +37,44 @@ static void new_bar(id self, SEL sel, NSString *str) {
     return old_bar(self, sel, str);
 }
 
+static bool replaced_base_bar_called;
+static void replaced_base_bar(id self, SEL sel, NSString *str) {
+    NSLog(@"replaced base bar: %@", str);
+    replaced_base_bar_called = true;
+}
+
 int main() {
+    substitute_set_objc_super_imp_cache(true);
     assert(!substitute_hook_objc_message([Derived class], @selector(foo:), new_foo, &old_foo, NULL));
     assert(!substitute_hook_objc_message([Derived class], @selector(bar:), new_bar, &old_bar, NULL));
     Derived *d = [[Derived alloc] init];
     [d foo:@"hi!"];
     [d bar:@"hello!"];
+
+    /* again, in one go and out of order */
+    static void (*old_foo_2)(id, SEL, NSString *), (*old_bar_2)(id, SEL, NSString *);
+    bool created_foo, created_bar;
+    struct substitute_objc_hook hooks[] = {
+        {[Derived class], @selector(bar:), new_bar, &old_bar_2, &created_bar},
+        {[Base class], @selector(foo:), new_foo, &old_foo_2, &created_foo},
+    };
+    assert(!substitute_hook_objc_messages(hooks, 2));
+    assert(!created_foo && !created_bar);
+    assert(old_bar_2 == (void *) new_bar);
+    struct substitute_objc_hook bad = {[Base class], @selector(baz:), new_foo, NULL, NULL};
+    assert(substitute_hook_objc_messages(&bad, 1) == SUBSTITUTE_ERR_NO_SUCH_SELECTOR);
+
+    /* old_bar calls Base's bar: and caches it; that has to notice this */
+    method_setImplementation(class_getInstanceMethod([Base class], @selector(bar:)),
+                             (IMP) replaced_base_bar);
+    [d bar:@"again!"];
+    assert(replaced_base_bar_called);
+
+    /* lazily: Base is loaded already, but nothing called NotYet exists */
+    static void (*old_foo_3)(id, SEL, NSString *);
+    assert(!substitute_hook_objc_message_lazy("Base", @selector(foo:), new_foo, &old_foo_3, NULL));
+    assert(old_foo_3);
+    static void (*old_foo_4)(id, SEL, NSString *);
+    assert(!substitute_hook_objc_message_lazy("NotYet", @selector(foo:), new_foo, &old_foo_4, NULL));
+    assert(!old_foo_4);
 }
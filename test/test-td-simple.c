@@ -10,6 +10,7 @@ typedef struct tc {
 } *tdis_ctx;
 #define P(x) P_##x
 #define DIS_MAY_MODIFY 0
+#define DIS_BRANCHES_ONLY 0
 
 #if defined(TARGET_x86_64) || defined(TARGET_i386)
 NOINLINE UNUSED
@@ -38,6 +38,7 @@ static void do_manual(uint8_t *in, size_t in_size, int patch_size,
         pc_trampoline,
         &arch,
         offsets,
+        NULL,
         TRANSFORM_DIS_BAN_CALLS);
     printf("=> %d\n", ret);
     printf("#endif\n");
@@ -83,26 +84,51 @@ static void print_given(const uint8_t *given, size_t given_size) {
     hex_dump(given, given_size);
 }
 
+/* On arm64 the markers are padded so the instructions after them stay
+ * aligned (see transform-dis-cases-arm64.S). */
+#ifdef TARGET_arm64
+#define MARKER_ALIGN 4
+#else
+#define MARKER_ALIGN 1
+#endif
+static uint8_t *skip_marker_padding(uint8_t *base, uint8_t *p) {
+    size_t off = p - base;
+    return base + (off + MARKER_ALIGN - 1) / MARKER_ALIGN * MARKER_ALIGN;
+}
+
 static void do_auto(uint8_t *in, size_t in_size, struct arch_dis_ctx arch) {
-    uint8_t *end = in + in_size;
+    uint8_t *base = in, *end = in + in_size;
     assert(!memcmp(in, "GIVEN", 5)); in += 5;
     while (in < end) {
+        in = skip_marker_padding(base, in);
+#ifdef TARGET_arm64
+        /* out of ADRP range, so the cases get the long forms, unless they
+         * say where the trampoline goes */
+        uint_tptr pc_trampoline = 0x7deac0000;
+        if (!memcmp(in, "TRAMP", 5)) {
+            in = skip_marker_padding(base, in + 5);
+            memcpy(&pc_trampoline, in, sizeof(pc_trampoline));
+            in += sizeof(pc_trampoline);
+        }
+#else
+        uint_tptr pc_trampoline = 0xdeac0000;
+#endif
         uint8_t *given = in;
         uint8_t *expect = memmem(in, end - in, "EXPECT", 6);
         assert(expect);
         size_t given_size = expect - given;
         expect += 6;
         in = expect;
-        bool expect_err = false;
+        bool expect_err = !memcmp(expect, "_ERR", 4);
         size_t expect_size;
-        if (!memcmp(expect, "_ERR", 4)) {
-            expect_err = true;
-            in += 4;
+        if (expect_err) {
+            in = skip_marker_padding(base, in + 4);
             if (in != end) {
                 assert(!memcmp(in, "GIVEN", 5));
                 in += 5;
             }
         } else {
+            in = expect = skip_marker_padding(base, expect);
             in = memmem(in, end - in, "GIVEN", 5);
             if (in) {
                 expect_size = in - expect;
@@ -118,15 +144,17 @@ static void do_auto(uint8_t *in, size_t in_size, struct arch_dis_ctx arch) {
         void *rewritten_ptr = out;
         uint_tptr pc_patch_start = 0xdead0000;
         uint_tptr pc_patch_end = pc_patch_start + patch_size;
-        uint_tptr pc_trampoline = 0xdeac0000;
+        /* (each case starts with nothing written) */
+        struct arch_dis_ctx case_arch = arch;
         int ret = transform_dis_main(
             given,
             &rewritten_ptr,
             pc_patch_start,
             &pc_patch_end,
             pc_trampoline,
-            &arch,
+            &case_arch,
             offsets,
+            NULL,
             0);//TRANSFORM_DIS_BAN_CALLS);
         if (ret) {
             if (expect_err) {
@@ -0,0 +1,397 @@
+/* Offline hookability report: for every function listed in LC_FUNCTION_STARTS
+ * of a Mach-O file, or of every image in a dyld shared cache, run
+ * transform-dis and jump-dis the way hook_functions would, with the shortest
+ * jump patch (i.e. a trampoline placed nearby), and print one JSON object per
+ * function:
+ *     {"image": ..., "uuid": ..., "offset": ..., "size": ..., "error": ...,
+ *      "patch_size": ..., "region_size": ..., "insns": ..., "outro_size": ...}
+ * 'offset' is from the image's header and, with the UUID and patch_size, is
+ * what the plan cache is keyed by; region_size is what it stores.  error is
+ * 0 if the function could be hooked, else a SUBSTITUTE_ERR_*.  Each image
+ * ends with a summary line.  Functions are checked on libdispatch's thread
+ * pool.
+ *
+ * Built once per architecture, since the disassemblers are; a fat file's
+ * matching slice is used.  For a split shared cache, only images whose
+ * __TEXT and __LINKEDIT are in the file given can be analyzed; the others are
+ * reported on stderr and skipped.
+ *
+ * usage: tool-hookability-ARCH [-u] [-q] file [image-substring]
+ *   -u  allow calls in the patched region (as for SUBSTITUTE_NO_THREAD_SAFETY)
+ *   -q  only print the per-image summaries
+ */
+#include "substitute.h"
+#include "substitute-internal.h"
+#include "darwin/read.h"
+#include "dis.h"
+#include "jump-dis.h"
+#include "transform-dis.h"
+#include stringify(TARGET_DIR/jump-patch.h)
+#include "dyld_cache_format.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <mach/machine.h>
+#include <mach-o/loader.h>
+#include <mach-o/fat.h>
+#include <libkern/OSByteOrder.h>
+#include <dispatch/dispatch.h>
+
+#if defined(TARGET_arm64)
+#define TOOL_CPU_TYPE CPU_TYPE_ARM64
+#elif defined(TARGET_x86_64)
+#define TOOL_CPU_TYPE CPU_TYPE_X86_64
+#else
+#error only 64-bit targets are supported
+#endif
+
+/* Functions up to this size are copied to the stack; jump_dis_main looks
+ * at all of a function, up to JUMP_DIS_MAX_FUNC_INSNS instructions, and
+ * transform_dis_main at least the patch, plus the longest instruction. */
+#define CODE_WINDOW 4096
+#define CODE_SLOP 16
+#define MAX_FUNC_SIZE (JUMP_DIS_MAX_FUNC_INSNS * MIN_INSN_SIZE)
+/* somewhere nowhere near the function, so pc-relative fixups take their
+ * longest forms, as in substitute_check_hooks */
+#define FAR_AWAY 0x10000000000ull
+
+static bool g_allow_calls, g_quiet;
+
+/* What's mapped where: a file is one image at offset 0 of its slice, while a
+ * shared cache has its own mappings. */
+struct file_view {
+    const uint8_t *base;
+    size_t size;
+    const struct dyld_cache_mapping_info *mappings;
+    uint32_t nmappings;
+};
+
+struct image {
+    const struct file_view *fv;
+    const char *path;
+    const struct mach_header_64 *mh;
+    /* for standalone images, where segments say what file offset they're at */
+    bool standalone;
+    uint64_t text_vmaddr, text_end;
+    uint8_t uuid[16];
+};
+
+/* Returns a pointer to addr in the file, and how much can be read there. */
+static const uint8_t *addr_to_ptr(const struct image *im, uint64_t addr,
+                                  size_t *avail_p) {
+    const struct file_view *fv = im->fv;
+    uint64_t off = 0;
+    bool found = false;
+    if (im->standalone) {
+        const struct load_command *lc = (void *) (im->mh + 1);
+        for (uint32_t i = 0; i < im->mh->ncmds; i++) {
+            if (lc->cmd == LC_SEGMENT_64) {
+                const struct segment_command_64 *sc = (void *) lc;
+                if (addr - sc->vmaddr < sc->filesize) {
+                    off = ((const uint8_t *) im->mh - fv->base) +
+                          sc->fileoff + (addr - sc->vmaddr);
+                    found = true;
+                    break;
+                }
+            }
+            lc = (void *) ((const uint8_t *) lc + lc->cmdsize);
+        }
+    } else {
+        for (uint32_t i = 0; i < fv->nmappings; i++) {
+            const struct dyld_cache_mapping_info *m = &fv->mappings[i];
+            if (addr - m->address < m->size) {
+                off = m->fileOffset + (addr - m->address);
+                found = true;
+                break;
+            }
+        }
+    }
+    if (!found || off >= fv->size)
+        return NULL;
+    *avail_p = fv->size - off;
+    return fv->base + off;
+}
+
+struct func_result {
+    uint64_t addr, size;
+    int error;
+    int patch_size;
+    size_t region_size, insns, outro_size;
+};
+
+struct image_job {
+    const struct image *im;
+    struct func_result *results;
+};
+
+static void analyze_func(void *ctx, size_t i) {
+    const struct image_job *job = ctx;
+    struct func_result *res = &job->results[i];
+    uint64_t pc = res->addr;
+    /* Copy the code into a zero-padded buffer, so neither pass can read off
+     * the end of the mapping. */
+    uint8_t stack_code[CODE_WINDOW + CODE_SLOP];
+    size_t avail;
+    const uint8_t *src = addr_to_ptr(job->im, pc, &avail);
+    if (!src) {
+        res->error = SUBSTITUTE_ERR_VM;
+        return;
+    }
+    size_t want = res->size > MAX_FUNC_SIZE ? MAX_FUNC_SIZE : res->size;
+    if (want < MAX_EXTENDED_PATCH_SIZE)
+        want = MAX_EXTENDED_PATCH_SIZE;
+    uint8_t *code = stack_code;
+    if (want > CODE_WINDOW && !(code = malloc(want + CODE_SLOP))) {
+        res->error = SUBSTITUTE_ERR_OOM;
+        return;
+    }
+    size_t len = avail < want ? avail : want;
+    memcpy(code, src, len);
+    memset(code + len, 0, want + CODE_SLOP - len);
+
+    struct arch_dis_ctx arch;
+    arch_dis_ctx_init(&arch);
+    res->patch_size = jump_patch_size(pc, pc, arch, false);
+    uint8_t outro[TD_MAX_REWRITTEN_SIZE + MAX_JUMP_PATCH_SIZE];
+    int offset_by_pcdiff[MAX_EXTENDED_PATCH_SIZE + 1];
+    void *outro_write = outro;
+    uint_tptr pc_patch_end = pc + res->patch_size;
+    res->error = transform_dis_main(code, &outro_write, pc, &pc_patch_end,
+                                    pc + FAR_AWAY, &arch, offset_by_pcdiff,
+                                    NULL,
+                                    g_allow_calls ? 0 : TRANSFORM_DIS_BAN_CALLS);
+    if (res->error)
+        goto end;
+    res->region_size = pc_patch_end - pc;
+    for (size_t d = 1; d <= res->region_size; d++)
+        res->insns += offset_by_pcdiff[d] != -1;
+    make_jump_patch(&outro_write,
+                    pc + FAR_AWAY + ((uint8_t *) outro_write - outro),
+                    pc_patch_end, arch);
+    res->outro_size = (uint8_t *) outro_write - outro;
+    if (jump_dis_main(code, pc, pc_patch_end, pc + res->size, arch, NULL))
+        res->error = SUBSTITUTE_ERR_FUNC_JUMPS_TO_START;
+end:
+    if (code != stack_code)
+        free(code);
+}
+
+static void print_uuid(char out[33], const uint8_t uuid[16]) {
+    for (int i = 0; i < 16; i++)
+        sprintf(out + 2 * i, "%02x", uuid[i]);
+}
+
+static bool load_image(struct image *im) {
+    const struct mach_header_64 *mh = im->mh;
+    if (mh->magic != MH_MAGIC_64 || mh->cputype != TOOL_CPU_TYPE)
+        return false;
+    memset(im->uuid, 0, sizeof(im->uuid));
+    im->text_vmaddr = im->text_end = 0;
+    const struct load_command *lc = (void *) (mh + 1);
+    for (uint32_t i = 0; i < mh->ncmds; i++) {
+        if (lc->cmd == LC_SEGMENT_64) {
+            const struct segment_command_64 *sc = (void *) lc;
+            if (!strncmp(sc->segname, "__TEXT", 16)) {
+                im->text_vmaddr = sc->vmaddr;
+                im->text_end = sc->vmaddr + sc->vmsize;
+            }
+        } else if (lc->cmd == LC_UUID) {
+            memcpy(im->uuid, ((const struct uuid_command *) lc)->uuid, 16);
+        }
+        lc = (void *) ((const uint8_t *) lc + lc->cmdsize);
+    }
+    return im->text_end != 0;
+}
+
+/* Decode LC_FUNCTION_STARTS into results (addr and size only). */
+static struct func_result *function_starts(const struct image *im,
+                                           size_t *countp) {
+    const struct linkedit_data_command *fs = NULL;
+    const struct load_command *lc = (void *) (im->mh + 1);
+    for (uint32_t i = 0; i < im->mh->ncmds; i++) {
+        if (lc->cmd == LC_FUNCTION_STARTS)
+            fs = (void *) lc;
+        lc = (void *) ((const uint8_t *) lc + lc->cmdsize);
+    }
+    if (!fs)
+        return NULL;
+    /* dataoff is from the start of the slice, or of the cache file */
+    const uint8_t *slice = im->standalone ? (const uint8_t *) im->mh
+                                          : im->fv->base;
+    if ((uint64_t) (slice - im->fv->base) + fs->dataoff + fs->datasize >
+        im->fv->size)
+        return NULL;
+    void *p = (void *) (slice + fs->dataoff);
+    void *end = (uint8_t *) p + fs->datasize;
+    size_t count = 0, capa = 64;
+    struct func_result *results = malloc(capa * sizeof(*results));
+    uint64_t addr = im->text_vmaddr, delta;
+    while (results && p < end && read_leb128(&p, end, false, &delta) &&
+           delta) {
+        addr += delta;
+        if (count == capa) {
+            capa *= 2;
+            struct func_result *n = realloc(results, capa * sizeof(*results));
+            if (!n) {
+                free(results);
+                return NULL;
+            }
+            results = n;
+        }
+        results[count++] = (struct func_result) {.addr = addr};
+    }
+    for (size_t i = 0; i < count; i++) {
+        uint64_t next = i + 1 < count ? results[i + 1].addr : im->text_end;
+        results[i].size = next - results[i].addr;
+    }
+    *countp = count;
+    return results;
+}
+
+static void analyze_image(const struct image *im) {
+    size_t n = 0;
+    struct func_result *results = function_starts(im, &n);
+    if (!results) {
+        fprintf(stderr, "%s: no usable LC_FUNCTION_STARTS, skipping\n",
+                im->path);
+        return;
+    }
+    struct image_job job = {im, results};
+    dispatch_apply_f(n, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH,
+                                                  0),
+                     &job, analyze_func);
+    char uuid[33];
+    print_uuid(uuid, im->uuid);
+    size_t nok = 0;
+    for (size_t i = 0; i < n; i++) {
+        const struct func_result *res = &results[i];
+        nok += !res->error;
+        if (g_quiet)
+            continue;
+        printf("{\"image\": \"%s\", \"uuid\": \"%s\", \"offset\": %llu, "
+               "\"size\": %llu, \"error\": %d, \"patch_size\": %d, "
+               "\"region_size\": %zu, \"insns\": %zu, \"outro_size\": %zu}\n",
+               im->path, uuid,
+               (unsigned long long) (res->addr - im->text_vmaddr),
+               (unsigned long long) res->size, res->error, res->patch_size,
+               res->region_size, res->insns, res->outro_size);
+    }
+    printf("{\"image\": \"%s\", \"uuid\": \"%s\", \"functions\": %zu, "
+           "\"hookable\": %zu}\n", im->path, uuid, n, nok);
+    free(results);
+}
+
+static int analyze_cache(const struct file_view *fv, const char *filter) {
+    const struct dyld_cache_header *dch = (const void *) fv->base;
+    if (sizeof(*dch) > fv->size ||
+        (uint64_t) dch->mappingOffset +
+        dch->mappingCount * sizeof(struct dyld_cache_mapping_info) > fv->size ||
+        (uint64_t) dch->imagesOffset +
+        dch->imagesCount * sizeof(struct dyld_cache_image_info) > fv->size) {
+        fprintf(stderr, "truncated shared cache\n");
+        return 1;
+    }
+    struct file_view cfv = *fv;
+    cfv.mappings = (const void *) (fv->base + dch->mappingOffset);
+    cfv.nmappings = dch->mappingCount;
+    const struct dyld_cache_image_info *infos =
+        (const void *) (fv->base + dch->imagesOffset);
+    for (uint32_t i = 0; i < dch->imagesCount; i++) {
+        struct image im = {.fv = &cfv};
+        im.path = infos[i].pathFileOffset < fv->size ?
+                  (const char *) fv->base + infos[i].pathFileOffset : "?";
+        if (filter && !strstr(im.path, filter))
+            continue;
+        size_t avail;
+        im.mh = (const void *) addr_to_ptr(&im, infos[i].address, &avail);
+        if (!im.mh || avail < sizeof(*im.mh) ||
+            avail < sizeof(*im.mh) + im.mh->sizeofcmds || !load_image(&im)) {
+            fprintf(stderr, "%s: not in this file, skipping\n", im.path);
+            continue;
+        }
+        analyze_image(&im);
+    }
+    return 0;
+}
+
+static int analyze_macho(const struct file_view *fv, const char *path) {
+    const uint8_t *slice = fv->base;
+    if (fv->size >= sizeof(struct fat_header) &&
+        OSSwapBigToHostInt32(((const struct fat_header *) slice)->magic) ==
+        FAT_MAGIC) {
+        uint32_t nfat = OSSwapBigToHostInt32(
+            ((const struct fat_header *) slice)->nfat_arch);
+        const struct fat_arch *archs =
+            (const void *) (slice + sizeof(struct fat_header));
+        slice = NULL;
+        for (uint32_t i = 0; i < nfat; i++) {
+            if ((const uint8_t *) &archs[i + 1] > fv->base + fv->size)
+                break;
+            if ((cpu_type_t) OSSwapBigToHostInt32(archs[i].cputype) ==
+                TOOL_CPU_TYPE) {
+                uint32_t off = OSSwapBigToHostInt32(archs[i].offset);
+                if (off < fv->size)
+                    slice = fv->base + off;
+                break;
+            }
+        }
+        if (!slice) {
+            fprintf(stderr, "%s: no slice for this architecture\n", path);
+            return 1;
+        }
+    }
+    struct image im = {
+        .fv = fv,
+        .path = path,
+        .mh = (const void *) slice,
+        .standalone = true,
+    };
+    size_t avail = fv->size - (slice - fv->base);
+    if (avail < sizeof(*im.mh) ||
+        avail < sizeof(*im.mh) + im.mh->sizeofcmds || !load_image(&im)) {
+        fprintf(stderr, "%s: not a Mach-O for this architecture\n", path);
+        return 1;
+    }
+    analyze_image(&im);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int c;
+    while ((c = getopt(argc, argv, "uq")) != -1) {
+        switch (c) {
+        case 'u': g_allow_calls = true; break;
+        case 'q': g_quiet = true; break;
+        default: goto usage;
+        }
+    }
+    if (optind >= argc)
+        goto usage;
+    const char *path = argv[optind];
+    const char *filter = optind + 1 < argc ? argv[optind + 1] : NULL;
+
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st)) {
+        perror(path);
+        return 1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    struct file_view fv = {map, st.st_size, NULL, 0};
+    if (fv.size >= 7 && !memcmp(map, "dyld_v1", 7))
+        return analyze_cache(&fv, filter);
+    return analyze_macho(&fv, path);
+
+usage:
+    fprintf(stderr, "usage: %s [-u] [-q] file [image-substring]\n", argv[0]);
+    return 1;
+}